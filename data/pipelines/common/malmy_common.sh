@@ -215,7 +215,8 @@ float ESM(sampler2D shadowmap, vec4 shadow_coord, float bias, float depth_multip
 }
 
 
-float pointLightShadow(sampler2D shadowmap, mat4 shadowmap_matrices[4], vec4 position, float fov)
+// atlas_slot.xy is the offset and atlas_slot.z the size of the light's slot in the shadow atlas
+float pointLightShadow(sampler2D shadowmap, mat4 shadowmap_matrices[4], vec4 atlas_slot, vec4 position, float fov)
 {
 	const float DEPTH_MULTIPLIER = 900.0;
 
@@ -232,21 +233,24 @@ float pointLightShadow(sampler2D shadowmap, mat4 shadowmap_matrices[4], vec4 pos
 		d = d / d.w;
 	
 		bool selection0 = all(lessThan(a.xy, vec2_splat(0.99))) && all(greaterThan(a.xy, vec2_splat(0.01))) && a.z < 1.0;
-		if(selection0) return noCheckESM(shadowmap, vec2(a.x * 0.5, a.y * 0.5), a.z, DEPTH_MULTIPLIER);
+		if(selection0) return noCheckESM(shadowmap, atlas_slot.xy + atlas_slot.z * vec2(a.x * 0.5, a.y * 0.5), a.z, DEPTH_MULTIPLIER);
 
 		bool selection1 = all(lessThan(b.xy, vec2_splat(0.99))) && all(greaterThan(b.xy, vec2_splat(0.01))) && b.z < 1.0;
-		if(selection1) return noCheckESM(shadowmap, vec2(0.5 + b.x * 0.5, b.y * 0.5), b.z, DEPTH_MULTIPLIER);
+		if(selection1) return noCheckESM(shadowmap, atlas_slot.xy + atlas_slot.z * vec2(0.5 + b.x * 0.5, b.y * 0.5), b.z, DEPTH_MULTIPLIER);
 		
 		bool selection2 = all(lessThan(c.xy, vec2_splat(0.99))) && all(greaterThan(c.xy, vec2_splat(0.01))) && c.z < 1.0;
-		if(selection2) return noCheckESM(shadowmap, vec2(c.x * 0.5, 0.5 + c.y * 0.5), c.z, DEPTH_MULTIPLIER);
+		if(selection2) return noCheckESM(shadowmap, atlas_slot.xy + atlas_slot.z * vec2(c.x * 0.5, 0.5 + c.y * 0.5), c.z, DEPTH_MULTIPLIER);
 		
-		return noCheckESM(shadowmap, vec2(0.5 + d.x * 0.5, 0.5 + d.y * 0.5), d.z, DEPTH_MULTIPLIER);
+		return noCheckESM(shadowmap, atlas_slot.xy + atlas_slot.z * vec2(0.5 + d.x * 0.5, 0.5 + d.y * 0.5), d.z, DEPTH_MULTIPLIER);
 	}
 	else
 	{
 		vec4 tmp = mul(shadowmap_matrices[0], position);
 		vec3 shadow_coord = tmp.xyz / tmp.w;
-			return ESM(shadowmap, vec4(shadow_coord.xy, shadow_coord.z, 1.0), 0.0, DEPTH_MULTIPLIER);
+		bool outside = any(greaterThan(shadow_coord.xy, vec2_splat(1.0)))
+					|| any(lessThan(shadow_coord.xy, vec2_splat(0.0)));
+		if (outside) return 1.0;
+		return noCheckESM(shadowmap, atlas_slot.xy + atlas_slot.z * shadow_coord.xy, shadow_coord.z, DEPTH_MULTIPLIER);
 	}
 }
 
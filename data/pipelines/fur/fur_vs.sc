@@ -1,14 +1,41 @@
 #ifdef SKINNED
-	$input a_position, a_normal, a_tangent, a_texcoord0, a_weight, a_indices
+	#ifdef INSTANCED
+		$input a_position, a_normal, a_tangent, a_texcoord0, a_weight, a_indices, i_data0, i_data1, i_data2, i_data3, i_data4
+	#else
+		$input a_position, a_normal, a_tangent, a_texcoord0, a_weight, a_indices
+	#endif
 #else
-	$input a_position, a_normal, a_tangent, a_texcoord0
+	#ifdef INSTANCED
+		$input a_position, a_normal, a_tangent, a_texcoord0, i_data0, i_data1, i_data2, i_data3
+	#else
+		$input a_position, a_normal, a_tangent, a_texcoord0
+	#endif
 #endif
-	
+
 $output v_wpos, v_view, v_normal, v_tangent, v_bitangent, v_texcoord0, v_common2
 
 #include "common.sh"
 
-uniform mat4 u_boneMatrices[128];
+#if defined SKINNED && defined INSTANCED
+	// see rigid_vs.sc
+	#define BONE_TEXTURE_WIDTH 1024.0
+	SAMPLER2D(u_boneTexture, 7);
+
+	mat4 getBoneMatrix(float bone)
+	{
+		float texel = bone * 4.0;
+		float row = floor(texel / BONE_TEXTURE_WIDTH);
+		ivec2 uv = ivec2(int(texel - row * BONE_TEXTURE_WIDTH), int(row));
+		mat4 m;
+		m[0] = texelFetch(u_boneTexture, uv, 0);
+		m[1] = texelFetch(u_boneTexture, uv + ivec2(1, 0), 0);
+		m[2] = texelFetch(u_boneTexture, uv + ivec2(2, 0), 0);
+		m[3] = texelFetch(u_boneTexture, uv + ivec2(3, 0), 0);
+		return m;
+	}
+#else
+	uniform mat4 u_boneMatrices[128];
+#endif
 uniform vec4 u_layer;
 uniform vec4 u_furLength;
 uniform vec4 u_gravity;
@@ -17,21 +44,43 @@ void main()
 {
 	vec4 normal = a_normal * 2.0 - 1.0;
 	vec4 tangent = a_tangent * 2.0 - 1.0;
-	#ifdef SKINNED
-		mat4 model = 
-			mul(u_model[0], a_weight.x * u_boneMatrices[int(a_indices.x)] + 
-			a_weight.y * u_boneMatrices[int(a_indices.y)] +
-			a_weight.z * u_boneMatrices[int(a_indices.z)] +
-			a_weight.w * u_boneMatrices[int(a_indices.w)]);
+	#ifdef INSTANCED
+		mat4 instance;
+		instance[0] = i_data0;
+		instance[1] = i_data1;
+		instance[2] = i_data2;
+		instance[3] = i_data3;
+		#ifdef SKINNED
+			mat4 skin = a_weight.x * getBoneMatrix(i_data4.x + a_indices.x) +
+				a_weight.y * getBoneMatrix(i_data4.x + a_indices.y) +
+				a_weight.z * getBoneMatrix(i_data4.x + a_indices.z) +
+				a_weight.w * getBoneMatrix(i_data4.x + a_indices.w);
+		#else
+			mat4 skin = mat4(1.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 1.0);
+		#endif
+		v_wpos = instMul(instance, instMul(skin, vec4(a_position, 1.0))).xyz;
 	#else
-		mat4 model = u_model[0];
-	#endif	
-	
+		#ifdef SKINNED
+			mat4 model =
+				mul(u_model[0], a_weight.x * u_boneMatrices[int(a_indices.x)] +
+				a_weight.y * u_boneMatrices[int(a_indices.y)] +
+				a_weight.z * u_boneMatrices[int(a_indices.z)] +
+				a_weight.w * u_boneMatrices[int(a_indices.w)]);
+		#else
+			mat4 model = u_model[0];
+		#endif
+		v_wpos = mul(model, vec4(a_position, 1.0)).xyz;
+	#endif
+
 
-    v_wpos = mul(model, vec4(a_position, 1.0)).xyz;
 	#ifndef SHADOW
-		v_normal = mul(model, vec4(normal.xyz, 0.0) ).xyz;
-		v_tangent = mul(model, vec4(tangent.xyz, 0.0) ).xyz;
+		#ifdef INSTANCED
+			v_normal = instMul(instance, instMul(skin, vec4(normal.xyz, 0.0))).xyz;
+			v_tangent = instMul(instance, instMul(skin, vec4(tangent.xyz, 0.0))).xyz;
+		#else
+			v_normal = mul(model, vec4(normal.xyz, 0.0) ).xyz;
+			v_tangent = mul(model, vec4(tangent.xyz, 0.0) ).xyz;
+		#endif
 		v_bitangent = cross(v_normal, v_tangent);
 		v_view = mul(u_invView, vec4(0.0, 0.0, 0.0, 1.0)).xyz - v_wpos;
 		#ifdef FUR
@@ -39,8 +88,8 @@ void main()
 		#endif
 	#endif
 
-	
+
 	v_texcoord0 = a_texcoord0;
-	v_common2 = mul(u_viewProj, vec4(v_wpos, 1.0) ); 
+	v_common2 = mul(u_viewProj, vec4(v_wpos, 1.0) );
 	gl_Position =  v_common2;
 }
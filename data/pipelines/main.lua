@@ -10,6 +10,10 @@ local ALL_RENDER_MASK = DEFAULT_RENDER_MASK + TRANSPARENT_RENDER_MASK + WATER_RE
 local LUA_SCRIPT_TYPE = Engine.getComponentType("lua_script")
 local SHADOWMAP_SIZE = 1024
 
+-- render() is recorded once and replayed natively, anything changing every frame must go through everyFrame;
+-- it is recorded again when a global or an upvalue it read changes, e.g. the settings below
+RECORD_ONCE = true
+
 local exposure = 4
 local screenshot_request = 0
 local occlusion_culling_enabled = false
@@ -183,22 +187,14 @@ function createFramebuffers()
 		width = SHADOWMAP_SIZE,
 		height = SHADOWMAP_SIZE,
 		renderbuffers = {
-			{format="r32f" },
+			{format="r32f", blit_dst = true },
 			{format = "depth24"}
 		}
 	})
 
-	addFramebuffer(this, "point_light_shadowmap", {
-		width = 1024,
-		height = 1024,
-		renderbuffers = {
-			{format = "depth24"}
-		}
-	})
-
-	addFramebuffer(this, "point_light2_shadowmap", {
-		width = 1024,
-		height = 1024,
+	addFramebuffer(this, "local_light_shadow_atlas", {
+		width = 2048,
+		height = 2048,
 		renderbuffers = {
 			{format = "depth24"}
 		}
@@ -372,7 +368,10 @@ function extractLuminance()
 		setUniform(this, lum_size_uniform, lum_uniforms[4])
 		bindFramebufferTexture(this, "lum16", 0, hdr_buffer_uniform, TEXTURE_MAG_ANISOTROPIC | TEXTURE_MIN_ANISOTROPIC)
 		drawQuad(this, 0, 0, 1, 1, extract_luminance_material)
+end
 
+-- luminance buffers are swapped each frame, so this runs every frame
+function adaptLuminanceAndTonemap()
 	local old_lum1 = "lum1b"
 	if current_lum1 == "lum1a" then 
 		current_lum1 = "lum1b" 
@@ -387,11 +386,7 @@ function extractLuminance()
 		bindFramebufferTexture(this, "lum4", 0, hdr_buffer_uniform, TEXTURE_MAG_ANISOTROPIC | TEXTURE_MIN_ANISOTROPIC)
 		bindFramebufferTexture(this, old_lum1, 0, avg_luminance_uniform)
 		drawQuad(this, 0, 0, 1, 1, extract_luminance_material)
-end
 
-function tonemapping()
-	extractLuminance()
-	
 	newView(this, "tonemap", "linear")
 		setMaterialDefine(this, tonemap_material, "FIXED_EXPOSURE", APP == nil and GAME_VIEW == nil)
 		setPass(this, "MAIN")
@@ -402,6 +397,11 @@ function tonemapping()
 		drawQuad(this, 0, 0, 1, 1, tonemap_material)
 end
 
+function tonemapping()
+	extractLuminance()
+	everyFrame(this, adaptLuminanceAndTonemap)
+end
+
 function renderSelectionOutline(ctx, camera_slot)
 	newView(this, "selection_mask", "selection_mask", ALL_RENDER_MASK)
 		clear(this, CLEAR_COLOR, 0xffffffff)
@@ -556,7 +556,7 @@ function shadowmap(ctx, camera_slot, layer_mask)
 		applyCamera(this, camera_slot)
 		renderShadowmap(this, 3) 
 		
-		renderLocalLightsShadowmaps(this, camera_slot, { "point_light_shadowmap", "point_light2_shadowmap" })
+		renderLocalLightsShadowmaps(this, camera_slot, "local_light_shadow_atlas")
 		
 	if blur_shadowmap then
 		newView(this, "blur_shadowmap_h", "shadowmap_blur")
@@ -584,7 +584,7 @@ function render()
 	end
 	rigid(camera_slot)
 	
-	doPostprocess(this, _ENV, "pre_transparent", camera_slot)
+	everyFrame(this, doPostprocess, this, _ENV, "pre_transparent", camera_slot)
 
 	particles(camera_slot)
 	transparency(camera_slot)
@@ -596,11 +596,11 @@ function render()
 	end
 	renderModels(this, occlusion_culling_enabled)
 
-	doPostprocess(this, _ENV, "main", camera_slot)
+	everyFrame(this, doPostprocess, this, _ENV, "main", camera_slot)
 
 	tonemapping()
 
-	doPostprocess(this, _ENV, "post_tonemapping", camera_slot)
+	everyFrame(this, doPostprocess, this, _ENV, "post_tonemapping", camera_slot)
 
 	newView(this, "copy_to_linear", "default")
 		clear(this, CLEAR_ALL, 0x00000000)
@@ -619,7 +619,10 @@ function render()
 		renderSelectionOutline(ctx, camera_slot)
 	end
 
+	everyFrame(this, processScreenshotRequest)
+end
 
+function processScreenshotRequest()
 	if screenshot_request > 1 then
 		-- we have to wait for a few frames to propagate changed resolution to ingame gui
 		-- only then we can take a screeshot
@@ -680,11 +683,14 @@ function onGUI()
 	
 	
 	if ImGui.BeginPopup("debug_popup") then
+		local dirty = false
 		for i, _ in ipairs(render_debug_deferred) do
 			changed, render_debug_deferred[i].enabled = ImGui.Checkbox(render_debug_deferred[i].label, render_debug_deferred[i].enabled)
+			dirty = dirty or changed
 			if render_debug_deferred[i].enabled then
 				ImGui.SameLine()
 				changed, render_debug_deferred[i].fullscreen = ImGui.Checkbox("Fullsize###gbf" .. tostring(i), render_debug_deferred[i].fullscreen)
+				dirty = dirty or changed
 				
 				if changed and render_debug_deferred[i].fullscreen then
 					for j, _ in ipairs(render_debug_deferred) do
@@ -696,9 +702,11 @@ function onGUI()
 		end
 		
 		changed, render_shadowmap_debug = ImGui.Checkbox("Shadowmap", render_shadowmap_debug)
+		dirty = dirty or changed
 		if render_shadowmap_debug then
 			ImGui.SameLine()
 			changed, render_shadowmap_debug_fullsize = ImGui.Checkbox("Fullsize###gbfsm", render_shadowmap_debug_fullsize)
+			dirty = dirty or changed
 		end
 		if ImGui.Button("High details") then
 			Renderer.setGlobalLODMultiplier(g_scene_renderer, 0.1)
@@ -710,12 +718,20 @@ function onGUI()
 			render_debug_deferred[2].enabled = v
 			render_debug_deferred[3].enabled = v
 			render_debug_deferred[4].enabled = v
+			dirty = true
 		end
 		changed, disable_render = ImGui.Checkbox("Disabled rendering", disable_render)
+		dirty = dirty or changed
 		changed, render_shadowmap = ImGui.Checkbox("Render shadowmap", render_shadowmap)
+		dirty = dirty or changed
 		changed, blur_shadowmap = ImGui.Checkbox("Blur shadowmap", blur_shadowmap)
+		dirty = dirty or changed
 		changed, render_gizmos = ImGui.Checkbox("Render gizmos", render_gizmos)
+		dirty = dirty or changed
 		changed, render_fur = ImGui.Checkbox("Render fur", render_fur)
+		dirty = dirty or changed
+		
+		if dirty then invalidateFrameGraph(this) end
 		
 		ImGui.EndPopup()
 	end
@@ -10,6 +10,7 @@ SAMPLER2D(u_gbuffer_depth, 12);
 #ifdef HAS_SHADOWMAP
 	SAMPLER2D(u_texShadowmap, 11);
 	uniform mat4 u_shadowmapMatrices[4];
+	uniform vec4 u_shadowAtlasSlot;
 #endif
 	
 uniform vec4 u_fogColorDensity; 
@@ -51,7 +52,7 @@ void main()
 	vec4 specular_color = (f0 - f0 * metallic) + albedo * metallic;
 	vec4 diffuse_color = albedo - albedo * metallic;
 	#ifdef HAS_SHADOWMAP
-		float shadow = pointLightShadow(u_texShadowmap, u_shadowmapMatrices, vec4(wpos, 1.0), v_dir_fov.w);
+		float shadow = pointLightShadow(u_texShadowmap, u_shadowmapMatrices, u_shadowAtlasSlot, vec4(wpos, 1.0), v_dir_fov.w);
 		attn *= shadow;
 	#endif
 
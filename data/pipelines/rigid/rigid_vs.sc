@@ -1,8 +1,10 @@
 #ifdef SKINNED
-	$input a_position, a_normal, a_tangent, a_texcoord0, a_weight, a_indices
+	#ifdef INSTANCED
+		$input a_position, a_normal, a_tangent, a_texcoord0, a_weight, a_indices, i_data0, i_data1, i_data2, i_data3, i_data4
+	#else
+		$input a_position, a_normal, a_tangent, a_texcoord0, a_weight, a_indices
+	#endif
 	$output v_wpos, v_view, v_normal, v_tangent, v_bitangent, v_texcoord0, v_common2
-
-	uniform mat4 u_boneMatrices[196];
 #else
 	#ifdef INSTANCED
 		$input a_position, a_normal, a_tangent, a_texcoord0, i_data0, i_data1, i_data2, i_data3
@@ -18,6 +20,29 @@
 
 #include "common.sh"
 
+#ifdef SKINNED
+	#ifdef INSTANCED
+		// bone matrices of all instances, 4 texels per matrix, i_data4.x is the first bone of the instance
+		#define BONE_TEXTURE_WIDTH 1024.0
+		SAMPLER2D(u_boneTexture, 7);
+
+		mat4 getBoneMatrix(float bone)
+		{
+			float texel = bone * 4.0;
+			float row = floor(texel / BONE_TEXTURE_WIDTH);
+			ivec2 uv = ivec2(int(texel - row * BONE_TEXTURE_WIDTH), int(row));
+			mat4 m;
+			m[0] = texelFetch(u_boneTexture, uv, 0);
+			m[1] = texelFetch(u_boneTexture, uv + ivec2(1, 0), 0);
+			m[2] = texelFetch(u_boneTexture, uv + ivec2(2, 0), 0);
+			m[3] = texelFetch(u_boneTexture, uv + ivec2(3, 0), 0);
+			return m;
+		}
+	#else
+		uniform mat4 u_boneMatrices[196];
+	#endif
+#endif
+
 #ifdef WIND_ANIMATION
 	SAMPLER2D(u_texNoise, 0);
 	uniform vec4 u_time;
@@ -29,7 +54,7 @@ void main()
 	const float FREQUENCY = 2;
 	const float WIND_STRENGTH = 1.0;
 	const vec3 WIND_DIR = vec3(1, 0, 0);
-	#if !defined INSTANCED || defined SKINNED
+	#ifndef INSTANCED
 		mat4 model = u_model[0];
 	#else
 		mat4 model;
@@ -54,7 +79,14 @@ void main()
 		}
 	#endif	
 
-	#ifdef SKINNED	
+	#if defined SKINNED && defined INSTANCED
+		mat4 skin = a_weight.x * getBoneMatrix(i_data4.x + a_indices.x) +
+			a_weight.y * getBoneMatrix(i_data4.x + a_indices.y) +
+			a_weight.z * getBoneMatrix(i_data4.x + a_indices.z) +
+			a_weight.w * getBoneMatrix(i_data4.x + a_indices.w);
+
+		v_wpos = instMul(model, instMul(skin, vec4(position, 1.0))).xyz;
+	#elif defined SKINNED
 		model = mul(u_model[0], a_weight.x * u_boneMatrices[int(a_indices.x)] + 
 			a_weight.y * u_boneMatrices[int(a_indices.y)] +
 			a_weight.z * u_boneMatrices[int(a_indices.z)] +
@@ -77,7 +109,10 @@ void main()
 		#endif
 		vec3 tangent = (a_tangent * 2.0 - 1.0).xyz;
 
-		#ifdef SKINNED	
+		#if defined SKINNED && defined INSTANCED
+			v_normal = instMul(model, instMul(skin, vec4(normal, 0.0))).xyz;
+			v_tangent = instMul(model, instMul(skin, vec4(tangent, 0.0))).xyz;
+		#elif defined SKINNED
 			v_normal = mul(model, vec4(normal, 0.0) ).xyz;
 			v_tangent = mul(model, vec4(tangent, 0.0) ).xyz;
 		#else
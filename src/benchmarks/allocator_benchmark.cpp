@@ -0,0 +1,289 @@
+#include "benchmarks/benchmark.h"
+#include "engine/debug/tracking_allocator.h"
+#include "engine/mt/task.h"
+#include "engine/pool_allocator.h"
+#include "engine/string.h"
+#include <cstdio>
+
+
+namespace Malmy
+{
+
+
+static const int LIVE_SLOTS = 16 * 1024;
+static const u32 OPS_COUNT = 10'000'000;
+static const int RUNS_COUNT = 10;
+static const int TAGS_COUNT = 8;
+static const int THREADS_COUNT = 4;
+static const u32 THREAD_OPS_COUNT = 2'000'000;
+static const int HANDOFF_COUNT = 256 * 1024;
+
+
+static u32 nextRandom(u32& state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+
+// mostly small blocks as in a frame of the engine, few bigger ones are forwarded to the source
+static size_t getRandomSize(u32& state)
+{
+	u32 r = nextRandom(state);
+	u32 kind = r % 100;
+	if (kind < 90) return 16 + (r >> 8) % 256;
+	if (kind < 99) return 272 + (r >> 8) % (4096 - 272);
+	return 4096 + (r >> 8) % (60 * 1024);
+}
+
+
+// with tags_count > 0 every allocation is done in one of the tags, so blocks of different tags are mixed
+static double runWorkload(IAllocator& allocator, IAllocator& timer_allocator, int tags_count = 0)
+{
+	int tags[TAGS_COUNT];
+	for (int i = 0; i < tags_count; ++i)
+	{
+		char name[32];
+		copyString(name, "benchmark_");
+		char num[8];
+		toCString(i, num, lengthOf(num));
+		catString(name, num);
+		tags[i] = Debug::registerAllocationTag(name);
+	}
+
+	void* slots[LIVE_SLOTS] = {};
+	u32 state = 0x9E3779B9;
+	BenchmarkTimer timer(timer_allocator);
+	timer.start();
+	for (u32 i = 0; i < OPS_COUNT; ++i)
+	{
+		if (tags_count > 0) Debug::pushAllocationTag(tags[i % tags_count]);
+		u32 slot = nextRandom(state) % LIVE_SLOTS;
+		if (slots[slot])
+		{
+			allocator.deallocate(slots[slot]);
+			slots[slot] = nullptr;
+		}
+		size_t size = getRandomSize(state);
+		void* ptr = allocator.allocate(size);
+		setMemory(ptr, (u8)i, size);
+		slots[slot] = ptr;
+		if (tags_count > 0) Debug::popAllocationTag();
+	}
+	for (void* ptr : slots) allocator.deallocate(ptr);
+	return timer.getMs();
+}
+
+
+struct AllocatorResult
+{
+	const char* name;
+	double ms;
+	size_t peak_size;
+};
+
+
+static void addRun(AllocatorResult& result, int run, double ms, const CountingAllocator& source)
+{
+	result.ms = run == 0 ? ms : Math::minimum(result.ms, ms);
+	result.peak_size = source.getPeak();
+}
+
+
+void benchmarkAllocators(IAllocator& allocator)
+{
+	printf("%u random allocations and frees, %d live blocks, best of %d runs\n", OPS_COUNT, LIVE_SLOTS, RUNS_COUNT);
+	printf("memory is the peak allocated from the system, overhead is relative to PoolAllocator\n");
+	printf("%-24s %9s %9s %10s\n", "allocator", "ms", "overhead", "memory KB");
+
+	AllocatorResult results[] = {{"DefaultAllocator"},
+		{"PoolAllocator"},
+		{"TrackingAllocator"},
+		{"  8 tags"},
+		{"  sampling every 1000th"}};
+	for (int run = 0; run < RUNS_COUNT; ++run)
+	{
+		// every run gets a fresh pool, blocks of a reused one are handed out in the order they were freed
+		{
+			CountingAllocator source(allocator);
+			addRun(results[0], run, runWorkload(source, allocator), source);
+		}
+		{
+			CountingAllocator source(allocator);
+			PoolAllocator pool(source);
+			addRun(results[1], run, runWorkload(pool, allocator), source);
+		}
+		{
+			CountingAllocator source(allocator);
+			PoolAllocator pool(source, Debug::MAX_ALLOCATION_TAGS);
+			Debug::TrackingAllocator tracking(pool);
+			addRun(results[2], run, runWorkload(tracking, allocator), source);
+		}
+		{
+			// every tag has its own pages
+			CountingAllocator source(allocator);
+			PoolAllocator pool(source, Debug::MAX_ALLOCATION_TAGS);
+			Debug::TrackingAllocator tracking(pool);
+			addRun(results[3], run, runWorkload(tracking, allocator, TAGS_COUNT), source);
+		}
+		{
+			CountingAllocator source(allocator);
+			PoolAllocator pool(source, Debug::MAX_ALLOCATION_TAGS);
+			Debug::TrackingAllocator tracking(pool);
+			tracking.setStackSampling(1000);
+			addRun(results[4], run, runWorkload(tracking, allocator), source);
+		}
+	}
+	for (const AllocatorResult& result : results)
+	{
+		printf("%-24s %9.1f %8.1f%% %10.1f\n",
+			result.name,
+			result.ms,
+			(result.ms / results[1].ms - 1) * 100,
+			result.peak_size / 1024.0);
+	}
+}
+
+
+// Every thread allocates and frees in its own slots, or only allocates blocks or only frees blocks
+// allocated by the previous thread, so the frees are cross-thread.
+struct AllocatorTask MALMY_FINAL : public MT::Task
+{
+	enum class Mode
+	{
+		LOCAL,
+		ALLOCATE,
+		FREE
+	};
+
+	AllocatorTask(IAllocator& allocator, IAllocator& task_allocator)
+		: MT::Task(task_allocator)
+		, m_allocator(allocator)
+	{
+	}
+
+	int task() override
+	{
+		u32 state = 0x9E3779B9 + m_seed;
+		if (m_mode == Mode::LOCAL)
+		{
+			void** slots = m_blocks;
+			for (int i = 0; i < LIVE_SLOTS; ++i) slots[i] = nullptr;
+			for (u32 i = 0; i < THREAD_OPS_COUNT; ++i)
+			{
+				u32 slot = nextRandom(state) % LIVE_SLOTS;
+				if (slots[slot]) m_allocator.deallocate(slots[slot]);
+				size_t size = getRandomSize(state);
+				slots[slot] = m_allocator.allocate(size);
+				setMemory(slots[slot], (u8)i, Math::minimum(size, (size_t)64));
+			}
+			for (int i = 0; i < LIVE_SLOTS; ++i) m_allocator.deallocate(slots[i]);
+		}
+		else if (m_mode == Mode::ALLOCATE)
+		{
+			for (int i = 0; i < HANDOFF_COUNT; ++i)
+			{
+				size_t size = getRandomSize(state);
+				m_blocks[i] = m_allocator.allocate(size);
+				setMemory(m_blocks[i], (u8)i, Math::minimum(size, (size_t)64));
+			}
+		}
+		else
+		{
+			for (int i = 0; i < HANDOFF_COUNT; ++i) m_allocator.deallocate(m_blocks[i]);
+		}
+		return 0;
+	}
+
+	IAllocator& m_allocator;
+	Mode m_mode;
+	u32 m_seed;
+	void** m_blocks;
+};
+
+
+static double runThreads(IAllocator& allocator,
+	IAllocator& timer_allocator,
+	AllocatorTask::Mode mode,
+	void** (&blocks)[THREADS_COUNT],
+	int blocks_offset)
+{
+	AllocatorTask* tasks[THREADS_COUNT];
+	for (int i = 0; i < THREADS_COUNT; ++i)
+	{
+		tasks[i] = MALMY_NEW(timer_allocator, AllocatorTask)(allocator, timer_allocator);
+		tasks[i]->m_mode = mode;
+		tasks[i]->m_seed = i;
+		tasks[i]->m_blocks = blocks[(i + blocks_offset) % THREADS_COUNT];
+	}
+	BenchmarkTimer timer(timer_allocator);
+	timer.start();
+	for (AllocatorTask* task : tasks) task->create("allocator_benchmark");
+	for (AllocatorTask* task : tasks) task->destroy();
+	double ms = timer.getMs();
+	for (AllocatorTask* task : tasks) MALMY_DELETE(timer_allocator, task);
+	return ms;
+}
+
+
+struct ThreadedResult
+{
+	const char* name;
+	double local_ms;
+	double allocate_ms;
+	double remote_free_ms;
+};
+
+
+static void runThreadedWorkload(ThreadedResult& result,
+	int run,
+	IAllocator& allocator,
+	IAllocator& timer_allocator,
+	void** (&blocks)[THREADS_COUNT])
+{
+	double local_ms = runThreads(allocator, timer_allocator, AllocatorTask::Mode::LOCAL, blocks, 0);
+	double allocate_ms = runThreads(allocator, timer_allocator, AllocatorTask::Mode::ALLOCATE, blocks, 0);
+	// thread i frees the blocks allocated by thread i + 1
+	double remote_free_ms = runThreads(allocator, timer_allocator, AllocatorTask::Mode::FREE, blocks, 1);
+	result.local_ms = run == 0 ? local_ms : Math::minimum(result.local_ms, local_ms);
+	result.allocate_ms = run == 0 ? allocate_ms : Math::minimum(result.allocate_ms, allocate_ms);
+	result.remote_free_ms = run == 0 ? remote_free_ms : Math::minimum(result.remote_free_ms, remote_free_ms);
+}
+
+
+void benchmarkThreadedAllocators(IAllocator& allocator)
+{
+	printf("%d threads, local: %u random allocations and frees per thread, %d live blocks per thread\n",
+		THREADS_COUNT,
+		THREAD_OPS_COUNT,
+		LIVE_SLOTS);
+	printf("cross-thread: every thread allocates %d blocks, then they are freed by another thread\n", HANDOFF_COUNT);
+	printf("wall clock ms, best of %d runs\n", RUNS_COUNT);
+	printf("%-24s %9s %9s %12s\n", "allocator", "local", "allocate", "remote free");
+
+	void** blocks[THREADS_COUNT];
+	for (void**& thread_blocks : blocks)
+	{
+		thread_blocks = (void**)allocator.allocate(sizeof(void*) * Math::maximum(LIVE_SLOTS, HANDOFF_COUNT));
+	}
+
+	// the pool is kept between runs, so its pages are warm like the system heap's
+	PoolAllocator pool(allocator);
+	ThreadedResult results[] = {{"DefaultAllocator"}, {"PoolAllocator"}};
+	for (int run = 0; run < RUNS_COUNT; ++run)
+	{
+		runThreadedWorkload(results[0], run, allocator, allocator, blocks);
+		runThreadedWorkload(results[1], run, pool, allocator, blocks);
+	}
+	for (const ThreadedResult& result : results)
+	{
+		printf("%-24s %9.1f %9.1f %12.1f\n", result.name, result.local_ms, result.allocate_ms, result.remote_free_ms);
+	}
+
+	for (void** thread_blocks : blocks) allocator.deallocate(thread_blocks);
+}
+
+
+} // namespace Malmy
@@ -0,0 +1,118 @@
+#pragma once
+#include "engine/iallocator.h"
+#include "engine/malmy.h"
+#include "engine/math_utils.h"
+#include "engine/timer.h"
+
+
+namespace Malmy
+{
+
+
+// Forwards to another allocator and counts live bytes, so benchmarks can report memory use
+struct CountingAllocator MALMY_FINAL : IAllocator
+{
+	explicit CountingAllocator(IAllocator& source)
+		: m_source(source)
+		, m_allocated(0)
+		, m_peak(0)
+	{
+	}
+
+	void* allocate(size_t size) override { return allocate_aligned(size, ALIGNMENT); }
+	void deallocate(void* ptr) override { deallocate_aligned(ptr); }
+	void* reallocate(void* ptr, size_t size) override { return reallocate_aligned(ptr, size, ALIGNMENT); }
+
+	void* allocate_aligned(size_t size, size_t align) override
+	{
+		u8* mem = (u8*)m_source.allocate_aligned(size + ALIGNMENT, Math::maximum(align, ALIGNMENT));
+		if (!mem) return nullptr;
+		*(size_t*)mem = size;
+		add(size);
+		return mem + ALIGNMENT;
+	}
+
+	void deallocate_aligned(void* ptr) override
+	{
+		if (!ptr) return;
+		u8* mem = (u8*)ptr - ALIGNMENT;
+		m_allocated -= *(size_t*)mem;
+		m_source.deallocate_aligned(mem);
+	}
+
+	void* reallocate_aligned(void* ptr, size_t size, size_t align) override
+	{
+		if (!ptr) return allocate_aligned(size, align);
+		u8* mem = (u8*)ptr - ALIGNMENT;
+		m_allocated -= *(size_t*)mem;
+		mem = (u8*)m_source.reallocate_aligned(mem, size + ALIGNMENT, Math::maximum(align, ALIGNMENT));
+		if (!mem) return nullptr;
+		*(size_t*)mem = size;
+		add(size);
+		return mem + ALIGNMENT;
+	}
+
+	size_t getAllocated() const { return m_allocated; }
+	size_t getPeak() const { return m_peak; }
+
+private:
+	static const size_t ALIGNMENT = 16;
+
+	void add(size_t size)
+	{
+		m_allocated += size;
+		if (m_allocated > m_peak) m_peak = m_allocated;
+	}
+
+	IAllocator& m_source;
+	size_t m_allocated;
+	size_t m_peak;
+};
+
+
+// Measures nanoseconds per operation of a timed scope
+struct BenchmarkTimer
+{
+	explicit BenchmarkTimer(IAllocator& allocator)
+		: m_timer(Timer::create(allocator))
+	{
+	}
+
+	~BenchmarkTimer() { Timer::destroy(m_timer); }
+
+	void start() { m_start = m_timer->getRawTimeSinceStart(); }
+
+	double getNsPerOp(u64 ops_count) const
+	{
+		u64 ticks = m_timer->getRawTimeSinceStart() - m_start;
+		return double(ticks) * 1e9 / double(m_timer->getFrequency()) / double(ops_count > 0 ? ops_count : 1);
+	}
+
+	double getMs() const
+	{
+		u64 ticks = m_timer->getRawTimeSinceStart() - m_start;
+		return double(ticks) * 1e3 / double(m_timer->getFrequency());
+	}
+
+private:
+	Timer* m_timer;
+	u64 m_start = 0;
+};
+
+
+// Benchmarks which also check behavior report failed checks here, benchmarks then exits with 1
+void reportFailure(const char* message);
+
+
+// Every benchmark prints its results to stdout, see benchmarks/main.cpp for the list
+void benchmarkAllocators(IAllocator& allocator);
+void benchmarkFileSystem(IAllocator& allocator);
+void benchmarkGUI(IAllocator& allocator);
+void benchmarkHashMaps(IAllocator& allocator);
+void benchmarkPaths(IAllocator& allocator);
+void benchmarkSparseSets(IAllocator& allocator);
+void benchmarkTextureStreaming(IAllocator& allocator);
+void benchmarkThreadedAllocators(IAllocator& allocator);
+
+
+} // namespace Malmy
@@ -0,0 +1,175 @@
+#include "benchmarks/benchmark.h"
+#include "engine/fs/disk_file_device.h"
+#include "engine/fs/file_system.h"
+#include "engine/fs/os_file.h"
+#include "engine/mt/atomic.h"
+#include "engine/mt/thread.h"
+#include "engine/path.h"
+#include "engine/string.h"
+#include <cstdio>
+#include <cstdlib>
+
+
+namespace Malmy
+{
+
+
+static const int FILES_COUNT = 10'000;
+static const int FILE_SIZE = 4096;
+
+
+static void getFileName(int idx, char (&out)[MAX_PATH_LENGTH])
+{
+	char num[16];
+	toCString(idx, num, lengthOf(num));
+	copyString(out, "fs_benchmark_");
+	catString(out, num);
+	catString(out, ".dat");
+}
+
+
+struct FileRequest
+{
+	// worker callback, the file is read on the I/O thread like resources do
+	void onOpened(FS::IFile& file, bool success)
+	{
+		u8 buffer[FILE_SIZE];
+		if (success) file.read(buffer, Math::minimum(file.size(), sizeof(buffer)));
+		fs->close(file);
+		done_time = timer->getRawTimeSinceStart();
+		MT::atomicIncrement(done_count);
+	}
+
+	void onDispatched(FS::IFile& file, bool success) {}
+
+	FS::FileSystem* fs;
+	Timer* timer;
+	volatile i32* done_count;
+	u64 queued_time;
+	u64 done_time;
+};
+
+
+static double getPercentile(double* sorted, int count, double p)
+{
+	return sorted[Math::minimum(int(p * count), count - 1)];
+}
+
+
+static void openAll(FS::FileSystem& fs, FileRequest* requests, u32* ids, volatile i32* done_count, Timer& timer)
+{
+	*done_count = 0;
+	for (int i = 0; i < FILES_COUNT; ++i)
+	{
+		char name[MAX_PATH_LENGTH];
+		getFileName(i, name);
+		FileRequest& request = requests[i];
+		request.fs = &fs;
+		request.timer = &timer;
+		request.done_count = done_count;
+		request.done_time = 0;
+		FS::ReadCallback cb;
+		cb.bind<FileRequest, &FileRequest::onDispatched>(&request);
+		FS::ReadCallback worker_cb;
+		worker_cb.bind<FileRequest, &FileRequest::onOpened>(&request);
+		request.queued_time = timer.getRawTimeSinceStart();
+		ids[i] = fs.openAsync(
+			fs.getDefaultDevice(), Path(name), FS::Mode::OPEN_AND_READ, cb, FS::AsyncPriority::NORMAL, worker_cb);
+	}
+}
+
+
+static void waitForAll(FS::FileSystem& fs)
+{
+	while (fs.hasWork())
+	{
+		fs.updateAsyncTransactions();
+		MT::sleep(1);
+	}
+}
+
+
+void benchmarkFileSystem(IAllocator& allocator)
+{
+	PathManager path_manager(allocator);
+	u8 content[FILE_SIZE];
+	for (int i = 0; i < FILE_SIZE; ++i) content[i] = u8(i);
+	for (int i = 0; i < FILES_COUNT; ++i)
+	{
+		char name[MAX_PATH_LENGTH];
+		getFileName(i, name);
+		FS::OsFile file;
+		if (!file.open(name, FS::Mode::CREATE_AND_WRITE))
+		{
+			printf("Could not create %s\n", name);
+			return;
+		}
+		file.write(content, sizeof(content));
+		file.close();
+	}
+
+	FS::FileSystem* fs = FS::FileSystem::create(allocator);
+	FS::DiskFileDevice disk_device("disk", "", allocator);
+	fs->mount(&disk_device);
+	fs->setDefaultDevice("disk");
+
+	Timer* timer = Timer::create(allocator);
+	double to_ms = 1e3 / double(timer->getFrequency());
+	FileRequest* requests = (FileRequest*)allocator.allocate(sizeof(FileRequest) * FILES_COUNT);
+	u32* ids = (u32*)allocator.allocate(sizeof(u32) * FILES_COUNT);
+	double* latencies = (double*)allocator.allocate(sizeof(double) * FILES_COUNT);
+	volatile i32 done_count = 0;
+
+	printf("%d files of %d bytes opened and read on I/O threads, the files were just written, so they are cached\n",
+		FILES_COUNT,
+		FILE_SIZE);
+
+	u64 start = timer->getRawTimeSinceStart();
+	openAll(*fs, requests, ids, &done_count, *timer);
+	double submit_ms = (timer->getRawTimeSinceStart() - start) * to_ms;
+	waitForAll(*fs);
+	double total_ms = (timer->getRawTimeSinceStart() - start) * to_ms;
+
+	for (int i = 0; i < FILES_COUNT; ++i) latencies[i] = (requests[i].done_time - requests[i].queued_time) * to_ms;
+	qsort(latencies, FILES_COUNT, sizeof(latencies[0]), [](const void* a, const void* b) {
+		const double lhs = *(const double*)a;
+		const double rhs = *(const double*)b;
+		return lhs < rhs ? -1 : (lhs > rhs ? 1 : 0);
+	});
+	printf("submit %.1f ms, all done %.1f ms, %.0f files/s, %.1f MB/s\n",
+		submit_ms,
+		total_ms,
+		FILES_COUNT / total_ms * 1000,
+		FILES_COUNT * double(FILE_SIZE) / (1024 * 1024) / total_ms * 1000);
+	printf("ms from openAsync to the file being read: p50 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+		getPercentile(latencies, FILES_COUNT, 0.5),
+		getPercentile(latencies, FILES_COUNT, 0.99),
+		getPercentile(latencies, FILES_COUNT, 0.999),
+		latencies[FILES_COUNT - 1]);
+
+	// cancels requests still in the queue and waits for the ones in progress
+	openAll(*fs, requests, ids, &done_count, *timer);
+	start = timer->getRawTimeSinceStart();
+	for (int i = FILES_COUNT - 1; i >= 0; --i) fs->cancelAsync(ids[i]);
+	double cancel_ms = (timer->getRawTimeSinceStart() - start) * to_ms;
+	int opened_count = done_count;
+	waitForAll(*fs);
+	printf("cancel all %.1f ms, %d files were opened before they were canceled\n", cancel_ms, opened_count);
+
+	allocator.deallocate(latencies);
+	allocator.deallocate(ids);
+	allocator.deallocate(requests);
+	Timer::destroy(timer);
+	fs->unMount(&disk_device);
+	FS::FileSystem::destroy(fs);
+
+	for (int i = 0; i < FILES_COUNT; ++i)
+	{
+		char name[MAX_PATH_LENGTH];
+		getFileName(i, name);
+		remove(name);
+	}
+}
+
+
+} // namespace Malmy
@@ -0,0 +1,312 @@
+#include "benchmarks/benchmark.h"
+#include "engine/array.h"
+#include "engine/string.h"
+#include "renderer/draw2d.h"
+#include <cfloat>
+#include <cstdio>
+
+
+namespace Malmy
+{
+
+
+static const int PANELS_COUNT = 50;
+static const int PANEL_CHILDREN_COUNT = 99;
+static const int FRAMES_COUNT = 300;
+static const Vec2 CANVAS_SIZE(1920, 1080);
+
+
+struct LayoutRect
+{
+	float x, y, w, h;
+};
+
+
+// Replays the Draw2D work of GUIScene on a 5,000 rect HUD, the root has PANELS_COUNT panels,
+// every panel has a grid of 9-patch buttons with centered labels
+struct BenchmarkRect
+{
+	struct Anchor
+	{
+		float points;
+		float relative;
+	};
+
+	Anchor top;
+	Anchor right;
+	Anchor bottom;
+	Anchor left;
+	bool is_patch9;
+	char text[16];
+	LayoutRect layout;
+	Vec2 text_size;
+	bool is_text_size_dirty;
+};
+
+
+struct PanelCache
+{
+	PanelCache(IAllocator& allocator) : draw(allocator) {}
+
+	Draw2D draw;
+	bool is_dirty = true;
+};
+
+
+struct GUIBenchmark
+{
+	GUIBenchmark(IAllocator& allocator)
+		: m_allocator(allocator)
+		, m_atlas(allocator)
+		, m_rects(allocator)
+		, m_caches(allocator)
+		, m_frame(allocator)
+	{
+		m_font = m_atlas.AddFontDefault();
+		unsigned char* pixels;
+		int width, height;
+		m_atlas.GetTexDataAsAlpha8(&pixels, &width, &height);
+		m_atlas.TexID = &m_font_texture;
+
+		// 1 + PANELS_COUNT * (1 + PANEL_CHILDREN_COUNT) rects, children follow their panel
+		m_rects.reserve(1 + PANELS_COUNT * (1 + PANEL_CHILDREN_COUNT));
+		BenchmarkRect& root = m_rects.emplace();
+		setAnchors(root, 0, 0, 1, 1, 0);
+		root.is_patch9 = false;
+		root.text[0] = '\0';
+		for (int i = 0; i < PANELS_COUNT; ++i)
+		{
+			BenchmarkRect& panel = m_rects.emplace();
+			float x = (i % 10) / 10.0f;
+			float y = (i / 10) / 5.0f;
+			setAnchors(panel, x, y, x + 0.1f, y + 0.2f, 2);
+			panel.is_patch9 = true;
+			panel.text[0] = '\0';
+			for (int j = 0; j < PANEL_CHILDREN_COUNT; ++j)
+			{
+				BenchmarkRect& child = m_rects.emplace();
+				float cx = (j % 9) / 9.0f;
+				float cy = (j / 9) / 11.0f;
+				setAnchors(child, cx, cy, cx + 1 / 9.0f, cy + 1 / 11.0f, 1);
+				child.is_patch9 = j % 2 == 0;
+				setText(child, i * PANEL_CHILDREN_COUNT + j);
+			}
+		}
+
+		m_caches.reserve(PANELS_COUNT);
+		for (int i = 0; i < PANELS_COUNT; ++i) m_caches.emplace(allocator);
+	}
+
+
+	static void setAnchors(BenchmarkRect& rect, float l, float t, float r, float b, float margin)
+	{
+		rect.left = {margin, l};
+		rect.top = {margin, t};
+		rect.right = {-margin, r};
+		rect.bottom = {-margin, b};
+	}
+
+
+	static void setText(BenchmarkRect& rect, int value)
+	{
+		toCString(value, rect.text, lengthOf(rect.text));
+		rect.is_text_size_dirty = true;
+	}
+
+
+	static LayoutRect getRectOnCanvas(const LayoutRect& parent_rect, const BenchmarkRect& rect)
+	{
+		float l = parent_rect.x + parent_rect.w * rect.left.relative + rect.left.points;
+		float r = parent_rect.x + parent_rect.w * rect.right.relative + rect.right.points;
+		float t = parent_rect.y + parent_rect.h * rect.top.relative + rect.top.points;
+		float b = parent_rect.y + parent_rect.h * rect.bottom.relative + rect.bottom.points;
+		return {l, t, r - l, b - t};
+	}
+
+
+	void renderRectContent(BenchmarkRect& rect, Draw2D& draw, bool cache_text_size)
+	{
+		float l = rect.layout.x;
+		float t = rect.layout.y;
+		float r = rect.layout.x + rect.layout.w;
+		float b = rect.layout.y + rect.layout.h;
+		if (rect.is_patch9)
+		{
+			float x[] = {l, l + 4, r - 4, r};
+			float y[] = {t, t + 4, b - 4, b};
+			float u[] = {0, 0.25f, 0.75f, 1};
+			for (int j = 0; j < 3; ++j)
+			{
+				for (int i = 0; i < 3; ++i)
+				{
+					draw.AddImage(&m_sprite_texture, {x[i], y[j]}, {x[i + 1], y[j + 1]}, {u[i], u[j]}, {u[i + 1], u[j + 1]});
+				}
+			}
+		}
+		else
+		{
+			draw.AddRectFilled({l, t}, {r, b}, 0xff303030);
+		}
+
+		if (rect.text[0])
+		{
+			if (!cache_text_size || rect.is_text_size_dirty)
+			{
+				rect.text_size = m_font->CalcTextSizeA(FONT_SIZE, FLT_MAX, 0, rect.text);
+				rect.is_text_size_dirty = false;
+			}
+			Vec2 pos(l + (rect.layout.w - rect.text_size.x) * 0.5f, t);
+			draw.AddText(m_font, FONT_SIZE, pos, 0xffffFFFF, rect.text);
+		}
+	}
+
+
+	// returns the number of rects rendered
+	int renderPanel(int panel_idx, Draw2D& draw, bool cache_text_size)
+	{
+		BenchmarkRect* panel = &m_rects[1 + panel_idx * (1 + PANEL_CHILDREN_COUNT)];
+		panel->layout = getRectOnCanvas(m_rects[0].layout, *panel);
+		renderRectContent(*panel, draw, cache_text_size);
+		for (int i = 1; i <= PANEL_CHILDREN_COUNT; ++i)
+		{
+			panel[i].layout = getRectOnCanvas(panel->layout, panel[i]);
+			renderRectContent(panel[i], draw, cache_text_size);
+		}
+		return 1 + PANEL_CHILDREN_COUNT;
+	}
+
+
+	void beginDraw(Draw2D& draw)
+	{
+		draw.Clear();
+		draw.FontTexUvWhitePixel = m_atlas.TexUvWhitePixel;
+		draw.PushClipRectFullScreen();
+		draw.PushTextureID(m_atlas.TexID);
+	}
+
+
+	// everything is laid out and tessellated every frame, as GUIScene did before retaining draw data
+	int renderImmediate()
+	{
+		beginDraw(m_frame);
+		BenchmarkRect& root = m_rects[0];
+		root.layout = getRectOnCanvas({0, 0, CANVAS_SIZE.x, CANVAS_SIZE.y}, root);
+		renderRectContent(root, m_frame, false);
+		int count = 1;
+		for (int i = 0; i < PANELS_COUNT; ++i) count += renderPanel(i, m_frame, false);
+		return count;
+	}
+
+
+	int renderRetained()
+	{
+		beginDraw(m_frame);
+		BenchmarkRect& root = m_rects[0];
+		root.layout = getRectOnCanvas({0, 0, CANVAS_SIZE.x, CANVAS_SIZE.y}, root);
+		renderRectContent(root, m_frame, true);
+		int count = 1;
+		for (int i = 0; i < PANELS_COUNT; ++i)
+		{
+			PanelCache& cache = m_caches[i];
+			if (cache.is_dirty)
+			{
+				beginDraw(cache.draw);
+				count += renderPanel(i, cache.draw, true);
+				cache.is_dirty = false;
+			}
+			m_frame.AddDrawList(cache.draw);
+		}
+		return count;
+	}
+
+
+	// a label of the panel changes, e.g. a counter in the HUD
+	void changePanel(int panel_idx, int frame)
+	{
+		BenchmarkRect& label = m_rects[1 + panel_idx * (1 + PANEL_CHILDREN_COUNT) + 1];
+		setText(label, frame);
+		m_caches[panel_idx].is_dirty = true;
+	}
+
+
+	static constexpr float FONT_SIZE = 13;
+
+	IAllocator& m_allocator;
+	FontAtlas m_atlas;
+	Font* m_font;
+	Array<BenchmarkRect> m_rects;
+	Array<PanelCache> m_caches;
+	Draw2D m_frame;
+	int m_font_texture = 0;
+	int m_sprite_texture = 0;
+};
+
+
+struct GUIResult
+{
+	const char* name;
+	double ms;
+	int rendered_rects;
+	int vertices_count;
+};
+
+
+enum class GUIMode
+{
+	IMMEDIATE,
+	RETAINED_STATIC,
+	RETAINED_ONE_PANEL,
+	RETAINED_ALL
+};
+
+
+static GUIResult runGUI(const char* name, GUIMode mode, IAllocator& allocator)
+{
+	GUIBenchmark gui(allocator);
+	BenchmarkTimer timer(allocator);
+	int rendered_rects = 0;
+	// the first frame fills the caches and grows the buffers
+	if (mode == GUIMode::IMMEDIATE) gui.renderImmediate();
+	else gui.renderRetained();
+
+	timer.start();
+	for (int frame = 0; frame < FRAMES_COUNT; ++frame)
+	{
+		switch (mode)
+		{
+			case GUIMode::IMMEDIATE: rendered_rects += gui.renderImmediate(); break;
+			case GUIMode::RETAINED_STATIC: rendered_rects += gui.renderRetained(); break;
+			case GUIMode::RETAINED_ONE_PANEL:
+				gui.changePanel(frame % PANELS_COUNT, frame);
+				rendered_rects += gui.renderRetained();
+				break;
+			case GUIMode::RETAINED_ALL:
+				for (int i = 0; i < PANELS_COUNT; ++i) gui.changePanel(i, frame);
+				rendered_rects += gui.renderRetained();
+				break;
+		}
+	}
+	return {name, timer.getMs() / FRAMES_COUNT, rendered_rects / FRAMES_COUNT, gui.m_frame.VtxBuffer.size()};
+}
+
+
+void benchmarkGUI(IAllocator& allocator)
+{
+	printf("%d rects, %d panels, half of the rects are 9-patch sprites, all but panels have a label\n",
+		1 + PANELS_COUNT * (1 + PANEL_CHILDREN_COUNT),
+		PANELS_COUNT);
+	printf("CPU ms per frame, average of %d frames\n", FRAMES_COUNT);
+	printf("%-28s %9s %14s %9s\n", "mode", "ms", "rendered rects", "vertices");
+
+	GUIResult results[] = {runGUI("immediate", GUIMode::IMMEDIATE, allocator),
+		runGUI("retained, static", GUIMode::RETAINED_STATIC, allocator),
+		runGUI("retained, 1 panel changes", GUIMode::RETAINED_ONE_PANEL, allocator),
+		runGUI("retained, all panels change", GUIMode::RETAINED_ALL, allocator)};
+	for (const GUIResult& result : results)
+	{
+		printf("%-28s %9.3f %14d %9d\n", result.name, result.ms, result.rendered_rects, result.vertices_count);
+	}
+}
+
+
+} // namespace Malmy
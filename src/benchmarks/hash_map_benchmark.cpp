@@ -0,0 +1,115 @@
+#include "benchmarks/benchmark.h"
+#include "engine/flat_hash_map.h"
+#include "engine/hash_map.h"
+#include <cstdio>
+
+
+namespace Malmy
+{
+
+
+// pseudo random unique keys, a bijection of the index
+static u32 getKey(u32 idx)
+{
+	u32 h = idx;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+
+template <typename Map>
+static void benchmarkMap(const char* name, u32 count, IAllocator& allocator)
+{
+	CountingAllocator counting(allocator);
+	BenchmarkTimer timer(allocator);
+	u64 checksum = 0;
+	{
+		Map map(counting);
+
+		timer.start();
+		for (u32 i = 0; i < count; ++i) map.insert(getKey(i), i);
+		double insert_ns = timer.getNsPerOp(count);
+		size_t inserted_bytes = counting.getAllocated();
+
+		timer.start();
+		for (u32 i = 0; i < count; ++i)
+		{
+			auto iter = map.find(getKey(i));
+			if (iter.isValid()) checksum += iter.value();
+		}
+		double hit_ns = timer.getNsPerOp(count);
+
+		timer.start();
+		for (u32 i = 0; i < count; ++i)
+		{
+			if (map.find(getKey(count + i)).isValid()) ++checksum;
+		}
+		double miss_ns = timer.getNsPerOp(count);
+
+		timer.start();
+		for (auto iter = map.begin(), end = map.end(); iter != end; ++iter) checksum += iter.value();
+		double iterate_ns = timer.getNsPerOp(count);
+
+		// FlatHashMap grows at 7/8 of its capacity, 3/8 of the capacity is kept, below its in place rehash limit
+		u32 capacity = 16;
+		while (capacity - capacity / 8 < count) capacity *= 2;
+		u32 erased_count = count - Math::minimum(count, capacity / 8 * 3);
+		timer.start();
+		for (u32 i = 0; i < erased_count; ++i) map.erase(getKey(i));
+		double erase_ns = timer.getNsPerOp(erased_count);
+
+		// every new key replaces the oldest one, erases in full groups leave tombstones
+		u32 churn_count = count * 4;
+		timer.start();
+		for (u32 i = 0; i < churn_count; ++i)
+		{
+			map.erase(getKey(erased_count + i));
+			map.insert(getKey(count + i), i);
+		}
+		double churn_ns = timer.getNsPerOp(churn_count);
+		size_t churned_bytes = counting.getAllocated();
+
+		printf("%-12s %9u %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %10.1f %10.1f\n",
+			name,
+			count,
+			insert_ns,
+			hit_ns,
+			miss_ns,
+			iterate_ns,
+			erase_ns,
+			churn_ns,
+			inserted_bytes / 1024.0,
+			churned_bytes / 1024.0);
+	}
+	// keeps the lookups from being optimized out
+	if (checksum == 0xffffFFFF) printf("%llu\n", (unsigned long long)checksum);
+}
+
+
+void benchmarkHashMaps(IAllocator& allocator)
+{
+	printf("ns per operation, memory in KB after inserting all keys and after churn\n");
+	printf("%-12s %9s %9s %9s %9s %9s %9s %9s %10s %10s\n",
+		"map",
+		"count",
+		"insert",
+		"hit",
+		"miss",
+		"iterate",
+		"erase",
+		"churn",
+		"inserted",
+		"churned");
+	for (u32 count = 1000; count <= 10'000'000; count *= 10)
+	{
+		benchmarkMap<HashMap<u32, u32>>("HashMap", count, allocator);
+		benchmarkMap<FlatHashMap<u32, u32>>("FlatHashMap", count, allocator);
+	}
+}
+
+
+} // namespace Malmy
@@ -0,0 +1,69 @@
+#include "benchmarks/benchmark.h"
+#include "engine/default_allocator.h"
+#include "engine/string.h"
+#include <cstdio>
+
+
+using namespace Malmy;
+
+
+struct Benchmark
+{
+	const char* name;
+	void (*run)(IAllocator& allocator);
+};
+
+
+static const Benchmark BENCHMARKS[] = {
+	{"allocator", &benchmarkAllocators},
+	{"allocator_threads", &benchmarkThreadedAllocators},
+	{"file_system", &benchmarkFileSystem},
+	{"gui", &benchmarkGUI},
+	{"hash_map", &benchmarkHashMaps},
+	{"path", &benchmarkPaths},
+	{"sparse_set", &benchmarkSparseSets},
+	{"texture_streaming", &benchmarkTextureStreaming},
+};
+
+
+static bool s_failed = false;
+
+
+void Malmy::reportFailure(const char* message)
+{
+	printf("FAILED: %s\n", message);
+	s_failed = true;
+}
+
+
+int main(int argc, char** argv)
+{
+	// arguments starting with '-' are left to the engine, e.g. -noop_renderer
+	const char* name = argc > 1 && argv[1][0] != '-' ? argv[1] : nullptr;
+	for (int i = name ? 2 : 1; i < argc; ++i)
+	{
+		if (argv[i][0] != '-')
+		{
+			printf("Usage: benchmarks [name] [engine flags]\n");
+			return 1;
+		}
+	}
+
+	DefaultAllocator allocator;
+	bool found = false;
+	for (const Benchmark& benchmark : BENCHMARKS)
+	{
+		if (name && !equalStrings(name, benchmark.name)) continue;
+		printf("== %s ==\n", benchmark.name);
+		benchmark.run(allocator);
+		found = true;
+	}
+	if (!found)
+	{
+		printf("Unknown benchmark %s, available:", name);
+		for (const Benchmark& benchmark : BENCHMARKS) printf(" %s", benchmark.name);
+		printf("\n");
+		return 1;
+	}
+	return s_failed ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+#include "benchmarks/benchmark.h"
+#include "engine/crc32.h"
+#include "engine/path.h"
+#include "engine/string.h"
+#include <cstdio>
+
+
+namespace Malmy
+{
+
+
+static void getPathString(u32 idx, char (&out)[MAX_PATH_LENGTH])
+{
+	char num[16];
+	toCString(idx, num, lengthOf(num));
+	copyString(out, "models/props/dir_");
+	char dir[16];
+	toCString(idx % 97, dir, lengthOf(dir));
+	catString(out, dir);
+	catString(out, "/mesh_");
+	catString(out, num);
+	catString(out, ".msh");
+}
+
+
+static void benchmarkPathCount(u32 count, IAllocator& allocator)
+{
+	CountingAllocator counting(allocator);
+	BenchmarkTimer timer(allocator);
+	u64 checksum = 0;
+	{
+		PathManager manager(counting);
+		char tmp[MAX_PATH_LENGTH];
+
+		timer.start();
+		for (u32 i = 0; i < count; ++i)
+		{
+			getPathString(i, tmp);
+			Path path(tmp);
+			checksum += path.getHash();
+		}
+		double intern_ns = timer.getNsPerOp(count);
+		size_t interned_bytes = counting.getAllocated();
+
+		timer.start();
+		for (u32 i = 0; i < count; ++i)
+		{
+			getPathString(i, tmp);
+			Path path(tmp);
+			checksum += path.getHash();
+		}
+		double existing_ns = timer.getNsPerOp(count);
+
+		timer.start();
+		for (u32 i = 0; i < count; ++i)
+		{
+			getPathString(i, tmp);
+			Path path(crc32(tmp));
+			checksum += path.length();
+		}
+		double by_hash_ns = timer.getNsPerOp(count);
+
+		printf("%9u %9.1f %9.1f %9.1f %10.1f\n", count, intern_ns, existing_ns, by_hash_ns, interned_bytes / 1024.0);
+	}
+	// keeps the lookups from being optimized out
+	if (checksum == 0xffffFFFF) printf("%llu\n", (unsigned long long)checksum);
+}
+
+
+void benchmarkPaths(IAllocator& allocator)
+{
+	printf("ns per path including building its string, memory in KB after interning all paths\n");
+	printf("%9s %9s %9s %9s %10s\n", "count", "new", "existing", "by hash", "memory");
+	for (u32 count = 1000; count <= 1'000'000; count *= 10)
+	{
+		benchmarkPathCount(count, allocator);
+	}
+}
+
+
+} // namespace Malmy
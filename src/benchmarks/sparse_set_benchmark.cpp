@@ -0,0 +1,94 @@
+#include "benchmarks/benchmark.h"
+#include "engine/associative_array.h"
+#include "engine/sparse_set.h"
+#include "engine/vec.h"
+#include <cstdio>
+
+
+namespace Malmy
+{
+
+
+// about the size of a component, e.g. a decal
+struct ComponentData
+{
+	Vec3 position;
+	float radius;
+	u32 flags;
+	int material;
+	GameObject parent;
+	float time;
+};
+
+
+// game objects are created and destroyed in random order, e.g. spawned from Lua
+static void shuffle(Array<GameObject>& objects)
+{
+	u32 state = 0x9E3779B9;
+	for (int i = objects.size() - 1; i > 0; --i)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		int j = state % (i + 1);
+		GameObject tmp = objects[i];
+		objects[i] = objects[j];
+		objects[j] = tmp;
+	}
+}
+
+
+template <typename Storage>
+static void benchmarkStorage(const char* name, int count, IAllocator& allocator)
+{
+	Array<GameObject> objects(allocator);
+	objects.resize(count);
+	for (int i = 0; i < count; ++i) objects[i] = {i};
+	shuffle(objects);
+
+	BenchmarkTimer timer(allocator);
+	float checksum = 0;
+	Storage storage(allocator);
+
+	timer.start();
+	for (GameObject object : objects)
+	{
+		ComponentData& data = storage.insert(object);
+		data.position = {(float)object.index, 0, 0};
+		data.radius = 1;
+		data.parent = object;
+	}
+	double create_ms = timer.getMs();
+
+	timer.start();
+	for (GameObject object : objects) checksum += storage[object].radius;
+	double find_ms = timer.getMs();
+
+	timer.start();
+	for (ComponentData& data : storage) checksum += data.position.x;
+	double iterate_ms = timer.getMs();
+
+	shuffle(objects);
+	timer.start();
+	for (GameObject object : objects) storage.erase(object);
+	double destroy_ms = timer.getMs();
+
+	printf("%-18s %9d %9.2f %9.2f %9.2f %9.2f\n", name, count, create_ms, find_ms, iterate_ms, destroy_ms);
+	// keeps the lookups from being optimized out
+	if (checksum == -1) printf("%f\n", checksum);
+}
+
+
+void benchmarkSparseSets(IAllocator& allocator)
+{
+	printf("ms to create, find, iterate and destroy components of all game objects, in random order\n");
+	printf("%-18s %9s %9s %9s %9s %9s\n", "storage", "count", "create", "find", "iterate", "destroy");
+	for (int count = 1000; count <= 100'000; count *= 10)
+	{
+		benchmarkStorage<AssociativeArray<GameObject, ComponentData>>("AssociativeArray", count, allocator);
+		benchmarkStorage<SparseSet<GameObject, ComponentData>>("SparseSet", count, allocator);
+	}
+}
+
+
+} // namespace Malmy
@@ -0,0 +1,295 @@
+#include "benchmarks/benchmark.h"
+#include "engine/engine.h"
+#include "engine/fs/file_system.h"
+#include "engine/fs/os_file.h"
+#include "engine/mt/thread.h"
+#include "engine/path.h"
+#include "engine/plugin_manager.h"
+#include "engine/resource_manager.h"
+#include "engine/string.h"
+#include "renderer/material.h"
+#include "renderer/material_manager.h"
+#include "renderer/renderer.h"
+#include "renderer/texture.h"
+#include "renderer/texture_manager.h"
+#include <cstdio>
+
+
+namespace Malmy
+{
+
+
+static const int STREAMED_SIZE = 1024;
+static const int SMALL_SIZE = 16;
+static const int MATERIALS_COUNT = 1000;
+// every STREAMED_MATERIAL_STEP-th material uses the streamed texture, the rest use the small one
+static const int STREAMED_MATERIAL_STEP = 100;
+static const int MAX_FRAMES = 1000;
+static const int HANDLE_CHANGES_COUNT = 1000;
+static const char* STREAMED_TEXTURE = "texture_streaming_test.dds";
+static const char* SMALL_TEXTURE = "texture_streaming_test_small.dds";
+// run from the data directory, the material needs a real shader
+static const char* SHADER = "pipelines/rigid/rigid.shd";
+
+
+static void getMaterialName(int idx, char (&out)[MAX_PATH_LENGTH])
+{
+	char num[16];
+	toCString(idx, num, lengthOf(num));
+	copyString(out, "texture_streaming_test_");
+	catString(out, num);
+	catString(out, ".mat");
+}
+
+
+static void writeU32(FS::OsFile& file, u32 value)
+{
+	file.write(&value, sizeof(value));
+}
+
+
+// uncompressed RGBA8 DDS with the complete mip chain
+static bool writeDDS(const char* path, int size, IAllocator& allocator)
+{
+	FS::OsFile file;
+	if (!file.open(path, FS::Mode::CREATE_AND_WRITE)) return false;
+
+	int mips = 1;
+	while ((size >> mips) > 0) ++mips;
+
+	writeU32(file, 0x20534444); // 'DDS '
+	writeU32(file, 124);
+	writeU32(file, 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000); // caps, height, width, pixel format, mip count
+	writeU32(file, size);
+	writeU32(file, size);
+	writeU32(file, size * 4);
+	writeU32(file, 0);
+	writeU32(file, mips);
+	for (int i = 0; i < 11; ++i) writeU32(file, 0);
+	writeU32(file, 32);
+	writeU32(file, 0x40 | 0x1); // RGB, alpha pixels
+	writeU32(file, 0);
+	writeU32(file, 32);
+	writeU32(file, 0x000000ff);
+	writeU32(file, 0x0000ff00);
+	writeU32(file, 0x00ff0000);
+	writeU32(file, 0xff000000);
+	writeU32(file, 0x1000 | 0x400000 | 0x8); // texture, mipmap, complex
+	for (int i = 0; i < 4; ++i) writeU32(file, 0);
+
+	u32* pixels = (u32*)allocator.allocate(size * size * sizeof(u32));
+	bool success = true;
+	for (int mip = 0; mip < mips; ++mip)
+	{
+		int mip_size = size >> mip;
+		for (int i = 0; i < mip_size * mip_size; ++i) pixels[i] = 0xff000000 | (mip * 0x1f);
+		success = success && file.write(pixels, mip_size * mip_size * sizeof(u32));
+	}
+	allocator.deallocate(pixels);
+	file.close();
+	return success;
+}
+
+
+static bool writeMaterial(const char* path, const char* texture)
+{
+	FS::OsFile file;
+	if (!file.open(path, FS::Mode::CREATE_AND_WRITE)) return false;
+	file << "{\n\t\"shader\" : \"" << SHADER << "\",\n\t\"texture\" : {\n\t\t\"source\" : \"" << texture << "\"\n\t}\n}\n";
+	file.close();
+	return true;
+}
+
+
+struct StreamingTest
+{
+	StreamingTest(Engine& _engine, Renderer& _renderer, IAllocator& allocator)
+		: engine(_engine)
+		, renderer(_renderer)
+		, texture_manager(_renderer.getTextureManager())
+		, materials(allocator)
+	{
+	}
+
+
+	// what the engine and the renderer do every frame, returns false if the condition is not met in MAX_FRAMES
+	template <typename F> bool runFrames(F condition)
+	{
+		for (int i = 0; i < MAX_FRAMES; ++i)
+		{
+			if (condition()) return true;
+			engine.getFileSystem().updateAsyncTransactions();
+			engine.getResourceManager().update();
+			renderer.frame(false);
+			MT::sleep(1);
+		}
+		return condition();
+	}
+
+
+	bool areMaterialsReady() const
+	{
+		for (Material* material : materials)
+		{
+			if (!material->isReady()) return false;
+		}
+		return true;
+	}
+
+
+	u32 getStreamedMaterialVersion() const { return materials[0]->getVersion(); }
+
+
+	Engine& engine;
+	Renderer& renderer;
+	TextureManager& texture_manager;
+	Array<Material*> materials;
+};
+
+
+// the O(materials) search TextureManager::onHandleChanged did before it kept the materials of each texture
+static void scanMaterials(ResourceManagerBase& material_manager, Texture& texture)
+{
+	for (Resource* resource : material_manager.getResourceTable())
+	{
+		Material* material = static_cast<Material*>(resource);
+		if (!material->isReady()) continue;
+		for (int i = 0, c = material->getTextureCount(); i < c; ++i)
+		{
+			if (material->getTexture(i) == &texture)
+			{
+				material->createCommandBuffer();
+				break;
+			}
+		}
+	}
+}
+
+
+static void runStreamingTest(StreamingTest& test, IAllocator& allocator)
+{
+	TextureManager& texture_manager = test.texture_manager;
+	MaterialManager& material_manager = test.renderer.getMaterialManager();
+	texture_manager.setStreamingEnabled(true);
+	texture_manager.setStreamingBudget(TextureManager::DEFAULT_STREAMING_BUDGET);
+
+	for (int i = 0; i < MATERIALS_COUNT; ++i)
+	{
+		char name[MAX_PATH_LENGTH];
+		getMaterialName(i, name);
+		test.materials.push(static_cast<Material*>(material_manager.load(Path(name))));
+	}
+	if (!test.runFrames([&test]() { return test.areMaterialsReady(); }))
+	{
+		reportFailure("materials are not ready, run from the data directory");
+		return;
+	}
+
+	Texture* streamed = test.materials[0]->getTexture(0);
+	if (!streamed || !streamed->is_streamed || streamed->resident_mip != streamed->base_mip)
+	{
+		reportFailure("the texture is not streamed or more than its base mips are resident after load");
+		return;
+	}
+	printf("loaded %d materials, %dx%d texture with %d mips, base mip %d\n",
+		MATERIALS_COUNT,
+		streamed->width,
+		streamed->height,
+		streamed->mips,
+		streamed->base_mip);
+
+	u32 version = test.getStreamedMaterialVersion();
+	bool is_resident = test.runFrames([streamed]() {
+		streamed->requestSize(STREAMED_SIZE);
+		return streamed->resident_mip == 0;
+	});
+	if (!is_resident)
+	{
+		reportFailure("requested mips were not streamed in");
+		return;
+	}
+	if (test.getStreamedMaterialVersion() == version)
+	{
+		reportFailure("the material was not updated when the texture handle changed");
+		return;
+	}
+	printf("streamed in, resident memory %.1f MB\n", streamed->getResidentMemory() / (1024.0 * 1024.0));
+
+	// nothing requests the texture now, the budget fits only base mips
+	version = test.getStreamedMaterialVersion();
+	texture_manager.setStreamingBudget(streamed->getMemory(streamed->base_mip));
+	if (!test.runFrames([streamed]() { return streamed->resident_mip == streamed->base_mip; }))
+	{
+		reportFailure("mips over the budget were not evicted");
+		return;
+	}
+	if (test.getStreamedMaterialVersion() == version)
+	{
+		reportFailure("the material was not updated when the texture was evicted");
+		return;
+	}
+	printf("evicted, resident memory %.1f MB\n", streamed->getResidentMemory() / (1024.0 * 1024.0));
+
+	BenchmarkTimer timer(allocator);
+	timer.start();
+	for (int i = 0; i < HANDLE_CHANGES_COUNT; ++i) texture_manager.onHandleChanged(*streamed);
+	double index_ns = timer.getNsPerOp(HANDLE_CHANGES_COUNT);
+	timer.start();
+	for (int i = 0; i < HANDLE_CHANGES_COUNT; ++i) scanMaterials(material_manager, *streamed);
+	double scan_ns = timer.getNsPerOp(HANDLE_CHANGES_COUNT);
+	printf("handle change with %d of %d materials using the texture: index %.0f ns, scan %.0f ns\n",
+		MATERIALS_COUNT / STREAMED_MATERIAL_STEP,
+		MATERIALS_COUNT,
+		index_ns,
+		scan_ns);
+}
+
+
+// Loads materials with a streamed texture on the Noop renderer and checks that mips are streamed in, evicted and
+// the materials using the texture are updated, run as "benchmarks texture_streaming -noop_renderer" from data
+void benchmarkTextureStreaming(IAllocator& allocator)
+{
+	if (!writeDDS(STREAMED_TEXTURE, STREAMED_SIZE, allocator) || !writeDDS(SMALL_TEXTURE, SMALL_SIZE, allocator))
+	{
+		reportFailure("could not write test textures");
+		return;
+	}
+	for (int i = 0; i < MATERIALS_COUNT; ++i)
+	{
+		char name[MAX_PATH_LENGTH];
+		getMaterialName(i, name);
+		if (!writeMaterial(name, i % STREAMED_MATERIAL_STEP == 0 ? STREAMED_TEXTURE : SMALL_TEXTURE))
+		{
+			reportFailure("could not write test materials");
+			return;
+		}
+	}
+
+	// paths are relative to the current directory
+	Engine* engine = Engine::create("", "", nullptr, allocator);
+	Renderer* renderer = static_cast<Renderer*>(engine->getPluginManager().load("renderer"));
+	if (!renderer)
+	{
+		reportFailure("could not load the renderer plugin");
+	}
+	else
+	{
+		StreamingTest test(*engine, *renderer, allocator);
+		runStreamingTest(test, allocator);
+		MaterialManager& material_manager = renderer->getMaterialManager();
+		for (Material* material : test.materials) material_manager.unload(*material);
+	}
+	Engine::destroy(engine, allocator);
+
+	remove(STREAMED_TEXTURE);
+	remove(SMALL_TEXTURE);
+	for (int i = 0; i < MATERIALS_COUNT; ++i)
+	{
+		char name[MAX_PATH_LENGTH];
+		getMaterialName(i, name);
+		remove(name);
+	}
+}
+
+
+} // namespace Malmy
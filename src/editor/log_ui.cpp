@@ -19,9 +19,9 @@ LogUI::LogUI(IAllocator& allocator)
 	, m_are_notifications_hovered(false)
 	, m_move_notifications_to_front(false)
 {
-	g_log_info.getCallback().bind<LogUI, &LogUI::onInfo>(this);
-	g_log_error.getCallback().bind<LogUI, &LogUI::onError>(this);
-	g_log_warning.getCallback().bind<LogUI, &LogUI::onWarning>(this);
+	g_log_info.bind<LogUI, &LogUI::onInfo>(this);
+	g_log_error.bind<LogUI, &LogUI::onError>(this);
+	g_log_warning.bind<LogUI, &LogUI::onWarning>(this);
 
 	for (int i = 0; i < COUNT; ++i)
 	{
@@ -32,9 +32,9 @@ LogUI::LogUI(IAllocator& allocator)
 
 LogUI::~LogUI()
 {
-	g_log_info.getCallback().unbind<LogUI, &LogUI::onInfo>(this);
-	g_log_error.getCallback().unbind<LogUI, &LogUI::onError>(this);
-	g_log_warning.getCallback().unbind<LogUI, &LogUI::onWarning>(this);
+	g_log_info.unbind<LogUI, &LogUI::onInfo>(this);
+	g_log_error.unbind<LogUI, &LogUI::onError>(this);
+	g_log_warning.unbind<LogUI, &LogUI::onWarning>(this);
 }
 
 
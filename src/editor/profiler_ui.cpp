@@ -4,6 +4,7 @@
 #include "engine/fs/os_file.h"
 #include "engine/log.h"
 #include "engine/math_utils.h"
+#include "engine/metrics.h"
 #include "engine/mt/atomic.h"
 #include "engine/mt/lock_free_fixed_queue.h"
 #include "engine/profiler.h"
@@ -12,6 +13,7 @@
 #include "engine/resource_manager_base.h"
 #include "engine/timer.h"
 #include "engine/debug/debug.h"
+#include "engine/debug/tracking_allocator.h"
 #include "engine/engine.h"
 #include "imgui/imgui.h"
 #include "utils.h"
@@ -46,8 +48,10 @@ enum MemoryColumn
 
 struct ProfilerUIImpl final : public ProfilerUI
 {
-	ProfilerUIImpl(Debug::Allocator& allocator, Engine& engine)
+	ProfilerUIImpl(Debug::Allocator& allocator, Debug::TrackingAllocator* tracking_allocator, Engine& engine)
 		: m_main_allocator(allocator)
+		, m_thread_events(m_allocator)
+		, m_tracking_allocator(tracking_allocator)
 		, m_resource_manager(engine.getResourceManager())
 		, m_logs(allocator)
 		, m_open_files(allocator)
@@ -59,6 +63,8 @@ struct ProfilerUIImpl final : public ProfilerUI
 		m_current_frame = -1;
 		m_is_open = false;
 		m_is_paused = true;
+		m_has_tags_baseline = false;
+		m_show_tags_diff = false;
 		m_allocation_root = MALMY_NEW(m_allocator, AllocationStackNode)(nullptr, 0, m_allocator);
 		m_filter[0] = 0;
 		m_resource_filter[0] = 0;
@@ -321,6 +327,7 @@ struct ProfilerUIImpl final : public ProfilerUI
 		if (ImGui::BeginDock("Profiler", &m_is_open))
 		{
 			onGUICPUProfiler();
+			onGUIMetrics();
 			onGUIMemoryProfiler();
 			onGUIResources();
 			onGUIFileSystem();
@@ -397,9 +404,12 @@ struct ProfilerUIImpl final : public ProfilerUI
 
 	void onGUICPUProfiler();
 	void onGUIMemoryProfiler();
+	void onGUIAllocationTags();
+	void onGUIMetrics();
 	void onGUIResources();
 	void onFrame();
 	void addToTree(Debug::Allocator::AllocationInfo* info);
+	AllocationStackNode* addToTree(Debug::StackNode* stack_leaf, size_t size);
 	void refreshAllocations();
 	void showAllocationTree(AllocationStackNode* node, int column) const;
 	AllocationStackNode* getOrCreate(AllocationStackNode* my_node,
@@ -408,6 +418,11 @@ struct ProfilerUIImpl final : public ProfilerUI
 
 	DefaultAllocator m_allocator;
 	Debug::Allocator& m_main_allocator;
+	Array<u8> m_thread_events;
+	Debug::TrackingAllocator* m_tracking_allocator;
+	Debug::AllocationTagsSnapshot m_tags_baseline;
+	bool m_has_tags_baseline;
+	bool m_show_tags_diff;
 	ResourceManager& m_resource_manager;
 	AllocationStackNode* m_allocation_root;
 	int m_allocation_size_from;
@@ -418,6 +433,7 @@ struct ProfilerUIImpl final : public ProfilerUI
 	i64 m_view_offset = 0;
 	char m_cpu_block_filter[256] = {};
 	u64 m_zoom = DEFAULT_ZOOM;
+	bool m_show_job_flows = true;
 	char m_filter[100];
 	char m_resource_filter[100];
 	Array<OpenedFile> m_open_files;
@@ -586,16 +602,23 @@ ProfilerUIImpl::AllocationStackNode* ProfilerUIImpl::getOrCreate(AllocationStack
 }
 
 
-void ProfilerUIImpl::addToTree(Debug::Allocator::AllocationInfo* info)
+ProfilerUIImpl::AllocationStackNode* ProfilerUIImpl::addToTree(Debug::StackNode* stack_leaf, size_t size)
 {
 	Debug::StackNode* nodes[1024];
-	int count = Debug::StackTree::getPath(info->stack_leaf, nodes, lengthOf(nodes));
+	int count = Debug::StackTree::getPath(stack_leaf, nodes, lengthOf(nodes));
 
 	auto node = m_allocation_root;
 	for (int i = count - 1; i >= 0; --i)
 	{
-		node = getOrCreate(node, nodes[i], info->size);
+		node = getOrCreate(node, nodes[i], size);
 	}
+	return node;
+}
+
+
+void ProfilerUIImpl::addToTree(Debug::Allocator::AllocationInfo* info)
+{
+	auto node = addToTree(info->stack_leaf, info->size);
 	node->m_allocations.push(info);
 }
 
@@ -615,6 +638,18 @@ void ProfilerUIImpl::refreshAllocations()
 		current_info = current_info->next;
 	}
 	m_main_allocator.unlock();
+
+	// release builds do not track every allocation, sampled ones are the only source of callstacks there
+	if (!m_tracking_allocator) return;
+
+	m_tracking_allocator->lock();
+	auto* sample = m_tracking_allocator->getFirstSampledAllocation();
+	while (sample)
+	{
+		addToTree(sample->stack_leaf, sample->size);
+		sample = sample->next;
+	}
+	m_tracking_allocator->unlock();
 }
 
 
@@ -691,6 +726,8 @@ void ProfilerUIImpl::onGUIMemoryProfiler()
 	}
 	ImGui::Text("Total size: %.3fMB", (m_main_allocator.getTotalSize() / 1024) / 1024.0f);
 
+	onGUIAllocationTags();
+
 	ImGui::Columns(2, "memc");
 	for (auto* child : m_allocation_root->m_children)
 	{
@@ -704,34 +741,124 @@ void ProfilerUIImpl::onGUIMemoryProfiler()
 	ImGui::Columns(1);
 }
 
-template <typename T>
-static void read(Profiler::ThreadContext& ctx, uint p, T& value)
+
+void ProfilerUIImpl::onGUIAllocationTags()
 {
-	u8* buf = ctx.buffer.begin();
-	const uint buf_size = ctx.buffer.size();
-	const uint l = p % buf_size;
-	if (l + sizeof(value) <= buf_size) {
-		memcpy(&value, buf + l, sizeof(value));
-		return;
+	if (!m_tracking_allocator) return;
+	if (!ImGui::TreeNode("Tags")) return;
+
+	int sampling = m_tracking_allocator->getStackSampling();
+	if (ImGui::InputInt("Callstack every n-th allocation", &sampling))
+	{
+		m_tracking_allocator->setStackSampling(Math::maximum(0, sampling));
+	}
+	if (ImGui::Button("Snapshot"))
+	{
+		m_tracking_allocator->getTagsSnapshot(m_tags_baseline);
+		m_has_tags_baseline = true;
+	}
+	if (m_has_tags_baseline)
+	{
+		ImGui::SameLine();
+		ImGui::Checkbox("Difference from snapshot", &m_show_tags_diff);
 	}
 
-	memcpy(&value, buf + l, buf_size - l);
-	memcpy((u8*)&value + (buf_size - l), buf, sizeof(value) - (buf_size - l));
+	Debug::AllocationTagsSnapshot current;
+	m_tracking_allocator->getTagsSnapshot(current);
+	Debug::AllocationTagsSnapshot diff;
+	bool show_diff = m_has_tags_baseline && m_show_tags_diff;
+	if (show_diff) Debug::diffAllocationTags(m_tags_baseline, current, diff);
+	const Debug::AllocationTagsSnapshot& shown = show_diff ? diff : current;
+
+	ImGui::Columns(4, "tagsc");
+	ImGui::Text("Tag");
+	ImGui::NextColumn();
+	ImGui::Text("Size");
+	ImGui::NextColumn();
+	ImGui::Text("Count");
+	ImGui::NextColumn();
+	ImGui::Text("Peak size");
+	ImGui::NextColumn();
+	ImGui::Separator();
+	for (int i = 0; i < shown.count; ++i)
+	{
+		const Debug::AllocationTagStats& tag = shown.tags[i];
+		ImGui::Text("%s", tag.name);
+		ImGui::NextColumn();
+		ImGui::Text("%.1f KB", tag.size / 1024.0f);
+		ImGui::NextColumn();
+		ImGui::Text("%d", (int)tag.count);
+		ImGui::NextColumn();
+		ImGui::Text("%.1f KB", tag.peak_size / 1024.0f);
+		ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+	ImGui::TreePop();
 }
 
 
-static void read(Profiler::ThreadContext& ctx, uint p, u8* ptr, int size)
+void ProfilerUIImpl::onGUIMetrics()
 {
-	u8* buf = ctx.buffer.begin();
-	const uint buf_size = ctx.buffer.size();
-	const uint l = p % buf_size;
-	if (l + size <= buf_size) {
-		memcpy(ptr, buf + l, size);
+	if (!ImGui::CollapsingHeader("Metrics")) return;
+
+	const int history_count = Metrics::getHistoryCount();
+	ImGui::Text("Percentiles over the last %d frames", history_count);
+	ImGui::Columns(6, "metricsc");
+	ImGui::Text("Metric");
+	ImGui::NextColumn();
+	ImGui::Text("History");
+	ImGui::NextColumn();
+	ImGui::Text("Last frame");
+	ImGui::NextColumn();
+	ImGui::Text("p50");
+	ImGui::NextColumn();
+	ImGui::Text("p95");
+	ImGui::NextColumn();
+	ImGui::Text("p99");
+	ImGui::NextColumn();
+	ImGui::Separator();
+	if (history_count == 0)
+	{
+		ImGui::Columns(1);
 		return;
 	}
 
-	memcpy(ptr, buf + l, buf_size - l);
-	memcpy(ptr + (buf_size - l), buf, size - (buf_size - l));
+	for (int i = 0, c = Metrics::getCount(); i < c; ++i)
+	{
+		const Metrics::Percentiles percentiles = Metrics::getPercentiles(i);
+		ImGui::Text("%s", Metrics::getName(i));
+		ImGui::NextColumn();
+		ImGui::PushID(i);
+		auto getter = [](void* data, int idx) -> float {
+			const int count = Metrics::getHistoryCount();
+			return Metrics::getValue((int)(intptr_t)data, count - 1 - idx);
+		};
+		ImGui::PlotLines("", getter, (void*)(intptr_t)i, history_count, 0, nullptr, FLT_MAX, FLT_MAX, ImVec2(-1, 0));
+		ImGui::PopID();
+		ImGui::NextColumn();
+		ImGui::Text("%.2f", Metrics::getValue(i, 0));
+		ImGui::NextColumn();
+		ImGui::Text("%.2f", percentiles.p50);
+		ImGui::NextColumn();
+		ImGui::Text("%.2f", percentiles.p95);
+		ImGui::NextColumn();
+		ImGui::Text("%.2f", percentiles.p99);
+		ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+}
+
+
+template <typename T>
+static void read(const Array<u8>& events, uint p, T& value)
+{
+	memcpy(&value, &events[p], sizeof(value));
+}
+
+
+static void read(const Array<u8>& events, uint p, u8* ptr, int size)
+{
+	memcpy(ptr, &events[p], size);
 }
 
 static inline ImVec2 operator+(const ImVec2& lhs, const ImVec2& rhs)            { return ImVec2(lhs.x+rhs.x, lhs.y+rhs.y); }
@@ -789,6 +916,15 @@ void ProfilerUIImpl::onGUICPUProfiler()
 	ImGui::Text("Zoom: %f", m_zoom / double(DEFAULT_ZOOM));
 	ImGui::SameLine();
 	if (ImGui::Button("Reset zoom")) m_zoom = DEFAULT_ZOOM;
+	ImGui::SameLine();
+	if (Profiler::isCapturing()) {
+		if (ImGui::Button("Stop capture")) Profiler::stopCapture();
+	}
+	else if (ImGui::Button("Start capture")) {
+		Profiler::startCapture("profiler.mcap");
+	}
+	ImGui::SameLine();
+	ImGui::Checkbox("Job flows", &m_show_job_flows);
 
 	auto& contexts = Profiler::lockContexts();
 	
@@ -828,10 +964,55 @@ void ProfilerUIImpl::onGUICPUProfiler()
 
 	HashMap<const char*, const char*> visible_blocks(1024, m_allocator);
 
+	auto time_to_x = [&](u64 time) {
+		const float t = float(i64(time - view_start) / double(view_end - view_start));
+		return a.x * (1 - t) + b.x * t;
+	};
+
+	// job events are matched across threads, so flows are drawn after all threads are processed
+	struct JobPoint
+	{
+		u64 time;
+		ImVec2 pos;
+	};
+	struct JobStart
+	{
+		u32 job;
+		JobPoint point;
+	};
+	struct SignalWait
+	{
+		u32 signal;
+		JobPoint point;
+	};
+	HashMap<u32, JobPoint> job_submits(m_allocator);
+	Array<JobStart> job_starts(m_allocator);
+	HashMap<u32, JobPoint> signal_triggers(m_allocator);
+	Array<SignalWait> signal_waits(m_allocator);
+	const u64 flows_start = view_start < m_zoom ? 0 : view_start - m_zoom;
+
+	// time workers spend in jobs, utilization is computed for the last complete frame in the view
+	struct BusyInterval
+	{
+		u64 from;
+		u64 to;
+	};
+	struct WorkerBusy
+	{
+		ImVec2 pos;
+		int first;
+		int count;
+	};
+	Array<BusyInterval> busy_intervals(m_allocator);
+	Array<WorkerBusy> workers_busy(m_allocator);
+	u64 frame_from = 0;
+	u64 frame_to = 0;
+
 	for(Profiler::ThreadContext* ctx : contexts) {
 		MT::SpinLock lock(ctx->mutex);
 		renderArrow(ImVec2(a.x, y), ctx->open ? ImGuiDir_Down : ImGuiDir_Right, 1, dl);
 		dl->AddText(ImVec2(a.x + 20, y), ImGui::GetColorU32(ImGuiCol_Text), ctx->name);
+		const ImVec2 utilization_pos(a.x + 30 + ImGui::CalcTextSize(ctx->name).x, y);
 		dl->AddLine(ImVec2(a.x, y + 20), ImVec2(b.x, y + 20), ImGui::GetColorU32(ImGuiCol_Border));
 		if (ImGui::IsMouseClicked(0) && ImGui::IsMouseHoveringRect(ImVec2(a.x, y), ImVec2(a.x + 20, y+20))){
 			ctx->open = !ctx->open;
@@ -848,8 +1029,9 @@ void ProfilerUIImpl::onGUICPUProfiler()
 			u32 color;
 		} open_blocks[64];
 		int level = -1;
-		uint p = ctx->begin;
-		const uint end = ctx->end;
+		Profiler::readEvents(*ctx, ctx->begin, m_thread_events);
+		uint p = 0;
+		const uint end = m_thread_events.size();
 
 		struct Property {
 			Profiler::EventHeader header;
@@ -857,6 +1039,11 @@ void ProfilerUIImpl::onGUICPUProfiler()
 			int offset;
 		} properties[64];
 		int properties_count = 0;
+		const int first_busy_interval = busy_intervals.size();
+		bool has_jobs = false;
+		bool is_busy = false;
+		u64 busy_start = 0;
+		const ImVec2 flow_offset(0, y + 10);
 
 		auto draw_block = [&](u64 from, u64 to, const char* name, u32 color) {
 			if(from <= view_end && to >= view_start) {
@@ -889,10 +1076,16 @@ void ProfilerUIImpl::onGUICPUProfiler()
 							case Profiler::EventType::STRING: {
 								char tmp[128];
 								const int tmp_size = properties[i].header.size - sizeof(properties[i].header);
-								read(*ctx, properties[i].offset, (u8*)tmp, tmp_size);
+								read(m_thread_events, properties[i].offset, (u8*)tmp, tmp_size);
 								ImGui::Text("%s", tmp);
 								break;
 							}
+							case Profiler::EventType::INT: {
+								Profiler::IntRecord r;
+								read(m_thread_events, properties[i].offset, r);
+								ImGui::Text("%s: %d", r.key, r.value);
+								break;
+							}
 							default: ASSERT(false); break;
 						}
 					}
@@ -903,7 +1096,7 @@ void ProfilerUIImpl::onGUICPUProfiler()
 
 		while(p != end) {
 			Profiler::EventHeader header;
-			read(*ctx, p, header);
+			read(m_thread_events, p, header);
 			switch(header.type) {
 				case Profiler::EventType::BEGIN_BLOCK:
 					++level;
@@ -915,9 +1108,9 @@ void ProfilerUIImpl::onGUICPUProfiler()
 					if (level >= 0) {
 						ctx->rows = Math::maximum(ctx->rows, level + 1);
 						Profiler::EventHeader start_header;
-						read(*ctx, open_blocks[level].offset, start_header);
+						read(m_thread_events, open_blocks[level].offset, start_header);
 						const char* name;
-						read(*ctx, open_blocks[level].offset + sizeof(Profiler::EventHeader), name);
+						read(m_thread_events, open_blocks[level].offset + sizeof(Profiler::EventHeader), name);
 						if (!m_cpu_block_filter[0] || stristr(name, m_cpu_block_filter)) {
 							draw_block(start_header.time, header.time, name, open_blocks[level].color);
 							if (!visible_blocks.find(name).isValid()) {
@@ -931,6 +1124,10 @@ void ProfilerUIImpl::onGUICPUProfiler()
 					}
 					break;
 				case Profiler::EventType::FRAME: {
+					if (header.time <= view_end) {
+						frame_from = frame_to;
+						frame_to = header.time;
+					}
 					if (header.time >= view_start && header.time <= view_end) {
 						const float t = float((header.time - view_start) / double(view_end - view_start));
 						const float x = a.x * (1 - t) + b.x * t;
@@ -940,7 +1137,8 @@ void ProfilerUIImpl::onGUICPUProfiler()
 					}
 					break;
 				}
-				case Profiler::EventType::STRING: {
+				case Profiler::EventType::STRING:
+				case Profiler::EventType::INT: {
 					if (properties_count < lengthOf(properties) && level >= 0) {
 						properties[properties_count].header = header;
 						properties[properties_count].level = level;
@@ -948,13 +1146,58 @@ void ProfilerUIImpl::onGUICPUProfiler()
 						++properties_count;
 					}
 					else {
-						ASSERT(false);
+						// ints can be recorded outside of blocks
+						ASSERT(header.type == Profiler::EventType::INT);
 					}
 					break;
 				}
 				case Profiler::EventType::BLOCK_COLOR:
 					if (level >= 0) {
-						read(*ctx, p + sizeof(Profiler::EventHeader), open_blocks[level].color);
+						read(m_thread_events, p + sizeof(Profiler::EventHeader), open_blocks[level].color);
+					}
+					break;
+				case Profiler::EventType::JOB_SUBMIT:
+				case Profiler::EventType::JOB_START:
+				case Profiler::EventType::JOB_END: {
+					Profiler::JobRecord job;
+					read(m_thread_events, p + sizeof(Profiler::EventHeader), job);
+					if (header.type == Profiler::EventType::JOB_START) {
+						has_jobs = true;
+						is_busy = true;
+						busy_start = header.time;
+					}
+					else if (header.type == Profiler::EventType::JOB_END && is_busy) {
+						busy_intervals.push({busy_start, header.time});
+						is_busy = false;
+					}
+
+					if (!m_show_job_flows || header.time < flows_start || header.time > view_end) break;
+					const JobPoint point = {header.time, ImVec2(time_to_x(header.time), 0) + flow_offset};
+					switch (header.type) {
+						case Profiler::EventType::JOB_SUBMIT: job_submits.insert(job.id, point); break;
+						case Profiler::EventType::JOB_START: job_starts.push({job.id, point}); break;
+						default: {
+							// several jobs can trigger the same signal, the last one wakes up the waiters
+							auto iter = signal_triggers.find(job.signal);
+							if (!iter.isValid()) signal_triggers.insert(job.signal, point);
+							else if (iter.value().time < point.time) iter.value() = point;
+							break;
+						}
+					}
+					break;
+				}
+				case Profiler::EventType::SIGNAL_WAIT_BEGIN:
+					// job waiting on a worker gives up the thread
+					if (is_busy) {
+						busy_intervals.push({busy_start, header.time});
+						is_busy = false;
+					}
+					break;
+				case Profiler::EventType::SIGNAL_WAIT_END:
+					if (m_show_job_flows && header.time >= view_start && header.time <= view_end) {
+						u32 signal;
+						read(m_thread_events, p + sizeof(Profiler::EventHeader), signal);
+						signal_waits.push({signal, {header.time, ImVec2(time_to_x(header.time), 0) + flow_offset}});
 					}
 					break;
 				default: ASSERT(false); break;
@@ -964,17 +1207,53 @@ void ProfilerUIImpl::onGUICPUProfiler()
 		ctx->rows = Math::maximum(ctx->rows, level + 1);
 		while(level >= 0) {
 			Profiler::EventHeader start_header;
-			read(*ctx, open_blocks[level].offset, start_header);
+			read(m_thread_events, open_blocks[level].offset, start_header);
 			const char* name;
-			read(*ctx, open_blocks[level].offset + sizeof(Profiler::EventHeader), name);
+			read(m_thread_events, open_blocks[level].offset + sizeof(Profiler::EventHeader), name);
 			if (!m_cpu_block_filter[0] || stristr(name, m_cpu_block_filter)) {
 				draw_block(start_header.time, m_paused_time, name, ImGui::GetColorU32(ImGuiCol_PlotHistogram));
 			}
 			--level;
 		}
+		if (is_busy) busy_intervals.push({busy_start, view_end});
+		if (has_jobs) {
+			workers_busy.push({utilization_pos, first_busy_interval, busy_intervals.size() - first_busy_interval});
+		}
 		y += ctx->rows * 20;
 	}
 
+	if (frame_to > frame_from) {
+		for (const WorkerBusy& worker : workers_busy) {
+			u64 busy = 0;
+			for (int i = worker.first; i < worker.first + worker.count; ++i) {
+				const u64 from = Math::maximum(busy_intervals[i].from, frame_from);
+				const u64 to = Math::minimum(busy_intervals[i].to, frame_to);
+				if (to > from) busy += to - from;
+			}
+			const StaticString<32> text("", u32(busy * 100 / (frame_to - frame_from)), "%");
+			dl->AddText(worker.pos, ImGui::GetColorU32(ImGuiCol_TextDisabled), text);
+		}
+	}
+
+	if (m_show_job_flows) {
+		dl->ChannelsSetCurrent(1);
+		for (const JobStart& start : job_starts) {
+			// only the first start of a job, the others are continuations after waits
+			auto iter = job_submits.find(start.job);
+			if (!iter.isValid()) continue;
+			dl->AddLine(iter.value().pos, start.point.pos, 0xff00ff00);
+			dl->AddCircleFilled(start.point.pos, 3, 0xff00ff00);
+			job_submits.erase(iter);
+		}
+		for (const SignalWait& wait : signal_waits) {
+			auto iter = signal_triggers.find(wait.signal);
+			if (!iter.isValid() || iter.value().time > wait.point.time) continue;
+			dl->AddLine(iter.value().pos, wait.point.pos, 0xff00a5ff);
+			dl->AddCircleFilled(wait.point.pos, 3, 0xff00a5ff);
+		}
+		dl->ChannelsSetCurrent(0);
+	}
+
 	dl->ChannelsMerge();
 	Profiler::unlockContexts();
 
@@ -1056,10 +1335,10 @@ void ProfilerUIImpl::onGUICPUProfiler()
 }
 
 
-ProfilerUI* ProfilerUI::create(Engine& engine)
+ProfilerUI* ProfilerUI::create(Engine& engine, Debug::TrackingAllocator* tracking_allocator)
 {
 	auto& allocator = static_cast<Debug::Allocator&>(engine.getAllocator());
-	return MALMY_NEW(engine.getAllocator(), ProfilerUIImpl)(allocator, engine);
+	return MALMY_NEW(engine.getAllocator(), ProfilerUIImpl)(allocator, tracking_allocator, engine);
 }
 
 
@@ -9,6 +9,7 @@ namespace Malmy
 
 	
 class Engine;
+namespace Debug { class TrackingAllocator; }
 
 
 class ProfilerUI
@@ -17,7 +18,8 @@ public:
 	virtual ~ProfilerUI() {}
 	virtual void onGUI() = 0;
 
-	static ProfilerUI* create(Engine& engine);
+	// tracking_allocator is optional, allocation tags are shown only if it's used
+	static ProfilerUI* create(Engine& engine, Debug::TrackingAllocator* tracking_allocator = nullptr);
 	static void destroy(ProfilerUI& ui);
 
 	bool m_is_open;
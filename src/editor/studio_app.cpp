@@ -8,6 +8,7 @@
 #include "engine/command_line_parser.h"
 #include "engine/crc32.h"
 #include "engine/debug/debug.h"
+#include "engine/debug/tracking_allocator.h"
 #include "engine/default_allocator.h"
 #include "engine/engine.h"
 #include "engine/fs/disk_file_device.h"
@@ -16,8 +17,10 @@
 #include "engine/input_system.h"
 #include "engine/log.h"
 #include "engine/lua_wrapper.h"
+#include "engine/metrics.h"
 #include "engine/mt/thread.h"
 #include "engine/path_utils.h"
+#include "engine/pool_allocator.h"
 #include "engine/plugin_manager.h"
 #include "engine/profiler.h"
 #include "engine/reflection.h"
@@ -156,7 +159,11 @@ namespace Malmy
 			, m_confirm_new(false)
 			, m_confirm_exit(false)
 			, m_exit_code(0)
-			, m_allocator(m_main_allocator)
+			, m_pool_allocator(m_main_allocator, hasCommandLineFlag("-memory_tracking") ? Debug::MAX_ALLOCATION_TAGS : 1)
+			, m_tracking_allocator(m_pool_allocator)
+			, m_allocator(hasCommandLineFlag("-memory_tracking")
+				? (IAllocator&)m_tracking_allocator
+				: selectSourceAllocator())
 			, m_projects(m_allocator)
 			, m_events(m_allocator)
 		{
@@ -173,6 +180,8 @@ namespace Malmy
 
 			char data_dir_path[MAX_PATH_LENGTH] = {};
 			checkDataDirCommandLine(data_dir_path, lengthOf(data_dir_path));
+			checkProfilerCaptureCommandLine();
+			checkMetricsCommandLine();
 			m_engine = Engine::create(current_dir, data_dir_path, nullptr, m_allocator);
 			createLua();
 
@@ -198,7 +207,8 @@ namespace Malmy
 
 			m_asset_browser = MALMY_NEW(m_allocator, AssetBrowser)(*this);
 			m_property_grid = MALMY_NEW(m_allocator, PropertyGrid)(*this);
-			m_profiler_ui = ProfilerUI::create(*m_engine);
+			m_profiler_ui = ProfilerUI::create(
+				*m_engine, hasCommandLineFlag("-memory_tracking") ? &m_tracking_allocator : nullptr);
 			m_log_ui = MALMY_NEW(m_allocator, LogUI)(m_editor->getAllocator());
 
 			ImGui::CreateContext();
@@ -274,6 +284,8 @@ namespace Malmy
 
 			SDL_DestroyWindow(m_window);
 			SDL_Quit();
+			Profiler::stopCapture();
+			Metrics::stopCSV();
 		}
 
 		bool makeFile(const char* path, const char* content) override
@@ -1191,7 +1203,10 @@ namespace Malmy
 				//buraya help menu falanda yapilcak
 
 				StaticString<200> stats("");
-				if (m_engine->getFileSystem().hasWork()) stats << "Loading... | ";
+				if (m_engine->getFileSystem().hasWork() || m_engine->getResourceManager().hasWork())
+				{
+					stats << "Loading... | ";
+				}
 				stats << "FPS: ";
 				stats << m_engine->getFPS();
 				if ((SDL_GetWindowFlags(m_window) & SDL_WINDOW_INPUT_FOCUS) == 0) stats << " - inactive window";
@@ -1548,6 +1563,27 @@ namespace Malmy
 			return true;
 		}
 
+		static bool hasCommandLineFlag(const char* flag)
+		{
+			char cmd_line[2048];
+			getCommandLine(cmd_line, lengthOf(cmd_line));
+
+			CommandLineParser parser(cmd_line);
+			while (parser.next())
+			{
+				if (parser.currentEquals(flag)) return true;
+			}
+			return false;
+		}
+
+		// called before m_allocator is constructed, -pool_allocator puts size class pools between it and malloc
+		IAllocator& selectSourceAllocator()
+		{
+			if (hasCommandLineFlag("-pool_allocator")) return m_pool_allocator;
+			return m_main_allocator;
+		}
+
+
 		//pluginleri yukle
 		void loadUserPlugins()
 		{
@@ -1720,6 +1756,44 @@ namespace Malmy
 		}
 
 
+		static void checkProfilerCaptureCommandLine()
+		{
+			char cmd_line[2048];
+			getCommandLine(cmd_line, lengthOf(cmd_line));
+
+			CommandLineParser parser(cmd_line);
+			while (parser.next())
+			{
+				if (!parser.currentEquals("-profiler_capture")) continue;
+				if (!parser.next()) break;
+
+				char path[MAX_PATH_LENGTH];
+				parser.getCurrent(path, lengthOf(path));
+				Profiler::startCapture(path);
+				break;
+			}
+		}
+
+
+		static void checkMetricsCommandLine()
+		{
+			char cmd_line[2048];
+			getCommandLine(cmd_line, lengthOf(cmd_line));
+
+			CommandLineParser parser(cmd_line);
+			while (parser.next())
+			{
+				if (!parser.currentEquals("-metrics_csv")) continue;
+				if (!parser.next()) break;
+
+				char path[MAX_PATH_LENGTH];
+				parser.getCurrent(path, lengthOf(path));
+				Metrics::startCSV(path);
+				break;
+			}
+		}
+
+
 		GUIPlugin* getPlugin(const char* name) override
 		{
 			for (auto* i : m_gui_plugins)
@@ -2207,6 +2281,15 @@ namespace Malmy
 
 				ImGui::Combo("Mode", (int*)&m_pack.mode, "All files\0Loaded project\0");
 
+				FS::FileSystem& fs = m_editor->getEngine().getFileSystem();
+				bool is_recording = fs.isAccessRecording();
+				if (ImGui::Checkbox("Record file access order", &is_recording)) fs.setAccessRecording(is_recording);
+				if (ImGui::IsItemHovered())
+				{
+					ImGui::SetTooltip("Files are written to the pack in the order they are first read while recording.\n"
+						"Record while playing the game to make loading read the pack sequentially.");
+				}
+
 				if (ImGui::Button("Pack")) packData();
 			}
 			ImGui::EndDock();
@@ -2246,10 +2329,32 @@ namespace Malmy
 			}
 
 			int count = infos.size();
+
+			// recorded files first, in the order they were accessed, then the rest
+			Array<int> order(m_allocator);
+			order.reserve(count);
+			Array<bool> is_ordered(m_allocator);
+			is_ordered.resize(count);
+			for (bool& b : is_ordered) b = false;
+			Array<Path> access_log(m_allocator);
+			m_editor->getEngine().getFileSystem().getAccessLog(access_log);
+			for (const Path& path : access_log)
+			{
+				int idx = infos.find(path.getHash());
+				if (idx < 0 || is_ordered[idx]) continue;
+				is_ordered[idx] = true;
+				order.push(idx);
+			}
+			for (int i = 0; i < count; ++i)
+			{
+				if (!is_ordered[i]) order.push(i);
+			}
+
 			file.write(&count, sizeof(count));
 			u64 offset = sizeof(count) + (sizeof(u32) + sizeof(u64) * 2) * count;
-			for (auto& info : infos)
+			for (int idx : order)
 			{
+				PackFileInfo& info = infos.at(idx);
 				info.offset = offset;
 				offset += info.size;
 			}
@@ -2261,8 +2366,9 @@ namespace Malmy
 				file.write(&info.size, sizeof(info.size));
 			}
 
-			for (auto& info : infos)
+			for (int idx : order)
 			{
+				const PackFileInfo& info = infos.at(idx);
 				FS::OsFile src;
 				size_t src_size = PlatformInterface::getFileSize(info.path);
 				if (!src.open(info.path, FS::Mode::OPEN_AND_READ))
@@ -2518,6 +2624,7 @@ namespace Malmy
 						if (!m_finished) update();
 
 						frame_time = timer->tick();
+						METRICS_SAMPLE("frame ms", 1000, frame_time * 1000);
 					}
 
 					if (m_sleep_when_inactive && (SDL_GetWindowFlags(m_window) & SDL_WINDOW_INPUT_FOCUS) == 0)
@@ -2533,6 +2640,7 @@ namespace Malmy
 					}
 				}
 
+				Metrics::frame();
 				Profiler::frame();
 			}
 
@@ -2674,6 +2782,10 @@ namespace Malmy
 
 
 		DefaultAllocator m_main_allocator;
+		PoolAllocator m_pool_allocator;
+		// counts allocations per tag when -memory_tracking is used, otherwise it is skipped,
+		// the pool then has a partition per tag, so small blocks do not need a header
+		Debug::TrackingAllocator m_tracking_allocator;
 		Debug::Allocator m_allocator;
 		Engine* m_engine;
 		SDL_Window* m_window;
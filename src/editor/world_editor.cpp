@@ -2345,7 +2345,11 @@ public:
 
 	void save(FS::IFile& file)
 	{
-		while (m_engine->getFileSystem().hasWork()) m_engine->getFileSystem().updateAsyncTransactions();
+		while (m_engine->getFileSystem().hasWork() || m_engine->getResourceManager().hasWork())
+		{
+			m_engine->getFileSystem().updateAsyncTransactions();
+			m_engine->getResourceManager().update();
+		}
 
 		ASSERT(m_project);
 
@@ -3620,7 +3624,11 @@ public:
 					return false;
 				}
 				command->deserialize(serializer);
-				while (fs.hasWork()) fs.updateAsyncTransactions();
+				while (fs.hasWork() || m_engine->getResourceManager().hasWork())
+				{
+					fs.updateAsyncTransactions();
+					m_engine->getResourceManager().update();
+				}
 				executeCommand(command);
 				serializer.deserializeObjectEnd();
 			}
@@ -3697,7 +3705,11 @@ public:
 	bool runTest(const char* dir, const char* name) override
 	{
 		FS::FileSystem& fs = m_engine->getFileSystem();
-		while (fs.hasWork()) fs.updateAsyncTransactions();
+		while (fs.hasWork() || m_engine->getResourceManager().hasWork())
+		{
+			fs.updateAsyncTransactions();
+			m_engine->getResourceManager().update();
+		}
 		newProject();
 		Path undo_stack_path(dir, name, ".json");
 		executeUndoStack(undo_stack_path);
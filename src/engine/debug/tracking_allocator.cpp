@@ -0,0 +1,417 @@
+#include "engine/debug/tracking_allocator.h"
+#include "engine/math_utils.h"
+#include "engine/mt/atomic.h"
+#include "engine/pool_allocator.h"
+#include "engine/string.h"
+
+
+namespace Malmy
+{
+namespace Debug
+{
+
+
+static const int MAX_TAG_STACK_DEPTH = 32;
+static const size_t MIN_ALIGN = 16;
+// thread local changes are added to the global counters only once they are big enough
+static const i64 FLUSH_SIZE = 64 * 1024;
+static const i64 FLUSH_COUNT = 256;
+
+
+struct TagCounters
+{
+	volatile i64 size;
+	volatile i64 count;
+};
+
+
+static void flushToTag(int tag, i64 size, i64 count);
+
+
+struct ThreadTagState
+{
+	i64 pending_size[MAX_ALLOCATION_TAGS];
+	i64 pending_count[MAX_ALLOCATION_TAGS];
+	int stack[MAX_TAG_STACK_DEPTH];
+	int stack_size;
+	int sample_countdown;
+	bool is_registered;
+};
+
+
+// flushes pending changes when its thread exits, it is kept apart from ThreadTagState, since every access to
+// a thread local with a destructor goes through an initialization check
+struct ThreadTagStateFlusher
+{
+	~ThreadTagStateFlusher();
+};
+
+
+static TagCounters g_tag_counters[MAX_ALLOCATION_TAGS] = {};
+static char g_tag_names[MAX_ALLOCATION_TAGS][32] = { "untagged" };
+static volatile i32 g_tag_count = 1;
+static thread_local ThreadTagState g_thread_state = {};
+static thread_local ThreadTagStateFlusher g_thread_state_flusher;
+
+
+ThreadTagStateFlusher::~ThreadTagStateFlusher()
+{
+	ThreadTagState& state = g_thread_state;
+	for (int i = 0; i < MAX_ALLOCATION_TAGS; ++i)
+	{
+		if (state.pending_size[i] != 0 || state.pending_count[i] != 0)
+		{
+			flushToTag(i, state.pending_size[i], state.pending_count[i]);
+		}
+	}
+}
+
+
+// tags can be registered during static initialization, so the mutex can not be a global
+static MT::SpinMutex& getTagMutex()
+{
+	static MT::SpinMutex mutex(false);
+	return mutex;
+}
+
+
+int registerAllocationTag(const char* name)
+{
+	MT::SpinLock lock(getTagMutex());
+	for (int i = 0; i < g_tag_count; ++i)
+	{
+		if (equalStrings(g_tag_names[i], name)) return i;
+	}
+	if (g_tag_count == MAX_ALLOCATION_TAGS) return 0;
+
+	copyString(g_tag_names[g_tag_count], name);
+	MT::memoryBarrier();
+	return g_tag_count++;
+}
+
+
+void pushAllocationTag(int tag)
+{
+	ThreadTagState& state = g_thread_state;
+	if (state.stack_size < MAX_TAG_STACK_DEPTH) state.stack[state.stack_size] = tag;
+	++state.stack_size;
+}
+
+
+void popAllocationTag()
+{
+	ThreadTagState& state = g_thread_state;
+	if (state.stack_size > 0) --state.stack_size;
+}
+
+
+static int getCurrentAllocationTag(const ThreadTagState& state)
+{
+	if (state.stack_size == 0) return 0;
+	return state.stack[Math::minimum(state.stack_size, MAX_TAG_STACK_DEPTH) - 1];
+}
+
+
+static void flushToTag(int tag, i64 size, i64 count)
+{
+	TagCounters& counters = g_tag_counters[tag];
+	MT::atomicAdd64(&counters.size, size);
+	MT::atomicAdd64(&counters.count, count);
+}
+
+
+static void addToTag(ThreadTagState& state, int tag, i64 size, i64 count)
+{
+	if (!state.is_registered)
+	{
+		// constructs the flusher of this thread
+		(void)&g_thread_state_flusher;
+		state.is_registered = true;
+	}
+	i64& pending_size = state.pending_size[tag];
+	i64& pending_count = state.pending_count[tag];
+	pending_size += size;
+	pending_count += count;
+	if (pending_size > FLUSH_SIZE || pending_size < -FLUSH_SIZE || pending_count > FLUSH_COUNT ||
+		pending_count < -FLUSH_COUNT)
+	{
+		flushToTag(tag, pending_size, pending_count);
+		pending_size = 0;
+		pending_count = 0;
+	}
+}
+
+
+void diffAllocationTags(const AllocationTagsSnapshot& from,
+	const AllocationTagsSnapshot& to,
+	AllocationTagsSnapshot& result)
+{
+	// tags are never unregistered, so `from` is a prefix of `to`
+	result.count = to.count;
+	for (int i = 0; i < to.count; ++i)
+	{
+		AllocationTagStats& stats = result.tags[i];
+		copyString(stats.name, to.tags[i].name);
+		stats.size = to.tags[i].size;
+		stats.count = to.tags[i].count;
+		stats.peak_size = to.tags[i].peak_size;
+		if (i < from.count)
+		{
+			stats.size -= from.tags[i].size;
+			stats.count -= from.tags[i].count;
+		}
+	}
+}
+
+
+struct TrackingAllocator::Header
+{
+	size_t size;
+	// from the pointer returned by source to the user pointer
+	u32 offset;
+	u16 tag;
+	u16 is_sampled;
+};
+
+
+TrackingAllocator::TrackingAllocator(PoolAllocator& source)
+	: m_source(source)
+	, m_mutex(false)
+	, m_sampled(nullptr)
+	, m_stack_sampling(0)
+{
+	setMemory(m_peak_sizes, 0, sizeof(m_peak_sizes));
+}
+
+
+void TrackingAllocator::getTagsSnapshot(AllocationTagsSnapshot& snapshot)
+{
+	snapshot.count = g_tag_count;
+	int partitions_count = m_source.getPartitionsCount();
+	MT::SpinLock lock(m_mutex);
+	for (int i = 0; i < snapshot.count; ++i)
+	{
+		AllocationTagStats& stats = snapshot.tags[i];
+		copyString(stats.name, g_tag_names[i]);
+		stats.size = g_tag_counters[i].size;
+		stats.count = g_tag_counters[i].count;
+		if (i < partitions_count)
+		{
+			PoolAllocator::SizeClassStats classes[PoolAllocator::SIZE_CLASS_COUNT];
+			m_source.getPartitionStats(i, classes);
+			for (const PoolAllocator::SizeClassStats& size_class : classes)
+			{
+				i64 count = i64(size_class.allocation_count - size_class.free_count);
+				stats.size += count * size_class.size;
+				stats.count += count;
+			}
+		}
+		m_peak_sizes[i] = Math::maximum(m_peak_sizes[i], stats.size);
+		stats.peak_size = m_peak_sizes[i];
+	}
+}
+
+
+void TrackingAllocator::lock()
+{
+	m_mutex.lock();
+}
+
+
+void TrackingAllocator::unlock()
+{
+	m_mutex.unlock();
+}
+
+
+bool TrackingAllocator::shouldSample(ThreadTagState& state)
+{
+	int n = m_stack_sampling;
+	if (n <= 0) return false;
+	if (--state.sample_countdown > 0) return false;
+	state.sample_countdown = n;
+	return true;
+}
+
+
+void TrackingAllocator::link(SampledAllocation* sample)
+{
+	MT::SpinLock lock(m_mutex);
+	sample->previous = nullptr;
+	sample->next = m_sampled;
+	if (m_sampled) m_sampled->previous = sample;
+	m_sampled = sample;
+}
+
+
+void TrackingAllocator::unlink(SampledAllocation* sample)
+{
+	MT::SpinLock lock(m_mutex);
+	if (sample->previous) sample->previous->next = sample->next;
+	else m_sampled = sample->next;
+	if (sample->next) sample->next->previous = sample->previous;
+}
+
+
+void* TrackingAllocator::allocateWithHeader(size_t size, size_t align, bool is_aligned, int tag, bool is_sampled)
+{
+	IAllocator& source = m_source.getSourceAllocator();
+	align = Math::maximum(align, MIN_ALIGN);
+	size_t prefix = sizeof(Header) + (is_sampled ? sizeof(SampledAllocation) : 0);
+	u32 offset = u32((prefix + align - 1) & ~(align - 1));
+
+	u8* system_ptr = (u8*)(is_aligned ? source.allocate_aligned(size + offset, align) : source.allocate(size + offset));
+	if (!system_ptr) return nullptr;
+
+	u8* user_ptr = system_ptr + offset;
+	Header* header = (Header*)user_ptr - 1;
+	header->size = size;
+	header->offset = offset;
+	header->tag = (u16)tag;
+	header->is_sampled = is_sampled;
+	addToTag(g_thread_state, tag, size, 1);
+
+	if (is_sampled)
+	{
+		SampledAllocation* sample = (SampledAllocation*)system_ptr;
+		sample->stack_leaf = m_stack_tree.record();
+		sample->size = size;
+		sample->tag = tag;
+		link(sample);
+	}
+	return user_ptr;
+}
+
+
+void* TrackingAllocator::allocate(size_t size, size_t align, bool is_aligned)
+{
+	ThreadTagState& state = g_thread_state;
+	int tag = getCurrentAllocationTag(state);
+	bool is_sampled = shouldSample(state);
+	if (is_sampled || size > PoolAllocator::MAX_SMALL_SIZE || align > MIN_ALIGN || tag >= m_source.getPartitionsCount())
+	{
+		return allocateWithHeader(size, align, is_aligned, tag, is_sampled);
+	}
+
+	// the partition is the tag, the pool counts the block
+	return m_source.allocate(size, tag);
+}
+
+
+void TrackingAllocator::deallocate(void* ptr, bool is_aligned)
+{
+	if (!ptr) return;
+
+	if (m_source.deallocateSmall(ptr)) return;
+
+	Header* header = (Header*)ptr - 1;
+	u8* system_ptr = (u8*)ptr - header->offset;
+	addToTag(g_thread_state, header->tag, -(i64)header->size, -1);
+	if (header->is_sampled) unlink((SampledAllocation*)system_ptr);
+
+	IAllocator& source = m_source.getSourceAllocator();
+	if (is_aligned) source.deallocate_aligned(system_ptr);
+	else source.deallocate(system_ptr);
+}
+
+
+void* TrackingAllocator::reallocate(void* ptr, size_t size, size_t align, bool is_aligned)
+{
+	if (!ptr) return allocate(size, align, is_aligned);
+	if (size == 0)
+	{
+		deallocate(ptr, is_aligned);
+		return nullptr;
+	}
+
+	size_t block_size = m_source.getBlockSize(ptr);
+	if (block_size != 0)
+	{
+		// keeps the tag the block was allocated with
+		if (size <= block_size && align <= MIN_ALIGN) return ptr;
+
+		void* new_ptr = allocate(size, align, is_aligned);
+		if (!new_ptr) return nullptr;
+		copyMemory(new_ptr, ptr, block_size);
+		deallocate(ptr, is_aligned);
+		return new_ptr;
+	}
+
+	Header* header = (Header*)ptr - 1;
+	u32 offset = header->offset;
+	bool is_sampled = header->is_sampled != 0;
+	u8* system_ptr = (u8*)ptr - offset;
+
+	// headers move with the data and the source keeps the alignment, so the offset stays valid
+	IAllocator& source = m_source.getSourceAllocator();
+	auto reallocate_source = [&]() {
+		return (u8*)(is_aligned
+			? source.reallocate_aligned(system_ptr, size + offset, Math::maximum(align, MIN_ALIGN))
+			: source.reallocate(system_ptr, size + offset));
+	};
+
+	u8* new_system_ptr;
+	if (is_sampled)
+	{
+		// neighbours must not be unlinked while the node moves, the old block stays linked if this fails
+		MT::SpinLock lock(m_mutex);
+		new_system_ptr = reallocate_source();
+		if (!new_system_ptr) return nullptr;
+		SampledAllocation* sample = (SampledAllocation*)new_system_ptr;
+		sample->size = size;
+		if (sample->previous) sample->previous->next = sample;
+		else m_sampled = sample;
+		if (sample->next) sample->next->previous = sample;
+	}
+	else
+	{
+		new_system_ptr = reallocate_source();
+		if (!new_system_ptr) return nullptr;
+	}
+
+	u8* user_ptr = new_system_ptr + offset;
+	header = (Header*)user_ptr - 1;
+	addToTag(g_thread_state, header->tag, (i64)size - (i64)header->size, 0);
+	header->size = size;
+	return user_ptr;
+}
+
+
+void* TrackingAllocator::allocate(size_t size)
+{
+	return allocate(size, MIN_ALIGN, false);
+}
+
+
+void TrackingAllocator::deallocate(void* ptr)
+{
+	deallocate(ptr, false);
+}
+
+
+void* TrackingAllocator::reallocate(void* ptr, size_t size)
+{
+	return reallocate(ptr, size, MIN_ALIGN, false);
+}
+
+
+void* TrackingAllocator::allocate_aligned(size_t size, size_t align)
+{
+	return allocate(size, align, true);
+}
+
+
+void TrackingAllocator::deallocate_aligned(void* ptr)
+{
+	deallocate(ptr, true);
+}
+
+
+void* TrackingAllocator::reallocate_aligned(void* ptr, size_t size, size_t align)
+{
+	return reallocate(ptr, size, align, true);
+}
+
+
+} // namespace Debug
+} // namespace Malmy
@@ -0,0 +1,125 @@
+#pragma once
+
+
+#include "engine/debug/debug.h"
+
+
+namespace Malmy
+{
+
+
+class PoolAllocator;
+
+
+namespace Debug
+{
+
+
+struct ThreadTagState;
+
+
+static const int MAX_ALLOCATION_TAGS = 64;
+
+
+struct AllocationTagStats
+{
+	char name[32];
+	i64 size;
+	i64 count;
+	i64 peak_size;
+};
+
+
+struct AllocationTagsSnapshot
+{
+	AllocationTagStats tags[MAX_ALLOCATION_TAGS];
+	int count;
+};
+
+
+// Tags are global, tag 0 is "untagged". Returns the existing tag if the name is already registered.
+MALMY_ENGINE_API int registerAllocationTag(const char* name);
+// Tag stack is per thread, a fiber switching threads inside a tag scope can attribute some allocations wrongly.
+MALMY_ENGINE_API void pushAllocationTag(int tag);
+MALMY_ENGINE_API void popAllocationTag();
+// result = to - from, peak_size is taken from `to`
+MALMY_ENGINE_API void diffAllocationTags(const AllocationTagsSnapshot& from,
+	const AllocationTagsSnapshot& to,
+	AllocationTagsSnapshot& result);
+
+
+struct AllocationTagScope
+{
+	explicit AllocationTagScope(int tag) { pushAllocationTag(tag); }
+	~AllocationTagScope() { popAllocationTag(); }
+};
+
+
+// Lightweight alternative to Allocator usable in release builds. Small blocks come from the PoolAllocator's
+// partition matching their tag, they have no header and are counted by the pool, their size is the size
+// of their class. Big and sampled blocks and blocks with tags without a partition come directly from
+// the pool's source and have a small header. Threads count those locally and add them to the global atomic
+// counters in batches, so snapshots lag by up to 64KB / 256 allocations per thread and tag.
+// Only every N-th allocation records its callstack and is kept in a list, see setStackSampling.
+class MALMY_ENGINE_API TrackingAllocator MALMY_FINAL : public IAllocator
+{
+public:
+	struct SampledAllocation
+	{
+		SampledAllocation* previous;
+		SampledAllocation* next;
+		StackNode* stack_leaf;
+		size_t size;
+		int tag;
+	};
+
+public:
+	explicit TrackingAllocator(PoolAllocator& source);
+
+	void* allocate(size_t size) override;
+	void deallocate(void* ptr) override;
+	void* reallocate(void* ptr, size_t size) override;
+	void* allocate_aligned(size_t size, size_t align) override;
+	void deallocate_aligned(void* ptr) override;
+	void* reallocate_aligned(void* ptr, size_t size, size_t align) override;
+
+	PoolAllocator& getSourceAllocator() { return m_source; }
+	// peak_size is the highest size seen by snapshots
+	void getTagsSnapshot(AllocationTagsSnapshot& snapshot);
+	// 0 disables sampling, otherwise callstack of every n-th allocation is recorded
+	void setStackSampling(int n) { m_stack_sampling = n; }
+	int getStackSampling() const { return m_stack_sampling; }
+	// list of live sampled allocations, must be accessed between lock and unlock
+	SampledAllocation* getFirstSampledAllocation() const { return m_sampled; }
+	void lock();
+	void unlock();
+
+private:
+	struct Header;
+
+	void* allocate(size_t size, size_t align, bool is_aligned);
+	void* allocateWithHeader(size_t size, size_t align, bool is_aligned, int tag, bool is_sampled);
+	void* reallocate(void* ptr, size_t size, size_t align, bool is_aligned);
+	void deallocate(void* ptr, bool is_aligned);
+	bool shouldSample(ThreadTagState& state);
+	void link(SampledAllocation* sample);
+	void unlink(SampledAllocation* sample);
+
+private:
+	PoolAllocator& m_source;
+	StackTree m_stack_tree;
+	MT::SpinMutex m_mutex;
+	SampledAllocation* m_sampled;
+	int m_stack_sampling;
+	// guarded by m_mutex
+	i64 m_peak_sizes[MAX_ALLOCATION_TAGS];
+};
+
+
+} // namespace Debug
+} // namespace Malmy
+
+
+#define MEMORY_TAG(name) \
+	static const int memory_tag = Malmy::Debug::registerAllocationTag(name); \
+	Malmy::Debug::AllocationTagScope memory_tag_scope(memory_tag);
@@ -2,18 +2,22 @@
 #include "engine/blob.h"
 #include "engine/crc32.h"
 #include "engine/debug/debug.h"
+#include "engine/debug/tracking_allocator.h"
 #include "engine/fs/disk_file_device.h"
 #include "engine/fs/file_system.h"
 #include "engine/fs/memory_file_device.h"
 #include "engine/fs/os_file.h"
+#include "engine/fs/pack_file_device.h"
 #include "engine/fs/resource_file_device.h"
 #include "engine/input_system.h"
 #include "engine/iplugin.h"
 #include "engine/job_system.h"
+#include "engine/frame_allocator.h"
 #include "engine/lifo_allocator.h"
 #include "engine/log.h"
 #include "engine/lua_wrapper.h"
 #include "engine/math_utils.h"
+#include "engine/metrics.h"
 #include "engine/path.h"
 #include "engine/plugin_manager.h"
 #include "engine/prefab.h"
@@ -440,6 +444,7 @@ public:
 		, m_prefab_resource_manager(m_allocator)
 		, m_resource_manager(m_allocator)
 		, m_lua_resources(m_allocator)
+		, m_plugin_allocation_tags(m_allocator)
 		, m_last_lua_resource_idx(-1)
 		, m_fps(0)
 		, m_is_game_running(false)
@@ -450,6 +455,7 @@ public:
 		, m_paused(false)
 		, m_next_frame(false)
 		, m_lifo_allocator(m_allocator, 10 * 1024 * 1024)
+		, m_frame_allocator(m_allocator)
 		, m_working_dir(working_dir)
 	{
 		g_log_info.log("Core") << "Creating engine...";
@@ -458,13 +464,15 @@ public:
 
 		g_is_error_file_open = g_error_file.open("error.log", FS::Mode::CREATE_AND_WRITE);
 
-		g_log_error.getCallback().bind<logErrorToFile>();
-		g_log_info.getCallback().bind<showLogInVS>();
-		g_log_warning.getCallback().bind<showLogInVS>();
-		g_log_error.getCallback().bind<showLogInVS>();
+		g_log_error.bind<logErrorToFile>();
+		g_log_info.bind<showLogInVS>();
+		g_log_warning.bind<showLogInVS>();
+		g_log_error.bind<showLogInVS>();
+		startLogThread(m_allocator);
 
 		m_platform_data = {};
-		m_state = lua_newstate(luaAllocator, &m_allocator);
+		m_lua_allocation_tag = Debug::registerAllocationTag("lua");
+		m_state = lua_newstate(luaAllocator, this);
 		luaL_openlibs(m_state);
 		registerLuaAPI();
 
@@ -480,20 +488,36 @@ public:
 			m_file_system->mount(m_mem_file_device);
 			m_file_system->mount(m_resource_file_device);
 			m_file_system->mount(m_disk_file_device);
+
+			m_pack_file_device = nullptr;
+			StaticString<MAX_PATH_LENGTH> pack_path(m_disk_file_device->getBasePath(), "data.pak");
+			if (FS::OsFile::fileExists(pack_path))
+			{
+				m_pack_file_device = MALMY_NEW(m_allocator, FS::PackFileDevice)(m_allocator);
+				if (m_pack_file_device->mount(pack_path))
+				{
+					m_file_system->mount(m_pack_file_device);
+					g_log_info.log("Core") << "Mounted " << pack_path;
+				}
+				else
+				{
+					g_log_error.log("Core") << "Failed to mount " << pack_path;
+					MALMY_DELETE(m_allocator, m_pack_file_device);
+					m_pack_file_device = nullptr;
+				}
+			}
+
 			bool is_patching = base_path1[0] != 0 && !equalStrings(working_dir, base_path1);
 			if (is_patching)
 			{
 				m_patch_file_device = MALMY_NEW(m_allocator, FS::DiskFileDevice)("patch", base_path1, m_allocator);
 				m_file_system->mount(m_patch_file_device);
-				m_file_system->setDefaultDevice("memory:patch:disk:resource");
-				m_file_system->setSaveGameDevice("memory:disk:resource");
 			}
 			else
 			{
 				m_patch_file_device = nullptr;
-				m_file_system->setDefaultDevice("memory:disk:resource");
-				m_file_system->setSaveGameDevice("memory:disk:resource");
 			}
+			setDefaultDevices();
 		}
 		else
 		{
@@ -502,10 +526,12 @@ public:
 			m_resource_file_device = nullptr;
 			m_disk_file_device = nullptr;
 			m_patch_file_device = nullptr;
+			m_pack_file_device = nullptr;
 		}
 
 		m_resource_manager.create(*m_file_system);
 		m_prefab_resource_manager.create(PrefabResource::TYPE, m_resource_manager);
+		m_prefab_resource_manager.setPackFileDevice(m_pack_file_device);
 
 		m_timer = Timer::create(m_allocator);
 		m_fps_timer = Timer::create(m_allocator);
@@ -521,12 +547,13 @@ public:
 
 	static bool LUA_hasFilesystemWork(Engine* engine)
 	{
-		return engine->getFileSystem().hasWork();
+		return engine->getFileSystem().hasWork() || engine->getResourceManager().hasWork();
 	}
 
 	static void LUA_processFilesystemWork(Engine* engine)
 	{
 		engine->getFileSystem().updateAsyncTransactions();
+		engine->getResourceManager().update();
 	}
 
 	static void LUA_startGame(Engine* engine, Project* project)
@@ -1165,7 +1192,9 @@ public:
 
 	static void* luaAllocator(void* ud, void* ptr, size_t osize, size_t nsize)
 	{
-		auto& allocator = *static_cast<IAllocator*>(ud);
+		auto* engine = static_cast<EngineImpl*>(ud);
+		Debug::AllocationTagScope tag_scope(engine->m_lua_allocation_tag);
+		auto& allocator = engine->m_allocator;
 		if (nsize == 0)
 		{
 			allocator.deallocate(ptr);
@@ -1198,6 +1227,7 @@ public:
 			MALMY_DELETE(m_allocator, m_resource_file_device);
 			MALMY_DELETE(m_allocator, m_disk_file_device);
 			MALMY_DELETE(m_allocator, m_patch_file_device);
+			MALMY_DELETE(m_allocator, m_pack_file_device);
 		}
 
 		m_prefab_resource_manager.destroy();
@@ -1205,6 +1235,7 @@ public:
 		JobSystem::shutdown();
 		lua_close(m_state);
 
+		stopLogThread();
 		g_error_file.close();
 	}
 
@@ -1214,10 +1245,10 @@ public:
 		{
 			if(m_patch_file_device)
 			{
-				m_file_system->setDefaultDevice("memory:disk:resource");
 				m_file_system->unMount(m_patch_file_device);
 				MALMY_DELETE(m_allocator, m_patch_file_device);
 				m_patch_file_device = nullptr;
+				setDefaultDevices();
 			}
 
 			return;
@@ -1227,8 +1258,7 @@ public:
 		{
 			m_patch_file_device = MALMY_NEW(m_allocator, FS::DiskFileDevice)("patch", path, m_allocator);
 			m_file_system->mount(m_patch_file_device);
-			m_file_system->setDefaultDevice("memory:patch:disk:resource");
-			m_file_system->setSaveGameDevice("memory:disk:resource");
+			setDefaultDevices();
 		}
 		else
 		{
@@ -1237,6 +1267,19 @@ public:
 	}
 
 
+	// devices are chained from the right, pack is checked before disk so packed files are found
+	// without touching the disk, patch still overrides them
+	void setDefaultDevices()
+	{
+		StaticString<64> dev("memory");
+		if (m_patch_file_device) dev << ":patch";
+		if (m_pack_file_device) dev << ":pack";
+		dev << ":disk:resource";
+		m_file_system->setDefaultDevice(dev);
+		m_file_system->setSaveGameDevice("memory:disk:resource");
+	}
+
+
 	void setPlatformData(const PlatformData& data) override
 	{
 		m_platform_data = data;
@@ -1301,6 +1344,7 @@ public:
 	FS::FileSystem& getFileSystem() override { return *m_file_system; }
 	FS::DiskFileDevice* getDiskFileDevice() override { return m_disk_file_device; }
 	FS::DiskFileDevice* getPatchFileDevice() override { return m_patch_file_device; }
+	FS::PackFileDevice* getPackFileDevice() override { return m_pack_file_device; }
 	FS::ResourceFileDevice* getResourceFileDevice() override { return m_resource_file_device; }
 
 	void startGame(Project& context) override
@@ -1347,9 +1391,22 @@ public:
 	}
 
 	//her framede yenileniyo
+	// registering a tag locks and compares names, so it's done once per plugin
+	int getAllocationTag(const IPlugin& plugin)
+	{
+		auto iter = m_plugin_allocation_tags.find(&plugin);
+		if (iter.isValid()) return iter.value();
+		const int tag = Debug::registerAllocationTag(plugin.getName());
+		m_plugin_allocation_tags.insert(&plugin, tag);
+		return tag;
+	}
+
+
 	void update(Project& context) override
 	{
 		PROFILE_FUNCTION();
+		const u64 start_time = Profiler::now();
+		m_frame_allocator.nextFrame();
 		++m_fps_frame;
 		if (m_fps_timer->getTimeSinceTick() > 0.5f)
 		{
@@ -1368,6 +1425,7 @@ public:
 			PROFILE_BLOCK("update scenes");
 			for (auto* scene : context.getScenes())
 			{
+				Debug::AllocationTagScope tag_scope(getAllocationTag(scene->getPlugin()));
 				scene->update(dt, m_paused);
 			}
 		}
@@ -1382,12 +1440,14 @@ public:
 		m_plugin_manager->update(dt, m_paused);
 		m_input_system->update(dt);
 		getFileSystem().updateAsyncTransactions();
+		m_resource_manager.update();
 
 		if (m_next_frame)
 		{
 			m_paused = true;
 			m_next_frame = false;
 		}
+		METRICS_SAMPLE("engine update ms", 64, (Profiler::now() - start_time) * 1000.0f / Profiler::frequency());
 	}
 
 	InputSystem& getInputSystem() override { return *m_input_system; }
@@ -1489,7 +1549,10 @@ public:
 		if (!hasSerializedPlugins(serializer)) return false;
 		if (!hasSupportedSceneVersions(serializer, ctx)) return false;
 
-		m_path_manager.deserialize(serializer);
+		// the world's path table lists what its components load, packed files are read ahead while scenes are created
+		Array<Path> paths(m_allocator);
+		m_path_manager.deserialize(serializer, m_pack_file_device ? &paths : nullptr);
+		if (!paths.empty()) m_pack_file_device->prefetch(&paths[0], paths.size());
 		ctx.deserialize(serializer);
 		m_plugin_manager->deserialize(serializer);
 		i32 scene_count;
@@ -1567,6 +1630,11 @@ public:
 		return m_lifo_allocator;
 	}
 
+	FrameAllocator& getFrameAllocator() override
+	{
+		return m_frame_allocator;
+	}
+
 	void runScript(const char* src, int src_length, const char* path) override
 	{
 		if (luaL_loadbuffer(m_state, src, src_length, path) != LUA_OK)
@@ -1591,12 +1659,14 @@ public:
 private:
 	IAllocator& m_allocator;
 	LIFOAllocator m_lifo_allocator;
+	FrameAllocator m_frame_allocator;
 
 	FS::FileSystem* m_file_system;
 	FS::MemoryFileDevice* m_mem_file_device;
 	FS::ResourceFileDevice* m_resource_file_device;
 	FS::DiskFileDevice* m_disk_file_device;
 	FS::DiskFileDevice* m_patch_file_device;
+	FS::PackFileDevice* m_pack_file_device;
 
 	ResourceManager m_resource_manager;
 	
@@ -1616,7 +1686,9 @@ private:
 	PlatformData m_platform_data;
 	PathManager m_path_manager;
 	lua_State* m_state;
+	int m_lua_allocation_tag;
 	HashMap<int, Resource*> m_lua_resources;
+	HashMap<const IPlugin*, int> m_plugin_allocation_tags;
 	int m_last_lua_resource_idx;
 	StaticString<MAX_PATH_LENGTH> m_working_dir;
 };
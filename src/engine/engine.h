@@ -8,11 +8,13 @@ namespace Malmy
 	namespace FS
 	{
 		class DiskFileDevice;
+		class PackFileDevice;
 		class ResourceFileDevice;
 		class FileSystem;
 	}
 
 	struct ComponentUID;
+	class FrameAllocator;
 	class InputBlob;
 	struct IAllocator;
 	class InputSystem;
@@ -52,6 +54,7 @@ namespace Malmy
 		virtual FS::FileSystem& getFileSystem() = 0;
 		virtual FS::DiskFileDevice* getDiskFileDevice() = 0;
 		virtual FS::DiskFileDevice* getPatchFileDevice() = 0;
+		virtual FS::PackFileDevice* getPackFileDevice() = 0;
 		virtual FS::ResourceFileDevice* getResourceFileDevice() = 0;
 		virtual InputSystem& getInputSystem() = 0;
 		virtual PluginManager& getPluginManager() = 0;
@@ -75,6 +78,7 @@ namespace Malmy
 		virtual void runScript(const char* src, int src_length, const char* path) = 0;
 		virtual ComponentUID createComponent(Project& project, GameObject gameobject, ComponentType type) = 0;
 		virtual IAllocator& getLIFOAllocator() = 0;
+		virtual FrameAllocator& getFrameAllocator() = 0;
 		virtual class Resource* getLuaResource(int idx) const = 0;
 		virtual int addLuaResource(const Path& path, struct ResourceType type) = 0;
 		virtual void unloadLuaResource(int resource_idx) = 0;
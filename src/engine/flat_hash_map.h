@@ -0,0 +1,405 @@
+#pragma once
+#include "engine/hash_map.h"
+#include <emmintrin.h>
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+
+namespace Malmy
+{
+	// Open addressing hash map with the same interface as HashMap. Keys and values are stored in one flat
+	// array, there is no allocation per item. Each slot has a control byte, which is either EMPTY, DELETED
+	// or 7 bits of the key's hash. Control bytes are probed by groups of 16 using SSE2, so a lookup
+	// usually touches one group of control bytes and one slot.
+	// Iterators and pointers to values are invalidated by insert.
+	template<class K, class T, class Hasher = HashFunc<K>>
+	class FlatHashMap
+	{
+	public:
+		typedef T value_type;
+		typedef K key_type;
+		typedef Hasher hasher_type;
+		typedef FlatHashMap<key_type, value_type, hasher_type> my_type;
+		typedef u32 size_type;
+
+	private:
+		static const size_type GROUP_SIZE = 16;
+		static const i8 EMPTY = -128;
+		static const i8 DELETED = -2;
+
+		struct Slot
+		{
+			K key;
+			T value;
+		};
+
+	public:
+		template <class MapType, class KeyType, class ValueType>
+		class Iterator
+		{
+		public:
+			typedef Iterator<MapType, KeyType, ValueType> iter_type;
+
+			Iterator() : m_map(nullptr), m_index(0) {}
+			Iterator(MapType* map, size_type index) : m_map(map), m_index(index) {}
+
+			bool isValid() const { return m_map && m_index < m_map->m_capacity; }
+			KeyType& key() const { return m_map->m_slots[m_index].key; }
+			ValueType& value() const { return m_map->m_slots[m_index].value; }
+			ValueType& operator*() const { return value(); }
+
+			iter_type& operator++()
+			{
+				m_index = m_map->nextFull(m_index + 1);
+				return *this;
+			}
+
+			iter_type operator++(int)
+			{
+				iter_type p = *this;
+				m_index = m_map->nextFull(m_index + 1);
+				return p;
+			}
+
+			bool operator==(const iter_type& it) const { return it.m_index == m_index; }
+			bool operator!=(const iter_type& it) const { return it.m_index != m_index; }
+
+		private:
+			friend my_type;
+
+			MapType* m_map;
+			size_type m_index;
+		};
+
+		typedef Iterator<my_type, key_type, value_type> iterator;
+		typedef Iterator<const my_type, const key_type, const value_type> constIterator;
+
+		explicit FlatHashMap(IAllocator& allocator)
+			: m_allocator(allocator)
+		{
+			init(0);
+		}
+
+		FlatHashMap(size_type buckets, IAllocator& allocator)
+			: m_allocator(allocator)
+		{
+			init(0);
+			rehash(buckets);
+		}
+
+		explicit FlatHashMap(const my_type& src)
+			: m_allocator(src.m_allocator)
+		{
+			init(0);
+			copyFrom(src);
+		}
+
+		~FlatHashMap()
+		{
+			destroyTable();
+		}
+
+		my_type& operator=(const my_type& src)
+		{
+			if (this != &src)
+			{
+				clear();
+				copyFrom(src);
+			}
+			return *this;
+		}
+
+		size_type size() const { return m_size; }
+		bool empty() const { return 0 == m_size; }
+
+		value_type& operator[](const key_type& key) const
+		{
+			size_type idx = findIndex(key);
+			ASSERT(idx != m_capacity);
+			return m_slots[idx].value;
+		}
+
+		value_type& at(const key_type& key) { return (*this)[key]; }
+
+		void insert(const key_type& key, const value_type& val)
+		{
+			size_type idx = prepareInsert(key);
+			new (NewPlaceholder(), &m_slots[idx].key) K(key);
+			new (NewPlaceholder(), &m_slots[idx].value) T(val);
+		}
+
+		value_type& insert(const key_type& key, value_type&& val)
+		{
+			size_type idx = prepareInsert(key);
+			new (NewPlaceholder(), &m_slots[idx].key) K(key);
+			new (NewPlaceholder(), &m_slots[idx].value) T(Move(val));
+			return m_slots[idx].value;
+		}
+
+		iterator erase(iterator it)
+		{
+			ASSERT(it.isValid());
+			eraseIndex(it.m_index);
+			return iterator(this, nextFull(it.m_index + 1));
+		}
+
+		size_type erase(const key_type& key)
+		{
+			size_type count = 0;
+			for (size_type idx = findIndex(key); idx != m_capacity; idx = findIndex(key))
+			{
+				eraseIndex(idx);
+				++count;
+			}
+			return count;
+		}
+
+		void clear()
+		{
+			destroyTable();
+			init(0);
+		}
+
+		void rehash(size_type ids_count)
+		{
+			size_type capacity = Math::maximum(GROUP_SIZE, Math::nextPow2(ids_count + ids_count / 7));
+			if (capacity > m_capacity) resize(capacity);
+		}
+
+		iterator begin() { return iterator(this, nextFull(0)); }
+		iterator end() { return iterator(this, m_capacity); }
+
+		constIterator begin() const { return constIterator(this, nextFull(0)); }
+		constIterator end() const { return constIterator(this, m_capacity); }
+
+		iterator find(const key_type& key) { return iterator(this, findIndex(key)); }
+		constIterator find(const key_type& key) const { return constIterator(this, findIndex(key)); }
+
+	private:
+		static u32 getLowestBit(u32 mask)
+		{
+			#ifdef _MSC_VER
+				unsigned long idx;
+				_BitScanForward(&idx, mask);
+				return idx;
+			#else
+				return __builtin_ctz(mask);
+			#endif
+		}
+
+		// lower bits of hash select the group, upper 7 bits are stored in control bytes
+		static i8 getH2(u32 hash) { return i8(hash >> 25); }
+
+		u32 matchByte(size_type group, i8 value) const
+		{
+			__m128i ctrl = _mm_load_si128((const __m128i*)&m_ctrl[group * GROUP_SIZE]);
+			return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(value), ctrl));
+		}
+
+		// EMPTY and DELETED are the only negative control bytes
+		u32 matchEmptyOrDeleted(size_type group) const
+		{
+			__m128i ctrl = _mm_load_si128((const __m128i*)&m_ctrl[group * GROUP_SIZE]);
+			return (u32)_mm_movemask_epi8(ctrl);
+		}
+
+		size_type findIndex(const key_type& key) const
+		{
+			if (m_size == 0) return m_capacity;
+
+			u32 hash = Hasher::get(key);
+			i8 h2 = getH2(hash);
+			size_type group_mask = m_capacity / GROUP_SIZE - 1;
+			size_type group = hash & group_mask;
+			for (size_type step = 1;; ++step)
+			{
+				for (u32 match = matchByte(group, h2); match; match &= match - 1)
+				{
+					size_type idx = group * GROUP_SIZE + getLowestBit(match);
+					if (m_slots[idx].key == key) return idx;
+				}
+				if (matchByte(group, EMPTY)) return m_capacity;
+				// triangular probing visits every group once with power of two group count
+				group = (group + step) & group_mask;
+			}
+		}
+
+		size_type findInsertIndex(u32 hash) const
+		{
+			size_type group_mask = m_capacity / GROUP_SIZE - 1;
+			size_type group = hash & group_mask;
+			for (size_type step = 1;; ++step)
+			{
+				u32 match = matchEmptyOrDeleted(group);
+				if (match) return group * GROUP_SIZE + getLowestBit(match);
+				group = (group + step) & group_mask;
+			}
+		}
+
+		size_type prepareInsert(const key_type& key)
+		{
+			if (m_growth_left == 0)
+			{
+				// growth is used up by tombstones if the map is less than half full, e.g. after many erase/insert cycles
+				if (m_capacity == 0) resize(GROUP_SIZE);
+				else if ((u64)m_size * 16 <= (u64)m_capacity * 7) dropDeletes();
+				else resize(m_capacity * 2);
+			}
+
+			u32 hash = Hasher::get(key);
+			size_type idx = findInsertIndex(hash);
+			if (m_ctrl[idx] == EMPTY) --m_growth_left;
+			m_ctrl[idx] = getH2(hash);
+			++m_size;
+			return idx;
+		}
+
+		void eraseIndex(size_type idx)
+		{
+			m_slots[idx].key.~K();
+			m_slots[idx].value.~T();
+			--m_size;
+			// probing stops at a group with an empty slot, so if the group already has one, nothing probes past it
+			if (matchByte(idx / GROUP_SIZE, EMPTY))
+			{
+				m_ctrl[idx] = EMPTY;
+				++m_growth_left;
+			}
+			else
+			{
+				m_ctrl[idx] = DELETED;
+			}
+		}
+
+		size_type nextFull(size_type idx) const
+		{
+			while (idx < m_capacity && m_ctrl[idx] < 0) ++idx;
+			return idx;
+		}
+
+		void init(size_type capacity)
+		{
+			m_capacity = capacity;
+			m_size = 0;
+			m_growth_left = capacity - capacity / 8;
+			if (capacity == 0)
+			{
+				// keeps lookups in an empty map free of special cases
+				m_ctrl = nullptr;
+				m_slots = nullptr;
+				return;
+			}
+			m_ctrl = (i8*)m_allocator.allocate_aligned(capacity, 16);
+			setMemory(m_ctrl, (u8)EMPTY, capacity);
+			m_slots = (Slot*)m_allocator.allocate_aligned(sizeof(Slot) * capacity, alignof(Slot));
+		}
+
+		void destroyTable()
+		{
+			for (size_type i = 0; i < m_capacity; ++i)
+			{
+				if (m_ctrl[i] < 0) continue;
+				m_slots[i].key.~K();
+				m_slots[i].value.~T();
+			}
+			if (m_ctrl) m_allocator.deallocate_aligned(m_ctrl);
+			if (m_slots) m_allocator.deallocate_aligned(m_slots);
+		}
+
+		void resize(size_type capacity)
+		{
+			ASSERT(Math::isPowOfTwo(capacity));
+			i8* old_ctrl = m_ctrl;
+			Slot* old_slots = m_slots;
+			size_type old_capacity = m_capacity;
+			size_type old_size = m_size;
+
+			init(capacity);
+			for (size_type i = 0; i < old_capacity; ++i)
+			{
+				if (old_ctrl[i] < 0) continue;
+				Slot& old = old_slots[i];
+				u32 hash = Hasher::get(old.key);
+				size_type idx = findInsertIndex(hash);
+				m_ctrl[idx] = getH2(hash);
+				new (NewPlaceholder(), &m_slots[idx].key) K(Move(old.key));
+				new (NewPlaceholder(), &m_slots[idx].value) T(Move(old.value));
+				old.key.~K();
+				old.value.~T();
+			}
+			m_size = old_size;
+			m_growth_left -= old_size;
+
+			if (old_ctrl) m_allocator.deallocate_aligned(old_ctrl);
+			if (old_slots) m_allocator.deallocate_aligned(old_slots);
+		}
+
+		// Rehashes in place at the same capacity. Full slots are marked DELETED and tombstones EMPTY, then each
+		// DELETED one is put where an insert would put it. A key already in the first group with a free slot stays,
+		// a key whose target is EMPTY is moved there, otherwise it is swapped with the unplaced key at the target.
+		void dropDeletes()
+		{
+			for (size_type i = 0; i < m_capacity; ++i)
+			{
+				m_ctrl[i] = m_ctrl[i] < 0 ? EMPTY : DELETED;
+			}
+
+			for (size_type i = 0; i < m_capacity; ++i)
+			{
+				if (m_ctrl[i] != DELETED) continue;
+
+				u32 hash = Hasher::get(m_slots[i].key);
+				size_type idx = findInsertIndex(hash);
+				if (idx / GROUP_SIZE == i / GROUP_SIZE)
+				{
+					m_ctrl[i] = getH2(hash);
+					continue;
+				}
+
+				Slot& slot = m_slots[i];
+				Slot& target = m_slots[idx];
+				if (m_ctrl[idx] == EMPTY)
+				{
+					new (NewPlaceholder(), &target.key) K(Move(slot.key));
+					new (NewPlaceholder(), &target.value) T(Move(slot.value));
+					slot.key.~K();
+					slot.value.~T();
+					m_ctrl[idx] = getH2(hash);
+					m_ctrl[i] = EMPTY;
+					continue;
+				}
+
+				K tmp_key(Move(target.key));
+				T tmp_value(Move(target.value));
+				target.key.~K();
+				target.value.~T();
+				new (NewPlaceholder(), &target.key) K(Move(slot.key));
+				new (NewPlaceholder(), &target.value) T(Move(slot.value));
+				slot.key.~K();
+				slot.value.~T();
+				new (NewPlaceholder(), &slot.key) K(Move(tmp_key));
+				new (NewPlaceholder(), &slot.value) T(Move(tmp_value));
+				m_ctrl[idx] = getH2(hash);
+				// the key swapped in is not placed yet
+				--i;
+			}
+			m_growth_left = m_capacity - m_capacity / 8 - m_size;
+		}
+
+		void copyFrom(const my_type& src)
+		{
+			rehash(src.m_size);
+			for (constIterator it = src.begin(), end = src.end(); it != end; ++it)
+			{
+				insert(it.key(), it.value());
+			}
+		}
+
+		i8* m_ctrl;
+		Slot* m_slots;
+		size_type m_capacity;
+		size_type m_size;
+		size_type m_growth_left;
+		IAllocator& m_allocator;
+	};
+} // namespace Malmy
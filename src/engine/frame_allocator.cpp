@@ -0,0 +1,199 @@
+#include "engine/frame_allocator.h"
+#include "engine/math_utils.h"
+#include "engine/mt/atomic.h"
+#include "engine/profiler.h"
+#include "engine/string.h"
+
+namespace Malmy
+{
+
+	struct FrameAllocator::Chunk
+	{
+		Chunk* next;
+		u8* current;
+		u8* end;
+		size_t size;
+	};
+
+
+	// size of an allocation is stored right before it, reallocate needs it
+	typedef size_t AllocationHeader;
+
+
+	// per thread position in the current frame, chunk is FrameAllocator::Chunk
+	struct ThreadCursor
+	{
+		i32 allocator_id;
+		u32 frame;
+		void* chunk;
+		u8* last_allocation;
+	};
+
+
+	static thread_local ThreadCursor g_cursor = {};
+	static volatile i32 g_last_allocator_id = 0;
+
+
+	FrameAllocator::FrameAllocator(IAllocator& source)
+		: m_source(source)
+		, m_mutex(false)
+		, m_free_chunks(nullptr)
+		, m_frame(1)
+		, m_allocation_count(0)
+		, m_source_allocation_count(0)
+		, m_last_allocation_count(0)
+		, m_last_source_allocation_count(0)
+		, m_last_used_size(0)
+	{
+		m_id = MT::atomicIncrement(&g_last_allocator_id);
+		m_frame_chunks[0] = m_frame_chunks[1] = nullptr;
+	}
+
+
+	FrameAllocator::~FrameAllocator()
+	{
+		Chunk* lists[] = { m_frame_chunks[0], m_frame_chunks[1], m_free_chunks };
+		for (Chunk* chunk : lists)
+		{
+			while (chunk)
+			{
+				Chunk* next = chunk->next;
+				m_source.deallocate_aligned(chunk);
+				chunk = next;
+			}
+		}
+	}
+
+
+	void FrameAllocator::nextFrame()
+	{
+		size_t used_size = 0;
+		for (Chunk* chunk = m_frame_chunks[m_frame & 1]; chunk; chunk = chunk->next)
+		{
+			used_size += chunk->current - (u8*)(chunk + 1);
+		}
+		m_last_allocation_count = m_allocation_count;
+		m_last_source_allocation_count = m_source_allocation_count;
+		m_last_used_size = used_size;
+		PROFILE_INT("frame allocator allocations", m_last_allocation_count);
+		PROFILE_INT("frame allocator chunks allocated", m_last_source_allocation_count);
+		PROFILE_INT("frame allocator used KB", int(used_size >> 10));
+		m_allocation_count = 0;
+		m_source_allocation_count = 0;
+
+		MT::SpinLock lock(m_mutex);
+		++m_frame;
+		// chunks of frame N - 1 are reused, chunks of frame N are still valid in N + 1
+		Chunk* chunk = m_frame_chunks[m_frame & 1];
+		m_frame_chunks[m_frame & 1] = nullptr;
+		while (chunk)
+		{
+			Chunk* next = chunk->next;
+			chunk->current = (u8*)(chunk + 1);
+			chunk->next = m_free_chunks;
+			m_free_chunks = chunk;
+			chunk = next;
+		}
+	}
+
+
+	FrameAllocator::Chunk* FrameAllocator::allocateChunk(size_t min_size)
+	{
+		MT::SpinLock lock(m_mutex);
+		Chunk** iter = &m_free_chunks;
+		while (*iter && (*iter)->size < min_size + sizeof(Chunk)) iter = &(*iter)->next;
+		Chunk* chunk = *iter;
+		if (chunk)
+		{
+			*iter = chunk->next;
+		}
+		else
+		{
+			size_t size = Math::maximum(CHUNK_SIZE, min_size + sizeof(Chunk));
+			chunk = (Chunk*)m_source.allocate_aligned(size, 16);
+			chunk->size = size;
+			chunk->current = (u8*)(chunk + 1);
+			chunk->end = (u8*)chunk + size;
+			MT::atomicIncrement(&m_source_allocation_count);
+		}
+		chunk->next = m_frame_chunks[m_frame & 1];
+		m_frame_chunks[m_frame & 1] = chunk;
+		return chunk;
+	}
+
+
+	static u8* alignPointer(u8* ptr, size_t align)
+	{
+		return (u8*)(((uintptr)ptr + align - 1) & ~(uintptr)(align - 1));
+	}
+
+
+	void* FrameAllocator::allocate_aligned(size_t size, size_t align)
+	{
+		MT::atomicIncrement(&m_allocation_count);
+		align = Math::maximum(align, sizeof(AllocationHeader));
+
+		ThreadCursor& cursor = g_cursor;
+		if (cursor.allocator_id != m_id || cursor.frame != m_frame)
+		{
+			cursor.allocator_id = m_id;
+			cursor.frame = m_frame;
+			cursor.chunk = nullptr;
+			cursor.last_allocation = nullptr;
+		}
+
+		Chunk* chunk = (Chunk*)cursor.chunk;
+		u8* mem = nullptr;
+		if (chunk)
+		{
+			mem = alignPointer(chunk->current + sizeof(AllocationHeader), align);
+			if (mem + size > chunk->end) mem = nullptr;
+		}
+		if (!mem)
+		{
+			chunk = allocateChunk(size + align + sizeof(AllocationHeader));
+			cursor.chunk = chunk;
+			mem = alignPointer(chunk->current + sizeof(AllocationHeader), align);
+		}
+
+		((AllocationHeader*)mem)[-1] = size;
+		chunk->current = mem + size;
+		cursor.last_allocation = mem;
+		return mem;
+	}
+
+
+	void* FrameAllocator::reallocate_aligned(void* ptr, size_t size, size_t align)
+	{
+		if (!ptr) return allocate_aligned(size, align);
+		if (size == 0) return nullptr;
+
+		ThreadCursor& cursor = g_cursor;
+		size_t old_size = ((AllocationHeader*)ptr)[-1];
+		bool is_last = cursor.allocator_id == m_id && cursor.frame == m_frame && cursor.last_allocation == ptr;
+		Chunk* chunk = (Chunk*)cursor.chunk;
+		if (is_last && (u8*)ptr + size <= chunk->end)
+		{
+			((AllocationHeader*)ptr)[-1] = size;
+			chunk->current = (u8*)ptr + size;
+			return ptr;
+		}
+
+		void* new_mem = allocate_aligned(size, align);
+		copyMemory(new_mem, ptr, Math::minimum(old_size, size));
+		return new_mem;
+	}
+
+
+	void* FrameAllocator::allocate(size_t size)
+	{
+		return allocate_aligned(size, sizeof(AllocationHeader));
+	}
+
+
+	void* FrameAllocator::reallocate(void* ptr, size_t size)
+	{
+		return reallocate_aligned(ptr, size, sizeof(AllocationHeader));
+	}
+
+} // namespace Malmy
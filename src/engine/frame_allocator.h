@@ -0,0 +1,57 @@
+#pragma once
+#include "engine/iallocator.h"
+#include "engine/malmy.h"
+#include "engine/mt/sync.h"
+
+namespace Malmy
+{
+
+	// Linear allocator for data which lives at most until the end of the next frame.
+	// Every thread bumps its own chunk, so it can be used from jobs. deallocate is a no-op,
+	// all memory is reclaimed at once by nextFrame. Memory allocated in frame N stays valid
+	// during frame N + 1, so data produced by update can be consumed by rendering of the next frame.
+	// Array<T>(frame_allocator) works as a per-frame array, the last allocation of a thread grows in place.
+	class MALMY_ENGINE_API FrameAllocator MALMY_FINAL : public IAllocator
+	{
+	public:
+		static const size_t CHUNK_SIZE = 256 * 1024;
+
+	public:
+		explicit FrameAllocator(IAllocator& source);
+		~FrameAllocator();
+
+		// main thread only, no job may allocate from this allocator at that time
+		void nextFrame();
+
+		void* allocate(size_t size) override;
+		void deallocate(void* ptr) override {}
+		void* reallocate(void* ptr, size_t size) override;
+		void* allocate_aligned(size_t size, size_t align) override;
+		void deallocate_aligned(void* ptr) override {}
+		void* reallocate_aligned(void* ptr, size_t size, size_t align) override;
+
+		// stats of the last finished frame
+		int getAllocationCount() const { return m_last_allocation_count; }
+		int getSourceAllocationCount() const { return m_last_source_allocation_count; }
+		size_t getUsedSize() const { return m_last_used_size; }
+
+	private:
+		struct Chunk;
+
+		Chunk* allocateChunk(size_t min_size);
+
+	private:
+		IAllocator& m_source;
+		MT::SpinMutex m_mutex;
+		Chunk* m_frame_chunks[2];
+		Chunk* m_free_chunks;
+		i32 m_id;
+		u32 m_frame;
+		volatile i32 m_allocation_count;
+		volatile i32 m_source_allocation_count;
+		int m_last_allocation_count;
+		int m_last_source_allocation_count;
+		size_t m_last_used_size;
+	};
+
+} // namespace Malmy
@@ -5,12 +5,15 @@
 #include "engine/blob.h"
 #include "engine/delegate_list.h"
 #include "engine/fs/disk_file_device.h"
-#include "engine/mt/lock_free_fixed_queue.h"
+#include "engine/hash_map.h"
+#include "engine/math_utils.h"
+#include "engine/metrics.h"
+#include "engine/mt/atomic.h"
+#include "engine/mt/sync.h"
 #include "engine/mt/task.h"
-#include "engine/mt/transaction.h"
+#include "engine/mt/thread.h"
 #include "engine/path.h"
 #include "engine/profiler.h"
-#include "engine/queue.h"
 #include "engine/string.h"
 
 
@@ -22,32 +25,46 @@ namespace Malmy
 
 		enum TransFlags
 		{
-			E_CLOSE = 0,
-			E_SUCCESS = 0x1,
-			E_IS_OPEN = E_SUCCESS << 1,
-			E_FAIL = E_IS_OPEN << 1,
-			E_CANCELED = E_FAIL << 1
+			E_IS_OPEN = 0x1,
+			E_CLOSE = E_IS_OPEN << 1,
+			E_SUCCESS = E_CLOSE << 1,
+			E_FAIL = E_SUCCESS << 1,
+			E_DETACHED = E_FAIL << 1
 		};
 
 		struct AsyncItem
 		{
 			IFile* m_file;
 			ReadCallback m_cb;
+			ReadCallback m_worker_cb;
 			Mode m_mode;
 			u32 m_id;
+			AsyncPriority m_priority;
+			u64 m_queued_time;
 			char m_path[MAX_PATH_LENGTH];
 			u8 m_flags;
+			// set from the main thread while a worker may be updating m_flags
+			volatile bool m_is_canceled;
+			// cancelAsync waits for the worker to finish the item
+			bool m_has_cancel_waiter;
 		};
 
-		static const i32 C_MAX_TRANS = 16;
+		static const int MAX_IO_WORKERS = 4;
+		static const int PRIORITY_COUNT = (int)AsyncPriority::COUNT;
 
-		typedef MT::Transaction<AsyncItem> AsynTrans;
-		typedef MT::LockFreeFixedQueue<AsynTrans, C_MAX_TRANS> TransQueue;
-		typedef Queue<AsynTrans*, C_MAX_TRANS> InProgressQueue;
-		typedef Array<AsyncItem> ItemsTable;
+		typedef Array<AsyncItem*> ItemsTable;
 		typedef Array<IFileDevice*> DevicesTable;
 
 
+		struct PriorityQueue
+		{
+			explicit PriorityQueue(IAllocator& allocator) : items(allocator), head(0) {}
+
+			ItemsTable items;
+			int head;
+		};
+
+
 		void IFile::release()
 		{
 			getDevice().destroyFile(this);
@@ -69,12 +86,15 @@ namespace Malmy
 		}
 
 
+		class FileSystemImpl;
+
+
 		class FSTask MALMY_FINAL : public MT::Task
 		{
 		public:
-			FSTask(TransQueue* queue, IAllocator& allocator)
+			FSTask(FileSystemImpl& fs, IAllocator& allocator)
 				: MT::Task(allocator)
-				, m_trans_queue(queue)
+				, m_fs(fs)
 			{
 			}
 
@@ -82,34 +102,10 @@ namespace Malmy
 			~FSTask() = default;
 
 
-			int task() override
-			{
-				while (!m_trans_queue->isAborted())
-				{
-					PROFILE_BLOCK("transaction");
-					AsynTrans* tr = m_trans_queue->pop(true);
-					if (!tr) break;
-
-					if ((tr->data.m_flags & E_IS_OPEN) == E_IS_OPEN)
-					{
-						tr->data.m_flags |=
-							tr->data.m_file->open(Path(tr->data.m_path), tr->data.m_mode) ? E_SUCCESS : E_FAIL;
-					}
-					else if ((tr->data.m_flags & E_CLOSE) == E_CLOSE)
-					{
-						tr->data.m_file->close();
-						tr->data.m_file->release();
-						tr->data.m_file = nullptr;
-					}
-					tr->setCompleted();
-				}
-				return 0;
-			}
-
-			void stop() { m_trans_queue->abort(); }
+			int task() override;
 
 		private:
-			TransQueue* m_trans_queue;
+			FileSystemImpl& m_fs;
 		};
 
 
@@ -118,40 +114,146 @@ namespace Malmy
 		public:
 			explicit FileSystemImpl(IAllocator& allocator)
 				: m_allocator(allocator)
-				, m_pending(m_allocator)
 				, m_devices(m_allocator)
+				, m_tasks(m_allocator)
+				, m_queue_mutex(false)
+				, m_queues(m_allocator)
 				, m_in_progress(m_allocator)
+				, m_completed(m_allocator)
+				, m_dispatching(m_allocator)
+				, m_work_signal(0, 0x7fffFFFF)
+				, m_cancel_done(false)
+				, m_work_count(0)
+				, m_is_finished(false)
 				, m_last_id(0)
+				, m_access_mutex(false)
+				, m_access_log(m_allocator)
+				, m_accessed(m_allocator)
+				, m_is_access_recording(false)
 			{
 				m_disk_device.m_devices[0] = nullptr;
 				m_memory_device.m_devices[0] = nullptr;
 				m_default_device.m_devices[0] = nullptr;
 				m_save_game_device.m_devices[0] = nullptr;
-				m_task = MALMY_NEW(m_allocator, FSTask)(&m_transaction_queue, m_allocator);
-				m_task->create("FSTask");
+				for (int i = 0; i < PRIORITY_COUNT; ++i) m_queues.emplace(m_allocator);
+
+				int workers_count = Math::clamp((int)MT::getCPUsCount() / 2, 1, MAX_IO_WORKERS);
+				for (int i = 0; i < workers_count; ++i)
+				{
+					FSTask* task = MALMY_NEW(m_allocator, FSTask)(*this, m_allocator);
+					task->create("FSTask");
+					m_tasks.push(task);
+				}
 			}
 
 			~FileSystemImpl()
 			{
-				m_task->stop();
-				m_task->destroy();
-				MALMY_DELETE(m_allocator, m_task);
-				while (!m_in_progress.empty())
+				m_is_finished = true;
+				for (int i = 0; i < m_tasks.size(); ++i) m_work_signal.signal();
+				for (FSTask* task : m_tasks)
 				{
-					auto* trans = m_in_progress.front();
-					m_in_progress.pop();
-					if (trans->data.m_file) close(*trans->data.m_file);
+					task->destroy();
+					MALMY_DELETE(m_allocator, task);
 				}
-				for (auto& i : m_pending)
+
+				for (PriorityQueue& queue : m_queues)
+				{
+					for (int i = queue.head; i < queue.items.size(); ++i)
+					{
+						AsyncItem* item = queue.items[i];
+						if (item->m_flags & E_CLOSE) item->m_file->close();
+						item->m_file->release();
+						MALMY_DELETE(m_allocator, item);
+					}
+				}
+				for (AsyncItem* item : m_completed)
 				{
-					close(*i.m_file);
+					if ((item->m_flags & E_DETACHED) == 0) close(*item->m_file);
+					MALMY_DELETE(m_allocator, item);
 				}
 			}
 
+
+			void pushItem(AsyncItem* item)
+			{
+				MT::atomicIncrement(&m_work_count);
+				{
+					MT::SpinLock lock(m_queue_mutex);
+					m_queues[(int)item->m_priority].items.push(item);
+				}
+				m_work_signal.signal();
+			}
+
+
+			AsyncItem* popItem()
+			{
+				MT::SpinLock lock(m_queue_mutex);
+				for (int p = PRIORITY_COUNT - 1; p >= 0; --p)
+				{
+					PriorityQueue& queue = m_queues[p];
+					if (queue.head == queue.items.size()) continue;
+
+					AsyncItem* item = queue.items[queue.head];
+					++queue.head;
+					if (queue.head == queue.items.size())
+					{
+						queue.items.clear();
+						queue.head = 0;
+					}
+					m_in_progress.push(item);
+					return item;
+				}
+				return nullptr;
+			}
+
+
+			// called from I/O workers
+			void processItem()
+			{
+				AsyncItem* item = popItem();
+				if (!item) return;
+
+				PROFILE_BLOCK("transaction");
+				if (item->m_flags & E_IS_OPEN)
+				{
+					bool success = item->m_file->open(Path(item->m_path), item->m_mode);
+					item->m_flags |= success ? E_SUCCESS : E_FAIL;
+					if (success && item->m_worker_cb.isValid())
+					{
+						item->m_flags |= E_DETACHED;
+						item->m_worker_cb.invoke(*item->m_file, true);
+					}
+				}
+				else if (item->m_flags & E_CLOSE)
+				{
+					item->m_file->close();
+					item->m_file->release();
+					item->m_file = nullptr;
+				}
+
+				MT::SpinLock lock(m_queue_mutex);
+				m_in_progress.eraseItemFast(item);
+				if (item->m_has_cancel_waiter) m_cancel_done.trigger();
+				if (item->m_flags & E_CLOSE)
+				{
+					MALMY_DELETE(m_allocator, item);
+					MT::atomicDecrement(&m_work_count);
+				}
+				else
+				{
+					m_completed.push(item);
+				}
+			}
+
+
+			bool isFinished() const { return m_is_finished; }
+			void waitForWork() { m_work_signal.wait(); }
+
+
 			BaseProxyAllocator& getAllocator() { return m_allocator; }
 
 
-			bool hasWork() const override { return !m_in_progress.empty() || !m_pending.empty(); }
+			bool hasWork() const override { return m_work_count > 0; }
 
 
 			bool mount(IFileDevice* device) override
@@ -209,8 +311,45 @@ namespace Malmy
 			}
 
 
+			void recordAccess(const Path& file, int mode)
+			{
+				if (!m_is_access_recording || (mode & Mode::READ) == 0) return;
+
+				MT::SpinLock lock(m_access_mutex);
+				if (m_accessed.find(file.getHash()).isValid()) return;
+				m_accessed.insert(file.getHash(), true);
+				m_access_log.push(file);
+			}
+
+
+			void setAccessRecording(bool enable) override
+			{
+				MT::SpinLock lock(m_access_mutex);
+				if (enable && !m_is_access_recording)
+				{
+					m_access_log.clear();
+					m_accessed.clear();
+				}
+				m_is_access_recording = enable;
+			}
+
+
+			bool isAccessRecording() const override { return m_is_access_recording; }
+
+
+			void getAccessLog(Array<Path>& paths) override
+			{
+				MT::SpinLock lock(m_access_mutex);
+				paths.clear();
+				paths.reserve(m_access_log.size());
+				for (const Path& path : m_access_log) paths.push(path);
+			}
+
+
 			IFile* open(const DeviceList& device_list, const Path& file, Mode mode) override
 			{
+				METRICS_ADD("file opens", 1);
+				recordAccess(file, mode);
 				IFile* prev = createFile(device_list);
 
 				if (prev)
@@ -229,23 +368,34 @@ namespace Malmy
 			u32 openAsync(const DeviceList& device_list,
 				const Path& file,
 				int mode,
-				const ReadCallback& call_back) override
+				const ReadCallback& call_back,
+				AsyncPriority priority,
+				const ReadCallback& worker_call_back) override
 			{
+				METRICS_ADD("file opens", 1);
+				recordAccess(file, mode);
 				IFile* prev = createFile(device_list);
 
 				if (prev)
 				{
-					AsyncItem& item = m_pending.emplace();
-
-					item.m_file = prev;
-					item.m_cb = call_back;
-					item.m_mode = mode;
-					copyString(item.m_path, file.c_str());
-					item.m_flags = E_IS_OPEN;
-					item.m_id = m_last_id;
+					AsyncItem* item = MALMY_NEW(m_allocator, AsyncItem);
+
+					item->m_file = prev;
+					item->m_cb = call_back;
+					item->m_worker_cb = worker_call_back;
+					item->m_mode = mode;
+					item->m_priority = priority;
+					copyString(item->m_path, file.c_str());
+					item->m_flags = E_IS_OPEN;
+					item->m_is_canceled = false;
+					item->m_has_cancel_waiter = false;
+					item->m_queued_time = Profiler::now();
+					item->m_id = m_last_id;
 					++m_last_id;
 					if (m_last_id == INVALID_ASYNC) m_last_id = 0;
-					return item.m_id;
+					const u32 id = item->m_id;
+					pushItem(item);
+					return id;
 				}
 
 				return INVALID_ASYNC;
@@ -256,24 +406,61 @@ namespace Malmy
 			{
 				if (id == INVALID_ASYNC) return;
 
-				for (int i = 0, c = m_pending.size(); i < c; ++i)
+				for (AsyncItem* item : m_dispatching)
 				{
-					if (m_pending[i].m_id == id)
+					if (item && item->m_id == id)
 					{
-						m_pending[i].m_flags |= E_CANCELED;
+						item->m_is_canceled = true;
 						return;
 					}
 				}
 
-				for (auto iter = m_in_progress.begin(), end = m_in_progress.end(); iter != end; ++iter)
+				bool is_in_progress = false;
 				{
-					if (iter.value()->data.m_id == id)
+					MT::SpinLock lock(m_queue_mutex);
+					for (PriorityQueue& queue : m_queues)
 					{
-						iter.value()->data.m_flags |= E_CANCELED;
-						return;
+						for (int i = queue.head; i < queue.items.size(); ++i)
+						{
+							AsyncItem* item = queue.items[i];
+							if (item->m_id != id || (item->m_flags & E_IS_OPEN) == 0) continue;
+
+							queue.items.erase(i);
+							if (queue.head == queue.items.size())
+							{
+								queue.items.clear();
+								queue.head = 0;
+							}
+							item->m_file->release();
+							MALMY_DELETE(m_allocator, item);
+							MT::atomicDecrement(&m_work_count);
+							return;
+						}
+					}
+
+					for (AsyncItem* item : m_completed)
+					{
+						if (item->m_id == id && (item->m_flags & E_IS_OPEN))
+						{
+							item->m_is_canceled = true;
+							return;
+						}
+					}
+
+					for (AsyncItem* item : m_in_progress)
+					{
+						if (item->m_id == id && (item->m_flags & E_IS_OPEN))
+						{
+							item->m_is_canceled = true;
+							item->m_has_cancel_waiter = true;
+							is_in_progress = true;
+							break;
+						}
 					}
 				}
 
+				// worker callback must not run after cancelAsync returns
+				if (is_in_progress) m_cancel_done.wait();
 			}
 
 
@@ -322,58 +509,52 @@ namespace Malmy
 
 			void closeAsync(IFile& file) override
 			{
-				AsyncItem& item = m_pending.emplace();
-
-				item.m_file = &file;
-				item.m_cb.bind<closeAsync>();
-				item.m_mode = 0;
-				item.m_flags = E_CLOSE;
+				AsyncItem* item = MALMY_NEW(m_allocator, AsyncItem);
+
+				item->m_file = &file;
+				item->m_mode = 0;
+				item->m_id = INVALID_ASYNC;
+				item->m_priority = AsyncPriority::HIGH;
+				item->m_path[0] = '\0';
+				item->m_flags = E_CLOSE;
+				item->m_is_canceled = false;
+				item->m_has_cancel_waiter = false;
+				pushItem(item);
 			}
 
-			//her framede calisiyor
+
 			void updateAsyncTransactions() override
 			{
 				PROFILE_FUNCTION();
-				while (!m_in_progress.empty())
+				ASSERT(m_dispatching.empty());
 				{
-					AsynTrans* tr = m_in_progress.front();
-					if (!tr->isCompleted()) break;
+					MT::SpinLock lock(m_queue_mutex);
+					m_dispatching.swap(m_completed);
+				}
 
+				for (int i = 0; i < m_dispatching.size(); ++i)
+				{
 					PROFILE_BLOCK("processAsyncTransaction");
-					m_in_progress.pop();
+					AsyncItem* item = m_dispatching[i];
 
-					if ((tr->data.m_flags & E_CANCELED) == 0)
+					if (!item->m_is_canceled)
 					{
-						tr->data.m_cb.invoke(*tr->data.m_file, !!(tr->data.m_flags & E_SUCCESS));
+						// from openAsync to the callback, includes waiting in the queue and for this update
+						const float ms = (Profiler::now() - item->m_queued_time) * 1000.0f / Profiler::frequency();
+						METRICS_SAMPLE("async file open ms", 256, ms);
+						item->m_cb.invoke(*item->m_file, !!(item->m_flags & E_SUCCESS));
 					}
-					if ((tr->data.m_flags & (E_SUCCESS | E_FAIL)) != 0)
+					if ((item->m_flags & E_DETACHED) == 0)
 					{
-						closeAsync(*tr->data.m_file);
+						closeAsync(*item->m_file);
 					}
-					m_transaction_queue.dealoc(tr);
-				}
-
-				i32 can_add = C_MAX_TRANS - m_in_progress.size();
-				while (can_add && !m_pending.empty())
-				{
-					AsynTrans* tr = m_transaction_queue.alloc(false);
-					if (tr)
-					{
-						AsyncItem& item = m_pending[0];
-						tr->data.m_file = item.m_file;
-						tr->data.m_cb = item.m_cb;
-						tr->data.m_id = item.m_id;
-						tr->data.m_mode = item.m_mode;
-						copyString(tr->data.m_path, sizeof(tr->data.m_path), item.m_path);
-						tr->data.m_flags = item.m_flags;
-						tr->reset();
-
-						m_transaction_queue.push(tr, true);
-						m_in_progress.push(tr);
-						m_pending.erase(0);
-					}
-					can_add--;
+					m_dispatching[i] = nullptr;
+					MALMY_DELETE(m_allocator, item);
+					MT::atomicDecrement(&m_work_count);
 				}
+				m_dispatching.clear();
+				PROFILE_INT("pending", m_work_count);
+				METRICS_SET("async file queue", m_work_count);
 			}
 
 			const DeviceList& getDefaultDevice() const override { return m_default_device; }
@@ -390,24 +571,45 @@ namespace Malmy
 				return nullptr;
 			}
 
-			static void closeAsync(IFile&, bool) {}
-
 		private:
 			BaseProxyAllocator m_allocator;
-			FSTask* m_task;
 			DevicesTable m_devices;
 
-			ItemsTable m_pending;
-			TransQueue m_transaction_queue;
-			InProgressQueue m_in_progress;
+			Array<FSTask*> m_tasks;
+			MT::SpinMutex m_queue_mutex;
+			Array<PriorityQueue> m_queues;
+			ItemsTable m_in_progress;
+			ItemsTable m_completed;
+			ItemsTable m_dispatching;
+			MT::Semaphore m_work_signal;
+			// only the main thread cancels, so there is at most one waiter
+			MT::Event m_cancel_done;
+			volatile i32 m_work_count;
+			volatile bool m_is_finished;
 
 			DeviceList m_disk_device;
 			DeviceList m_memory_device;
 			DeviceList m_default_device;
 			DeviceList m_save_game_device;
 			u32 m_last_id;
+
+			MT::SpinMutex m_access_mutex;
+			Array<Path> m_access_log;
+			HashMap<u32, bool> m_accessed;
+			volatile bool m_is_access_recording;
 		};
 
+		int FSTask::task()
+		{
+			while (!m_fs.isFinished())
+			{
+				m_fs.waitForWork();
+				m_fs.processItem();
+			}
+			return 0;
+		}
+
+
 		FileSystem* FileSystem::create(IAllocator& allocator)
 		{
 			return MALMY_NEW(allocator, FileSystemImpl)(allocator);
@@ -1,14 +1,15 @@
 #pragma once
 
+#include "engine/delegate.h"
 #include "engine/malmy.h"
 
 namespace Malmy
 {
 
 struct IAllocator;
+template <typename T> class Array;
 class OutputBlob;
 class Path;
-template <typename T> class Delegate;
 
 
 namespace FS
@@ -86,6 +87,16 @@ protected:
 typedef Delegate<void(IFile&, bool)> ReadCallback;
 
 
+enum class AsyncPriority : u8
+{
+	LOW,
+	NORMAL,
+	HIGH,
+
+	COUNT
+};
+
+
 struct MALMY_ENGINE_API DeviceList
 {
 	IFileDevice* m_devices[8];
@@ -106,10 +117,14 @@ public:
 	virtual bool unMount(IFileDevice* device) = 0;
 
 	virtual IFile* open(const DeviceList& device_list, const Path& file, Mode mode) = 0;
+	// worker_call_back, if valid, is called from an I/O thread as soon as the file is open, even if the request
+	// was canceled meanwhile (cancelAsync waits for it); the file is then owned by the caller and must be closed by it
 	virtual u32 openAsync(const DeviceList& device_list,
 						   const Path& file,
 						   int mode,
-						   const ReadCallback& call_back) = 0;
+						   const ReadCallback& call_back,
+						   AsyncPriority priority = AsyncPriority::NORMAL,
+						   const ReadCallback& worker_call_back = ReadCallback()) = 0;
 	virtual void cancelAsync(u32 id) = 0;
 
 	virtual void close(IFile& file) = 0;
@@ -127,6 +142,11 @@ public:
 	virtual void setDefaultDevice(const char* dev) = 0;
 	virtual void setSaveGameDevice(const char* dev) = 0;
 	virtual bool hasWork() const = 0;
+
+	// records the order in which files are first read, used to lay out pack files
+	virtual void setAccessRecording(bool enable) = 0;
+	virtual bool isAccessRecording() const = 0;
+	virtual void getAccessLog(Array<Path>& paths) = 0;
 };
 
 
@@ -117,6 +117,75 @@ bool OsFile::seek(SeekMode base, size_t pos)
 }
 
 
+OsMappedFile::OsMappedFile()
+	: m_file((void*)INVALID_HANDLE_VALUE)
+	, m_mapping(nullptr)
+	, m_data(nullptr)
+	, m_size(0)
+{
+}
+
+
+OsMappedFile::~OsMappedFile()
+{
+	ASSERT(!m_data);
+}
+
+
+bool OsMappedFile::open(const char* path)
+{
+	ASSERT(!m_data);
+	m_file = (HANDLE)::CreateFile(
+		path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (INVALID_HANDLE_VALUE == (HANDLE)m_file) return false;
+
+	LARGE_INTEGER size;
+	if (!::GetFileSizeEx((HANDLE)m_file, &size) || size.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+	m_size = (size_t)size.QuadPart;
+
+	m_mapping = ::CreateFileMappingA((HANDLE)m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!m_mapping)
+	{
+		close();
+		return false;
+	}
+
+	m_data = (const u8*)::MapViewOfFile((HANDLE)m_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!m_data)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+
+void OsMappedFile::close()
+{
+	if (m_data) ::UnmapViewOfFile(m_data);
+	if (m_mapping) ::CloseHandle((HANDLE)m_mapping);
+	if (INVALID_HANDLE_VALUE != (HANDLE)m_file) ::CloseHandle((HANDLE)m_file);
+	m_data = nullptr;
+	m_mapping = nullptr;
+	m_file = (void*)INVALID_HANDLE_VALUE;
+	m_size = 0;
+}
+
+
+void OsMappedFile::prefetch(size_t offset, size_t size)
+{
+	ASSERT(m_data && offset + size <= m_size);
+	WIN32_MEMORY_RANGE_ENTRY range;
+	range.VirtualAddress = (PVOID)(m_data + offset);
+	range.NumberOfBytes = size;
+	::PrefetchVirtualMemory(::GetCurrentProcess(), 1, &range, 0);
+}
+
+
 OsFile& OsFile::operator <<(const char* text)
 {
 	write(text, stringLength(text));
@@ -40,5 +40,28 @@ namespace Malmy
 		private:
 			void* m_handle;
 		};
+
+
+		// read-only mapping of a whole file
+		class MALMY_ENGINE_API OsMappedFile
+		{
+		public:
+			OsMappedFile();
+			~OsMappedFile();
+
+			bool open(const char* path);
+			void close();
+			bool isOpen() const { return m_data != nullptr; }
+			const u8* getData() const { return m_data; }
+			size_t size() const { return m_size; }
+			// hint, asks the OS to read the range into memory in the background
+			void prefetch(size_t offset, size_t size);
+
+		private:
+			void* m_file;
+			void* m_mapping;
+			const u8* m_data;
+			size_t m_size;
+		};
 	} // namespace FS
 } // namespace Malmy
@@ -1,7 +1,10 @@
 #include "engine/fs/file_system.h"
+#include "engine/array.h"
 #include "engine/iallocator.h"
 #include "engine/path.h"
+#include "engine/profiler.h"
 #include "pack_file_device.h"
+#include <cstring>
 
 
 namespace Malmy
@@ -13,57 +16,115 @@ namespace FS
 class PackFile MALMY_FINAL : public IFile
 {
 public:
-	PackFile(PackFileDevice& device, IAllocator& allocator)
+	PackFile(IFile* fallthrough, PackFileDevice& device, IAllocator& allocator)
 		: m_device(device)
-		, m_local_offset(0)
+		, m_fallthrough(fallthrough)
+		, m_use_fallthrough(false)
+		, m_data(nullptr)
+		, m_size(0)
+		, m_pos(0)
 	{
 	}
 
 
+	~PackFile()
+	{
+		if (m_fallthrough) m_fallthrough->release();
+	}
+
+
 	bool open(const Path& path, Mode mode) override
 	{
 		auto iter = m_device.m_files.find(path.getHash());
-		if (iter == m_device.m_files.end()) return false;
-		m_file = iter.value();
-		m_local_offset = 0;
-		return m_device.m_file.seek(SeekMode::BEGIN, (size_t)m_file.offset);
+		if (iter == m_device.m_files.end() || (mode & Mode::WRITE) != 0)
+		{
+			if (!m_fallthrough) return false;
+			m_use_fallthrough = true;
+			return m_fallthrough->open(path, mode);
+		}
+		const PackFileDevice::PackFileInfo& info = iter.value();
+		m_data = m_device.m_file.getData() + info.offset;
+		m_size = (size_t)info.size;
+		m_pos = 0;
+		return true;
+	}
+
+
+	void close() override
+	{
+		if (m_fallthrough) m_fallthrough->close();
+		m_use_fallthrough = false;
+		m_data = nullptr;
+		m_size = 0;
+		m_pos = 0;
 	}
 
 
 	bool read(void* buffer, size_t size) override
 	{
-		if (m_device.m_offset != m_file.offset + m_local_offset)
+		if (m_use_fallthrough) return m_fallthrough->read(buffer, size);
+		if (m_pos + size > m_size) return false;
+		memcpy(buffer, m_data + m_pos, size);
+		m_pos += size;
+		return true;
+	}
+
+
+	bool seek(SeekMode base, size_t pos) override
+	{
+		if (m_use_fallthrough) return m_fallthrough->seek(base, pos);
+		size_t new_pos;
+		switch (base)
 		{
-			if (!m_device.m_file.seek(FS::SeekMode::BEGIN, size_t(m_file.offset + m_local_offset)))
-			{
-				return false;
-			}
+			case SeekMode::BEGIN: new_pos = pos; break;
+			case SeekMode::END: new_pos = m_size - pos; break;
+			case SeekMode::CURRENT: new_pos = m_pos + pos; break;
+			default: ASSERT(false); return false;
 		}
-		m_local_offset += size;
-		return m_device.m_file.read(buffer, size);
+		if (new_pos > m_size) return false;
+		m_pos = new_pos;
+		return true;
 	}
 
 
-	bool seek(SeekMode base, size_t pos) override
+	bool write(const void* buffer, size_t size) override
+	{
+		if (m_use_fallthrough) return m_fallthrough->write(buffer, size);
+		ASSERT(false);
+		return false;
+	}
+
+
+	const void* getBuffer() const override
+	{
+		if (m_use_fallthrough) return m_fallthrough->getBuffer();
+		return m_data;
+	}
+
+
+	size_t size() override
 	{
-		m_local_offset = pos;
-		return m_device.m_file.seek(SeekMode::BEGIN, size_t(m_file.offset + pos));
+		if (m_use_fallthrough) return m_fallthrough->size();
+		return m_size;
+	}
+
+
+	size_t pos() override
+	{
+		if (m_use_fallthrough) return m_fallthrough->pos();
+		return m_pos;
 	}
 
 
 	IFileDevice& getDevice() override { return m_device; }
-	void close() override { m_local_offset = 0; }
-	bool write(const void* buffer, size_t size) override { ASSERT(false); return false; }
-	const void* getBuffer() const override { return nullptr; }
-	size_t size() override { return (size_t)m_file.size; }
-	size_t pos() override { return m_local_offset; }
 
 private:
-	~PackFile() = default;
-
-	PackFileDevice::PackFileInfo m_file;
 	PackFileDevice& m_device;
-	size_t m_local_offset;
+	IFile* m_fallthrough;
+	bool m_use_fallthrough;
+	const u8* m_data;
+	size_t m_size;
+	size_t m_pos;
 }; // class PackFile
 
 
@@ -83,32 +144,104 @@ PackFileDevice::~PackFileDevice()
 bool PackFileDevice::mount(const char* path)
 {
 	m_file.close();
-	if(!m_file.open(path, Mode::OPEN_AND_READ)) return false;
+	m_files.clear();
+	if (!m_file.open(path)) return false;
 
+	const u8* data = m_file.getData();
+	const size_t file_size = m_file.size();
 	i32 count;
-	m_file.read(&count, sizeof(count));
-	for(int i = 0; i < count; ++i)
+	if (file_size < sizeof(count))
+	{
+		m_file.close();
+		return false;
+	}
+	memcpy(&count, data, sizeof(count));
+	const size_t entry_size = sizeof(u32) + sizeof(PackFileInfo);
+	if (count < 0 || sizeof(count) + count * entry_size > file_size)
+	{
+		m_file.close();
+		return false;
+	}
+
+	const u8* entry = data + sizeof(count);
+	for (int i = 0; i < count; ++i)
 	{
 		u32 hash;
-		m_file.read(&hash, sizeof(hash));
 		PackFileInfo info;
-		m_file.read(&info, sizeof(info));
+		memcpy(&hash, entry, sizeof(hash));
+		memcpy(&info, entry + sizeof(hash), sizeof(info));
+		entry += entry_size;
+		if (info.offset + info.size > file_size)
+		{
+			m_files.clear();
+			m_file.close();
+			return false;
+		}
 		m_files.insert(hash, info);
 	}
-	m_offset = m_file.pos();
 	return true;
 }
 
 
+bool PackFileDevice::contains(const Path& path) const
+{
+	return m_files.find(path.getHash()).isValid();
+}
+
+
+void PackFileDevice::prefetch(const Path* paths, int count)
+{
+	PROFILE_FUNCTION();
+	if (!m_file.isOpen()) return;
+
+	Array<PackFileInfo> ranges(m_allocator);
+	ranges.reserve(count);
+	for (int i = 0; i < count; ++i)
+	{
+		auto iter = m_files.find(paths[i].getHash());
+		if (iter.isValid()) ranges.push(iter.value());
+	}
+	if (ranges.empty()) return;
+
+	// insertion sort, the list is short and usually already in pack order
+	for (int i = 1; i < ranges.size(); ++i)
+	{
+		PackFileInfo tmp = ranges[i];
+		int j = i;
+		while (j > 0 && ranges[j - 1].offset > tmp.offset)
+		{
+			ranges[j] = ranges[j - 1];
+			--j;
+		}
+		ranges[j] = tmp;
+	}
+
+	PackFileInfo merged = ranges[0];
+	for (int i = 1; i < ranges.size(); ++i)
+	{
+		const PackFileInfo& range = ranges[i];
+		if (range.offset <= merged.offset + merged.size)
+		{
+			u64 end = range.offset + range.size;
+			if (end > merged.offset + merged.size) merged.size = end - merged.offset;
+			continue;
+		}
+		m_file.prefetch((size_t)merged.offset, (size_t)merged.size);
+		merged = range;
+	}
+	m_file.prefetch((size_t)merged.offset, (size_t)merged.size);
+}
+
+
 void PackFileDevice::destroyFile(IFile* file)
 {
 	MALMY_DELETE(m_allocator, file);
 }
 
 
-IFile* PackFileDevice::createFile(IFile*)
+IFile* PackFileDevice::createFile(IFile* child)
 {
-	return MALMY_NEW(m_allocator, PackFile)(*this, m_allocator);
+	return MALMY_NEW(m_allocator, PackFile)(child, *this, m_allocator);
 }
 
 
@@ -9,12 +9,15 @@
 namespace Malmy
 {
 struct IAllocator;
+class Path;
 
 namespace FS
 {
 struct IFile;
 
 
+// Pack is mapped to memory, files are not copied, PackFile::getBuffer points into the mapping.
+// Files not in the pack fall through to the next device.
 class MALMY_ENGINE_API PackFileDevice MALMY_FINAL : public IFileDevice
 {
 	friend class PackFile;
@@ -26,6 +29,9 @@ public:
 	void destroyFile(IFile* file) override;
 	const char* name() const override { return "pack"; }
 	bool mount(const char* path);
+	bool contains(const Path& path) const;
+	// asks the OS to read the files in background, ranges of adjacent files are merged
+	void prefetch(const Path* paths, int count);
 
 private:
 	struct PackFileInfo
@@ -35,8 +41,7 @@ private:
 	};
 
 	HashMap<u32, PackFileInfo> m_files;
-	size_t m_offset;
-	OsFile m_file;
+	OsMappedFile m_file;
 	IAllocator& m_allocator;
 };
 
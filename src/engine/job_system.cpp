@@ -5,6 +5,7 @@
 #include "engine/iallocator.h"
 #include "engine/log.h"
 #include "engine/math_utils.h"
+#include "engine/metrics.h"
 #include "engine/mt/atomic.h"
 #include "engine/mt/lock_free_fixed_queue.h"
 #include "engine/mt/sync.h"
@@ -28,6 +29,10 @@ namespace Malmy
 			void(*task)(void*) = nullptr;
 			void* data = nullptr;
 			SignalHandle dec_on_finish;
+			// internal jobs have no name and are not profiled
+			const char* name = nullptr;
+			u32 id = 0;
+			SignalHandle precondition;
 		};
 
 		struct Signal {
@@ -82,6 +87,7 @@ namespace Malmy
 			Array<FiberDecl*> m_ready_fibers;
 			IAllocator& m_allocator;
 			Array<u32> m_free_queue;
+			u32 m_last_job_id = 0;
 		};
 
 		static System* g_system = nullptr;
@@ -104,6 +110,7 @@ namespace Malmy
 
 			Job job = system.m_job_queue.back();
 			system.m_job_queue.pop();
+			METRICS_SET("job queue", system.m_job_queue.size());
 			if (system.m_job_queue.empty()) system.m_work_signal.reset();
 			return job;
 		}
@@ -231,7 +238,10 @@ namespace Malmy
 				signal.next_job.task = nullptr;
 				iter = signal.sibling;
 			}
-			if (any_new_job) g_system->m_work_signal.trigger();
+			if (any_new_job) {
+				g_system->m_work_signal.trigger();
+				METRICS_SET("job queue", g_system->m_job_queue.size());
+			}
 		}
 
 		static MALMY_FORCE_INLINE bool isSignalZero(SignalHandle handle, bool lock)
@@ -248,15 +258,23 @@ namespace Malmy
 			return is_zero;
 		}
 
+		static Profiler::JobRecord toRecord(const Job& job)
+		{
+			return { job.id, job.dec_on_finish, job.precondition, job.name };
+		}
+
 		static MALMY_FORCE_INLINE void runInternal(void* data
 			, void(*task)(void*)
 			, SignalHandle precondition
 			, bool lock
-			, SignalHandle* on_finish)
+			, SignalHandle* on_finish
+			, const char* name)
 		{
 			Job j;
 			j.data = data;
 			j.task = task;
+			j.name = name;
+			j.precondition = precondition;
 
 			if (lock) g_system->m_sync.lock();
 			j.dec_on_finish = [&]() -> SignalHandle {
@@ -268,10 +286,15 @@ namespace Malmy
 				return allocateSignal();
 			}();
 			if (on_finish) *on_finish = j.dec_on_finish;
+			if (name) {
+				j.id = ++g_system->m_last_job_id;
+				Profiler::recordJob(Profiler::EventType::JOB_SUBMIT, toRecord(j));
+			}
 
 			if (!isValid(precondition) || isSignalZero(precondition, false)) {
 				g_system->m_job_queue.push(j);
 				g_system->m_work_signal.trigger();
+				METRICS_SET("job queue", g_system->m_job_queue.size());
 			}
 			else {
 				Signal& counter = g_system->m_signals_pool[precondition & HANDLE_ID_MASK];
@@ -290,9 +313,9 @@ namespace Malmy
 			if (lock) g_system->m_sync.unlock();
 		}
 
-		void run(void* data, void(*task)(void*), SignalHandle* on_finished, SignalHandle precondition)
+		void run(void* data, void(*task)(void*), SignalHandle* on_finished, SignalHandle precondition, const char* name)
 		{
-			runInternal(data, task, precondition, true, on_finished);
+			runInternal(data, task, precondition, true, on_finished, name ? name : "job");
 		}
 
 		static void __stdcall fiberProc(void* data)
@@ -303,7 +326,16 @@ namespace Malmy
 			for (;;)
 			{
 				Job job = fiber_decl->current_job;
-				job.task(job.data);
+				if (job.name) {
+					Profiler::recordJob(Profiler::EventType::JOB_START, toRecord(job));
+					Profiler::beginBlock(job.name);
+					job.task(job.data);
+					Profiler::endBlock();
+					Profiler::recordJob(Profiler::EventType::JOB_END, toRecord(job));
+				}
+				else {
+					job.task(job.data);
+				}
 				if (isValid(job.dec_on_finish)) trigger(job.dec_on_finish);
 				fiber_decl->job_finished = true;
 
@@ -385,28 +417,38 @@ namespace Malmy
 			}
 
 			if (g_worker) {
-				PROFILE_BLOCK("waiting");
 				FiberDecl* fiber_decl = ((WorkerTask*)g_worker)->m_current_fiber;
+				const Job& job = fiber_decl->current_job;
+
+				// the fiber can continue on another thread, blocks opened on this one would never end
+				Profiler::recordSignalWait(Profiler::EventType::SIGNAL_WAIT_BEGIN, handle);
+				Profiler::FiberSwitchData switch_data;
+				Profiler::beginFiberSwitch(switch_data);
 
 				runInternal(fiber_decl, [](void* data) {
 					MT::SpinLock lock(g_system->m_sync);
 					g_system->m_ready_fibers.push((FiberDecl*)data);
-				}, handle, false, nullptr);
+				}, handle, false, nullptr, nullptr);
 				fiber_decl->job_finished = false;
 				Fiber::switchTo(&fiber_decl->fiber, fiber_decl->worker_task->m_primary_fiber);
 
 				ASSERT(isSignalZero(handle, false));
 				g_system->m_sync.unlock();
+
+				Profiler::recordSignalWait(Profiler::EventType::SIGNAL_WAIT_END, handle);
+				if (job.name) Profiler::recordJob(Profiler::EventType::JOB_START, toRecord(job));
+				Profiler::endFiberSwitch(switch_data);
 			}
 			else
 			{
 				PROFILE_BLOCK("not a job waiting");
+				Profiler::recordSignalWait(Profiler::EventType::SIGNAL_WAIT_BEGIN, handle);
 
 				g_system->m_event_outside_job.reset();
 
 				runInternal(nullptr, [](void* data) {
 					g_system->m_event_outside_job.trigger();
-				}, handle, false, nullptr);
+				}, handle, false, nullptr, nullptr);
 
 				g_system->m_sync.unlock();
 
@@ -414,6 +456,7 @@ namespace Malmy
 				while (!isSignalZero(handle, true)) {
 					g_system->m_event_outside_job.waitTimeout(1);
 				}
+				Profiler::recordSignalWait(Profiler::EventType::SIGNAL_WAIT_END, handle);
 			}
 		}
 
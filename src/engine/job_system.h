@@ -15,7 +15,12 @@ namespace Malmy
 		MALMY_ENGINE_API bool init(IAllocator& allocator);
 		MALMY_ENGINE_API void shutdown();
 
-		MALMY_ENGINE_API void run(void* data, void(*task)(void*), SignalHandle* on_finish, SignalHandle precondition);
+		// name must outlive the profiler data, jobs are shown as "job" if it's null
+		MALMY_ENGINE_API void run(void* data,
+			void(*task)(void*),
+			SignalHandle* on_finish,
+			SignalHandle precondition,
+			const char* name = nullptr);
 		MALMY_ENGINE_API void wait(SignalHandle waitable);
 		MALMY_ENGINE_API inline bool isValid(SignalHandle waitable) { return waitable != INVALID_HANDLE; }
 
@@ -1,6 +1,25 @@
 #include "engine/log.h"
+#include "engine/crc32.h"
+#include "engine/iallocator.h"
+#include "engine/math_utils.h"
+#include "engine/mt/atomic.h"
+#include "engine/mt/lock_free_fixed_queue.h"
+#include "engine/mt/task.h"
+#include "engine/mt/thread.h"
 #include "engine/path.h"
+#include "engine/profiler.h"
 #include "engine/string.h"
+#include <cstddef>
+
+#ifdef _WIN32
+	#include <intrin.h>
+	#pragma intrinsic(_ReturnAddress)
+	#define MALMY_RETURN_ADDRESS() _ReturnAddress()
+	#define MALMY_NO_INLINE __declspec(noinline)
+#else
+	#define MALMY_RETURN_ADDRESS() __builtin_return_address(0)
+	#define MALMY_NO_INLINE __attribute__((noinline))
+#endif
 
 namespace Malmy
 {
@@ -9,75 +28,462 @@ namespace Malmy
 	Log g_log_warning;
 	Log g_log_error;
 
-	LogProxy Log::log(const char* system)
+
+	enum class LogArg : u8
+	{
+		STRING,
+		FLOAT,
+		I32,
+		U32,
+		U64
+	};
+
+
+	static const int LOG_QUEUE_SIZE = 256;
+	static const int LOG_SITES_COUNT = 1024;
+	static const int LOG_SITES_PROBE_COUNT = 16;
+	static const i32 MAX_MESSAGES_PER_SECOND = 20;
+	static const u32 LOG_THREAD_SLEEP_MS = 10;
+
+
+	// identical messages from the same call site, call site is the return address of Log::log
+	struct LogSite
+	{
+		volatile i64 key;
+		volatile i64 window_start;
+		volatile i32 count;
+		volatile i32 suppressed_count;
+		// last dispatched message, protected by getSitesMutex
+		Log* log;
+		char system[32];
+		char text[128];
+	};
+
+
+	static LogSite g_log_sites[LOG_SITES_COUNT] = {};
+	static thread_local bool g_is_log_thread = false;
+	static thread_local int g_dispatch_depth = 0;
+
+
+	// log can be used during static initialization, so the mutex can not be a global
+	static MT::SpinMutex& getSitesMutex()
+	{
+		static MT::SpinMutex mutex(false);
+		return mutex;
+	}
+
+
+	static i32 takeSuppressedCount(LogSite& site)
+	{
+		for (;;)
+		{
+			const i32 count = site.suppressed_count;
+			if (count == 0 || MT::compareAndExchange(&site.suppressed_count, 0, count)) return count;
+		}
+	}
+
+
+	static void reportSuppressed(bool all)
+	{
+		const i64 now = (i64)Profiler::now();
+		const i64 frequency = (i64)Profiler::frequency();
+		for (LogSite& site : g_log_sites)
+		{
+			if (site.suppressed_count == 0 || !site.log) continue;
+			if (!all && now - site.window_start <= frequency) continue;
+
+			const i32 count = takeSuppressedCount(site);
+			if (count == 0) continue;
+			Log* log;
+			char system[32];
+			StaticString<256> message;
+			{
+				MT::SpinLock lock(getSitesMutex());
+				log = site.log;
+				copyString(system, site.system);
+				message << site.text << " (" << count << " identical messages suppressed)";
+			}
+			log->dispatch(system, message);
+		}
+	}
+
+
+	static void dispatchRecord(const LogRecord& record)
 	{
-		return LogProxy(*this, system, m_allocator);
+		// a float is 5 bytes in the record and at most 40 characters as text
+		const u32 text_size = record.size * 8 + 64;
+		char stack_text[4096];
+		char* text = text_size > sizeof(stack_text) ? (char*)record.allocator->allocate(text_size) : stack_text;
+		text[0] = '\0';
+
+		const u8* data = record.heap ? record.heap : record.data;
+		u32 pos = 0;
+		while (pos < record.size)
+		{
+			const LogArg type = (LogArg)data[pos];
+			++pos;
+			char tmp[40];
+			switch (type)
+			{
+				case LogArg::STRING:
+				{
+					u32 length;
+					copyMemory(&length, data + pos, sizeof(length));
+					pos += sizeof(length);
+					catNString(text, text_size, (const char*)data + pos, length);
+					pos += length;
+					continue;
+				}
+				case LogArg::FLOAT:
+				{
+					float value;
+					copyMemory(&value, data + pos, sizeof(value));
+					pos += sizeof(value);
+					toCString(value, tmp, 30, 10);
+					break;
+				}
+				case LogArg::I32:
+				{
+					i32 value;
+					copyMemory(&value, data + pos, sizeof(value));
+					pos += sizeof(value);
+					toCString(value, tmp, 30);
+					break;
+				}
+				case LogArg::U32:
+				{
+					u32 value;
+					copyMemory(&value, data + pos, sizeof(value));
+					pos += sizeof(value);
+					toCString(value, tmp, 30);
+					break;
+				}
+				case LogArg::U64:
+				{
+					u64 value;
+					copyMemory(&value, data + pos, sizeof(value));
+					pos += sizeof(value);
+					toCString(value, tmp, 30);
+					break;
+				}
+				default: ASSERT(false); return;
+			}
+			catString(text, text_size, tmp);
+		}
+		if (record.site)
+		{
+			MT::SpinLock lock(getSitesMutex());
+			record.site->log = record.log;
+			copyString(record.site->system, record.system);
+			copyString(record.site->text, text);
+		}
+		if (record.suppressed_count > 0)
+		{
+			char tmp[30];
+			toCString(record.suppressed_count, tmp, lengthOf(tmp));
+			catString(text, text_size, " (");
+			catString(text, text_size, tmp);
+			catString(text, text_size, " identical messages suppressed)");
+		}
+
+		record.log->dispatch(record.system, text);
+
+		if (text != stack_text) record.allocator->deallocate(text);
+		if (record.heap) record.allocator->deallocate(record.heap);
 	}
 
-	Log::Callback& Log::getCallback()
+
+	struct LogTask MALMY_FINAL : MT::Task
 	{
-		return m_callbacks;
+		explicit LogTask(IAllocator& allocator)
+			: MT::Task(allocator)
+			, m_allocator(allocator)
+			, m_pushed_count(0)
+			, m_dispatched_count(0)
+		{
+		}
+
+
+		int task() override
+		{
+			g_is_log_thread = true;
+			// polls, so suppressed messages of quiet sites are reported even if nothing else is logged
+			while (!m_queue.isAborted())
+			{
+				LogRecord* record = m_queue.pop(false);
+				if (!record)
+				{
+					reportSuppressed(false);
+					MT::sleep(LOG_THREAD_SLEEP_MS);
+					continue;
+				}
+
+				dispatchRecord(*record);
+				m_queue.dealoc(record);
+				MT::atomicIncrement(&m_dispatched_count);
+			}
+			reportSuppressed(true);
+			return 0;
+		}
+
+
+		IAllocator& m_allocator;
+		MT::LockFreeFixedQueue<LogRecord, LOG_QUEUE_SIZE> m_queue;
+		volatile i32 m_pushed_count;
+		volatile i32 m_dispatched_count;
+	};
+
+
+	static LogTask* volatile g_log_task = nullptr;
+
+
+	static LogSite* getLogSite(i64 key, i64 now)
+	{
+		const u32 hash = u32((u64(key) >> 4) * 2654435761u);
+		for (int i = 0; i < LOG_SITES_PROBE_COUNT; ++i)
+		{
+			LogSite& site = g_log_sites[(hash + i) & (LOG_SITES_COUNT - 1)];
+			const i64 old_key = site.key;
+			if (old_key == key) return &site;
+
+			// sites of messages not logged for a while are reused
+			const bool is_stale = old_key != 0 && site.suppressed_count == 0 &&
+								  now - site.window_start > 2 * (i64)Profiler::frequency();
+			if ((old_key == 0 || is_stale) && MT::compareAndExchange64(&site.key, key, old_key))
+			{
+				site.window_start = now;
+				site.count = 0;
+				return &site;
+			}
+			if (site.key == key) return &site;
+		}
+		return nullptr;
+	}
+
+
+	// returns true if the message should be dropped
+	static bool rateLimit(LogRecord& record, void* call_site)
+	{
+		const u8* data = record.heap ? record.heap : record.data;
+		i64 key = i64(u64((uintptr)call_site) * 31 + crc32(data, (int)record.size));
+		if (key == 0) key = 1;
+		const i64 now = (i64)Profiler::now();
+		LogSite* site = getLogSite(key, now);
+		if (!site) return false;
+
+		const i64 window_start = site->window_start;
+		if (now - window_start > (i64)Profiler::frequency() && MT::compareAndExchange64(&site->window_start, now, window_start))
+		{
+			site->count = 0;
+		}
+		if (MT::atomicIncrement(&site->count) > MAX_MESSAGES_PER_SECOND)
+		{
+			MT::atomicIncrement(&site->suppressed_count);
+			return true;
+		}
+
+		record.suppressed_count = takeSuppressedCount(*site);
+		record.site = site;
+		return false;
 	}
 
+
+	void startLogThread(IAllocator& allocator)
+	{
+		ASSERT(!g_log_task);
+		LogTask* task = MALMY_NEW(allocator, LogTask)(allocator);
+		if (!task->create("Log"))
+		{
+			MALMY_DELETE(allocator, task);
+			g_log_error.log("Engine") << "Could not create log thread, messages are dispatched synchronously";
+			return;
+		}
+		MT::memoryBarrier();
+		g_log_task = task;
+	}
+
+
+	void flushLog()
+	{
+		LogTask* task = g_log_task;
+		// the log thread would wait for itself
+		if (!task || g_is_log_thread) return;
+
+		const i32 pushed = task->m_pushed_count;
+		while (task->m_dispatched_count - pushed < 0) MT::yield();
+	}
+
+
+	void stopLogThread()
+	{
+		LogTask* task = g_log_task;
+		if (!task) return;
+
+		flushLog();
+		// from now on messages are dispatched synchronously
+		g_log_task = nullptr;
+		task->m_queue.abort();
+		task->destroy();
+		MALMY_DELETE(task->m_allocator, task);
+	}
+
+
+	MALMY_NO_INLINE LogProxy Log::log(const char* system)
+	{
+		return LogProxy(*this, system, m_allocator, MALMY_RETURN_ADDRESS());
+	}
+
+
+	void Log::dispatch(const char* system, const char* message)
+	{
+		// a callback logging on this thread already holds a mutex, locking again could deadlock
+		if (g_dispatch_depth > 0)
+		{
+			m_callbacks.invoke(system, message);
+			return;
+		}
+
+		++g_dispatch_depth;
+		{
+			MT::SpinLock lock(m_mutex);
+			m_callbacks.invoke(system, message);
+		}
+		--g_dispatch_depth;
+	}
+
+
 	LogProxy::LogProxy(Log& log, const char* system, IAllocator& allocator)
-		: m_allocator(allocator)
-		, m_log(log)
-		, m_system(system, m_allocator)
-		, m_message(m_allocator)
+		: m_log(log)
+		, m_call_site(nullptr)
+	{
+		m_record.log = &log;
+		m_record.allocator = &allocator;
+		m_record.heap = nullptr;
+		m_record.size = 0;
+		m_record.capacity = LogRecord::INLINE_SIZE;
+		m_record.suppressed_count = 0;
+		m_record.site = nullptr;
+		copyString(m_record.system, system);
+	}
+
+
+	LogProxy::LogProxy(Log& log, const char* system, IAllocator& allocator, void* call_site)
+		: LogProxy(log, system, allocator)
 	{
-		//
+		m_call_site = call_site;
 	}
 
+
 	LogProxy::~LogProxy()
 	{
-		m_log.getCallback().invoke(m_system.c_str(), m_message.c_str());
+		LogTask* task = g_log_task;
+		// without the log thread everything is dispatched as it's logged, suppressed messages can not be reported
+		if (task && m_call_site && rateLimit(m_record, m_call_site))
+		{
+			if (m_record.heap) m_record.allocator->deallocate(m_record.heap);
+			return;
+		}
+
+		if (&m_log == &g_log_error)
+		{
+			flushLog();
+			dispatchRecord(m_record);
+			return;
+		}
+
+		LogRecord* queued = task ? task->m_queue.alloc(false) : nullptr;
+		if (!queued)
+		{
+			// the queue is full, the message is not lost but this thread waits for the callbacks
+			dispatchRecord(m_record);
+			return;
+		}
+
+		copyMemory(queued, &m_record, offsetof(LogRecord, data) + (m_record.heap ? 0 : m_record.size));
+		MT::atomicIncrement(&task->m_pushed_count);
+		task->m_queue.push(queued, true);
+	}
+
+
+	u8* LogProxy::reserve(u32 size)
+	{
+		if (m_record.size + size > m_record.capacity)
+		{
+			const u32 capacity = Math::maximum(m_record.capacity * 2, m_record.size + size);
+			u8* heap = (u8*)m_record.allocator->allocate(capacity);
+			copyMemory(heap, m_record.heap ? m_record.heap : m_record.data, m_record.size);
+			if (m_record.heap) m_record.allocator->deallocate(m_record.heap);
+			m_record.heap = heap;
+			m_record.capacity = capacity;
+		}
+		u8* ptr = (m_record.heap ? m_record.heap : m_record.data) + m_record.size;
+		m_record.size += size;
+		return ptr;
+	}
+
+
+	void LogProxy::write(u8 type, const void* value, u32 size)
+	{
+		u8* ptr = reserve(1 + size);
+		*ptr = type;
+		copyMemory(ptr + 1, value, size);
 	}
 
+
+	void LogProxy::writeString(const char* str, u32 length)
+	{
+		u8* ptr = reserve(1 + sizeof(length) + length);
+		*ptr = (u8)LogArg::STRING;
+		copyMemory(ptr + 1, &length, sizeof(length));
+		copyMemory(ptr + 1 + sizeof(length), str, length);
+	}
+
+
 	LogProxy& LogProxy::substring(const char* str, int start, int length)
 	{
-		m_message.cat(str + start, length);
+		writeString(str + start, length);
 		return *this;
 	}
 
 	LogProxy& LogProxy::operator<<(const char* message)
 	{
-		m_message.cat(message);
+		writeString(message, stringLength(message));
 		return *this;
 	}
 
 	LogProxy& LogProxy::operator<<(float message)
 	{
-		m_message.cat(message);
+		write((u8)LogArg::FLOAT, &message, sizeof(message));
 		return *this;
 	}
 
 	LogProxy& LogProxy::operator<<(u32 message)
 	{
-		m_message.cat(message);
+		write((u8)LogArg::U32, &message, sizeof(message));
 		return *this;
 	}
 
 	LogProxy& LogProxy::operator<<(u64 message)
 	{
-		m_message.cat(message);
+		write((u8)LogArg::U64, &message, sizeof(message));
 		return *this;
 	}
 
 	LogProxy& LogProxy::operator<<(i32 message)
 	{
-		m_message.cat(message);
+		write((u8)LogArg::I32, &message, sizeof(message));
 		return *this;
 	}
 
 	LogProxy& LogProxy::operator<<(const string& path)
 	{
-		m_message.cat(path.c_str());
+		writeString(path.c_str(), path.length());
 		return *this;
 	}
 
 	LogProxy& LogProxy::operator<<(const Path& path)
 	{
-		m_message.cat(path.c_str());
+		writeString(path.c_str(), stringLength(path.c_str()));
 		return *this;
 	}
 
@@ -2,12 +2,32 @@
 #include "engine/default_allocator.h"
 #include "engine/delegate_list.h"
 #include "engine/malmy.h"
+#include "engine/mt/sync.h"
 #include "engine/string.h"
 
 namespace Malmy
 {
 	class Log;
 	class Path;
+	struct LogSite;
+
+	// Arguments of one message in binary form, they are converted to text when the message is dispatched.
+	struct LogRecord
+	{
+		enum { INLINE_SIZE = 448 };
+
+		Log* log;
+		// longer messages are moved to heap allocated from allocator
+		IAllocator* allocator;
+		u8* heap;
+		u32 size;
+		u32 capacity;
+		// number of identical messages dropped by rate limiting since the last one
+		u32 suppressed_count;
+		LogSite* site;
+		char system[32];
+		u8 data[INLINE_SIZE];
+	};
 
 	class MALMY_ENGINE_API LogProxy
 	{
@@ -26,10 +46,15 @@ namespace Malmy
 		LogProxy& substring(const char* str, int start, int length);
 
 	private:
-		IAllocator& m_allocator;
-		string m_system;
-		string m_message;
+		LogProxy(Log& log, const char* system, IAllocator& allocator, void* call_site);
+		u8* reserve(u32 size);
+		void write(u8 type, const void* value, u32 size);
+		void writeString(const char* str, u32 length);
+
+	private:
 		Log& m_log;
+		void* m_call_site;
+		LogRecord m_record;
 
 		LogProxy(const LogProxy&);
 		void operator = (const LogProxy&);
@@ -41,10 +66,31 @@ namespace Malmy
 		typedef DelegateList<void(const char*, const char*)> Callback;
 
 	public:
-		Log() : m_callbacks(m_allocator) {}
+		Log() : m_callbacks(m_allocator), m_mutex(false) {}
 
 		LogProxy log(const char* system);
-		Callback& getCallback();
+
+		// callbacks can be called from the log thread, see startLogThread
+		template <typename C, void (C::*Function)(const char*, const char*)> void bind(C* instance)
+		{
+			MT::SpinLock lock(m_mutex);
+			m_callbacks.bind<C, Function>(instance);
+		}
+
+		template <void (*Function)(const char*, const char*)> void bind()
+		{
+			MT::SpinLock lock(m_mutex);
+			m_callbacks.bind<Function>();
+		}
+
+		template <typename C, void (C::*Function)(const char*, const char*)> void unbind(C* instance)
+		{
+			MT::SpinLock lock(m_mutex);
+			m_callbacks.unbind<C, Function>(instance);
+		}
+
+		// passes the message to callbacks on the calling thread
+		void dispatch(const char* system, const char* message);
 
 	private:
 		Log(const Log&);
@@ -53,8 +99,19 @@ namespace Malmy
 	private:
 		DefaultAllocator m_allocator;
 		Callback m_callbacks;
+		MT::SpinMutex m_mutex;
 	};
 
+	// While the log thread runs, messages are queued and converted to text and passed to callbacks on it,
+	// otherwise it happens on the calling thread. Errors are dispatched on the calling thread after the queued
+	// messages, so they are not lost on a crash. Identical messages from the same call site are rate limited,
+	// the count of suppressed ones is reported by the next one that gets through or when the site goes quiet.
+	MALMY_ENGINE_API void startLogThread(IAllocator& allocator);
+	// must not be called while other threads log
+	MALMY_ENGINE_API void stopLogThread();
+	// waits until all messages queued so far are dispatched
+	MALMY_ENGINE_API void flushLog();
+
 	extern Log MALMY_ENGINE_API g_log_info;
 	extern Log MALMY_ENGINE_API g_log_warning;
 	extern Log MALMY_ENGINE_API g_log_error;
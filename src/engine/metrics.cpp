@@ -0,0 +1,344 @@
+#include "engine/metrics.h"
+#include "engine/fs/os_file.h"
+#include "engine/log.h"
+#include "engine/math_utils.h"
+#include "engine/mt/atomic.h"
+#include "engine/mt/sync.h"
+#include "engine/string.h"
+#include <cmath>
+#include <cstdlib>
+
+
+namespace Malmy
+{
+
+	namespace Metrics
+	{
+
+		// sum of histogram samples is kept in fixed point, so it can be updated atomically
+		static const float SUM_SCALE = 1000;
+		static const int OVERFLOW_BUCKET = HISTOGRAM_BUCKETS - 1;
+		// buckets between the first one and the overflow one
+		static const float BUCKETS_PER_OCTAVE = float(HISTOGRAM_BUCKETS - 2) / HISTOGRAM_OCTAVES;
+
+
+		struct Metric
+		{
+			char name[32];
+			Type type;
+			int histogram;
+			float max_value;
+			// log2 of the upper bound of the first bucket
+			float log_min_value;
+			// counters since the last frame, gauges the current value
+			volatile i64 value;
+			float history[HISTORY_SIZE];
+		};
+
+
+		struct Histogram
+		{
+			volatile i32 buckets[HISTOGRAM_BUCKETS];
+			volatile i64 sum;
+			// the largest sample in the overflow bucket, fixed point like sum
+			volatile i64 overflow_max;
+			// per-frame bucket counts, saturated
+			u16 history[HISTORY_SIZE][HISTOGRAM_BUCKETS];
+			float overflow_max_history[HISTORY_SIZE];
+			// sum of the history, percentiles are computed from it
+			u32 window[HISTOGRAM_BUCKETS];
+		};
+
+
+		static Metric g_metrics[MAX_METRICS] = {};
+		static Histogram g_histograms[MAX_HISTOGRAMS] = {};
+		static volatile i32 g_metrics_count = 0;
+		static int g_histograms_count = 0;
+		static u32 g_frame = 0;
+		static FS::OsFile g_csv;
+		static bool g_is_csv_open = false;
+
+
+		// metrics can be registered during static initialization, so the mutex can not be a global
+		static MT::SpinMutex& getMutex()
+		{
+			static MT::SpinMutex mutex(false);
+			return mutex;
+		}
+
+
+		static int registerMetric(const char* name, Type type, float max_value)
+		{
+			MT::SpinLock lock(getMutex());
+			for (int i = 0; i < g_metrics_count; ++i)
+			{
+				if (!equalStrings(g_metrics[i].name, name)) continue;
+				ASSERT(g_metrics[i].type == type);
+				return i;
+			}
+			if (g_metrics_count == MAX_METRICS) return -1;
+			if (type == Type::HISTOGRAM && g_histograms_count == MAX_HISTOGRAMS) return -1;
+
+			Metric& metric = g_metrics[g_metrics_count];
+			copyString(metric.name, name);
+			metric.type = type;
+			metric.histogram = type == Type::HISTOGRAM ? g_histograms_count++ : -1;
+			metric.max_value = max_value;
+			metric.log_min_value = type == Type::HISTOGRAM ? log2f(max_value) - HISTOGRAM_OCTAVES : 0;
+			MT::memoryBarrier();
+			return g_metrics_count++;
+		}
+
+
+		int registerCounter(const char* name)
+		{
+			return registerMetric(name, Type::COUNTER, 0);
+		}
+
+
+		int registerGauge(const char* name)
+		{
+			return registerMetric(name, Type::GAUGE, 0);
+		}
+
+
+		int registerHistogram(const char* name, float max_value)
+		{
+			ASSERT(max_value > 0);
+			return registerMetric(name, Type::HISTOGRAM, max_value);
+		}
+
+
+		void add(int counter, i64 value)
+		{
+			if (counter < 0) return;
+			ASSERT(g_metrics[counter].type == Type::COUNTER);
+			MT::atomicAdd64(&g_metrics[counter].value, value);
+		}
+
+
+		void set(int gauge, i64 value)
+		{
+			if (gauge < 0) return;
+			ASSERT(g_metrics[gauge].type == Type::GAUGE);
+			g_metrics[gauge].value = value;
+		}
+
+
+		void sample(int histogram, float value)
+		{
+			if (histogram < 0) return;
+			const Metric& metric = g_metrics[histogram];
+			ASSERT(metric.type == Type::HISTOGRAM);
+			Histogram& h = g_histograms[metric.histogram];
+			const i64 fixed_value = i64(value * SUM_SCALE);
+			int bucket;
+			if (value >= metric.max_value)
+			{
+				bucket = OVERFLOW_BUCKET;
+				for (i64 max = h.overflow_max; fixed_value > max; max = h.overflow_max)
+				{
+					if (MT::compareAndExchange64(&h.overflow_max, fixed_value, max)) break;
+				}
+			}
+			else if (value > 0)
+			{
+				const int log_bucket = 1 + int((log2f(value) - metric.log_min_value) * BUCKETS_PER_OCTAVE);
+				bucket = Math::clamp(log_bucket, 0, OVERFLOW_BUCKET - 1);
+			}
+			else
+			{
+				bucket = 0;
+			}
+			MT::atomicIncrement(&h.buckets[bucket]);
+			MT::atomicAdd64(&h.sum, fixed_value);
+		}
+
+
+		static float getBucketMin(const Metric& metric, int bucket)
+		{
+			if (bucket == 0) return 0;
+			if (bucket == OVERFLOW_BUCKET) return metric.max_value;
+			return exp2f(metric.log_min_value + (bucket - 1) / BUCKETS_PER_OCTAVE);
+		}
+
+
+		static void writeCSV(int history_idx, int count)
+		{
+			char buffer[4096];
+			int size = 0;
+			for (int i = 0; i < count; ++i)
+			{
+				const Metric& metric = g_metrics[i];
+				const StaticString<128> row("", g_frame - 1, ",\"", metric.name, "\",", metric.history[history_idx], "\n");
+				const int len = stringLength(row);
+				if (size + len > sizeof(buffer))
+				{
+					g_csv.write(buffer, size);
+					size = 0;
+				}
+				copyMemory(buffer + size, row.data, len);
+				size += len;
+			}
+			g_csv.write(buffer, size);
+		}
+
+
+		void frame()
+		{
+			const int idx = g_frame % HISTORY_SIZE;
+			const int count = g_metrics_count;
+			for (int i = 0; i < count; ++i)
+			{
+				Metric& metric = g_metrics[i];
+				switch (metric.type)
+				{
+					case Type::COUNTER:
+					{
+						// anything added after the read is counted in the next frame
+						const i64 value = metric.value;
+						MT::atomicAdd64(&metric.value, -value);
+						metric.history[idx] = (float)value;
+						break;
+					}
+					case Type::GAUGE: metric.history[idx] = (float)metric.value; break;
+					case Type::HISTOGRAM:
+					{
+						Histogram& h = g_histograms[metric.histogram];
+						u32 samples = 0;
+						for (int b = 0; b < HISTOGRAM_BUCKETS; ++b)
+						{
+							const i32 n = h.buckets[b];
+							MT::atomicSubtract(&h.buckets[b], n);
+							samples += n;
+							h.window[b] -= h.history[idx][b];
+							h.history[idx][b] = (u16)Math::minimum(n, 0xffff);
+							h.window[b] += h.history[idx][b];
+						}
+						const i64 sum = h.sum;
+						MT::atomicAdd64(&h.sum, -sum);
+						// a larger sample added after the read stays for the next frame
+						const i64 overflow_max = h.overflow_max;
+						MT::compareAndExchange64(&h.overflow_max, 0, overflow_max);
+						h.overflow_max_history[idx] = overflow_max / SUM_SCALE;
+						metric.history[idx] = samples > 0 ? sum / SUM_SCALE / samples : 0;
+						break;
+					}
+				}
+			}
+			++g_frame;
+			if (g_is_csv_open) writeCSV(idx, count);
+		}
+
+
+		int getCount()
+		{
+			return g_metrics_count;
+		}
+
+
+		const char* getName(int metric)
+		{
+			return g_metrics[metric].name;
+		}
+
+
+		Type getType(int metric)
+		{
+			return g_metrics[metric].type;
+		}
+
+
+		int getHistoryCount()
+		{
+			return (int)Math::minimum(g_frame, (u32)HISTORY_SIZE);
+		}
+
+
+		float getValue(int metric, int frames_ago)
+		{
+			ASSERT(frames_ago < getHistoryCount());
+			return g_metrics[metric].history[(g_frame - 1 - frames_ago) % HISTORY_SIZE];
+		}
+
+
+		static float getHistogramPercentile(const Metric& metric, float p)
+		{
+			const Histogram& h = g_histograms[metric.histogram];
+			u32 total = 0;
+			for (u32 n : h.window) total += n;
+			if (total == 0) return 0;
+
+			// samples are assumed to be uniformly distributed inside a bucket
+			const float target = p * total;
+			u32 cumulative = 0;
+			for (int b = 0; b < OVERFLOW_BUCKET; ++b)
+			{
+				if (h.window[b] == 0) continue;
+				if (cumulative + h.window[b] >= target)
+				{
+					const float min = getBucketMin(metric, b);
+					const float max = getBucketMin(metric, b + 1);
+					return min + (max - min) * (target - cumulative) / h.window[b];
+				}
+				cumulative += h.window[b];
+			}
+
+			// the overflow bucket is unbounded, the largest sample is reported instead of interpolating
+			float max = metric.max_value;
+			for (int i = 0, c = getHistoryCount(); i < c; ++i)
+			{
+				max = Math::maximum(max, h.overflow_max_history[(g_frame - 1 - i) % HISTORY_SIZE]);
+			}
+			return max;
+		}
+
+
+		Percentiles getPercentiles(int metric)
+		{
+			const Metric& m = g_metrics[metric];
+			if (m.type == Type::HISTOGRAM)
+			{
+				return {getHistogramPercentile(m, 0.5f), getHistogramPercentile(m, 0.95f), getHistogramPercentile(m, 0.99f)};
+			}
+
+			const int count = getHistoryCount();
+			if (count == 0) return {0, 0, 0};
+
+			float values[HISTORY_SIZE];
+			copyMemory(values, m.history, sizeof(values[0]) * count);
+			qsort(values, count, sizeof(values[0]), [](const void* a, const void* b) {
+				const float lhs = *(const float*)a;
+				const float rhs = *(const float*)b;
+				return lhs < rhs ? -1 : (lhs > rhs ? 1 : 0);
+			});
+			auto percentile = [&](float p) { return values[Math::minimum(int(p * count), count - 1)]; };
+			return {percentile(0.5f), percentile(0.95f), percentile(0.99f)};
+		}
+
+
+		bool startCSV(const char* path)
+		{
+			stopCSV();
+			if (!g_csv.open(path, FS::Mode::CREATE_AND_WRITE))
+			{
+				g_log_error.log("Engine") << "Could not create metrics file " << path;
+				return false;
+			}
+			g_csv.writeText("frame,metric,value\n");
+			g_is_csv_open = true;
+			return true;
+		}
+
+
+		void stopCSV()
+		{
+			if (!g_is_csv_open) return;
+			g_csv.close();
+			g_is_csv_open = false;
+		}
+
+
+	} // namespace Metrics
+
+} // namespace Malmy
@@ -0,0 +1,80 @@
+#pragma once
+#include "engine/malmy.h"
+
+namespace Malmy
+{
+
+	namespace Metrics
+	{
+
+		enum class Type : u8
+		{
+			// sum of values added during a frame
+			COUNTER,
+			// last value set before the end of a frame
+			GAUGE,
+			// distribution of samples, per-frame value is their mean
+			HISTOGRAM
+		};
+
+		struct Percentiles
+		{
+			float p50;
+			float p95;
+			float p99;
+		};
+
+		static const int MAX_METRICS = 128;
+		static const int MAX_HISTOGRAMS = 16;
+		static const int HISTORY_SIZE = 256;
+		static const int HISTOGRAM_BUCKETS = 64;
+		// log-scale buckets of histograms cover this many octaves below max_value
+		static const int HISTOGRAM_OCTAVES = 16;
+
+		// Registration is global and returns the existing metric if the name is already registered,
+		// -1 if there is no free slot. Updates are lock-free and can be done from any thread.
+		MALMY_ENGINE_API int registerCounter(const char* name);
+		MALMY_ENGINE_API int registerGauge(const char* name);
+		// the first bucket is [0, max_value / 2^HISTOGRAM_OCTAVES), then log-scale buckets up to max_value,
+		// larger samples go to the last, overflow bucket, which also keeps their maximum
+		MALMY_ENGINE_API int registerHistogram(const char* name, float max_value);
+		MALMY_ENGINE_API void add(int counter, i64 value);
+		MALMY_ENGINE_API void set(int gauge, i64 value);
+		MALMY_ENGINE_API void sample(int histogram, float value);
+
+		// aggregates values of the finished frame into the history, call once per frame from the main thread
+		MALMY_ENGINE_API void frame();
+		MALMY_ENGINE_API int getCount();
+		MALMY_ENGINE_API const char* getName(int metric);
+		MALMY_ENGINE_API Type getType(int metric);
+		// number of frames in the history, at most HISTORY_SIZE
+		MALMY_ENGINE_API int getHistoryCount();
+		// 0 is the last finished frame
+		MALMY_ENGINE_API float getValue(int metric, int frames_ago);
+		// over the history, histograms use all samples, other metrics use per-frame values
+		MALMY_ENGINE_API Percentiles getPercentiles(int metric);
+
+		// every following frame appends "frame,metric,value" rows to the file
+		MALMY_ENGINE_API bool startCSV(const char* path);
+		MALMY_ENGINE_API void stopCSV();
+
+	} // namespace Metrics
+
+} // namespace Malmy
+
+
+#define METRICS_ADD(name, value) \
+	{ \
+		static const int metric_id = Malmy::Metrics::registerCounter(name); \
+		Malmy::Metrics::add(metric_id, value); \
+	}
+#define METRICS_SET(name, value) \
+	{ \
+		static const int metric_id = Malmy::Metrics::registerGauge(name); \
+		Malmy::Metrics::set(metric_id, value); \
+	}
+#define METRICS_SAMPLE(name, max_value, value) \
+	{ \
+		static const int metric_id = Malmy::Metrics::registerHistogram(name, max_value); \
+		Malmy::Metrics::sample(metric_id, value); \
+	}
@@ -22,6 +22,11 @@ i32 atomicAdd(i32 volatile* addend, i32 value)
 	return _InterlockedExchangeAdd((volatile long*)addend, value);
 }
 
+i64 atomicAdd64(i64 volatile* addend, i64 value)
+{
+	return _InterlockedExchangeAdd64(addend, value);
+}
+
 i32 atomicSubtract(i32 volatile* addend, i32 value)
 {
 	return _InterlockedExchangeAdd((volatile long*)addend, -value);
@@ -53,5 +58,12 @@ MALMY_ENGINE_API void memoryBarrier()
 }
 
 
+MALMY_ENGINE_API void storeBarrier()
+{
+	// x86 and x64 do not reorder stores with other stores, only the compiler has to be stopped
+	_WriteBarrier();
+}
+
+
 } // namespace MT
 } // namespace Malmy
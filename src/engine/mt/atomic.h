@@ -11,11 +11,14 @@ namespace MT
 MALMY_ENGINE_API i32 atomicIncrement(i32 volatile* value);
 MALMY_ENGINE_API i32 atomicDecrement(i32 volatile* value);
 MALMY_ENGINE_API i32 atomicAdd(i32 volatile* addend, i32 value);
+MALMY_ENGINE_API i64 atomicAdd64(i64 volatile* addend, i64 value);
 MALMY_ENGINE_API i32 atomicSubtract(i32 volatile* addend,
 										i32 value);
 MALMY_ENGINE_API bool compareAndExchange(i32 volatile* dest, i32 exchange, i32 comperand);
 MALMY_ENGINE_API bool compareAndExchange64(i64 volatile* dest, i64 exchange, i64 comperand);
 MALMY_ENGINE_API void memoryBarrier();
+// stores before the barrier are visible to other threads before stores after it, loads are not ordered
+MALMY_ENGINE_API void storeBarrier();
 
 
 } // namespace MT
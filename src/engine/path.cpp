@@ -2,6 +2,8 @@
 #include "engine/path.h"
 #include "engine/blob.h"
 #include "engine/crc32.h"
+#include "engine/log.h"
+#include "engine/mt/atomic.h"
 #include "engine/mt/sync.h"
 #include "engine/path_utils.h"
 #include "engine/string.h"
@@ -9,189 +11,217 @@
 namespace Malmy
 {
 
+	// load factor is kept at most 0.5, so lookups rarely probe more than one slot
+	static const u32 INITIAL_INDEX_SIZE = 4096;
+	static const u32 CHUNK_SIZE = 64 * 1024;
+
 	static PathManager* g_path_manager = nullptr;
 
 	PathManager::PathManager(IAllocator& allocator)
-		: m_paths(allocator)
+		: m_allocator(allocator)
+		, m_entries_count(0)
+		, m_old_indices(allocator)
+		, m_chunks(allocator)
+		, m_chunk_used(CHUNK_SIZE)
 		, m_mutex(false)
-		, m_allocator(allocator)
 	{
+		setMemory(m_entry_chunks, 0, sizeof(m_entry_chunks));
+		m_index = createIndex(INITIAL_INDEX_SIZE);
 		g_path_manager = this;
-		m_empty_path = MALMY_NEW(m_allocator, Path)();
+		// empty path is always the first entry, crc32("") is 0
+		intern(0, "");
 	}
 
 	PathManager::~PathManager()
 	{
-		MALMY_DELETE(m_allocator, m_empty_path);
-		ASSERT(m_paths.size() == 0);
+		for (char* chunk : m_chunks) m_allocator.deallocate(chunk);
+		for (Index* index : m_old_indices) m_allocator.deallocate(index);
+		m_allocator.deallocate(m_index);
+		for (Entry* entries : m_entry_chunks)
+		{
+			if (!entries) break;
+			m_allocator.deallocate(entries);
+		}
 		g_path_manager = nullptr;
 	}
 
 	const Path& PathManager::getEmptyPath()
 	{
-		return *g_path_manager->m_empty_path;
+		return g_path_manager->m_empty_path;
 	}
 
 	void PathManager::serialize(OutputBlob& serializer)
 	{
 		MT::SpinLock lock(m_mutex);
-		clear();
-		serializer.write((i32)m_paths.size());
-		for (int i = 0; i < m_paths.size(); ++i)
+		serializer.write((i32)m_entries_count);
+		for (u32 i = 0; i < m_entries_count; ++i)
 		{
-			serializer.writeString(m_paths.at(i)->m_path);
+			serializer.writeString(getEntry(i).path);
 		}
 	}
 
-	void PathManager::deserialize(InputBlob& serializer)
+	void PathManager::deserialize(InputBlob& serializer, Array<Path>* paths)
 	{
-		MT::SpinLock lock(m_mutex);
 		i32 size;
 		serializer.read(size);
+		if (paths) paths->reserve(paths->size() + size);
 		for (int i = 0; i < size; ++i)
 		{
 			char path[MAX_PATH_LENGTH];
 			serializer.readString(path, sizeof(path));
 			u32 hash = crc32(path);
-			PathInternal* internal = getPathMultithreadUnsafe(hash, path);
-			--internal->m_ref_count;
+			intern(hash, path);
+			if (paths) paths->emplace(hash);
 		}
 	}
 
-	Path::Path()
+	PathManager::Index* PathManager::createIndex(u32 size)
 	{
-		m_data = g_path_manager->getPath(0, "");
+		ASSERT((size & (size - 1)) == 0);
+		Index* index = (Index*)m_allocator.allocate(sizeof(Index) + sizeof(u32) * size);
+		index->mask = size - 1;
+		index->slots = (volatile u32*)(index + 1);
+		setMemory((void*)index->slots, 0, sizeof(u32) * size);
+		return index;
 	}
 
-	Path::Path(u32 hash)
+	void PathManager::insertIntoIndex(Index& index, u32 handle)
 	{
-		m_data = g_path_manager->getPath(hash);
-		ASSERT(m_data);
+		u32 pos = getEntry(handle).hash & index.mask;
+		while (index.slots[pos] != 0) pos = (pos + 1) & index.mask;
+		index.slots[pos] = handle + 1;
 	}
 
-	PathInternal* PathManager::getPath(u32 hash)
+	u32 PathManager::find(u32 hash) const
 	{
-		MT::SpinLock lock(m_mutex);
-		int index = m_paths.find(hash);
-		if (index < 0)
+		const Index* index = m_index;
+		const u32 mask = index->mask;
+		const volatile u32* slots = index->slots;
+		u32 pos = hash & mask;
+		for (;;)
 		{
-			return nullptr;
+			const u32 slot = slots[pos];
+			if (slot == 0) return INVALID_HANDLE;
+			if (getEntry(slot - 1).hash == hash) return slot - 1;
+			pos = (pos + 1) & mask;
 		}
-		++m_paths.at(index)->m_ref_count;
-		return m_paths.at(index);
 	}
 
-	PathInternal* PathManager::getPath(u32 hash, const char* path)
+	const char* PathManager::allocateString(const char* path, u32 length)
 	{
-		MT::SpinLock lock(m_mutex);
-		return getPathMultithreadUnsafe(hash, path);
-	}
-
-	void PathManager::clear()
-	{
-		for (int i = m_paths.size() - 1; i >= 0; --i)
+		if (m_chunk_used + length + 1 > CHUNK_SIZE)
 		{
-			if (m_paths.at(i)->m_ref_count == 0)
-			{
-				MALMY_DELETE(m_allocator, m_paths.at(i));
-				m_paths.eraseAt(i);
-			}
+			m_chunks.push((char*)m_allocator.allocate(CHUNK_SIZE));
+			m_chunk_used = 0;
 		}
+		char* str = m_chunks.back() + m_chunk_used;
+		copyMemory(str, path, length + 1);
+		m_chunk_used += length + 1;
+		return str;
 	}
 
-	PathInternal* PathManager::getPathMultithreadUnsafe(u32 hash, const char* path)
+	u32 PathManager::intern(u32 hash, const char* path)
 	{
-		int index = m_paths.find(hash);
-		if (index < 0)
+		u32 handle = find(hash);
+		if (handle != INVALID_HANDLE) return handle;
+
+		MT::SpinLock lock(m_mutex);
+		handle = find(hash);
+		if (handle != INVALID_HANDLE) return handle;
+
+		handle = m_entries_count;
+		const u32 chunk_idx = handle / ENTRIES_PER_CHUNK;
+		if (chunk_idx == MAX_ENTRY_CHUNKS)
 		{
-			PathInternal* internal = MALMY_NEW(m_allocator, PathInternal);
-			internal->m_ref_count = 1;
-			internal->m_id = hash;
-			copyString(internal->m_path, path);
-			m_paths.insert(hash, internal);
-			return internal;
+			g_log_error.log("Engine") << "Too many paths (" << handle << "), " << path
+				<< " is replaced by an empty path";
+			ASSERT(false);
+			return 0;
+		}
+		if (!m_entry_chunks[chunk_idx])
+		{
+			m_entry_chunks[chunk_idx] = (Entry*)m_allocator.allocate(sizeof(Entry) * ENTRIES_PER_CHUNK);
 		}
-		++m_paths.at(index)->m_ref_count;
-		return m_paths.at(index);
-	}
 
-	void PathManager::incrementRefCount(PathInternal* path)
-	{
-		MT::SpinLock lock(m_mutex);
-		++path->m_ref_count;
-	}
+		const u32 length = stringLength(path);
+		ASSERT(length < MAX_PATH_LENGTH);
+		Entry& entry = m_entry_chunks[chunk_idx][handle % ENTRIES_PER_CHUNK];
+		entry.path = allocateString(path, length);
+		entry.hash = hash;
+		entry.length = length;
 
-	void PathManager::decrementRefCount(PathInternal* path)
-	{
-		MT::SpinLock lock(m_mutex);
-		--path->m_ref_count;
-		if (path->m_ref_count == 0)
+		Index* index = m_index;
+		if ((handle + 1) * 2 > index->mask + 1)
 		{
-			m_paths.erase(path->m_id);
-			MALMY_DELETE(m_allocator, path);
+			// readers keep using the old index until the new one is complete, they can only miss the new entry
+			Index* new_index = createIndex((index->mask + 1) * 2);
+			for (u32 i = 0; i <= handle; ++i) insertIntoIndex(*new_index, i);
+			MT::memoryBarrier();
+			m_index = new_index;
+			m_old_indices.push(index);
 		}
+		else
+		{
+			// readers must not see the slot before the entry
+			MT::memoryBarrier();
+			insertIntoIndex(*index, handle);
+		}
+		m_entries_count = handle + 1;
+		return handle;
 	}
 
-	Path::Path(const Path& rhs)
-		: m_data(rhs.m_data)
+	u32 PathManager::internNormalized(const char* path)
 	{
-		g_path_manager->incrementRefCount(m_data);
+		char tmp[MAX_PATH_LENGTH];
+		PathUtils::normalize(path, tmp, lengthOf(tmp));
+		return intern(crc32(tmp), tmp);
+	}
+
+	Path::Path(u32 hash)
+	{
+		m_handle = g_path_manager->find(hash);
+		ASSERT(m_handle != PathManager::INVALID_HANDLE);
+		if (m_handle == PathManager::INVALID_HANDLE) m_handle = 0;
 	}
 
 	Path::Path(const char* s1, const char* s2)
 	{
 		StaticString<MAX_PATH_LENGTH> tmp(s1, s2);
-		char out[MAX_PATH_LENGTH];
-		PathUtils::normalize(tmp, out, lengthOf(out));
-		u32 hash = crc32(out);
-		m_data = g_path_manager->getPath(hash, out);
+		m_handle = g_path_manager->internNormalized(tmp);
 	}
 
 	Path::Path(const char* s1, const char* s2, const char* s3)
 	{
 		StaticString<MAX_PATH_LENGTH> tmp(s1, s2, s3);
-		char out[MAX_PATH_LENGTH];
-		PathUtils::normalize(tmp, out, lengthOf(out));
-		u32 hash = crc32(out);
-		m_data = g_path_manager->getPath(hash, out);
+		m_handle = g_path_manager->internNormalized(tmp);
 	}
 
 	Path::Path(const char* path)
 	{
-		char tmp[MAX_PATH_LENGTH];
-		size_t len = stringLength(path);
-		ASSERT(len < MAX_PATH_LENGTH);
-		PathUtils::normalize(path, tmp, (u32)len + 1);
-		u32 hash = crc32(tmp);
-		m_data = g_path_manager->getPath(hash, tmp);
+		ASSERT(stringLength(path) < MAX_PATH_LENGTH);
+		m_handle = g_path_manager->internNormalized(path);
 	}
 
-	Path::~Path()
+	void Path::operator =(const char* rhs)
 	{
-		g_path_manager->decrementRefCount(m_data);
+		ASSERT(stringLength(rhs) < MAX_PATH_LENGTH);
+		m_handle = g_path_manager->internNormalized(rhs);
 	}
 
-	int Path::length() const
+	// empty path does not need the manager, so it can be used in globals
+	u32 Path::getHash() const
 	{
-		return stringLength(m_data->m_path);
+		return m_handle == 0 ? 0 : g_path_manager->getEntry(m_handle).hash;
 	}
 
-	void Path::operator =(const Path& rhs)
+	const char* Path::c_str() const
 	{
-		g_path_manager->decrementRefCount(m_data);
-		m_data = rhs.m_data;
-		g_path_manager->incrementRefCount(m_data);
+		return m_handle == 0 ? "" : g_path_manager->getEntry(m_handle).path;
 	}
 
-	void Path::operator =(const char* rhs)
+	int Path::length() const
 	{
-		g_path_manager->decrementRefCount(m_data);
-		char tmp[MAX_PATH_LENGTH];
-		size_t len = stringLength(rhs);
-		ASSERT(len < MAX_PATH_LENGTH);
-		PathUtils::normalize(rhs, tmp, (u32)len + 1);
-		u32 hash = crc32(tmp);
-		m_data = g_path_manager->getPath(hash, tmp);
+		return m_handle == 0 ? 0 : (int)g_path_manager->getEntry(m_handle).length;
 	}
 
 } // namespace Malmy
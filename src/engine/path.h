@@ -1,5 +1,6 @@
 #pragma once
 
+#include "engine/array.h"
 #include "engine/associative_array.h"
 #include "engine/mt/sync.h"
 
@@ -11,72 +12,90 @@ namespace Malmy
 	class InputBlob;
 	class OutputBlob;
 
-	class PathInternal
-	{
-	public:
-		char m_path[MAX_PATH_LENGTH];
-		u32 m_id;
-		volatile i32 m_ref_count;
-	};
-
+	// Handle to an interned path, paths with the same hash share the handle. 0 is the empty path.
+	// Interned strings live as long as PathManager, so copying and destroying a Path is free.
 	class MALMY_ENGINE_API Path
 	{
 	public:
-		Path();
-		Path(const Path& rhs);
+		Path() : m_handle(0) {}
 		Path(const char* s1, const char* s2);
 		Path(const char* s1, const char* s2, const char* s3);
 		explicit Path(u32 hash);
 		explicit Path(const char* path);
-		void operator=(const Path& rhs);
 		void operator=(const char* rhs);
-		bool operator==(const Path& rhs) const
-		{
-			return m_data->m_id == rhs.m_data->m_id;
-		}
-		bool operator!=(const Path& rhs) const
-		{
-			return m_data->m_id != rhs.m_data->m_id;
-		}
-
-		~Path();
+		bool operator==(const Path& rhs) const { return m_handle == rhs.m_handle; }
+		bool operator!=(const Path& rhs) const { return m_handle != rhs.m_handle; }
 
-		u32 getHash() const { return m_data->m_id; }
-		const char* c_str() const { return m_data->m_path; }
+		u32 getHash() const;
+		const char* c_str() const;
 
 		int length() const;
-		bool isValid() const { return m_data->m_path[0] != '\0'; }
+		bool isValid() const { return m_handle != 0; }
 
 	private:
-		PathInternal* m_data;
+		u32 m_handle;
 	};
 
+	// Intern table. Strings are appended to an arena, entries live in chunks which never move and are indexed
+	// by an open addressing hash table. Lookups do not lock, only adding a new path takes the mutex.
 	class MALMY_ENGINE_API PathManager
 	{
 		friend class Path;
 
+	public:
+		static const u32 ENTRIES_PER_CHUNK = 4096;
+		static const u32 MAX_ENTRY_CHUNKS = 4096;
+		static const u32 INVALID_HANDLE = 0xffffFFFF;
+
 	public:
 		explicit PathManager(IAllocator& allocator);
 		~PathManager();
 
 		void serialize(OutputBlob& serializer);
-		void deserialize(InputBlob& serializer);
+		// paths, if not null, receives the deserialized paths
+		void deserialize(InputBlob& serializer, Array<Path>* paths = nullptr);
 
-		void clear();
+		// paths are never removed, kept for compatibility
+		void clear() {}
 		static const Path& getEmptyPath();
 
 	private:
-		PathInternal* getPath(u32 hash, const char* path);
-		PathInternal* getPath(u32 hash);
-		PathInternal* getPathMultithreadUnsafe(u32 hash, const char* path);
-		void incrementRefCount(PathInternal* path);
-		void decrementRefCount(PathInternal* path);
+		struct Entry
+		{
+			const char* path;
+			u32 hash;
+			u32 length;
+		};
+
+		struct Index
+		{
+			u32 mask;
+			// handle + 1 of the entry, 0 means the slot is empty, published after the entry is written
+			volatile u32* slots;
+		};
+
+		const Entry& getEntry(u32 handle) const
+		{
+			return m_entry_chunks[handle / ENTRIES_PER_CHUNK][handle % ENTRIES_PER_CHUNK];
+		}
+		u32 find(u32 hash) const;
+		u32 intern(u32 hash, const char* path);
+		u32 internNormalized(const char* path);
+		const char* allocateString(const char* path, u32 length);
+		Index* createIndex(u32 size);
+		void insertIntoIndex(Index& index, u32 handle);
 
 	private:
 		IAllocator& m_allocator;
-		AssociativeArray<u32, PathInternal*> m_paths;
+		Entry* m_entry_chunks[MAX_ENTRY_CHUNKS];
+		u32 m_entries_count;
+		Index* volatile m_index;
+		// replaced indices can still be read by lookups in flight, so they are freed with the manager
+		Array<Index*> m_old_indices;
+		Array<char*> m_chunks;
+		u32 m_chunk_used;
 		MT::SpinMutex m_mutex;
-		Path* m_empty_path;
+		Path m_empty_path;
 	};
 
 } // namespace Malmy
@@ -0,0 +1,463 @@
+#include "engine/pool_allocator.h"
+#include "engine/math_utils.h"
+#include "engine/mt/atomic.h"
+#include "engine/mt/thread.h"
+#include "engine/string.h"
+
+namespace Malmy
+{
+
+	static const u16 SIZE_CLASS_SIZES[PoolAllocator::SIZE_CLASS_COUNT] = {
+		16, 32, 48, 64, 80, 96, 112, 128,
+		160, 192, 224, 256,
+		320, 384, 448, 512,
+		640, 768, 896, 1024,
+		1280, 1536, 1792, 2048,
+		2560, 3072, 3584, 4096
+	};
+	static const size_t SMALL_ALIGN = 16;
+	static const int PAGES_PER_ARENA = 16;
+	// page map covers 47 bit address space, root is indexed by bits 32..46, leaves by bits 16..31 of the address
+	static const int PAGE_MAP_ROOT_SIZE = 1 << 15;
+	static const int PAGE_MAP_LEAF_SIZE = 1 << 16;
+
+
+	static struct SizeClassTable
+	{
+		SizeClassTable()
+		{
+			int size_class = 0;
+			for (int i = 0; i < lengthOf(classes); ++i)
+			{
+				while (SIZE_CLASS_SIZES[size_class] < i * SMALL_ALIGN) ++size_class;
+				classes[i] = (u8)size_class;
+			}
+		}
+
+		int get(size_t size) const { return classes[(size + SMALL_ALIGN - 1) / SMALL_ALIGN]; }
+
+		u8 classes[PoolAllocator::MAX_SMALL_SIZE / SMALL_ALIGN + 1];
+	} s_size_class_table;
+
+
+	// aligned to cache line so threads working with different classes do not share a lock's line
+	struct alignas(64) PoolAllocator::SizeClass
+	{
+		SizeClass() : mutex(false) {}
+
+		MT::SpinMutex mutex;
+		void* free_list;
+		int free_count;
+		u8* page_current;
+		u8* page_end;
+		int page_count;
+		int size;
+		// number of blocks moved between a thread cache and the shared list at once
+		int batch;
+	};
+
+
+	struct alignas(64) PoolAllocator::ThreadCache
+	{
+		struct Bin
+		{
+			void* head;
+			int count;
+			u64 allocation_count;
+			u64 free_count;
+		};
+
+		ThreadCache* next;
+		MT::ThreadID thread_id;
+		// SIZE_CLASS_COUNT bins per partition
+		Bin bins[1];
+	};
+
+
+	struct PoolAllocator::Arena
+	{
+		Arena* next;
+		u8* memory;
+	};
+
+
+	struct ThreadCacheRef
+	{
+		i32 allocator_id;
+		PoolAllocator::ThreadCache* cache;
+	};
+
+
+	static thread_local ThreadCacheRef g_thread_cache = {};
+	static volatile i32 g_last_allocator_id = 0;
+
+
+	PoolAllocator::PoolAllocator(IAllocator& source, int partitions_count)
+		: m_source(source)
+		, m_mutex(false)
+		, m_partitions_count(partitions_count)
+		, m_thread_caches(nullptr)
+		, m_arena(nullptr)
+		, m_arena_end(nullptr)
+		, m_arenas(nullptr)
+		, m_source_allocation_count(0)
+	{
+		ASSERT(partitions_count > 0 && partitions_count <= MAX_PARTITIONS);
+		m_id = MT::atomicIncrement(&g_last_allocator_id);
+
+		int classes_count = SIZE_CLASS_COUNT * m_partitions_count;
+		m_classes = (SizeClass*)m_source.allocate_aligned(sizeof(SizeClass) * classes_count, alignof(SizeClass));
+		for (int i = 0; i < classes_count; ++i)
+		{
+			SizeClass* size_class = new (NewPlaceholder(), &m_classes[i]) SizeClass();
+			size_class->free_list = nullptr;
+			size_class->free_count = 0;
+			size_class->page_current = nullptr;
+			size_class->page_end = nullptr;
+			size_class->page_count = 0;
+			size_class->size = SIZE_CLASS_SIZES[i % SIZE_CLASS_COUNT];
+			size_class->batch = Math::clamp(8192 / size_class->size, 4, 64);
+		}
+
+		m_page_map = (u16**)m_source.allocate(sizeof(u16*) * PAGE_MAP_ROOT_SIZE);
+		setMemory(m_page_map, 0, sizeof(u16*) * PAGE_MAP_ROOT_SIZE);
+	}
+
+
+	PoolAllocator::~PoolAllocator()
+	{
+		while (m_arenas)
+		{
+			Arena* next = m_arenas->next;
+			m_source.deallocate_aligned(m_arenas->memory);
+			m_source.deallocate(m_arenas);
+			m_arenas = next;
+		}
+		while (m_thread_caches)
+		{
+			ThreadCache* next = m_thread_caches->next;
+			m_source.deallocate_aligned(m_thread_caches);
+			m_thread_caches = next;
+		}
+		for (int i = 0; i < PAGE_MAP_ROOT_SIZE; ++i)
+		{
+			if (m_page_map[i]) m_source.deallocate(m_page_map[i]);
+		}
+		m_source.deallocate(m_page_map);
+		for (int i = 0; i < SIZE_CLASS_COUNT * m_partitions_count; ++i)
+		{
+			m_classes[i].~SizeClass();
+		}
+		m_source.deallocate_aligned(m_classes);
+	}
+
+
+	int PoolAllocator::getPageClass(const void* ptr) const
+	{
+		uintptr addr = (uintptr)ptr;
+		u64 root_idx = u64(addr) >> 32;
+		if (root_idx >= PAGE_MAP_ROOT_SIZE) return -1;
+		const u16* leaf = m_page_map[root_idx];
+		if (!leaf) return -1;
+		return int(leaf[(addr >> 16) & (PAGE_MAP_LEAF_SIZE - 1)]) - 1;
+	}
+
+
+	size_t PoolAllocator::getBlockSize(const void* ptr, int* partition) const
+	{
+		int size_class = getPageClass(ptr);
+		if (size_class < 0) return 0;
+		if (partition) *partition = size_class / SIZE_CLASS_COUNT;
+		return SIZE_CLASS_SIZES[size_class % SIZE_CLASS_COUNT];
+	}
+
+
+	PoolAllocator::ThreadCache& PoolAllocator::getThreadCache()
+	{
+		ThreadCacheRef& ref = g_thread_cache;
+		if (ref.allocator_id == m_id) return *ref.cache;
+
+		// thread used another pool allocator since, or it's the first allocation from this thread
+		MT::ThreadID thread_id = MT::getCurrentThreadID();
+		MT::SpinLock lock(m_mutex);
+		ThreadCache* cache = m_thread_caches;
+		while (cache && cache->thread_id != thread_id) cache = cache->next;
+		if (!cache)
+		{
+			size_t cache_size = sizeof(ThreadCache) + sizeof(ThreadCache::Bin) * (SIZE_CLASS_COUNT * m_partitions_count - 1);
+			cache = (ThreadCache*)m_source.allocate_aligned(cache_size, alignof(ThreadCache));
+			setMemory(cache, 0, cache_size);
+			cache->thread_id = thread_id;
+			cache->next = m_thread_caches;
+			m_thread_caches = cache;
+		}
+		ref.allocator_id = m_id;
+		ref.cache = cache;
+		return *cache;
+	}
+
+
+	u8* PoolAllocator::allocatePage(int size_class)
+	{
+		MT::SpinLock lock(m_mutex);
+		if (m_arena == m_arena_end)
+		{
+			u8* memory = (u8*)m_source.allocate_aligned(PAGE_SIZE * PAGES_PER_ARENA, PAGE_SIZE);
+			Arena* arena = (Arena*)m_source.allocate(sizeof(Arena));
+			arena->memory = memory;
+			arena->next = m_arenas;
+			m_arenas = arena;
+			m_arena = memory;
+			m_arena_end = memory + PAGE_SIZE * PAGES_PER_ARENA;
+		}
+
+		u8* page = m_arena;
+		m_arena += PAGE_SIZE;
+
+		uintptr addr = (uintptr)page;
+		u64 root_idx = u64(addr) >> 32;
+		ASSERT(root_idx < PAGE_MAP_ROOT_SIZE);
+		u16* leaf = m_page_map[root_idx];
+		if (!leaf)
+		{
+			leaf = (u16*)m_source.allocate(sizeof(u16) * PAGE_MAP_LEAF_SIZE);
+			setMemory(leaf, 0, sizeof(u16) * PAGE_MAP_LEAF_SIZE);
+			MT::memoryBarrier();
+			m_page_map[root_idx] = leaf;
+		}
+		leaf[(addr >> 16) & (PAGE_MAP_LEAF_SIZE - 1)] = u16(size_class + 1);
+		return page;
+	}
+
+
+	void PoolAllocator::refill(ThreadCache& cache, int size_class)
+	{
+		SizeClass& cls = m_classes[size_class];
+		ThreadCache::Bin& bin = cache.bins[size_class];
+		MT::SpinLock lock(cls.mutex);
+		for (int i = 0; i < cls.batch; ++i)
+		{
+			void* block;
+			if (cls.free_list)
+			{
+				block = cls.free_list;
+				cls.free_list = *(void**)block;
+				--cls.free_count;
+			}
+			else
+			{
+				if (!cls.page_current || cls.page_current + cls.size > cls.page_end)
+				{
+					if (bin.head) return;
+					cls.page_current = allocatePage(size_class);
+					cls.page_end = cls.page_current + PAGE_SIZE;
+					++cls.page_count;
+				}
+				block = cls.page_current;
+				cls.page_current += cls.size;
+			}
+			*(void**)block = bin.head;
+			bin.head = block;
+			++bin.count;
+		}
+	}
+
+
+	void PoolAllocator::flush(ThreadCache& cache, int size_class, int count)
+	{
+		ThreadCache::Bin& bin = cache.bins[size_class];
+		ASSERT(count > 0 && count <= bin.count);
+		void* first = bin.head;
+		void* last = first;
+		for (int i = 1; i < count; ++i) last = *(void**)last;
+		bin.head = *(void**)last;
+		bin.count -= count;
+
+		SizeClass& cls = m_classes[size_class];
+		MT::SpinLock lock(cls.mutex);
+		*(void**)last = cls.free_list;
+		cls.free_list = first;
+		cls.free_count += count;
+	}
+
+
+	void* PoolAllocator::allocateSmall(int size_class)
+	{
+		ThreadCache& cache = getThreadCache();
+		ThreadCache::Bin& bin = cache.bins[size_class];
+		if (!bin.head) refill(cache, size_class);
+
+		void* block = bin.head;
+		bin.head = *(void**)block;
+		--bin.count;
+		++bin.allocation_count;
+		return block;
+	}
+
+
+	void PoolAllocator::deallocateSmall(void* ptr, int size_class)
+	{
+		ThreadCache& cache = getThreadCache();
+		ThreadCache::Bin& bin = cache.bins[size_class];
+		*(void**)ptr = bin.head;
+		bin.head = ptr;
+		++bin.count;
+		++bin.free_count;
+
+		int batch = m_classes[size_class].batch;
+		if (bin.count > batch * 2) flush(cache, size_class, batch);
+	}
+
+
+	void* PoolAllocator::allocate(size_t size, int partition)
+	{
+		ASSERT(partition >= 0 && partition < m_partitions_count);
+		if (size <= MAX_SMALL_SIZE)
+		{
+			return allocateSmall(partition * SIZE_CLASS_COUNT + s_size_class_table.get(size));
+		}
+
+		MT::atomicIncrement(&m_source_allocation_count);
+		return m_source.allocate(size);
+	}
+
+
+	void* PoolAllocator::allocate(size_t size)
+	{
+		return allocate(size, 0);
+	}
+
+
+	bool PoolAllocator::deallocateSmall(void* ptr)
+	{
+		int size_class = getPageClass(ptr);
+		if (size_class < 0) return false;
+
+		deallocateSmall(ptr, size_class);
+		return true;
+	}
+
+
+	void PoolAllocator::deallocate(void* ptr)
+	{
+		if (!ptr) return;
+
+		int size_class = getPageClass(ptr);
+		if (size_class >= 0)
+		{
+			deallocateSmall(ptr, size_class);
+			return;
+		}
+		m_source.deallocate(ptr);
+	}
+
+
+	void* PoolAllocator::reallocate(void* ptr, size_t size)
+	{
+		if (!ptr) return allocate(size);
+
+		int size_class = getPageClass(ptr);
+		if (size_class < 0) return m_source.reallocate(ptr, size);
+
+		if (size == 0)
+		{
+			deallocateSmall(ptr, size_class);
+			return nullptr;
+		}
+		size_t class_size = SIZE_CLASS_SIZES[size_class % SIZE_CLASS_COUNT];
+		if (size <= class_size) return ptr;
+
+		void* new_ptr = allocate(size, size_class / SIZE_CLASS_COUNT);
+		copyMemory(new_ptr, ptr, class_size);
+		deallocateSmall(ptr, size_class);
+		return new_ptr;
+	}
+
+
+	void* PoolAllocator::allocate_aligned(size_t size, size_t align)
+	{
+		if (size <= MAX_SMALL_SIZE && align <= SMALL_ALIGN) return allocateSmall(s_size_class_table.get(size));
+
+		MT::atomicIncrement(&m_source_allocation_count);
+		return m_source.allocate_aligned(size, align);
+	}
+
+
+	void PoolAllocator::deallocate_aligned(void* ptr)
+	{
+		if (!ptr) return;
+
+		int size_class = getPageClass(ptr);
+		if (size_class >= 0)
+		{
+			deallocateSmall(ptr, size_class);
+			return;
+		}
+		m_source.deallocate_aligned(ptr);
+	}
+
+
+	void* PoolAllocator::reallocate_aligned(void* ptr, size_t size, size_t align)
+	{
+		if (!ptr) return allocate_aligned(size, align);
+
+		int size_class = getPageClass(ptr);
+		if (size_class < 0) return m_source.reallocate_aligned(ptr, size, align);
+
+		if (size == 0)
+		{
+			deallocateSmall(ptr, size_class);
+			return nullptr;
+		}
+		size_t class_size = SIZE_CLASS_SIZES[size_class % SIZE_CLASS_COUNT];
+		if (size <= class_size) return ptr;
+
+		void* new_ptr = align <= SMALL_ALIGN ? allocate(size, size_class / SIZE_CLASS_COUNT) : allocate_aligned(size, align);
+		copyMemory(new_ptr, ptr, class_size);
+		deallocateSmall(ptr, size_class);
+		return new_ptr;
+	}
+
+
+	void PoolAllocator::getStats(SizeClassStats (&stats)[SIZE_CLASS_COUNT])
+	{
+		getStats(stats, 0, m_partitions_count);
+	}
+
+
+	void PoolAllocator::getPartitionStats(int partition, SizeClassStats (&stats)[SIZE_CLASS_COUNT])
+	{
+		ASSERT(partition >= 0 && partition < m_partitions_count);
+		getStats(stats, partition, 1);
+	}
+
+
+	void PoolAllocator::getStats(SizeClassStats (&stats)[SIZE_CLASS_COUNT], int first_partition, int partitions_count)
+	{
+		for (int i = 0; i < SIZE_CLASS_COUNT; ++i)
+		{
+			stats[i].size = SIZE_CLASS_SIZES[i];
+			stats[i].allocation_count = 0;
+			stats[i].free_count = 0;
+			stats[i].page_count = 0;
+		}
+
+		int from = first_partition * SIZE_CLASS_COUNT;
+		int to = from + partitions_count * SIZE_CLASS_COUNT;
+		for (int i = from; i < to; ++i)
+		{
+			stats[i % SIZE_CLASS_COUNT].page_count += m_classes[i].page_count;
+		}
+
+		MT::SpinLock lock(m_mutex);
+		for (ThreadCache* cache = m_thread_caches; cache; cache = cache->next)
+		{
+			for (int i = from; i < to; ++i)
+			{
+				stats[i % SIZE_CLASS_COUNT].allocation_count += cache->bins[i].allocation_count;
+				stats[i % SIZE_CLASS_COUNT].free_count += cache->bins[i].free_count;
+			}
+		}
+	}
+
+} // namespace Malmy
@@ -0,0 +1,89 @@
+#pragma once
+#include "engine/iallocator.h"
+#include "engine/malmy.h"
+#include "engine/mt/sync.h"
+
+namespace Malmy
+{
+
+	// Size class allocator for small blocks, bigger blocks and blocks with alignment > 16 are forwarded to the source.
+	// Every thread has a cache of free blocks per size class, so most allocations and frees do not take any lock.
+	// Caches exchange blocks in batches with the shared per class free lists, a block freed by another thread
+	// than the one which allocated it simply goes to the freeing thread's cache.
+	// Small blocks live in pages which are never returned to the source until the allocator is destroyed.
+	// Optionally the size classes are split into partitions, which do not share pages, so the partition of
+	// a block is known from its page, see Debug::TrackingAllocator.
+	class MALMY_ENGINE_API PoolAllocator MALMY_FINAL : public IAllocator
+	{
+	public:
+		static const int SIZE_CLASS_COUNT = 28;
+		static const size_t MAX_SMALL_SIZE = 4096;
+		static const size_t PAGE_SIZE = 64 * 1024;
+		static const int MAX_PARTITIONS = 256;
+
+		struct SizeClassStats
+		{
+			size_t size;
+			// blocks allocated and freed since creation, summed over all threads
+			u64 allocation_count;
+			u64 free_count;
+			int page_count;
+		};
+
+		struct ThreadCache;
+
+	public:
+		explicit PoolAllocator(IAllocator& source, int partitions_count = 1);
+		~PoolAllocator();
+
+		// small blocks are allocated from the partition, other blocks are forwarded to the source
+		void* allocate(size_t size, int partition);
+		void* allocate(size_t size) override;
+		void deallocate(void* ptr) override;
+		void* reallocate(void* ptr, size_t size) override;
+		void* allocate_aligned(size_t size, size_t align) override;
+		void deallocate_aligned(void* ptr) override;
+		void* reallocate_aligned(void* ptr, size_t size, size_t align) override;
+
+		// returns false and does nothing if ptr is not a small block
+		bool deallocateSmall(void* ptr);
+
+		IAllocator& getSourceAllocator() { return m_source; }
+		int getPartitionsCount() const { return m_partitions_count; }
+		// size of the size class for small blocks, 0 for blocks forwarded to the source
+		size_t getBlockSize(const void* ptr, int* partition = nullptr) const;
+		// values are approximate while other threads allocate
+		void getStats(SizeClassStats (&stats)[SIZE_CLASS_COUNT]);
+		void getPartitionStats(int partition, SizeClassStats (&stats)[SIZE_CLASS_COUNT]);
+		// blocks larger than MAX_SMALL_SIZE or with big alignment
+		u64 getSourceAllocationCount() const { return (u64)m_source_allocation_count; }
+
+	private:
+		struct SizeClass;
+		struct Arena;
+
+		// size classes of all partitions are in one array, partition * SIZE_CLASS_COUNT + size class
+		int getPageClass(const void* ptr) const;
+		ThreadCache& getThreadCache();
+		void* allocateSmall(int size_class);
+		void deallocateSmall(void* ptr, int size_class);
+		void refill(ThreadCache& cache, int size_class);
+		void flush(ThreadCache& cache, int size_class, int count);
+		u8* allocatePage(int size_class);
+		void getStats(SizeClassStats (&stats)[SIZE_CLASS_COUNT], int first_partition, int partitions_count);
+
+	private:
+		IAllocator& m_source;
+		MT::SpinMutex m_mutex;
+		SizeClass* m_classes;
+		int m_partitions_count;
+		u16** m_page_map;
+		ThreadCache* m_thread_caches;
+		u8* m_arena;
+		u8* m_arena_end;
+		Arena* m_arenas;
+		i32 m_id;
+		volatile i32 m_source_allocation_count;
+	};
+
+} // namespace Malmy
@@ -1,8 +1,59 @@
 #include "prefab.h"
+#include "engine/array.h"
+#include "engine/fs/file_system.h"
+#include "engine/fs/pack_file_device.h"
+#include "engine/malmy.h"
+#include "engine/path.h"
+#include "engine/string.h"
 
 namespace Malmy
 {
 
 	const ResourceType PrefabResource::TYPE("prefab");
 
-}
\ No newline at end of file
+
+	// paths of resources are quoted strings with an extension in the prefab's text
+	void PrefabResourceManager::prefetchReferencedFiles(const OutputBlob& blob)
+	{
+		if (!m_pack_file_device) return;
+
+		Array<Path> paths(m_allocator);
+		const char* c = (const char*)blob.getData();
+		const char* end = c + blob.getPos();
+		while (c < end)
+		{
+			if (*c != '"')
+			{
+				++c;
+				continue;
+			}
+			const char* str = ++c;
+			bool has_extension = false;
+			while (c < end && *c != '"')
+			{
+				if (*c == '.') has_extension = true;
+				else if (*c == '/' || *c == '\\') has_extension = false;
+				++c;
+			}
+			if (c == end) break;
+			int length = int(c - str);
+			++c;
+			if (!has_extension || length >= MAX_PATH_LENGTH) continue;
+
+			char tmp[MAX_PATH_LENGTH];
+			copyString(tmp, length + 1, str);
+			Path path(tmp);
+			if (m_pack_file_device->contains(path)) paths.push(path);
+		}
+		if (!paths.empty()) m_pack_file_device->prefetch(&paths[0], paths.size());
+	}
+
+
+	bool PrefabResource::load(FS::IFile& file)
+	{
+		file.getContents(blob);
+		static_cast<PrefabResourceManager&>(m_resource_manager).prefetchReferencedFiles(blob);
+		return true;
+	}
+
+}
@@ -5,6 +5,10 @@
 
 namespace Malmy
 {
+	namespace FS
+	{
+		class PackFileDevice;
+	}
 
 	enum class PrefabVersion : u32
 	{
@@ -26,11 +30,7 @@ namespace Malmy
 
 		void unload() override { blob.clear(); }
 
-		bool load(FS::IFile& file) override
-		{
-			file.getContents(blob);
-			return true;
-		}
+		bool load(FS::IFile& file) override;
 
 		OutputBlob blob;
 
@@ -43,10 +43,15 @@ namespace Malmy
 		explicit PrefabResourceManager(IAllocator& allocator)
 			: m_allocator(allocator)
 			, ResourceManagerBase(allocator)
+			, m_pack_file_device(nullptr)
 		{
 			//
 		}
 
+		// files referenced by a loaded prefab are read ahead from the pack
+		void setPackFileDevice(FS::PackFileDevice* device) { m_pack_file_device = device; }
+		void prefetchReferencedFiles(const OutputBlob& blob);
+
 	protected:
 		Resource* createResource(const Path& path) override
 		{
@@ -60,6 +65,7 @@ namespace Malmy
 
 	private:
 		IAllocator& m_allocator;
+		FS::PackFileDevice* m_pack_file_device;
 	};
 
 } // namespace Malmy
@@ -1,7 +1,12 @@
+#include "engine/crc32.h"
+#include "engine/fs/os_file.h"
 #include "engine/hash_map.h"
 #include "engine/log.h"
+#include "engine/math_utils.h"
 #include "engine/timer.h"
+#include "engine/mt/atomic.h"
 #include "engine/mt/sync.h"
+#include "engine/mt/task.h"
 #include "engine/mt/thread.h"
 #include "profiler.h"
 #include <cstring>
@@ -12,18 +17,24 @@ namespace Malmy
 	namespace Profiler
 	{
 
+		struct CaptureTask;
+
+
 		static struct Instance
 		{
 			Instance()
 				: contexts(allocator)
 				, timer(Timer::create(allocator))
 				, mutex(false)
+				, names(allocator)
+				, names_mutex(false)
 			{
 				//
 			}
 
 			~Instance()
 			{
+				for (const char* name : names) allocator.deallocate((void*)name);
 				Timer::destroy(timer);
 			}
 
@@ -43,9 +54,72 @@ namespace Malmy
 			Array<ThreadContext*> contexts;
 			MT::SpinMutex mutex;
 			Timer* timer;
+			CaptureTask* capture = nullptr;
 			bool paused = false;
+			// see internName
+			HashMap<u32, const char*> names;
+			MT::SpinMutex names_mutex;
 		} g_instance;
 
+
+		static void copyFromRing(const ThreadContext& ctx, uint pos, u8* dst, uint size)
+		{
+			const u8* buf = ctx.buffer.begin();
+			const uint buf_size = ctx.buffer.size();
+			const uint l = pos % buf_size;
+			if (buf_size - l >= size) {
+				memcpy(dst, buf + l, size);
+			}
+			else {
+				memcpy(dst, buf + l, buf_size - l);
+				memcpy(dst + (buf_size - l), buf, size - (buf_size - l));
+			}
+		}
+
+
+		static void copyToRing(ThreadContext& ctx, uint pos, const void* src, uint size)
+		{
+			u8* buf = ctx.buffer.begin();
+			const uint buf_size = ctx.buffer.size();
+			const uint l = pos % buf_size;
+			if (buf_size - l >= size) {
+				memcpy(buf + l, src, size);
+			}
+			else {
+				memcpy(buf + l, src, buf_size - l);
+				memcpy(buf, (const u8*)src + buf_size - l, size - (buf_size - l));
+			}
+		}
+
+
+		// only the thread owning ctx writes, readers copy the events and check `begin` afterwards
+		// to find out which of them were overwritten while copying
+		static uint beginWrite(ThreadContext& ctx, uint size)
+		{
+			const uint buf_size = ctx.buffer.size();
+			const uint end = ctx.end;
+			const uint old_begin = ctx.begin;
+			uint begin = old_begin;
+			while (size + end - begin > buf_size) {
+				u16 event_size;
+				copyFromRing(ctx, begin, (u8*)&event_size, sizeof(event_size));
+				begin += event_size;
+			}
+			if (begin != old_begin) {
+				ctx.begin = begin;
+				MT::storeBarrier();
+			}
+			return end;
+		}
+
+
+		static void endWrite(ThreadContext& ctx, uint end)
+		{
+			MT::storeBarrier();
+			ctx.end = end;
+		}
+
+
 		template <typename T>
 		void write(ThreadContext& ctx, EventType type, const T& value)
 		{
@@ -62,25 +136,9 @@ namespace Malmy
 			v.header.time = now();
 			v.value = value;
 
-			MT::SpinLock lock(ctx.mutex);
-			u8* buf = ctx.buffer.begin();
-			const int buf_size = ctx.buffer.size();
-
-			while (sizeof(v) + ctx.end - ctx.begin > buf_size) {
-				const u8 size = buf[ctx.begin % buf_size];
-				ctx.begin += size;
-			}
-
-			const uint lend = ctx.end % buf_size;
-			if (buf_size - lend >= sizeof(v)) {
-				memcpy(buf + lend, &v, sizeof(v));
-			}
-			else {
-				memcpy(buf + lend, &v, buf_size - lend);
-				memcpy(buf, ((u8*)&v) + buf_size - lend, sizeof(v) - (buf_size - lend));
-			}
-
-			ctx.end += sizeof(v);
+			const uint end = beginWrite(ctx, sizeof(v));
+			copyToRing(ctx, end, &v, sizeof(v));
+			endWrite(ctx, end + sizeof(v));
 		};
 
 		void write(ThreadContext& ctx, EventType type, const u8* data, int size)
@@ -93,36 +151,63 @@ namespace Malmy
 			header.size = u16(sizeof(header) + size);
 			header.time = now();
 
-			MT::SpinLock lock(ctx.mutex);
-			u8* buf = ctx.buffer.begin();
-			const uint buf_size = ctx.buffer.size();
+			const uint end = beginWrite(ctx, header.size);
+			copyToRing(ctx, end, &header, sizeof(header));
+			copyToRing(ctx, end + sizeof(header), data, size);
+			endWrite(ctx, end + header.size);
+		};
 
-			while (header.size + ctx.end - ctx.begin > buf_size) {
-				const u8 size = buf[ctx.begin % buf_size];
-				ctx.begin += size;
+		uint readEvents(ThreadContext& ctx, uint from, Array<u8>& events, uint* lost_size)
+		{
+			const uint end = ctx.end;
+			MT::memoryBarrier();
+			uint begin = ctx.begin;
+			if (int(from - begin) > 0) begin = from;
+
+			const uint size = end - begin;
+			events.resize(size);
+			if (size > 0) copyFromRing(ctx, begin, events.begin(), size);
+			MT::memoryBarrier();
+
+			// events are overwritten only after begin moves past them
+			uint valid_begin = ctx.begin;
+			if (int(valid_begin - begin) > 0) {
+				const uint skip = Math::minimum(valid_begin - begin, size);
+				moveMemory(events.begin(), events.begin() + skip, size - skip);
+				events.resize(size - skip);
+				begin += skip;
 			}
+			if (lost_size) *lost_size = int(begin - from) > 0 ? begin - from : 0;
+			return end;
+		}
 
-			auto cpy = [&](const u8* ptr, uint size) {
-				const uint lend = ctx.end % buf_size;
-				if (buf_size - lend >= size) {
-					memcpy(buf + lend, ptr, size);
-				}
-				else {
-					memcpy(buf + lend, ptr, buf_size - lend);
-					memcpy(buf, ((u8*)ptr) + buf_size - lend, size - (buf_size - lend));
-				}
+		void recordString(const char* value)
+		{
+			ThreadContext* ctx = g_instance.getThreadContext();
+			write(*ctx, EventType::STRING, (u8*)value, stringLength(value) + 1);
+		}
 
-				ctx.end += size;
-			};
+		void recordInt(const char* key, int value)
+		{
+			IntRecord r;
+			r.key = key;
+			r.value = value;
+			ThreadContext* ctx = g_instance.getThreadContext();
+			write(*ctx, EventType::INT, r);
+		}
 
-			cpy((u8*)&header, sizeof(header));
-			cpy(data, size);
-		};
+		void recordJob(EventType type, const JobRecord& job)
+		{
+			ASSERT(type == EventType::JOB_SUBMIT || type == EventType::JOB_START || type == EventType::JOB_END);
+			ThreadContext* ctx = g_instance.getThreadContext();
+			write(*ctx, type, job);
+		}
 
-		void recordString(const char* value)
+		void recordSignalWait(EventType type, u32 signal)
 		{
+			ASSERT(type == EventType::SIGNAL_WAIT_BEGIN || type == EventType::SIGNAL_WAIT_END);
 			ThreadContext* ctx = g_instance.getThreadContext();
-			write(*ctx, EventType::STRING, (u8*)value, stringLength(value) + 1);
+			write(*ctx, type, signal);
 		}
 
 		void blockColor(u8 r, u8 g, u8 b)
@@ -132,22 +217,49 @@ namespace Malmy
 			write(*ctx, EventType::BLOCK_COLOR, color);
 		}
 
+		const char* internName(const char* name)
+		{
+			u32 hash = crc32(name);
+			MT::SpinLock lock(g_instance.names_mutex);
+			auto iter = g_instance.names.find(hash);
+			if (iter.isValid()) return iter.value();
+
+			int size = stringLength(name) + 1;
+			char* copy = (char*)g_instance.allocator.allocate(size);
+			copyMemory(copy, name, size);
+			g_instance.names.insert(hash, copy);
+			return copy;
+		}
+
 		void beginBlock(const char* name)
 		{
 			ThreadContext* ctx = g_instance.getThreadContext();
+			ASSERT(ctx->open_blocks_count < ThreadContext::MAX_OPEN_BLOCKS);
+			if (ctx->open_blocks_count < ThreadContext::MAX_OPEN_BLOCKS) {
+				ctx->open_blocks[ctx->open_blocks_count] = name;
+			}
 			++ctx->open_blocks_count;
 			write(*ctx, EventType::BEGIN_BLOCK, name);
 		}
 
-		void beginFiberSwitch()
+		void beginFiberSwitch(FiberSwitchData& data)
 		{
 			ThreadContext* ctx = g_instance.getThreadContext();
+			data.blocks_count = Math::minimum(ctx->open_blocks_count, ThreadContext::MAX_OPEN_BLOCKS);
+			copyMemory(data.blocks, ctx->open_blocks, sizeof(data.blocks[0]) * data.blocks_count);
 			while (ctx->open_blocks_count > 0) {
 				write(*ctx, EventType::END_BLOCK, 0);
 				--ctx->open_blocks_count;
 			}
 		}
 
+		void endFiberSwitch(const FiberSwitchData& data)
+		{
+			for (int i = 0; i < data.blocks_count; ++i) {
+				beginBlock(data.blocks[i]);
+			}
+		}
+
 		void endBlock()
 		{
 			ThreadContext* ctx = g_instance.getThreadContext();
@@ -197,6 +309,175 @@ namespace Malmy
 			g_instance.paused = paused;
 		}
 
+
+		struct CaptureTask MALMY_FINAL : MT::Task
+		{
+			struct Thread
+			{
+				uint position;
+				StaticString<64> name;
+			};
+
+			explicit CaptureTask(IAllocator& allocator)
+				: MT::Task(allocator)
+				, m_threads(allocator)
+				, m_contexts(allocator)
+				, m_strings(allocator)
+				, m_events(allocator)
+				, m_finished(false)
+			{
+			}
+
+			bool open(const char* path)
+			{
+				if (!m_file.open(path, FS::Mode::CREATE_AND_WRITE)) return false;
+
+				CaptureHeader header;
+				header.magic = CaptureHeader::MAGIC;
+				header.version = CaptureHeader::VERSION;
+				header.frequency = frequency();
+				header.pointer_size = sizeof(void*);
+				m_file.write(&header, sizeof(header));
+
+				// only events recorded after this moment are captured
+				MT::SpinLock lock(g_instance.mutex);
+				for (ThreadContext* ctx : g_instance.contexts) {
+					Thread& thread = m_threads.emplace();
+					thread.position = ctx->end;
+				}
+				return true;
+			}
+
+			void writeChunk(CaptureChunkType type, int thread, const void* data, u32 size, const void* data2 = nullptr, u32 size2 = 0)
+			{
+				CaptureChunkHeader header;
+				header.type = type;
+				header.thread = thread;
+				header.size = size + size2;
+				m_file.write(&header, sizeof(header));
+				m_file.write(data, size);
+				if (data2) m_file.write(data2, size2);
+			}
+
+			void writeString(const char* str)
+			{
+				if (m_strings.find(str).isValid()) return;
+				m_strings.insert(str, true);
+				writeChunk(CaptureChunkType::STRING, 0, &str, sizeof(str), str, stringLength(str) + 1);
+			}
+
+			void flush()
+			{
+				// contexts are never destroyed, so the file is written without holding the lock
+				{
+					MT::SpinLock lock(g_instance.mutex);
+					m_contexts.resize(g_instance.contexts.size());
+					for (int i = 0, c = m_contexts.size(); i < c; ++i) m_contexts[i] = g_instance.contexts[i];
+				}
+				for (int i = 0, c = m_contexts.size(); i < c; ++i) {
+					ThreadContext& ctx = *m_contexts[i];
+					if (i >= m_threads.size()) {
+						Thread& thread = m_threads.emplace();
+						thread.position = 0;
+					}
+					Thread& thread = m_threads[i];
+					StaticString<64> name;
+					{
+						MT::SpinLock name_lock(ctx.mutex);
+						name = ctx.name;
+					}
+					if (!equalStrings(thread.name, name)) {
+						thread.name = name;
+						writeChunk(CaptureChunkType::THREAD, i, thread.name.data, stringLength(thread.name) + 1);
+					}
+
+					uint lost_size;
+					thread.position = readEvents(ctx, thread.position, m_events, &lost_size);
+					if (lost_size > 0) writeChunk(CaptureChunkType::LOST, i, &lost_size, sizeof(lost_size));
+					if (m_events.empty()) continue;
+
+					for (int p = 0; p < m_events.size();) {
+						EventHeader header;
+						memcpy(&header, &m_events[p], sizeof(header));
+						const u8* data = &m_events[p + sizeof(header)];
+						if (header.type == EventType::BEGIN_BLOCK) {
+							const char* name;
+							memcpy(&name, data, sizeof(name));
+							writeString(name);
+						}
+						else if (header.type == EventType::INT) {
+							IntRecord r;
+							memcpy(&r, data, sizeof(r));
+							writeString(r.key);
+						}
+						else if (header.type == EventType::JOB_SUBMIT || header.type == EventType::JOB_START ||
+								 header.type == EventType::JOB_END) {
+							JobRecord r;
+							memcpy(&r, data, sizeof(r));
+							if (r.name) writeString(r.name);
+						}
+						p += header.size;
+					}
+					writeChunk(CaptureChunkType::EVENTS, i, m_events.begin(), m_events.size());
+				}
+			}
+
+			int task() override
+			{
+				while (!m_finished) {
+					flush();
+					MT::sleep(10);
+				}
+				flush();
+				m_file.close();
+				return 0;
+			}
+
+			FS::OsFile m_file;
+			Array<Thread> m_threads;
+			Array<ThreadContext*> m_contexts;
+			HashMap<const char*, bool> m_strings;
+			Array<u8> m_events;
+			volatile bool m_finished;
+		};
+
+
+		bool startCapture(const char* path)
+		{
+			if (g_instance.capture) return false;
+
+			CaptureTask* capture = MALMY_NEW(g_instance.allocator, CaptureTask)(g_instance.allocator);
+			if (!capture->open(path)) {
+				g_log_error.log("Engine") << "Could not create profiler capture " << path;
+				MALMY_DELETE(g_instance.allocator, capture);
+				return false;
+			}
+			if (!capture->create("Profiler capture")) {
+				g_log_error.log("Engine") << "Could not create profiler capture thread";
+				capture->m_file.close();
+				MALMY_DELETE(g_instance.allocator, capture);
+				return false;
+			}
+			g_instance.capture = capture;
+			return true;
+		}
+
+		void stopCapture()
+		{
+			CaptureTask* capture = g_instance.capture;
+			if (!capture) return;
+
+			capture->m_finished = true;
+			capture->destroy();
+			MALMY_DELETE(g_instance.allocator, capture);
+			g_instance.capture = nullptr;
+		}
+
+		bool isCapturing()
+		{
+			return g_instance.capture != nullptr;
+		}
+
 	} // namespace Malmy
 
 } //	namespace Profiler
@@ -12,8 +12,12 @@ namespace Malmy
 	namespace Profiler
 	{
 
+		// Ring buffer of events written only by its own thread, the oldest events are overwritten when it's full.
+		// begin and end are byte positions since the thread started, use readEvents to access the events.
 		struct ThreadContext
 		{
+			static const int MAX_OPEN_BLOCKS = 64;
+
 			ThreadContext(IAllocator& allocator)
 				: buffer(allocator)
 				, mutex(false)
@@ -21,12 +25,15 @@ namespace Malmy
 				buffer.resize(1024 * 512);
 			}
 
+			// names of blocks deeper than MAX_OPEN_BLOCKS are not kept
+			const char* open_blocks[MAX_OPEN_BLOCKS];
 			int open_blocks_count = 0;
 			Array<u8> buffer;
-			uint begin = 0;
-			uint end = 0;
+			volatile uint begin = 0;
+			volatile uint end = 0;
 			uint rows = 0;
 			bool open = false;
+			// protects name, writing events does not lock
 			MT::SpinMutex mutex;
 			StaticString<64> name;
 		};
@@ -37,7 +44,15 @@ namespace Malmy
 			BLOCK_COLOR,
 			END_BLOCK,
 			FRAME,
-			STRING
+			STRING,
+			INT,
+			JOB_SUBMIT,
+			// job started or continued after a wait on this thread
+			JOB_START,
+			// job finished and triggered its signal
+			JOB_END,
+			SIGNAL_WAIT_BEGIN,
+			SIGNAL_WAIT_END
 		};
 
 #pragma pack(1)
@@ -47,24 +62,93 @@ namespace Malmy
 			EventType type;
 			u64 time;
 		};
+
+		struct IntRecord
+		{
+			const char* key;
+			int value;
+		};
+
+		struct JobRecord
+		{
+			u32 id;
+			// JobSystem::SignalHandle triggered by the job and the one it waits for before it can start
+			u32 signal;
+			u32 precondition;
+			const char* name;
+		};
 #pragma pack()
 
+
+		// Capture file is CaptureHeader followed by chunks, each chunk is CaptureChunkHeader and `size` bytes.
+		// Events are stored as in ThreadContext::buffer, names of blocks and ints are pointers which
+		// are resolved by STRING chunks written before the first event using them.
+		enum class CaptureChunkType : u32
+		{
+			THREAD, // zero terminated thread name
+			STRING, // pointer, then zero terminated string
+			EVENTS,
+			LOST // u32, bytes of events overwritten before they were captured
+		};
+
+		struct CaptureHeader
+		{
+			static const u32 MAGIC = 0x5043'4C4D; // "MLCP"
+			static const u32 VERSION = 0;
+
+			u32 magic;
+			u32 version;
+			u64 frequency;
+			u32 pointer_size;
+		};
+
+		struct CaptureChunkHeader
+		{
+			CaptureChunkType type;
+			u32 thread;
+			u32 size;
+		};
+
 		MALMY_ENGINE_API void setThreadName(const char* name);
 
 		MALMY_ENGINE_API u64 now();
 		MALMY_ENGINE_API u64 frequency();
 		MALMY_ENGINE_API void pause(bool paused);
 
+		// Blocks are identified by the pointer to their name, names built at runtime must be interned, equal names
+		// get the same pointer, which is valid until exit.
+		MALMY_ENGINE_API const char* internName(const char* name);
 		MALMY_ENGINE_API void beginBlock(const char* name);
 		MALMY_ENGINE_API void blockColor(u8 r, u8 g, u8 b);
 		MALMY_ENGINE_API void endBlock();
 		MALMY_ENGINE_API void frame();
 		MALMY_ENGINE_API void recordString(const char* value);
+		// key must be valid for the whole run, e.g. a string literal
+		MALMY_ENGINE_API void recordInt(const char* key, int value);
+		MALMY_ENGINE_API void recordJob(EventType type, const JobRecord& job);
+		MALMY_ENGINE_API void recordSignalWait(EventType type, u32 signal);
+
+		// A fiber can continue on another thread, so blocks open on the current thread are ended
+		// before the switch and begun again, in the same order, by endFiberSwitch after it.
+		struct FiberSwitchData
+		{
+			const char* blocks[ThreadContext::MAX_OPEN_BLOCKS];
+			int blocks_count;
+		};
 
-		MALMY_ENGINE_API void beginFiberSwitch();
+		MALMY_ENGINE_API void beginFiberSwitch(FiberSwitchData& data);
+		MALMY_ENGINE_API void endFiberSwitch(const FiberSwitchData& data);
 
 		MALMY_ENGINE_API Array<ThreadContext*>& lockContexts();
 		MALMY_ENGINE_API void unlockContexts();
+		// Copies events starting at position `from`, or the oldest event still in the buffer, to `events`.
+		// Never blocks the thread writing to ctx. Returns the position where the next read should start.
+		MALMY_ENGINE_API uint readEvents(ThreadContext& ctx, uint from, Array<u8>& events, uint* lost_size = nullptr);
+
+		// Streams events of all threads to a file on a background thread until stopCapture.
+		MALMY_ENGINE_API bool startCapture(const char* path);
+		MALMY_ENGINE_API void stopCapture();
+		MALMY_ENGINE_API bool isCapturing();
 
 		struct Scope
 		{
@@ -74,7 +158,7 @@ namespace Malmy
 
 	} // namespace Profiler
 
-#define PROFILE_INT(...)
+#define PROFILE_INT(key, value) Profiler::recordInt(key, int(value));
 #define PROFILE_FUNCTION() Profiler::Scope profile_scope(__FUNCTION__);
 #define PROFILE_BLOCK(name) Profiler::Scope profile_scope(name);
 
@@ -30,6 +30,7 @@ Project::Project(IAllocator& allocator)
 	, m_gameobject_destroyed(m_allocator)
 	, m_gameobject_moved(m_allocator)
 	, m_first_free_slot(-1)
+	, m_hierarchy_version(0)
 	, m_scenes(m_allocator)
 	, m_hierarchy(m_allocator)
 {
@@ -526,6 +527,7 @@ void Project::setParent(GameObject new_parent, GameObject child)
 		g_log_error.log("Engine") << "Hierarchy can not contains a cycle.";
 		return;
 	}
+	++m_hierarchy_version;
 
 	auto collectGarbage = [this](GameObject gameobject) {
 		Hierarchy& h = m_hierarchy[m_entities[gameobject.index].hierarchy];
@@ -742,6 +744,7 @@ void Project::deserialize(InputBlob& serializer)
 	serializer.read(count);
 	m_hierarchy.resize(count);
 	if (count > 0) serializer.read(&m_hierarchy[0], sizeof(m_hierarchy[0]) * m_hierarchy.size());
+	++m_hierarchy_version;
 }
 
 
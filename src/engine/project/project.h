@@ -83,6 +83,8 @@ public:
 	Transform getLocalTransform(GameObject gameobject) const;
 	float getLocalScale(GameObject gameobject) const;
 	void setParent(GameObject parent, GameObject child);
+	// changes whenever any parent-child relation changes
+	u32 getHierarchyVersion() const { return m_hierarchy_version; }
 	void setLocalPosition(GameObject gameobject, const Vec3& pos);
 	void setLocalRotation(GameObject gameobject, const Quat& rot);
 	void setLocalTransform(GameObject gameobject, const Transform& transform);
@@ -191,6 +193,7 @@ private:
 	DelegateList<void(const ComponentUID&)> m_component_destroyed;
 	DelegateList<void(const ComponentUID&)> m_component_added;
 	int m_first_free_slot;
+	u32 m_hierarchy_version;
 	StaticString<64> m_name;
 };
 
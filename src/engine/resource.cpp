@@ -1,11 +1,15 @@
 #include "engine/resource.h"
 #include "engine/crc32.h"
+#include "engine/debug/tracking_allocator.h"
 #include "engine/fs/file_system.h"
 #include "engine/log.h"
 #include "engine/malmy.h"
 #include "engine/path.h"
+#include "engine/path_utils.h"
+#include "engine/profiler.h"
 #include "engine/resource_manager.h"
 #include "engine/resource_manager_base.h"
+#include "engine/string.h"
 
 namespace Malmy
 {
@@ -16,6 +20,15 @@ namespace Malmy
 		type = crc32(type_name);
 	}
 
+	// memory of loaded resources is attributed to a tag per file extension, resolved once per resource
+	static int getAllocationTag(const Path& path)
+	{
+		char ext[10];
+		PathUtils::getExtension(ext, lengthOf(ext), path.c_str());
+		StaticString<32> tag_name("resource ", ext);
+		return Debug::registerAllocationTag(tag_name);
+	}
+
 	Resource::Resource(const Path& path, ResourceManagerBase& resource_manager, IAllocator& allocator)
 		: m_ref_count()
 		, m_empty_dep_count(1)
@@ -27,6 +40,10 @@ namespace Malmy
 		, m_cb(allocator)
 		, m_resource_manager(resource_manager)
 		, m_async_op(FS::FileSystem::INVALID_ASYNC)
+		, m_decode_file(nullptr)
+		, m_decode_signal(JobSystem::INVALID_HANDLE)
+		, m_decode_success(false)
+		, m_allocation_tag(getAllocationTag(path))
 	{
 		//
 	}
@@ -65,6 +82,8 @@ namespace Malmy
 	{
 		m_async_op = FS::FileSystem::INVALID_ASYNC;
 		if (m_desired_state != State::READY) return;
+		// the file is already being decoded, see fileOpened
+		if (success && m_resource_manager.isAsyncDecodeEnabled()) return;
 
 		ASSERT(m_current_state != State::READY);
 		ASSERT(m_empty_dep_count == 1);
@@ -80,6 +99,7 @@ namespace Malmy
 			return;
 		}
 
+		Debug::AllocationTagScope tag_scope(m_allocation_tag);
 		if (!load(file))
 		{
 			++m_failed_dep_count;
@@ -91,6 +111,49 @@ namespace Malmy
 		m_async_op = FS::FileSystem::INVALID_ASYNC;
 	}
 
+	// called from an I/O thread, the file is ours and it's handed directly to the decode job
+	void Resource::fileOpened(FS::IFile& file, bool success)
+	{
+		ASSERT(success);
+		m_decode_file = &file;
+		m_resource_manager.getOwner().onDecodeStarted();
+		JobSystem::run(this, [](void* data) {
+			PROFILE_BLOCK("decode resource");
+			Resource* resource = (Resource*)data;
+			Debug::AllocationTagScope tag_scope(resource->m_allocation_tag);
+			resource->m_decode_success = resource->decode(*resource->m_decode_file);
+			resource->m_resource_manager.getOwner().onDecoded(*resource);
+		}, &m_decode_signal, JobSystem::INVALID_HANDLE, "decode resource");
+	}
+
+	void Resource::finishDecode()
+	{
+		m_decode_signal = JobSystem::INVALID_HANDLE;
+		FS::IFile& file = *m_decode_file;
+		Debug::AllocationTagScope tag_scope(m_allocation_tag);
+		if (!m_decode_success || !finalize(file))
+		{
+			++m_failed_dep_count;
+		}
+		m_resource_manager.getOwner().getFileSystem().close(file);
+		m_decode_file = nullptr;
+
+		ASSERT(m_empty_dep_count > 0);
+		--m_empty_dep_count;
+		checkState();
+	}
+
+	void Resource::cancelDecode()
+	{
+		if (!m_decode_file) return;
+
+		JobSystem::wait(m_decode_signal);
+		m_decode_signal = JobSystem::INVALID_HANDLE;
+		m_resource_manager.getOwner().removeDecoded(*this);
+		m_resource_manager.getOwner().getFileSystem().close(*m_decode_file);
+		m_decode_file = nullptr;
+	}
+
 	void Resource::doUnload()
 	{
 		if (m_async_op != FS::FileSystem::INVALID_ASYNC)
@@ -99,6 +162,7 @@ namespace Malmy
 			fs.cancelAsync(m_async_op);
 			m_async_op = FS::FileSystem::INVALID_ASYNC;
 		}
+		cancelDecode();
 
 		m_desired_state = State::EMPTY;
 		unload();
@@ -130,7 +194,10 @@ namespace Malmy
 		FS::FileSystem& fs = m_resource_manager.getOwner().getFileSystem();
 		FS::ReadCallback cb;
 		cb.bind<Resource, &Resource::fileLoaded>(this);
-		m_async_op = fs.openAsync(fs.getDefaultDevice(), m_path, FS::Mode::OPEN_AND_READ, cb);
+		FS::ReadCallback worker_cb;
+		if (m_resource_manager.isAsyncDecodeEnabled()) worker_cb.bind<Resource, &Resource::fileOpened>(this);
+		m_async_op = fs.openAsync(
+			fs.getDefaultDevice(), m_path, FS::Mode::OPEN_AND_READ, cb, FS::AsyncPriority::NORMAL, worker_cb);
 	}
 
 	void Resource::addDependency(Resource& dependent_resource)
@@ -1,6 +1,7 @@
 #pragma once
 #include "engine/delegate_list.h"
 #include "engine/fs/file_system.h"
+#include "engine/job_system.h"
 #include "engine/path.h"
 
 namespace Malmy
@@ -24,6 +25,7 @@ namespace Malmy
 	class MALMY_ENGINE_API Resource
 	{
 	public:
+		friend class ResourceManager;
 		friend class ResourceManagerBase;
 
 		enum class State : u32
@@ -65,6 +67,10 @@ namespace Malmy
 		virtual void onBeforeEmpty() {}
 		virtual void unload() = 0;
 		virtual bool load(FS::IFile& file) = 0;
+		// if the manager enables asynchronous decoding, decode runs in a job instead of load and it must not
+		// create GPU objects, log nor touch other resources; finalize then runs on the main thread
+		virtual bool decode(FS::IFile& file) { return true; }
+		virtual bool finalize(FS::IFile& file) { return load(file); }
 
 		void onCreated(State state);
 		void doUnload();
@@ -84,6 +90,9 @@ namespace Malmy
 	private:
 		void doLoad();
 		void fileLoaded(FS::IFile& file, bool success);
+		void fileOpened(FS::IFile& file, bool success);
+		void finishDecode();
+		void cancelDecode();
 		void onStateChanged(State old_state, State new_state, Resource&);
 		u32 addRef() { return ++m_ref_count; }
 		u32 remRef() { return --m_ref_count; }
@@ -98,6 +107,10 @@ namespace Malmy
 		u16 m_failed_dep_count;
 		State m_current_state;
 		u32 m_async_op;
+		FS::IFile* m_decode_file;
+		JobSystem::SignalHandle m_decode_signal;
+		bool m_decode_success;
+		int m_allocation_tag;
 	}; // class Resource
 
 } // namespace Malmy
@@ -1,7 +1,11 @@
+#include "engine/metrics.h"
+#include "engine/mt/atomic.h"
 #include "engine/path.h"
+#include "engine/profiler.h"
 #include "engine/resource.h"
 #include "engine/resource_manager.h"
 #include "engine/resource_manager_base.h"
+#include "engine/timer.h"
 
 namespace Malmy
 {
@@ -9,6 +13,11 @@ namespace Malmy
 		: m_resource_managers(allocator)
 		, m_allocator(allocator)
 		, m_file_system(nullptr)
+		, m_decoded_mutex(false)
+		, m_decoded(allocator)
+		, m_decoding_count(0)
+		, m_finalize_budget(0.004f)
+		, m_timer(nullptr)
 	{
 		//
 	}
@@ -18,10 +27,60 @@ namespace Malmy
 	void ResourceManager::create(FS::FileSystem& fs)
 	{
 		m_file_system = &fs;
+		m_timer = Timer::create(m_allocator);
 	}
 
 	void ResourceManager::destroy()
 	{
+		Timer::destroy(m_timer);
+		m_timer = nullptr;
+	}
+
+	void ResourceManager::update()
+	{
+		PROFILE_FUNCTION();
+		m_timer->tick();
+		int finalized_count = 0;
+		for (;;)
+		{
+			Resource* resource;
+			{
+				MT::SpinLock lock(m_decoded_mutex);
+				if (m_decoded.empty()) break;
+				resource = m_decoded[0];
+				m_decoded.erase(0);
+			}
+			MT::atomicDecrement(&m_decoding_count);
+			resource->finishDecode();
+			++finalized_count;
+			// at least one resource per frame is finalized so loading always progresses
+			if (m_timer->getTimeSinceTick() > m_finalize_budget) break;
+		}
+		PROFILE_INT("pending", m_decoding_count);
+		METRICS_SET("resources decoding", m_decoding_count);
+		METRICS_ADD("resources finalized", finalized_count);
+	}
+
+	void ResourceManager::onDecodeStarted()
+	{
+		MT::atomicIncrement(&m_decoding_count);
+	}
+
+	void ResourceManager::onDecoded(Resource& resource)
+	{
+		MT::SpinLock lock(m_decoded_mutex);
+		m_decoded.push(&resource);
+	}
+
+	void ResourceManager::removeDecoded(Resource& resource)
+	{
+		MT::SpinLock lock(m_decoded_mutex);
+		int idx = m_decoded.indexOf(&resource);
+		if (idx >= 0)
+		{
+			m_decoded.erase(idx);
+			MT::atomicDecrement(&m_decoding_count);
+		}
 	}
 
 	ResourceManagerBase* ResourceManager::get(ResourceType type)
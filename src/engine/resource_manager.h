@@ -1,5 +1,7 @@
 #pragma once
+#include "engine/array.h"
 #include "engine/hash_map.h"
+#include "engine/mt/sync.h"
 
 namespace Malmy
 {
@@ -14,9 +16,11 @@ namespace Malmy
 	}
 
 	class ResourceManagerBase;
+	class Timer;
 
 	class MALMY_ENGINE_API ResourceManager
 	{
+		friend class Resource;
 		typedef HashMap<u32, ResourceManagerBase*> ResourceManagerTable;
 
 	public:
@@ -35,13 +39,27 @@ namespace Malmy
 		void reload(const Path& path);
 		void removeUnreferenced();
 		void enableUnload(bool enable);
+		// finalizes asynchronously decoded resources, see ResourceManagerBase::enableAsyncDecode
+		void update();
+		bool hasWork() const { return m_decoding_count > 0; }
+		void setFinalizeBudget(float seconds) { m_finalize_budget = seconds; }
 
 		FS::FileSystem& getFileSystem() { return *m_file_system; }
 
+	private:
+		void onDecodeStarted();
+		void onDecoded(Resource& resource);
+		void removeDecoded(Resource& resource);
+
 	private:
 		IAllocator& m_allocator;
 		ResourceManagerTable m_resource_managers;
 		FS::FileSystem* m_file_system;
+		MT::SpinMutex m_decoded_mutex;
+		Array<Resource*> m_decoded;
+		volatile i32 m_decoding_count;
+		float m_finalize_budget;
+		Timer* m_timer;
 	};
 
 } // namespace Malmy
@@ -27,6 +27,7 @@ namespace Malmy
 		for (auto iter = m_resources.begin(), end = m_resources.end(); iter != end; ++iter)
 		{
 			Resource* resource = iter.value();
+			resource->cancelDecode();
 			if (!resource->isEmpty())
 			{
 				g_log_error.log("Engine") << "Leaking resource " << resource->getPath().c_str() << "\n";
@@ -160,6 +161,7 @@ namespace Malmy
 		, m_allocator(allocator)
 		, m_owner(nullptr)
 		, m_is_unload_enabled(true)
+		, m_is_async_decode_enabled(false)
 		, m_load_hook(nullptr)
 	{
 		//
@@ -1,5 +1,5 @@
 #pragma once
-#include "engine/hash_map.h"
+#include "engine/flat_hash_map.h"
 
 namespace Malmy
 {
@@ -18,7 +18,7 @@ namespace Malmy
 	{
 		friend class Resource;
 	public:
-		typedef HashMap<u32, Resource*> ResourceTable;
+		typedef FlatHashMap<u32, Resource*> ResourceTable;
 
 		struct MALMY_ENGINE_API LoadHook
 		{
@@ -37,6 +37,8 @@ namespace Malmy
 
 		void setLoadHook(LoadHook& load_hook);
 		void enableUnload(bool enable);
+		void enableAsyncDecode(bool enable) { m_is_async_decode_enabled = enable; }
+		bool isAsyncDecodeEnabled() const { return m_is_async_decode_enabled; }
 
 		Resource* load(const Path& path);
 		void load(Resource& resource);
@@ -64,6 +66,7 @@ namespace Malmy
 		ResourceTable m_resources;
 		ResourceManager* m_owner;
 		bool m_is_unload_enabled;
+		bool m_is_async_decode_enabled;
 	};
 
 }
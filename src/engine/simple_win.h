@@ -118,6 +118,8 @@ CreateWindowExA(0L,                 \
 #define FILE_LIST_DIRECTORY (0x0001)
 #define FILE_SHARE_DELETE 0x00000004
 #define FILE_FLAG_WRITE_THROUGH 0x80000000
+#define PAGE_READONLY 0x02
+#define FILE_MAP_READ 0x0004
 #define FILE_FLAG_OVERLAPPED 0x40000000
 #define FILE_FLAG_NO_BUFFERING 0x20000000
 #define FILE_FLAG_RANDOM_ACCESS 0x10000000
@@ -492,6 +494,29 @@ WINBASEAPI DWORD WINAPI SetFilePointer(HANDLE hFile,
 	PLONG lpDistanceToMoveHigh,
 	DWORD dwMoveMethod);
 WINBASEAPI BOOL WINAPI SetEndOfFile(HANDLE hFile);
+WINBASEAPI BOOL WINAPI GetFileSizeEx(HANDLE hFile, LARGE_INTEGER* lpFileSize);
+WINBASEAPI HANDLE WINAPI CreateFileMappingA(HANDLE hFile,
+	LPSECURITY_ATTRIBUTES lpFileMappingAttributes,
+	DWORD flProtect,
+	DWORD dwMaximumSizeHigh,
+	DWORD dwMaximumSizeLow,
+	LPCSTR lpName);
+WINBASEAPI LPVOID WINAPI MapViewOfFile(HANDLE hFileMappingObject,
+	DWORD dwDesiredAccess,
+	DWORD dwFileOffsetHigh,
+	DWORD dwFileOffsetLow,
+	SIZE_T dwNumberOfBytesToMap);
+WINBASEAPI BOOL WINAPI UnmapViewOfFile(LPCVOID lpBaseAddress);
+WINBASEAPI HANDLE WINAPI GetCurrentProcess();
+typedef struct _WIN32_MEMORY_RANGE_ENTRY
+{
+	PVOID VirtualAddress;
+	SIZE_T NumberOfBytes;
+} WIN32_MEMORY_RANGE_ENTRY, *PWIN32_MEMORY_RANGE_ENTRY;
+WINBASEAPI BOOL WINAPI PrefetchVirtualMemory(HANDLE hProcess,
+	ULONG_PTR NumberOfEntries,
+	PWIN32_MEMORY_RANGE_ENTRY VirtualAddresses,
+	ULONG Flags);
 WINBASEAPI HANDLE WINAPI CreateSemaphoreA(LPSECURITY_ATTRIBUTES lpSemaphoreAttributes,
 	LONG lInitialCount,
 	LONG lMaximumCount,
@@ -0,0 +1,150 @@
+#pragma once
+#include "engine/array.h"
+#include "engine/math_utils.h"
+
+namespace Malmy
+{
+	// Component storage with the same interface as AssociativeArray, for keys with an `index` member (GameObject).
+	// Values are packed in a dense array and the sparse array maps key.index to the dense position, so insert,
+	// find and erase are O(1). Erase moves the last item into the hole, so dense positions and iteration order
+	// change on erase; keys remain the stable handles.
+	template <typename Key, typename Value>
+	class SparseSet
+	{
+		public:
+			explicit SparseSet(IAllocator& allocator)
+				: m_keys(allocator)
+				, m_values(allocator)
+				, m_sparse(allocator)
+			{}
+
+			Value& insert(const Key& key)
+			{
+				ASSERT(find(key) < 0);
+				setDenseIndex(key, m_values.size());
+				m_keys.push(key);
+				return m_values.emplace();
+			}
+
+			template <typename... Params> Value& emplace(const Key& key, Params&&... params)
+			{
+				ASSERT(find(key) < 0);
+				setDenseIndex(key, m_values.size());
+				m_keys.push(key);
+				return m_values.emplace(static_cast<Params&&>(params)...);
+			}
+
+			int insert(const Key& key, const Value& value)
+			{
+				if (find(key) >= 0) return -1;
+
+				int i = m_values.size();
+				setDenseIndex(key, i);
+				m_keys.push(key);
+				m_values.push(value);
+				return i;
+			}
+
+			bool find(const Key& key, Value& value) const
+			{
+				int i = find(key);
+				if (i < 0) return false;
+				value = m_values[i];
+				return true;
+			}
+
+			int find(const Key& key) const
+			{
+				if (key.index < 0 || key.index >= m_sparse.size()) return -1;
+				return m_sparse[key.index];
+			}
+
+			const Value& operator [](const Key& key) const
+			{
+				int index = find(key);
+				ASSERT(index >= 0);
+				return m_values[index];
+			}
+
+			Value& operator [](const Key& key)
+			{
+				int index = find(key);
+				if (index >= 0) return m_values[index];
+				return m_values[insert(key, Value())];
+			}
+
+			int size() const { return m_values.size(); }
+
+			Value& get(const Key& key)
+			{
+				int index = find(key);
+				ASSERT(index >= 0);
+				return m_values[index];
+			}
+
+			const Value& get(const Key& key) const
+			{
+				int index = find(key);
+				ASSERT(index >= 0);
+				return m_values[index];
+			}
+
+			Value* begin() { return m_values.begin(); }
+			Value* end() { return m_values.end(); }
+			const Value* begin() const { return m_values.begin(); }
+			const Value* end() const { return m_values.end(); }
+
+			Value& at(int index) { return m_values[index]; }
+			const Value& at(int index) const { return m_values[index]; }
+			const Key& getKey(int index) const { return m_keys[index]; }
+
+			void clear()
+			{
+				m_keys.clear();
+				m_values.clear();
+				m_sparse.clear();
+			}
+
+			void reserve(int capacity)
+			{
+				m_keys.reserve(capacity);
+				m_values.reserve(capacity);
+			}
+
+			void eraseAt(int index)
+			{
+				if (index < 0 || index >= m_values.size()) return;
+
+				m_sparse[m_keys[index].index] = -1;
+				int last = m_values.size() - 1;
+				if (index != last) m_sparse[m_keys[last].index] = index;
+				m_keys.eraseFast(index);
+				m_values.eraseFast(index);
+			}
+
+			void erase(const Key& key)
+			{
+				eraseAt(find(key));
+			}
+
+		private:
+			void setDenseIndex(const Key& key, int index)
+			{
+				ASSERT(key.index >= 0);
+				if (key.index >= m_sparse.size())
+				{
+					int old_size = m_sparse.size();
+					int new_size = Math::maximum(key.index + 1, old_size * 2);
+					m_sparse.resize(new_size);
+					for (int i = old_size; i < new_size; ++i) m_sparse[i] = -1;
+				}
+				m_sparse[key.index] = index;
+			}
+
+		private:
+			Array<Key> m_keys;
+			Array<Value> m_values;
+			Array<int> m_sparse;
+	};
+
+} // namespace Malmy
@@ -84,6 +84,11 @@ struct SpritePlugin MALMY_FINAL : public AssetBrowser::IPlugin
 		{
 			sprite->setTexture(Path(tmp));
 		}
+		if (ImGui::Checkbox("Atlas", &sprite->use_atlas) && tex)
+		{
+			Path path = tex->getPath();
+			sprite->setTexture(path);
+		}
 
 		static const char* TYPES_STR[] = { "9 patch", "Simple" };
 		if (ImGui::BeginCombo("Type", TYPES_STR[sprite->type]))
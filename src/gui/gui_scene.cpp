@@ -3,14 +3,17 @@
 #include "sprite_manager.h"
 #include "engine/engine.h"
 #include "engine/flag_set.h"
+#include "engine/hash_map.h"
 #include "engine/iallocator.h"
 #include "engine/input_system.h"
 #include "engine/log.h"
 #include "engine/plugin_manager.h"
+#include "engine/profiler.h"
 #include "engine/reflection.h"
 #include "engine/resource_manager.h"
 #include "engine/resource_manager_base.h"
 #include "engine/serializer.h"
+#include "engine/sparse_set.h"
 #include "engine/project/project.h"
 #include "renderer/draw2d.h"
 #include "renderer/font_manager.h"
@@ -69,6 +72,7 @@ struct GUIText
 	void setFontSize(int value)
 	{
 		m_font_size = value;
+		m_is_size_dirty = true;
 		if (m_font_resource && m_font_resource->isReady())
 		{
 			if(m_font) m_font_resource->removeRef(*m_font);
@@ -77,6 +81,28 @@ struct GUIText
 	}
 
 
+	void setText(const char* value)
+	{
+		text = value;
+		m_is_size_dirty = true;
+	}
+
+
+	void onTextEdited() { m_is_size_dirty = true; }
+
+
+	const Vec2& getTextSize(Font* font)
+	{
+		if (m_is_size_dirty || m_measured_font != font)
+		{
+			m_text_size = font->CalcTextSizeA((float)m_font_size, FLT_MAX, 0, text.c_str());
+			m_measured_font = font;
+			m_is_size_dirty = false;
+		}
+		return m_text_size;
+	}
+
+
 	FontResource* getFontResource() const { return m_font_resource; }
 	int getFontSize() const { return m_font_size; }
 	Font* getFont() const { return m_font; }
@@ -90,6 +116,9 @@ private:
 	int m_font_size = 13;
 	Font* m_font = nullptr;
 	FontResource* m_font_resource = nullptr;
+	Font* m_measured_font = nullptr;
+	Vec2 m_text_size;
+	bool m_is_size_dirty = true;
 };
 
 
@@ -145,6 +174,17 @@ struct GUIRect
 	GUIText* text = nullptr;
 	GUIInputField* input_field = nullptr;
 	bgfx::TextureHandle* render_target = nullptr;
+	GUIScene::Rect layout = {};
+};
+
+
+// draw data of a subtree of the root rect, regenerated only when something in the subtree changes
+struct GUIDrawCache
+{
+	GUIDrawCache(IAllocator& allocator) : draw(allocator) {}
+
+	Draw2D draw;
+	bool is_dirty = true;
 };
 
 
@@ -161,6 +201,9 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 		, m_button_clicked(allocator)
 		, m_buttons_down_count(0)
 		, m_canvas_size(800, 600)
+		, m_draw_caches(allocator)
+		, m_root_draw_cache(allocator)
+		, m_hierarchy_version(context.getHierarchyVersion())
 	{
 		context.registerComponentType(GUI_RECT_TYPE
 			, this
@@ -199,75 +242,140 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 			, &GUISceneImpl::serializeButton
 			, &GUISceneImpl::deserializeButton);
 		m_font_manager = (FontManager*)system.getEngine().getResourceManager().get(FontResource::TYPE);
+		m_font_manager->onAtlasTextureChanged().bind<GUISceneImpl, &GUISceneImpl::invalidateAll>(this);
+	}
+
+
+	~GUISceneImpl()
+	{
+		m_font_manager->onAtlasTextureChanged().unbind<GUISceneImpl, &GUISceneImpl::invalidateAll>(this);
+		destroyDrawCaches();
+	}
+
+
+	void destroyDrawCaches()
+	{
+		for (GUIDrawCache* cache : m_draw_caches)
+		{
+			MALMY_DELETE(m_allocator, cache);
+		}
+		m_draw_caches.clear();
+	}
+
+
+	void invalidateAll()
+	{
+		m_root_draw_cache.is_dirty = true;
+		destroyDrawCaches();
 	}
 
-	void renderTextCursor(GUIRect& rect, Draw2D& draw, const Vec2& pos)
+
+	// marks cached draw data of the subtree containing gameobject as dirty
+	void invalidate(GameObject gameobject)
 	{
-		if (!rect.input_field) return;
-		if (m_focused_gameobject != rect.gameobject) return;
-		if (rect.input_field->anim > CURSOR_BLINK_PERIOD * 0.5f) return;
+		if (!m_root) return;
+
+		GameObject root = m_root->gameobject;
+		GameObject e = gameobject;
+		for (;;)
+		{
+			if (e == root)
+			{
+				invalidateAll();
+				return;
+			}
+			GameObject parent = m_project.getParent(e);
+			if (!parent.isValid()) return;
+			if (parent == root) break;
+			e = parent;
+		}
 
-		const char* text = rect.text->text.c_str();
-		const char* text_end = text + rect.input_field->cursor;
-		Font* font = rect.text->getFont();
-		float font_size = (float)rect.text->getFontSize();
+		auto iter = m_draw_caches.find(e);
+		if (iter.isValid()) iter.value()->is_dirty = true;
+	}
+
+	void renderTextCursor(Draw2D& draw)
+	{
+		GUIRect* rect = getInput(m_focused_gameobject);
+		if (!rect) return;
+		if (rect->input_field->anim > CURSOR_BLINK_PERIOD * 0.5f) return;
+
+		Font* font = rect->text->getFont();
+		if (!font) font = m_font_manager->getDefaultFont();
+		Vec2 pos = getTextPos(*rect, font);
+		const char* text = rect->text->text.c_str();
+		const char* text_end = text + rect->input_field->cursor;
+		float font_size = (float)rect->text->getFontSize();
 		Vec2 text_size = font->CalcTextSizeA(font_size, FLT_MAX, 0, text, text_end);
-		draw.AddLine({ pos.x + text_size.x, pos.y }, { pos.x + text_size.x, pos.y + text_size.y }, rect.text->color, 1);
+		draw.AddLine({ pos.x + text_size.x, pos.y }, { pos.x + text_size.x, pos.y + text_size.y }, rect->text->color, 1);
 	}
 
 
-	void renderRect(GUIRect& rect, Pipeline& pipeline, const Rect& parent_rect)
+	Vec2 getTextPos(GUIRect& rect, Font* font)
 	{
-		if (!rect.flags.isSet(GUIRect::IS_VALID)) return;
-		if (!rect.flags.isSet(GUIRect::IS_ENABLED)) return;
+		const Rect& layout = rect.layout;
+		Vec2 text_pos(layout.x, layout.y);
+		switch (rect.text->horizontal_align)
+		{
+			case TextHAlign::LEFT: break;
+			case TextHAlign::RIGHT: text_pos.x = layout.x + layout.w - rect.text->getTextSize(font).x; break;
+			case TextHAlign::CENTER: text_pos.x = layout.x + (layout.w - rect.text->getTextSize(font).x) * 0.5f; break;
+		}
+		return text_pos;
+	}
 
-		float l = parent_rect.x + rect.left.points + parent_rect.w * rect.left.relative;
-		float r = parent_rect.x + rect.right.points + parent_rect.w * rect.right.relative;
-		float t = parent_rect.y + rect.top.points + parent_rect.h * rect.top.relative;
-		float b = parent_rect.y + rect.bottom.points + parent_rect.h * rect.bottom.relative;
-			 
-		Draw2D& draw = pipeline.getDraw2D();
-		if (rect.flags.isSet(GUIRect::IS_CLIP)) draw.PushClipRect({ l, t }, { r, b });
+
+	// resources which are not loaded yet are drawn with fallbacks, such draw data must not be retained
+	void renderRectContent(GUIRect& rect, Draw2D& draw)
+	{
+		float l = rect.layout.x;
+		float t = rect.layout.y;
+		float r = rect.layout.x + rect.layout.w;
+		float b = rect.layout.y + rect.layout.h;
 
 		if (rect.image && rect.image->flags.isSet(GUIImage::IS_ENABLED))
 		{
+			Sprite* sprite = rect.image->sprite;
+			if (sprite && !(sprite->isReady() && sprite->getTexture()))
+			{
+				m_is_draw_cache_volatile = true;
+			}
 			if (rect.image->sprite && rect.image->sprite->getTexture())
 			{
-				Sprite* sprite = rect.image->sprite;
 				Texture* tex = sprite->getTexture();
+				bgfx::TextureHandle* handle;
+				Vec2 uv0, uv1;
+				if (!sprite->getDrawData(&handle, &uv0, &uv1)) m_is_draw_cache_volatile = true;
 				if (sprite->type == Sprite::PATCH9)
 				{
-					struct Quad {
-						float l, t, r, b;
-					} pos = {
-						l + sprite->left,
-						t + sprite->top,
-						r - tex->width + sprite->right,
-						b - tex->height + sprite->bottom
+					// uvs are remapped to the sprite's rectangle, which is not the whole texture if it's in atlas
+					Vec2 uv_size = uv1 - uv0;
+					float x[] = { l, l + sprite->left, r - tex->width + sprite->right, r };
+					float y[] = { t, t + sprite->top, b - tex->height + sprite->bottom, b };
+					float u[] = {
+						uv0.x,
+						uv0.x + uv_size.x * sprite->left / (float)tex->width,
+						uv0.x + uv_size.x * sprite->right / (float)tex->width,
+						uv1.x
 					};
-					Quad uvs = {
-						sprite->left / (float)tex->width,
-						sprite->top / (float)tex->height,
-						sprite->right / (float)tex->width,
-						sprite->bottom / (float)tex->height
+					float v[] = {
+						uv0.y,
+						uv0.y + uv_size.y * sprite->top / (float)tex->height,
+						uv0.y + uv_size.y * sprite->bottom / (float)tex->height,
+						uv1.y
 					};
 
-					draw.AddImage(&tex->handle, { l, t }, { pos.l, pos.t }, { 0, 0 }, { uvs.l, uvs.t });
-					draw.AddImage(&tex->handle, { pos.l, t }, { pos.r, pos.t }, { uvs.l, 0 }, { uvs.r, uvs.t });
-					draw.AddImage(&tex->handle, { pos.r, t }, { r, pos.t }, { uvs.r, 0 }, { 1, uvs.t });
-
-					draw.AddImage(&tex->handle, { l, pos.t }, { pos.l, pos.b }, { 0, uvs.t }, { uvs.l, uvs.b });
-					draw.AddImage(&tex->handle, { pos.l, pos.t }, { pos.r, pos.b }, { uvs.l, uvs.t }, { uvs.r, uvs.b });
-					draw.AddImage(&tex->handle, { pos.r, pos.t }, { r, pos.b }, { uvs.r, uvs.t }, { 1, uvs.b });
-
-					draw.AddImage(&tex->handle, { l, pos.b }, { pos.l, b }, { 0, uvs.b }, { uvs.l, 1 });
-					draw.AddImage(&tex->handle, { pos.l, pos.b }, { pos.r, b }, { uvs.l, uvs.b }, { uvs.r, 1 });
-					draw.AddImage(&tex->handle, { pos.r, pos.b }, { r, b }, { uvs.r, uvs.b }, { 1, 1 });
-
+					for (int j = 0; j < 3; ++j)
+					{
+						for (int i = 0; i < 3; ++i)
+						{
+							draw.AddImage(handle, { x[i], y[j] }, { x[i + 1], y[j + 1] }, { u[i], v[j] }, { u[i + 1], v[j + 1] });
+						}
+					}
 				}
 				else
 				{
-					draw.AddImage(&tex->handle, { l, t }, { r, b });
+					draw.AddImage(handle, { l, t }, { r, b }, uv0, uv1);
 				}
 			}
 			else
@@ -276,31 +384,48 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 			}
 		}
 
-		if (rect.render_target && bgfx::isValid(*rect.render_target))
+		if (rect.render_target)
 		{
-			draw.AddImage(rect.render_target, { l, t }, { r, b });
+			if (bgfx::isValid(*rect.render_target))
+			{
+				draw.AddImage(rect.render_target, { l, t }, { r, b });
+			}
+			else
+			{
+				m_is_draw_cache_volatile = true;
+			}
 		}
 
 		if (rect.text)
 		{
 			Font* font = rect.text->getFont();
-			if (!font) font = m_font_manager->getDefaultFont();
-
-			const char* text_cstr = rect.text->text.c_str();
-			float font_size = (float)rect.text->getFontSize();
-			Vec2 text_size = font->CalcTextSizeA(font_size, FLT_MAX, 0, text_cstr);
-			Vec2 text_pos(l, t);
-
-			switch (rect.text->horizontal_align)
+			if (!font)
 			{
-				case TextHAlign::LEFT: break;
-				case TextHAlign::RIGHT: text_pos.x = r - text_size.x; break;
-				case TextHAlign::CENTER: text_pos.x = (r + l - text_size.x) * 0.5f; break; 
+				font = m_font_manager->getDefaultFont();
+				if (rect.text->getFontResource()) m_is_draw_cache_volatile = true;
 			}
 
-			draw.AddText(font, font_size, text_pos, rect.text->color, text_cstr);
-			renderTextCursor(rect, draw, text_pos);
+			float font_size = (float)rect.text->getFontSize();
+			draw.AddText(font, font_size, getTextPos(rect, font), rect.text->color, rect.text->text.c_str());
 		}
+	}
+
+
+	void renderRect(GUIRect& rect, Draw2D& draw, const Rect& parent_rect)
+	{
+		if (!rect.flags.isSet(GUIRect::IS_VALID)) return;
+		if (!rect.flags.isSet(GUIRect::IS_ENABLED)) return;
+
+		rect.layout = getRectOnCanvas(parent_rect, rect);
+		++m_rendered_rects_count;
+
+		float l = rect.layout.x;
+		float t = rect.layout.y;
+		float r = rect.layout.x + rect.layout.w;
+		float b = rect.layout.y + rect.layout.h;
+		if (rect.flags.isSet(GUIRect::IS_CLIP)) draw.PushClipRect({ l, t }, { r, b });
+
+		renderRectContent(rect, draw);
 
 		GameObject child = m_project.getFirstChild(rect.gameobject);
 		while (child.isValid())
@@ -308,7 +433,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 			int idx = m_rects.find(child);
 			if (idx >= 0)
 			{
-				renderRect(*m_rects.at(idx), pipeline, { l, t, r - l, b - t });
+				renderRect(*m_rects.at(idx), draw, rect.layout);
 			}
 			child = m_project.getNextSibling(child);
 		}
@@ -316,12 +441,92 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 	}
 
 
+	void beginDrawCache(GUIDrawCache& cache)
+	{
+		FontAtlas& atlas = m_font_manager->getFontAtlas();
+		Draw2D& draw = cache.draw;
+		draw.Clear();
+		draw.FontTexUvWhitePixel = atlas.TexUvWhitePixel;
+		draw.PushClipRectFullScreen();
+		draw.PushTextureID(atlas.TexID);
+		m_is_draw_cache_volatile = false;
+	}
+
+
+	void endDrawCache(GUIDrawCache& cache)
+	{
+		cache.is_dirty = m_is_draw_cache_volatile;
+	}
+
+
+	GUIDrawCache& getDrawCache(GameObject gameobject)
+	{
+		auto iter = m_draw_caches.find(gameobject);
+		if (iter.isValid()) return *iter.value();
+
+		GUIDrawCache* cache = MALMY_NEW(m_allocator, GUIDrawCache)(m_allocator);
+		m_draw_caches.insert(gameobject, cache);
+		return *cache;
+	}
+
+
 	void render(Pipeline& pipeline, const Vec2& canvas_size) override
 	{
 		if (!m_root) return;
+		PROFILE_FUNCTION();
 
+		auto& sprite_manager = (SpriteManager&)*m_system.getEngine().getResourceManager().get(Sprite::TYPE);
+		u32 atlas_generation = sprite_manager.getAtlas().getGeneration();
+		if (m_canvas_size.x != canvas_size.x || m_canvas_size.y != canvas_size.y
+			|| m_hierarchy_version != m_project.getHierarchyVersion()
+			|| m_atlas_generation != atlas_generation)
+		{
+			invalidateAll();
+			m_hierarchy_version = m_project.getHierarchyVersion();
+			m_atlas_generation = atlas_generation;
+		}
 		m_canvas_size = canvas_size;
-		renderRect(*m_root, pipeline, {0, 0, canvas_size.x, canvas_size.y});
+		m_rendered_rects_count = 0;
+
+		GUIRect& root = *m_root;
+		if (!root.flags.isSet(GUIRect::IS_VALID)) return;
+		if (!root.flags.isSet(GUIRect::IS_ENABLED)) return;
+
+		root.layout = getRectOnCanvas({ 0, 0, canvas_size.x, canvas_size.y }, root);
+		bool is_clip = root.flags.isSet(GUIRect::IS_CLIP);
+		Vec2 clip_min(root.layout.x, root.layout.y);
+		Vec2 clip_max(root.layout.x + root.layout.w, root.layout.y + root.layout.h);
+
+		if (m_root_draw_cache.is_dirty)
+		{
+			beginDrawCache(m_root_draw_cache);
+			if (is_clip) m_root_draw_cache.draw.PushClipRect(clip_min, clip_max);
+			renderRectContent(root, m_root_draw_cache.draw);
+			endDrawCache(m_root_draw_cache);
+		}
+		Draw2D& draw = pipeline.getDraw2D();
+		draw.AddDrawList(m_root_draw_cache.draw);
+
+		for (GameObject child = m_project.getFirstChild(root.gameobject); child.isValid(); child = m_project.getNextSibling(child))
+		{
+			int idx = m_rects.find(child);
+			if (idx < 0) continue;
+
+			GUIDrawCache& cache = getDrawCache(child);
+			if (cache.is_dirty)
+			{
+				beginDrawCache(cache);
+				if (is_clip) cache.draw.PushClipRect(clip_min, clip_max);
+				renderRect(*m_rects.at(idx), cache.draw, root.layout);
+				endDrawCache(cache);
+			}
+			draw.AddDrawList(cache.draw);
+		}
+		PROFILE_INT("regenerated rects", m_rendered_rects_count);
+
+		if (is_clip) draw.PushClipRect(clip_min, clip_max);
+		renderTextCursor(draw);
+		if (is_clip) draw.PopClipRect();
 	}
 
 
@@ -349,7 +554,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 	}
 
 
-	void enableImage(GameObject gameobject, bool enable) override { m_rects[gameobject]->image->flags.set(GUIImage::IS_ENABLED, enable); }
+	void enableImage(GameObject gameobject, bool enable) override { m_rects[gameobject]->image->flags.set(GUIImage::IS_ENABLED, enable); invalidate(gameobject); }
 	bool isImageEnabled(GameObject gameobject) override { return m_rects[gameobject]->image->flags.isSet(GUIImage::IS_ENABLED); }
 
 
@@ -405,6 +610,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 		{
 			image->sprite = nullptr;
 		}
+		invalidate(gameobject);
 	}
 
 
@@ -412,6 +618,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 	{
 		GUIImage* image = m_rects[gameobject]->image;
 		image->color = RGBAVec4ToABGRu32(color);
+		invalidate(gameobject);
 	}
 
 
@@ -492,35 +699,36 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 		return { l, t, r - l, b - t };
 	}
 
-	void setRectClip(GameObject gameobject, bool enable) override { m_rects[gameobject]->flags.set(GUIRect::IS_CLIP, enable); }
+	void setRectClip(GameObject gameobject, bool enable) override { m_rects[gameobject]->flags.set(GUIRect::IS_CLIP, enable); invalidate(gameobject); }
 	bool getRectClip(GameObject gameobject) override { return m_rects[gameobject]->flags.isSet(GUIRect::IS_CLIP); }
-	void enableRect(GameObject gameobject, bool enable) override { m_rects[gameobject]->flags.set(GUIRect::IS_ENABLED, enable); }
+	void enableRect(GameObject gameobject, bool enable) override { m_rects[gameobject]->flags.set(GUIRect::IS_ENABLED, enable); invalidate(gameobject); }
 	bool isRectEnabled(GameObject gameobject) override { return m_rects[gameobject]->flags.isSet(GUIRect::IS_ENABLED); }
 	float getRectLeftPoints(GameObject gameobject) override { return m_rects[gameobject]->left.points; }
-	void setRectLeftPoints(GameObject gameobject, float value) override { m_rects[gameobject]->left.points = value; }
+	void setRectLeftPoints(GameObject gameobject, float value) override { m_rects[gameobject]->left.points = value; invalidate(gameobject); }
 	float getRectLeftRelative(GameObject gameobject) override { return m_rects[gameobject]->left.relative; }
-	void setRectLeftRelative(GameObject gameobject, float value) override { m_rects[gameobject]->left.relative = value; }
+	void setRectLeftRelative(GameObject gameobject, float value) override { m_rects[gameobject]->left.relative = value; invalidate(gameobject); }
 
 	float getRectRightPoints(GameObject gameobject) override { return m_rects[gameobject]->right.points; }
-	void setRectRightPoints(GameObject gameobject, float value) override { m_rects[gameobject]->right.points = value; }
+	void setRectRightPoints(GameObject gameobject, float value) override { m_rects[gameobject]->right.points = value; invalidate(gameobject); }
 	float getRectRightRelative(GameObject gameobject) override { return m_rects[gameobject]->right.relative; }
-	void setRectRightRelative(GameObject gameobject, float value) override { m_rects[gameobject]->right.relative = value; }
+	void setRectRightRelative(GameObject gameobject, float value) override { m_rects[gameobject]->right.relative = value; invalidate(gameobject); }
 
 	float getRectTopPoints(GameObject gameobject) override { return m_rects[gameobject]->top.points; }
-	void setRectTopPoints(GameObject gameobject, float value) override { m_rects[gameobject]->top.points = value; }
+	void setRectTopPoints(GameObject gameobject, float value) override { m_rects[gameobject]->top.points = value; invalidate(gameobject); }
 	float getRectTopRelative(GameObject gameobject) override { return m_rects[gameobject]->top.relative; }
-	void setRectTopRelative(GameObject gameobject, float value) override { m_rects[gameobject]->top.relative = value; }
+	void setRectTopRelative(GameObject gameobject, float value) override { m_rects[gameobject]->top.relative = value; invalidate(gameobject); }
 
 	float getRectBottomPoints(GameObject gameobject) override { return m_rects[gameobject]->bottom.points; }
-	void setRectBottomPoints(GameObject gameobject, float value) override { m_rects[gameobject]->bottom.points = value; }
+	void setRectBottomPoints(GameObject gameobject, float value) override { m_rects[gameobject]->bottom.points = value; invalidate(gameobject); }
 	float getRectBottomRelative(GameObject gameobject) override { return m_rects[gameobject]->bottom.relative; }
-	void setRectBottomRelative(GameObject gameobject, float value) override { m_rects[gameobject]->bottom.relative = value; }
+	void setRectBottomRelative(GameObject gameobject, float value) override { m_rects[gameobject]->bottom.relative = value; invalidate(gameobject); }
 
 
 	void setTextFontSize(GameObject gameobject, int value) override
 	{
 		GUIText* gui_text = m_rects[gameobject]->text;
 		gui_text->setFontSize(value);
+		invalidate(gameobject);
 	}
 	
 	
@@ -542,6 +750,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 	{
 		GUIText* gui_text = m_rects[gameobject]->text;
 		gui_text->color = RGBAVec4ToABGRu32(color);
+		invalidate(gameobject);
 	}
 
 
@@ -557,6 +766,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 		GUIText* gui_text = m_rects[gameobject]->text;
 		FontResource* res = path.isValid() ? (FontResource*)m_font_manager->load(path) : nullptr;
 		gui_text->setFontResource(res);
+		invalidate(gameobject);
 	}
 
 
@@ -572,13 +782,15 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 	{
 		GUIText* gui_text = m_rects[gameobject]->text;
 		gui_text->horizontal_align = value;
+		invalidate(gameobject);
 	}
 
 
 	void setText(GameObject gameobject, const char* value) override
 	{
 		GUIText* gui_text = m_rects[gameobject]->text;
-		gui_text->text = value;
+		gui_text->setText(value);
+		invalidate(gameobject);
 	}
 
 
@@ -610,6 +822,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void deserializeRect(IDeserializer& serializer, GameObject gameobject, int /*scene_version*/)
 	{
+		invalidateAll();
 		int idx = m_rects.find(gameobject);
 		GUIRect* rect;
 		if (idx >= 0)
@@ -648,6 +861,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void deserializeRenderTarget(IDeserializer& serializer, GameObject gameobject, int /*scene_version*/)
 	{
+		invalidateAll();
 		int idx = m_rects.find(gameobject);
 		if (idx < 0)
 		{
@@ -671,6 +885,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 	
 	void deserializeButton(IDeserializer& serializer, GameObject gameobject, int /*scene_version*/)
 	{
+		invalidateAll();
 		GUIButton& button = m_buttons.emplace(gameobject);
 		serializer.read(&button.normal_color);
 		serializer.read(&button.hovered_color);
@@ -685,6 +900,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void deserializeInputField(IDeserializer& serializer, GameObject gameobject, int /*scene_version*/)
 	{
+		invalidateAll();
 		int idx = m_rects.find(gameobject);
 		if (idx < 0)
 		{
@@ -710,6 +926,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void deserializeImage(IDeserializer& serializer, GameObject gameobject, int /*scene_version*/)
 	{
+		invalidateAll();
 		int idx = m_rects.find(gameobject);
 		if (idx < 0)
 		{
@@ -752,6 +969,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void deserializeText(IDeserializer& serializer, GameObject gameobject, int /*scene_version*/)
 	{
+		invalidateAll();
 		int idx = m_rects.find(gameobject);
 		if (idx < 0)
 		{
@@ -779,6 +997,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void clear() override
 	{
+		invalidateAll();
 		for (GUIRect* rect : m_rects)
 		{
 			MALMY_DELETE(m_allocator, rect->input_field);
@@ -800,6 +1019,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 		if (rect.image) rect.image->color = button.normal_color;
 		if (rect.text) rect.text->color = button.normal_color;
+		invalidate(rect.gameobject);
 
 		m_rect_hovered_out.invoke(rect.gameobject);
 	}
@@ -814,6 +1034,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 		if (rect.image) rect.image->color = button.hovered_color;
 		if (rect.text) rect.text->color = button.hovered_color;
+		invalidate(rect.gameobject);
 
 		m_rect_hovered.invoke(rect.gameobject);
 	}
@@ -929,6 +1150,8 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 		if (!rect) return;
 		rect->text->text.insert(rect->input_field->cursor, event.data.text.text);
 		rect->input_field->cursor += stringLength(event.data.text.text);
+		rect->text->onTextEdited();
+		invalidate(rect->gameobject);
 	}
 
 
@@ -964,6 +1187,8 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 				if (rect->input_field->cursor < rect->text->text.length()) ++rect->input_field->cursor;
 				break;
 		}
+		rect->text->onTextEdited();
+		invalidate(rect->gameobject);
 	}
 
 
@@ -1031,6 +1256,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void createRect(GameObject gameobject)
 	{
+		invalidateAll();
 		int idx = m_rects.find(gameobject);
 		GUIRect* rect;
 		if (idx >= 0)
@@ -1052,6 +1278,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void createText(GameObject gameobject)
 	{
+		invalidateAll();
 		int idx = m_rects.find(gameobject);
 		if (idx < 0)
 		{
@@ -1067,6 +1294,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void createRenderTarget(GameObject gameobject)
 	{
+		invalidateAll();
 		int idx = m_rects.find(gameobject);
 		if (idx < 0)
 		{
@@ -1080,6 +1308,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void createButton(GameObject gameobject)
 	{
+		invalidateAll();
 		int idx = m_rects.find(gameobject);
 		if (idx < 0)
 		{
@@ -1099,6 +1328,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void createInputField(GameObject gameobject)
 	{
+		invalidateAll();
 		int idx = m_rects.find(gameobject);
 		if (idx < 0)
 		{
@@ -1114,6 +1344,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void createImage(GameObject gameobject)
 	{
+		invalidateAll();
 		int idx = m_rects.find(gameobject);
 		if (idx < 0)
 		{
@@ -1146,6 +1377,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void destroyRect(GameObject gameobject)
 	{
+		invalidateAll();
 		GUIRect* rect = m_rects[gameobject];
 		rect->flags.set(GUIRect::IS_VALID, false);
 		if (rect->image == nullptr && rect->text == nullptr && rect->input_field == nullptr)
@@ -1164,6 +1396,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void destroyButton(GameObject gameobject)
 	{
+		invalidateAll();
 		m_buttons.erase(gameobject);
 		m_project.onComponentDestroyed(gameobject, GUI_BUTTON_TYPE, this);
 	}
@@ -1171,6 +1404,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void destroyRenderTarget(GameObject gameobject)
 	{
+		invalidateAll();
 		GUIRect* rect = m_rects[gameobject];
 		rect->render_target = nullptr;
 		m_project.onComponentDestroyed(gameobject, GUI_RENDER_TARGET_TYPE, this);
@@ -1179,6 +1413,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void destroyInputField(GameObject gameobject)
 	{
+		invalidateAll();
 		GUIRect* rect = m_rects[gameobject];
 		MALMY_DELETE(m_allocator, rect->input_field);
 		rect->input_field = nullptr;
@@ -1188,6 +1423,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void destroyImage(GameObject gameobject)
 	{
+		invalidateAll();
 		GUIRect* rect = m_rects[gameobject];
 		MALMY_DELETE(m_allocator, rect->image);
 		rect->image = nullptr;
@@ -1197,6 +1433,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void destroyText(GameObject gameobject)
 	{
+		invalidateAll();
 		GUIRect* rect = m_rects[gameobject];
 		MALMY_DELETE(m_allocator, rect->text);
 		rect->text = nullptr;
@@ -1250,6 +1487,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 
 	void deserialize(InputBlob& serializer) override
 	{
+		invalidateAll();
 		clear();
 		int count = serializer.read<int>();
 		for (int i = 0; i < count; ++i)
@@ -1326,6 +1564,7 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 	void setRenderTarget(GameObject gameobject, bgfx::TextureHandle* texture_handle) override
 	{
 		m_rects[gameobject]->render_target = texture_handle;
+		invalidate(gameobject);
 	}
 
 	
@@ -1354,14 +1593,20 @@ struct GUISceneImpl MALMY_FINAL : public GUIScene
 	Project& m_project;
 	GUISystem& m_system;
 	
-	AssociativeArray<GameObject, GUIRect*> m_rects;
-	AssociativeArray<GameObject, GUIButton> m_buttons;
+	SparseSet<GameObject, GUIRect*> m_rects;
+	SparseSet<GameObject, GUIButton> m_buttons;
 	GameObject m_buttons_down[16];
 	int m_buttons_down_count;
 	GameObject m_focused_gameobject = INVALID_GAMEOBJECT;
 	GUIRect* m_root = nullptr;
 	FontManager* m_font_manager = nullptr;
 	Vec2 m_canvas_size;
+	HashMap<GameObject, GUIDrawCache*> m_draw_caches;
+	GUIDrawCache m_root_draw_cache;
+	u32 m_hierarchy_version;
+	u32 m_atlas_generation = 0;
+	bool m_is_draw_cache_volatile = false;
+	int m_rendered_rects_count = 0;
 	Vec2 m_mouse_down_pos;
 	DelegateList<void(GameObject)> m_button_clicked;
 	DelegateList<void(GameObject)> m_rect_hovered;
@@ -1,6 +1,8 @@
 #include "sprite_manager.h"
 #include "engine/json_serializer.h"
 #include "engine/log.h"
+#include "engine/math_utils.h"
+#include "engine/profiler.h"
 #include "engine/resource_manager.h"
 #include "renderer/texture.h"
 #include "renderer/texture_manager.h"
@@ -16,34 +18,91 @@ const ResourceType Sprite::TYPE("sprite");
 
 Sprite::Sprite(const Path& path, ResourceManagerBase& manager, IAllocator& allocator)
 	: Resource(path, manager, allocator)
+	, use_atlas(false)
 	, m_texture(nullptr)
+	, m_atlas_page(-1)
+	, m_has_data_reference(false)
 {
 }
 
 
 void Sprite::unload()
+{
+	releaseTexture();
+}
+
+
+void Sprite::releaseTexture()
 {
 	if (!m_texture) return;
-	
+
+	if (m_atlas_page >= 0)
+	{
+		((SpriteManager&)getResourceManager()).m_atlas.release(m_atlas_page);
+		m_atlas_page = -1;
+	}
+	if (m_has_data_reference)
+	{
+		m_texture->removeDataReference();
+		m_has_data_reference = false;
+	}
 	m_texture->getResourceManager().unload(*m_texture);
 	m_texture = nullptr;
 }
 
 
-void Sprite::setTexture(const Path& path)
+void Sprite::loadTexture(const Path& path)
 {
-	if (m_texture)
+	auto* manager = getResourceManager().getOwner().get(Texture::TYPE);
+	m_texture = (Texture*)manager->load(path);
+	if (use_atlas)
 	{
-		m_texture->getResourceManager().unload(*m_texture);
+		// pixels are needed on CPU to copy them into the atlas
+		m_texture->addDataReference();
+		m_has_data_reference = true;
 	}
-	if (path.isValid())
+}
+
+
+void Sprite::setTexture(const Path& path)
+{
+	releaseTexture();
+	if (path.isValid()) loadTexture(path);
+}
+
+
+bool Sprite::getDrawData(bgfx::TextureHandle** texture, Vec2* uv0, Vec2* uv1)
+{
+	ASSERT(m_texture);
+	SpriteAtlas& atlas = ((SpriteManager&)getResourceManager()).m_atlas;
+	if (m_atlas_page < 0 && m_has_data_reference && m_texture->isReady())
 	{
-		m_texture = (Texture*)getResourceManager().getOwner().get(Texture::TYPE)->load(path);
+		if (!m_texture->getData())
+		{
+			g_log_warning.log("gui") << "Texture " << m_texture->getPath()
+				<< " has no CPU pixel data, sprite " << getPath() << " is not atlased";
+		}
+		else
+		{
+			m_atlas_page = atlas.add(*m_texture, &m_atlas_uv0, &m_atlas_uv1);
+		}
+		// sprites which can not be packed (no pixel data, too big, not RGBA8, ...) stay standalone
+		m_texture->removeDataReference();
+		m_has_data_reference = false;
 	}
-	else
+
+	if (m_atlas_page >= 0)
 	{
-		m_texture = nullptr;
+		*texture = atlas.getPageTexture(m_atlas_page);
+		*uv0 = m_atlas_uv0;
+		*uv1 = m_atlas_uv1;
+		return true;
 	}
+
+	*texture = &m_texture->handle;
+	*uv0 = { 0, 0 };
+	*uv1 = { 1, 1 };
+	return m_texture->isReady() && !m_has_data_reference;
 }
 
 
@@ -57,6 +116,7 @@ bool Sprite::save(JsonSerializer& serializer)
 	serializer.serialize("bottom", bottom);
 	serializer.serialize("left", left);
 	serializer.serialize("right", right);
+	serializer.serialize("atlas", use_atlas);
 	serializer.serialize("texture", m_texture ? m_texture->getPath().c_str() : "");
 	serializer.endObject();
 
@@ -69,6 +129,7 @@ bool Sprite::load(FS::IFile& file)
 	auto& manager = (SpriteManager&)getResourceManager();
 	IAllocator& allocator = manager.m_allocator;
 	JsonDeserializer serializer(file, getPath(), allocator);
+	char texture_path[MAX_PATH_LENGTH] = "";
 	serializer.deserializeObjectBegin();
 	while (!serializer.isObjectEnd())
 	{
@@ -95,25 +156,139 @@ bool Sprite::load(FS::IFile& file)
 		{
 			serializer.deserialize(right, 0);
 		}
+		else if (equalIStrings(tmp, "atlas"))
+		{
+			serializer.deserialize(use_atlas, false);
+		}
 		else if (equalIStrings(tmp, "texture"))
 		{
-			char texture_path[MAX_PATH_LENGTH];
 			serializer.deserialize(texture_path, lengthOf(texture_path), "");
-			auto* mng = m_resource_manager.getOwner().get(Texture::TYPE);
-			m_texture = texture_path[0] != '\0' ? (Texture*)mng->load(Path(texture_path)) : nullptr;
 		}
 		else
 		{
 			g_log_error.log("gui") << "Unknown label " << tmp << " in " << getPath();
 		}
 	}
+	// texture is loaded after all labels are read, so it does not depend on their order
+	if (texture_path[0] != '\0') loadTexture(Path(texture_path));
 	return true;
 }
 
 
+SpriteAtlas::SpriteAtlas(IAllocator& allocator)
+	: m_allocator(allocator)
+	, m_pages(allocator)
+	, m_generation(0)
+{
+}
+
+
+SpriteAtlas::~SpriteAtlas()
+{
+	for (Page* page : m_pages)
+	{
+		bgfx::destroy(page->handle);
+		MALMY_DELETE(m_allocator, page);
+	}
+}
+
+
+bool SpriteAtlas::allocate(Page& page, int w, int h, int* x, int* y) const
+{
+	if (page.cursor_x + w > PAGE_SIZE)
+	{
+		page.shelf_y += page.shelf_height;
+		page.shelf_height = 0;
+		page.cursor_x = 0;
+	}
+	if (page.shelf_y + h > PAGE_SIZE) return false;
+
+	*x = page.cursor_x;
+	*y = page.shelf_y;
+	page.cursor_x += w;
+	page.shelf_height = Math::maximum(page.shelf_height, h);
+	return true;
+}
+
+
+int SpriteAtlas::add(const Texture& texture, Vec2* uv0, Vec2* uv1)
+{
+	PROFILE_FUNCTION();
+	if (texture.getData() == nullptr || texture.bytes_per_pixel != 4) return -1;
+	if (texture.is_cubemap || texture.depth > 1 || texture.layers > 1 || texture.tile_size != 0) return -1;
+	if (texture.width > MAX_SPRITE_SIZE || texture.height > MAX_SPRITE_SIZE) return -1;
+	if (texture.data.size() < texture.width * texture.height * 4) return -1;
+
+	int w = texture.width + PADDING * 2;
+	int h = texture.height + PADDING * 2;
+	int x, y;
+	int page_idx = -1;
+	for (int i = 0, c = m_pages.size(); i < c; ++i)
+	{
+		if (allocate(*m_pages[i], w, h, &x, &y))
+		{
+			page_idx = i;
+			break;
+		}
+	}
+	if (page_idx < 0)
+	{
+		Page* page = MALMY_NEW(m_allocator, Page);
+		page->handle = bgfx::createTexture2D(PAGE_SIZE,
+			PAGE_SIZE,
+			false,
+			1,
+			bgfx::TextureFormat::RGBA8,
+			BGFX_TEXTURE_U_CLAMP | BGFX_TEXTURE_V_CLAMP,
+			nullptr);
+		bgfx::setName(page->handle, "sprite_atlas");
+		page->cursor_x = page->shelf_y = page->shelf_height = page->sprites_count = 0;
+		m_pages.push(page);
+		page_idx = m_pages.size() - 1;
+		bool allocated = allocate(*page, w, h, &x, &y);
+		ASSERT(allocated);
+	}
+
+	// border texels are repeated into the padding, so bilinear filtering does not bleed between sprites
+	const bgfx::Memory* mem = bgfx::alloc(w * h * 4);
+	const u32* src = (const u32*)texture.getData();
+	u32* dst = (u32*)mem->data;
+	for (int j = 0; j < h; ++j)
+	{
+		int src_y = Math::clamp(j - PADDING, 0, texture.height - 1);
+		for (int i = 0; i < w; ++i)
+		{
+			int src_x = Math::clamp(i - PADDING, 0, texture.width - 1);
+			dst[i + j * w] = src[src_x + src_y * texture.width];
+		}
+	}
+	Page& page = *m_pages[page_idx];
+	bgfx::updateTexture2D(page.handle, 0, 0, (u16)x, (u16)y, (u16)w, (u16)h, mem);
+	++page.sprites_count;
+
+	*uv0 = { (x + PADDING) / (float)PAGE_SIZE, (y + PADDING) / (float)PAGE_SIZE };
+	*uv1 = { (x + PADDING + texture.width) / (float)PAGE_SIZE, (y + PADDING + texture.height) / (float)PAGE_SIZE };
+	return page_idx;
+}
+
+
+void SpriteAtlas::release(int page_idx)
+{
+	Page& page = *m_pages[page_idx];
+	--page.sprites_count;
+	// the released region can be reused by another sprite
+	++m_generation;
+	if (page.sprites_count == 0)
+	{
+		page.cursor_x = page.shelf_y = page.shelf_height = 0;
+	}
+}
+
+
 SpriteManager::SpriteManager(IAllocator& allocator)
 	: ResourceManagerBase(allocator)
 	, m_allocator(allocator)
+	, m_atlas(allocator)
 {
 }
 
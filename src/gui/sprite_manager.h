@@ -1,8 +1,11 @@
 #pragma once
 
 
+#include "engine/array.h"
 #include "engine/resource.h"
 #include "engine/resource_manager_base.h"
+#include "engine/vec.h"
+#include <bgfx/bgfx.h>
 
 
 namespace Malmy
@@ -33,17 +36,70 @@ public:
 	
 	void setTexture(const Path& path);
 	Texture* getTexture() const { return m_texture; }
+	// texture and uv rectangle to draw the sprite with, either its own texture or a page of SpriteAtlas;
+	// returns false while these can still change
+	bool getDrawData(bgfx::TextureHandle** texture, Vec2* uv0, Vec2* uv1);
+	bool isInAtlas() const { return m_atlas_page >= 0; }
 
 	Type type;
 	int top;
 	int bottom;
 	int left;
 	int right;
+	bool use_atlas;
 
 	static const ResourceType TYPE;
 
+private:
+	void loadTexture(const Path& path);
+	void releaseTexture();
+
 private:
 	Texture* m_texture;
+	int m_atlas_page;
+	Vec2 m_atlas_uv0;
+	Vec2 m_atlas_uv1;
+	bool m_has_data_reference;
+};
+
+
+// Packs small uncompressed sprite textures into shared pages, so GUI images using different sprites
+// end up in the same Draw2D command. Pages are filled by shelves and reset once no sprite uses them.
+class SpriteAtlas
+{
+public:
+	static const int PAGE_SIZE = 1024;
+	static const int MAX_SPRITE_SIZE = 256;
+	static const int PADDING = 1;
+
+public:
+	explicit SpriteAtlas(IAllocator& allocator);
+	~SpriteAtlas();
+
+	// returns page or -1 if the texture can not be packed
+	int add(const Texture& texture, Vec2* uv0, Vec2* uv1);
+	void release(int page);
+	bgfx::TextureHandle* getPageTexture(int page) { return &m_pages[page]->handle; }
+	int getPagesCount() const { return m_pages.size(); }
+	// changes whenever previously returned uvs can become invalid, retained draws must be rebuilt then
+	u32 getGeneration() const { return m_generation; }
+
+private:
+	struct Page
+	{
+		bgfx::TextureHandle handle;
+		int cursor_x;
+		int shelf_y;
+		int shelf_height;
+		int sprites_count;
+	};
+
+	bool allocate(Page& page, int w, int h, int* x, int* y) const;
+
+private:
+	IAllocator& m_allocator;
+	Array<Page*> m_pages;
+	u32 m_generation;
 };
 
 
@@ -53,12 +109,15 @@ friend class Sprite;
 public:
 	SpriteManager(IAllocator& allocator);
 
+	SpriteAtlas& getAtlas() { return m_atlas; }
+
 private:
 	Resource* createResource(const Path& path) override;
 	void destroyResource(Resource& resource) override;
 
 private:
 	IAllocator& m_allocator;
+	SpriteAtlas m_atlas;
 };
 
 
@@ -11,6 +11,7 @@
 #include "engine/resource_manager.h"
 #include "engine/resource_manager_base.h"
 #include "engine/serializer.h"
+#include "engine/sparse_set.h"
 #include "engine/project/project.h"
 #include "lua_script/lua_script_system.h"
 #include "physics/physics_geometry_manager.h"
@@ -219,7 +220,7 @@ struct PhysicsSceneImpl MALMY_FINAL : public PhysicsScene
 				PROFILE_FUNCTION();
 				task->run();
 				task->release();
-			}, nullptr, JobSystem::INVALID_HANDLE);
+			}, nullptr, JobSystem::INVALID_HANDLE, task.getName());
 		}
 		PxU32 getWorkerCount() const override { return MT::getCPUsCount(); }
 	};
@@ -2518,6 +2519,15 @@ struct PhysicsSceneImpl MALMY_FINAL : public PhysicsScene
 
 		int width = terrain.m_heightmap->width;
 		int height = terrain.m_heightmap->height;
+		float xz_scale = terrain.m_xz_scale;
+		if (terrain.m_heightmap->tile_size > 0)
+		{
+			// tiled heightmaps keep only the coarsest level in memory
+			const int coarse_mip = terrain.m_heightmap->mips - 1;
+			width = Math::maximum(1, width >> coarse_mip);
+			height = Math::maximum(1, height >> coarse_mip);
+			xz_scale *= float(1 << coarse_mip);
+		}
 		heights.resize(width * height);
 		int bytes_per_pixel = terrain.m_heightmap->bytes_per_pixel;
 		if (bytes_per_pixel == 2)
@@ -2569,8 +2579,8 @@ struct PhysicsSceneImpl MALMY_FINAL : public PhysicsScene
 			PxHeightFieldGeometry hfGeom(heightfield,
 				PxMeshGeometryFlags(),
 				height_scale * terrain.m_y_scale,
-				terrain.m_xz_scale,
-				terrain.m_xz_scale);
+				xz_scale,
+				xz_scale);
 			if (terrain.m_actor)
 			{
 				PxRigidActor* actor = terrain.m_actor;
@@ -5020,11 +5030,11 @@ struct PhysicsSceneImpl MALMY_FINAL : public PhysicsScene
 	PxControllerManager* m_controller_manager;
 	PxMaterial* m_default_material;
 
-	AssociativeArray<GameObject, RigidActor*> m_actors;
-	AssociativeArray<GameObject, Ragdoll> m_ragdolls;
-	AssociativeArray<GameObject, Joint> m_joints;
-	AssociativeArray<GameObject, Controller> m_controllers;
-	AssociativeArray<GameObject, Heightfield> m_terrains;
+	SparseSet<GameObject, RigidActor*> m_actors;
+	SparseSet<GameObject, Ragdoll> m_ragdolls;
+	SparseSet<GameObject, Joint> m_joints;
+	SparseSet<GameObject, Controller> m_controllers;
+	SparseSet<GameObject, Heightfield> m_terrains;
 
 	Array<RigidActor*> m_dynamic_actors;
 	RigidActor* m_update_in_progress;
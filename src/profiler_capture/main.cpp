@@ -0,0 +1,308 @@
+#include "engine/array.h"
+#include "engine/blob.h"
+#include "engine/default_allocator.h"
+#include "engine/fs/os_file.h"
+#include "engine/hash_map.h"
+#include "engine/job_system.h"
+#include "engine/profiler.h"
+#include "engine/string.h"
+#include <cstdio>
+
+
+using namespace Malmy;
+
+
+// Converts a capture written by Profiler::startCapture to the Chrome trace event format,
+// the result can be opened in chrome://tracing or https://ui.perfetto.dev
+struct Converter
+{
+	static const int FLUSH_SIZE = 1024 * 1024;
+
+	explicit Converter(IAllocator& allocator)
+		: m_strings(allocator)
+		, m_string_offsets(allocator)
+		, m_thread_depths(allocator)
+		, m_thread_lost_sizes(allocator)
+		, m_chunk(allocator)
+		, m_out(allocator)
+		, m_base_time(0)
+		, m_has_base_time(false)
+		, m_is_first_event(true)
+	{
+	}
+
+
+	u64 readPointer(const u8* data) const
+	{
+		if (m_header.pointer_size == 4)
+		{
+			u32 value;
+			copyMemory(&value, data, sizeof(value));
+			return value;
+		}
+		u64 value;
+		copyMemory(&value, data, sizeof(value));
+		return value;
+	}
+
+
+	const char* getString(u64 ptr) const
+	{
+		auto iter = m_string_offsets.find(ptr);
+		if (!iter.isValid()) return "N/A";
+		return &m_strings[iter.value()];
+	}
+
+
+	void writeEscaped(const char* str)
+	{
+		for (const char* c = str; *c; ++c)
+		{
+			if (*c == '"' || *c == '\\')
+			{
+				char tmp[] = { '\\', *c, 0 };
+				m_out << tmp;
+			}
+			else if ((u8)*c < 0x20)
+			{
+				m_out << " ";
+			}
+			else
+			{
+				char tmp[] = { *c, 0 };
+				m_out << tmp;
+			}
+		}
+	}
+
+
+	void writeTime(u64 time)
+	{
+		if (!m_has_base_time)
+		{
+			m_base_time = time;
+			m_has_base_time = true;
+		}
+		double us = time < m_base_time ? 0 : double(time - m_base_time) * 1'000'000 / m_header.frequency;
+		u64 whole = u64(us);
+		u32 fraction = u32((us - whole) * 1000);
+		char tmp[8];
+		copyString(tmp, fraction < 100 ? (fraction < 10 ? "00" : "0") : "");
+		m_out << whole << "." << tmp << fraction;
+	}
+
+
+	void beginEvent(const char* phase, const char* name, int thread)
+	{
+		m_out << (m_is_first_event ? "\n" : ",\n") << "{\"ph\":\"" << phase << "\",\"pid\":0,\"tid\":" << thread
+			  << ",\"name\":\"";
+		writeEscaped(name);
+		m_out << "\"";
+		m_is_first_event = false;
+	}
+
+
+	void writeFlow(const char* phase, const char* category, u32 id, u64 time, int thread)
+	{
+		beginEvent(phase, category, thread);
+		// signal handles are reused, the last start with the same id is bound to the next finish
+		m_out << ",\"cat\":\"" << category << "\",\"id\":" << id << ",\"bp\":\"e\",\"ts\":";
+		writeTime(time);
+		m_out << "}";
+	}
+
+
+	void convertEvents(int thread)
+	{
+		while (m_thread_depths.size() <= thread) m_thread_depths.push(0);
+		int& depth = m_thread_depths[thread];
+
+		const u8* data = (const u8*)m_chunk.begin();
+		const u8* end = data + m_chunk.size();
+		while (data + sizeof(Profiler::EventHeader) <= end)
+		{
+			Profiler::EventHeader header;
+			copyMemory(&header, data, sizeof(header));
+			if (header.size < sizeof(header)) break;
+			const u8* payload = data + sizeof(header);
+			switch (header.type)
+			{
+				case Profiler::EventType::BEGIN_BLOCK:
+					++depth;
+					beginEvent("B", getString(readPointer(payload)), thread);
+					m_out << ",\"ts\":";
+					writeTime(header.time);
+					m_out << "}";
+					break;
+				case Profiler::EventType::END_BLOCK:
+					// blocks opened before the capture started
+					if (depth == 0) break;
+					--depth;
+					m_out << ",\n{\"ph\":\"E\",\"pid\":0,\"tid\":" << thread << ",\"ts\":";
+					writeTime(header.time);
+					m_out << "}";
+					break;
+				case Profiler::EventType::FRAME:
+					beginEvent("i", "frame", thread);
+					m_out << ",\"s\":\"g\",\"ts\":";
+					writeTime(header.time);
+					m_out << "}";
+					break;
+				case Profiler::EventType::STRING:
+					beginEvent("i", (const char*)payload, thread);
+					m_out << ",\"s\":\"t\",\"ts\":";
+					writeTime(header.time);
+					m_out << "}";
+					break;
+				case Profiler::EventType::INT:
+				{
+					i32 value;
+					copyMemory(&value, payload + m_header.pointer_size, sizeof(value));
+					beginEvent("C", getString(readPointer(payload)), thread);
+					m_out << ",\"ts\":";
+					writeTime(header.time);
+					m_out << ",\"args\":{\"value\":" << value << "}}";
+					break;
+				}
+				case Profiler::EventType::JOB_SUBMIT:
+				case Profiler::EventType::JOB_START:
+				case Profiler::EventType::JOB_END:
+				{
+					// JobRecord starts with id, signal and precondition
+					u32 ids[3];
+					copyMemory(ids, payload, sizeof(ids));
+					// flow from the submitter to the job and from the job to whoever waits for its signal
+					if (header.type == Profiler::EventType::JOB_SUBMIT) writeFlow("s", "job", ids[0], header.time, thread);
+					else if (header.type == Profiler::EventType::JOB_START) writeFlow("f", "job", ids[0], header.time, thread);
+					else if (JobSystem::isValid(ids[1])) writeFlow("s", "signal", ids[1], header.time, thread);
+					break;
+				}
+				case Profiler::EventType::SIGNAL_WAIT_BEGIN: break;
+				case Profiler::EventType::SIGNAL_WAIT_END:
+				{
+					u32 signal;
+					copyMemory(&signal, payload, sizeof(signal));
+					writeFlow("f", "signal", signal, header.time, thread);
+					break;
+				}
+				case Profiler::EventType::BLOCK_COLOR: break;
+				default: ASSERT(false); break;
+			}
+			data += header.size;
+		}
+	}
+
+
+	bool convert(const char* src_path, const char* dst_path)
+	{
+		FS::OsFile src;
+		if (!src.open(src_path, FS::Mode::OPEN_AND_READ))
+		{
+			printf("Could not open %s\n", src_path);
+			return false;
+		}
+		if (!src.read(&m_header, sizeof(m_header)) || m_header.magic != Profiler::CaptureHeader::MAGIC)
+		{
+			printf("%s is not a profiler capture\n", src_path);
+			src.close();
+			return false;
+		}
+		if (m_header.version > Profiler::CaptureHeader::VERSION)
+		{
+			printf("%s has unsupported version %d\n", src_path, m_header.version);
+			src.close();
+			return false;
+		}
+
+		FS::OsFile dst;
+		if (!dst.open(dst_path, FS::Mode::CREATE_AND_WRITE))
+		{
+			printf("Could not create %s\n", dst_path);
+			src.close();
+			return false;
+		}
+
+		m_out << "{\"traceEvents\":[";
+		const size_t file_size = src.size();
+		Profiler::CaptureChunkHeader chunk;
+		while (src.pos() + sizeof(chunk) <= file_size && src.read(&chunk, sizeof(chunk)))
+		{
+			// the application could have been terminated while writing the last chunk
+			if (src.pos() + chunk.size > file_size) break;
+			m_chunk.resize(chunk.size);
+			if (chunk.size > 0 && !src.read(m_chunk.begin(), chunk.size)) break;
+
+			switch (chunk.type)
+			{
+				case Profiler::CaptureChunkType::THREAD:
+					beginEvent("M", "thread_name", chunk.thread);
+					m_out << ",\"args\":{\"name\":\"";
+					writeEscaped(m_chunk.begin());
+					m_out << "\"}}";
+					break;
+				case Profiler::CaptureChunkType::STRING:
+				{
+					u64 ptr = readPointer((const u8*)m_chunk.begin());
+					m_string_offsets.insert(ptr, m_strings.size());
+					for (int i = m_header.pointer_size; i < m_chunk.size(); ++i) m_strings.push(m_chunk[i]);
+					break;
+				}
+				case Profiler::CaptureChunkType::EVENTS: convertEvents(chunk.thread); break;
+				case Profiler::CaptureChunkType::LOST:
+				{
+					u32 lost_size;
+					copyMemory(&lost_size, m_chunk.begin(), sizeof(lost_size));
+					while (m_thread_lost_sizes.size() <= (int)chunk.thread) m_thread_lost_sizes.push(0);
+					m_thread_lost_sizes[chunk.thread] += lost_size;
+					break;
+				}
+				default: break;
+			}
+
+			if (m_out.getPos() > FLUSH_SIZE)
+			{
+				dst.write(m_out.getData(), m_out.getPos());
+				m_out.clear();
+			}
+		}
+		m_out << "\n]}\n";
+		dst.write(m_out.getData(), m_out.getPos());
+		dst.close();
+		src.close();
+
+		for (int i = 0; i < m_thread_lost_sizes.size(); ++i)
+		{
+			if (m_thread_lost_sizes[i] == 0) continue;
+			printf("Thread %d: %.1f MB of events were overwritten before they were captured\n",
+				i,
+				m_thread_lost_sizes[i] / (1024.0 * 1024.0));
+		}
+		return true;
+	}
+
+
+	Profiler::CaptureHeader m_header;
+	Array<char> m_strings;
+	HashMap<u64, int> m_string_offsets;
+	Array<int> m_thread_depths;
+	Array<u64> m_thread_lost_sizes;
+	Array<char> m_chunk;
+	OutputBlob m_out;
+	u64 m_base_time;
+	bool m_has_base_time;
+	bool m_is_first_event;
+};
+
+
+int main(int argc, char** argv)
+{
+	if (argc != 3)
+	{
+		printf("Usage: profiler_capture <capture> <output.json>\n");
+		return 1;
+	}
+
+	DefaultAllocator allocator;
+	Converter converter(allocator);
+	return converter.convert(argv[1], argv[2]) ? 0 : 1;
+}
@@ -148,7 +148,7 @@ public:
 				i == m_result.size() - 1 ? count - 1 : (i + 1) * step - 1,
 				&frustum
 			};
-			JobSystem::run(&job_data[i], cullTask, &job_counter, JobSystem::INVALID_HANDLE);
+			JobSystem::run(&job_data[i], cullTask, &job_counter, JobSystem::INVALID_HANDLE, "culling");
 		}
 		JobSystem::wait(job_counter);
 		return m_result;
@@ -81,6 +81,40 @@ void Draw2D::AddDrawCmd()
 	CmdBuffer.push(draw_cmd);
 }
 
+void Draw2D::AddDrawList(const Draw2D& src)
+{
+	if (src.IdxBuffer.empty()) return;
+
+	int vtx_offset = VtxBuffer.size();
+	VtxBuffer.resize(vtx_offset + src.VtxBuffer.size());
+	memcpy(&VtxBuffer[vtx_offset], &src.VtxBuffer[0], src.VtxBuffer.size() * sizeof(DrawVert));
+
+	int idx_offset = IdxBuffer.size();
+	IdxBuffer.resize(idx_offset + src.IdxBuffer.size());
+	for (int i = 0, c = src.IdxBuffer.size(); i < c; ++i)
+	{
+		IdxBuffer[idx_offset + i] = (DrawIdx)(src.IdxBuffer[i] + vtx_offset);
+	}
+
+	if (!CmdBuffer.empty() && CmdBuffer.back().ElemCount == 0) CmdBuffer.pop();
+	for (const DrawCmd& cmd : src.CmdBuffer)
+	{
+		if (cmd.ElemCount == 0) continue;
+		DrawCmd* last = !CmdBuffer.empty() ? &CmdBuffer.back() : NULL;
+		if (last && last->TextureId == cmd.TextureId && memcmp(&last->ClipRect, &cmd.ClipRect, sizeof(Vec4)) == 0)
+		{
+			last->ElemCount += cmd.ElemCount;
+		}
+		else
+		{
+			CmdBuffer.push(cmd);
+		}
+	}
+
+	_VtxCurrentIdx = VtxBuffer.size();
+	AddDrawCmd();
+}
+
 // Our scheme may appears a bit unusual, basically we want the most-common calls AddLine AddRect etc. to not have to perform any check so we always have a command ready in the stack.
 // The cost of figuring out if a new command has to be added or if we can merge is paid in those Update** functions only.
 void Draw2D::UpdateClipRect()
@@ -252,6 +252,7 @@ struct MALMY_RENDERER_API Draw2D
 
 	// Advanced
 	void  AddDrawCmd();                                               // This is useful if you need to forcefully create a new draw call (to allow for dependent rendering / blending). Otherwise primitives are merged into the same draw-call as much as possible
+	void  AddDrawList(const Draw2D& src);                             // Append vertices, indices and commands of src, commands keep their clip rect and texture
 
 																		// Internal helpers
 																		// NB: all primitives needs to be reserved via PrimReserve() beforehand!
@@ -17,6 +17,7 @@
 #include "engine/path_utils.h"
 #include "engine/plugin_manager.h"
 #include "engine/reflection.h"
+#include "engine/resource_manager.h"
 #include "engine/system.h"
 #include "engine/project/project.h"
 #include "imgui/imgui.h"
@@ -3071,7 +3072,11 @@ static bool createBillboard(ImportAssetDialog& dialog,
 
 	auto* pipeline = Pipeline::create(*renderer, Path("pipelines/billboard.lua"), "", engine.getAllocator());
 	pipeline->load();
-	while (engine.getFileSystem().hasWork()) engine.getFileSystem().updateAsyncTransactions();
+	while (engine.getFileSystem().hasWork() || engine.getResourceManager().hasWork())
+	{
+		engine.getFileSystem().updateAsyncTransactions();
+		engine.getResourceManager().update();
+	}
 
 	auto mesh_gameobject = project.createGameObject({0, 0, 0}, {0, 0, 0, 0});
 	static const auto MODEL_INSTANCE_TYPE = Reflection::getComponentType("renderable");
@@ -3095,7 +3100,11 @@ static bool createBillboard(ImportAssetDialog& dialog,
 	project.createComponent(GLOBAL_LIGHT_TYPE, light_gameobject);
 	render_scene->setGlobalLightIntensity(light_gameobject, 0);
 
-	while (engine.getFileSystem().hasWork()) engine.getFileSystem().updateAsyncTransactions();
+	while (engine.getFileSystem().hasWork() || engine.getResourceManager().hasWork())
+	{
+		engine.getFileSystem().updateAsyncTransactions();
+		engine.getResourceManager().update();
+	}
 
 	auto* model = render_scene->getModelInstanceModel(mesh_gameobject);
 	int width = 640, height = 480;
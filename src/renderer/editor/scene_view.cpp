@@ -24,6 +24,7 @@
 #include "renderer/pipeline.h"
 #include "renderer/render_scene.h"
 #include "renderer/renderer.h"
+#include "renderer/texture_manager.h"
 #include <SDL.h>
 
 
@@ -520,9 +521,20 @@ void SceneView::onWindowGUI()
 			const auto& stats = m_pipeline->getStats();
 			ImGui::LabelText("Draw calls (scene view only)", "%d", stats.draw_call_count);
 			ImGui::LabelText("Instances (scene view only)", "%d", stats.instance_count);
+			ImGui::LabelText("Elided state commands", "%d", stats.elided_command_count);
+			ImGui::LabelText("Shadow cascade cache",
+				"%s %s %s %s",
+				stats.shadow_cascade_cache_hit[0] ? "hit" : "miss",
+				stats.shadow_cascade_cache_hit[1] ? "hit" : "miss",
+				stats.shadow_cascade_cache_hit[2] ? "hit" : "miss",
+				stats.shadow_cascade_cache_hit[3] ? "hit" : "miss");
 			char buf[30];
 			toCStringPretty(stats.triangle_count, buf, lengthOf(buf));
 			ImGui::LabelText("Triangles (scene view only)", "%s", buf);
+			if (stats.frame_graph_ops_count > 0)
+			{
+				ImGui::LabelText("Replayed pipeline calls", "%d", stats.frame_graph_ops_count);
+			}
 			ImGui::LabelText("GPU memory used", "%dMB", int(bgfx_stats->gpuMemoryUsed / (1024 * 1024)));
 			ImGui::LabelText("Resolution", "%dx%d", m_pipeline->getWidth(), m_pipeline->getHeight());
 			ImGui::LabelText("FPS", "%.2f", m_editor.getEngine().getFPS());
@@ -534,6 +546,23 @@ void SceneView::onWindowGUI()
 			ImGui::LabelText("GPU time", "%.2f", gpu_time);
 			ImGui::LabelText("Waiting for submit", "%.2f", wait_submit_time);
 			ImGui::LabelText("Waiting for render thread", "%.2f", wait_render_time);
+			Engine& engine = m_editor.getEngine();
+			auto* renderer = static_cast<Renderer*>(engine.getPluginManager().getPlugin("renderer"));
+			TextureManager& texture_manager = renderer->getTextureManager();
+			if (texture_manager.isStreamingEnabled())
+			{
+				const TextureManager::StreamingStats& streaming = texture_manager.getStreamingStats();
+				ImGui::LabelText("Streamed textures",
+					"%d (%d full, %d pending)",
+					streaming.streamed_count,
+					streaming.fully_resident_count,
+					streaming.pending_count);
+				ImGui::LabelText("Streamed memory",
+					"%dMB / %dMB",
+					int(streaming.resident_memory / (1024 * 1024)),
+					int(streaming.budget / (1024 * 1024)));
+				ImGui::LabelText("Streaming loads / evictions", "%d / %d", streaming.loads_count, streaming.evictions_count);
+			}
 		}
 		ImGui::End();
 		ImGui::PopStyleColor();
@@ -7,6 +7,7 @@
 #include "editor/utils.h"
 #include "engine/crc32.h"
 #include "engine/engine.h"
+#include "engine/fs/disk_file_device.h"
 #include "engine/geometry.h"
 #include "engine/json_serializer.h"
 #include "engine/log.h"
@@ -22,6 +23,7 @@
 #include "renderer/material.h"
 #include "renderer/model.h"
 #include "renderer/render_scene.h"
+#include "renderer/terrain_tiles.h"
 #include "renderer/texture.h"
 #include "stb/stb_image.h"
 #include <cmath>
@@ -839,6 +841,37 @@ void TerrainEditor::splitSplatmap(const char* dir)
 }
 
 
+void TerrainEditor::convertToTiles()
+{
+	Material* material = getMaterial();
+	if (!material)
+	{
+		g_log_error.log("Renderer") << "Terrain has no material";
+		return;
+	}
+
+	WorldEditor& editor = m_app.getWorldEditor();
+	FS::FileSystem& fs = editor.getEngine().getFileSystem();
+	const char* base_path = editor.getEngine().getDiskFileDevice()->getBasePath();
+	const char* uniforms[] = { HEIGHTMAP_UNIFORM, SPLATMAP_UNIFORM };
+	for (const char* uniform : uniforms)
+	{
+		Texture* texture = material->getTextureByUniform(uniform);
+		if (!texture || texture->tile_size > 0) continue;
+
+		PathUtils::FileInfo info(texture->getPath().c_str());
+		StaticString<MAX_PATH_LENGTH> out_path(info.m_dir, info.m_basename, ".tiles");
+		StaticString<MAX_PATH_LENGTH> pages_dir(base_path, info.m_dir, info.m_basename, "_tiles");
+		PlatformInterface::makePath(pages_dir);
+		if (TerrainTileCache::convert(fs, *texture, out_path, TerrainTileCache::DEFAULT_TILE_SIZE, editor.getAllocator()))
+		{
+			g_log_info.log("Editor") << texture->getPath() << " converted to " << out_path
+									 << ", use it in the terrain's material";
+		}
+	}
+}
+
+
 void TerrainEditor::mergeSplatmap(const char* dir)
 {
 	auto* render_scene = (RenderScene*)m_component.scene;
@@ -1121,6 +1154,12 @@ bool TerrainEditor::onMouseDown(const WorldEditor::RayHit& hit, int, int)
 	bool is_terrain = m_world_editor.getProject()->hasComponent(selected_entities[0], TERRAIN_TYPE);
 	if (!is_terrain) return false;
 	if (m_action_type == NOT_SET || !m_component.isValid()) return false;
+	Texture* heightmap = getHeightmap();
+	if (heightmap && heightmap->tile_size > 0)
+	{
+		g_log_warning.log("Editor") << "Tiled terrain " << heightmap->getPath() << " can not be edited, edit its source instead";
+		return false;
+	}
 
 	detectModifiers();
 
@@ -1745,6 +1784,8 @@ void TerrainEditor::onGUI()
 	{
 		mergeSplatmap(dir);
 	}
+	ImGui::SameLine();
+	if (ImGui::Button("Convert to tiles")) convertToTiles();
 
 	if (!m_component.isValid() || m_action_type == NOT_SET || !m_is_enabled)
 	{
@@ -48,6 +48,7 @@ public:
 private:
 	void splitSplatmap(const char* dir);
 	void mergeSplatmap(const char* dir);
+	void convertToTiles();
 	void onProjectDestroyed();
 	void detectModifiers();
 	void drawCursor(RenderScene& scene, GameObject terrain, const Vec3& center);
@@ -30,7 +30,7 @@ FrameBuffer::FrameBuffer(const Declaration& decl)
 				false,
 				1,
 				renderbuffer.m_format,
-				RenderBuffer::DEFAULT_FLAGS);
+				renderbuffer.m_flags);
 		}
 		bgfx::setName(texture_handles[i], StaticString<128>(m_declaration.m_name, " - ", i));
 		m_declaration.m_renderbuffers[i].m_handle = texture_handles[i];
@@ -103,7 +103,7 @@ void FrameBuffer::resize(int width, int height)
 			else
 			{
 				texture_handles[i] = bgfx::createTexture2D(
-					(uint16_t)width, (uint16_t)height, false, 1, renderbuffer.m_format, RenderBuffer::DEFAULT_FLAGS);
+					(uint16_t)width, (uint16_t)height, false, 1, renderbuffer.m_format, renderbuffer.m_flags);
 			}
 			bgfx::setName(texture_handles[i], StaticString<128>(m_declaration.m_name, " - ", i));
 			m_declaration.m_renderbuffers[i].m_handle = texture_handles[i];
@@ -148,6 +148,13 @@ void FrameBuffer::RenderBuffer::parse(lua_State* L)
 		m_format = bgfx::TextureFormat::RGBA8;
 	}
 	lua_pop(L, 1);
+
+	m_flags = DEFAULT_FLAGS;
+	if (lua_getfield(L, -1, "blit_dst") == LUA_TBOOLEAN && lua_toboolean(L, -1))
+	{
+		m_flags |= BGFX_TEXTURE_BLIT_DST;
+	}
+	lua_pop(L, 1);
 }
 
 
@@ -31,6 +31,8 @@ class FrameBuffer
 			bgfx::TextureFormat::Enum m_format;
 			bgfx::TextureHandle m_handle;
 			RenderBuffer* m_shared = nullptr;
+			// DEFAULT_FLAGS, BGFX_TEXTURE_BLIT_DST is added with blit_dst = true
+			u32 m_flags = DEFAULT_FLAGS;
 
 			void parse(lua_State* state);
 		};
@@ -12,6 +12,7 @@
 #include "renderer/renderer.h"
 #include "renderer/shader.h"
 #include "renderer/texture.h"
+#include "renderer/texture_manager.h"
 
 
 namespace Malmy
@@ -31,6 +32,41 @@ static struct CustomFlags
 static u8 DEFAULT_COMMAND_BUFFER = 0;
 
 
+// decode parses the JSON in a job, names of defines, custom flags and the render layer are resolved and
+// the shader and textures are loaded in finalize, because the renderer and resource managers are not thread-safe
+struct Material::Decoded
+{
+	struct DecodedTexture
+	{
+		Path path;
+		u32 flags;
+		bool keep_data;
+	};
+
+	explicit Decoded(IAllocator& allocator)
+		: uniforms(allocator)
+		, defines(allocator)
+		, custom_flags(allocator)
+	{
+	}
+
+	Array<Uniform> uniforms;
+	Array<StaticString<32>> defines;
+	Array<StaticString<32>> custom_flags;
+	StaticString<32> render_layer;
+	Path shader;
+	DecodedTexture textures[MAX_TEXTURE_COUNT];
+	int texture_count = 0;
+	u64 render_states = BGFX_STATE_CULL_CW;
+	Vec4 color = {1, 1, 1, 1};
+	float alpha_ref = DEFAULT_ALPHA_REF_VALUE;
+	float metallic = 0;
+	float roughness = 1;
+	float emission = 0;
+	int layers_count = 0;
+};
+
+
 const ResourceType Material::TYPE("material");
 
 
@@ -48,10 +84,13 @@ Material::Material(const Path& path, ResourceManagerBase& resource_manager, IAll
 	, m_shader_instance(nullptr)
 	, m_define_mask(0)
 	, m_command_buffer(&DEFAULT_COMMAND_BUFFER)
+	, m_baked_texture_count(0)
 	, m_custom_flags(0)
 	, m_render_layer(0)
 	, m_render_layer_mask(1)
 	, m_layers_count(0)
+	, m_version(0)
+	, m_decoded(nullptr)
 {
 	setAlphaRef(DEFAULT_ALPHA_REF_VALUE);
 	for (int i = 0; i < MAX_TEXTURE_COUNT; ++i)
@@ -127,15 +166,32 @@ void Material::setDefine(u8 define_idx, bool enabled)
 
 	if (old_mask != m_define_mask)
 	{
-		m_shader_instance = &m_shader->getInstance(m_define_mask);
+		updateShaderInstance();
 	}
 }
 
 
+ShaderInstance& Material::getShaderInstance(u32 override_mask, u32 override_defines) const
+{
+	ASSERT(m_shader_instance);
+	return m_shader->getInstance((m_define_mask & ~override_mask) | (override_defines & override_mask));
+}
+
+
+void Material::updateShaderInstance()
+{
+	auto& renderer = static_cast<MaterialManager&>(m_resource_manager).getRenderer();
+	m_shader->createPrograms(m_define_mask, renderer.getDrawDefinesMask());
+	m_shader_instance = &m_shader->getInstance(m_define_mask);
+	++m_version;
+}
+
+
 void Material::unload()
 {
-	if(m_command_buffer != &DEFAULT_COMMAND_BUFFER) m_allocator.deallocate(m_command_buffer);
-	m_command_buffer = &DEFAULT_COMMAND_BUFFER;
+	MALMY_DELETE(m_allocator, m_decoded);
+	m_decoded = nullptr;
+	destroyCommandBuffer();
 	m_uniforms.clear();
 
 	ResourceManagerBase* texture_manager = m_resource_manager.getOwner().get(Texture::TYPE);
@@ -301,13 +357,12 @@ bool Material::save(JsonSerializer& serializer)
 
 void Material::deserializeCustomFlags(JsonDeserializer& serializer)
 {
-	m_custom_flags = 0;
+	m_decoded->custom_flags.clear();
 	serializer.deserializeArrayBegin();
 	while (!serializer.isArrayEnd())
 	{
-		char tmp[32];
-		serializer.deserializeArrayItem(tmp, lengthOf(tmp), "");
-		setCustomFlag(getCustomFlag(tmp));
+		StaticString<32>& flag = m_decoded->custom_flags.emplace();
+		serializer.deserializeArrayItem(flag.data, lengthOf(flag.data), "");
 	}
 	serializer.deserializeArrayEnd();
 }
@@ -315,14 +370,12 @@ void Material::deserializeCustomFlags(JsonDeserializer& serializer)
 
 void Material::deserializeDefines(JsonDeserializer& serializer)
 {
-	auto& renderer = static_cast<MaterialManager&>(m_resource_manager).getRenderer();
+	m_decoded->defines.clear();
 	serializer.deserializeArrayBegin();
-	m_define_mask = 0;
 	while (!serializer.isArrayEnd())
 	{
-		char tmp[32];
-		serializer.deserializeArrayItem(tmp, lengthOf(tmp), "");
-		m_define_mask |= 1 << renderer.getShaderDefineIdx(tmp);
+		StaticString<32>& define = m_decoded->defines.emplace();
+		serializer.deserializeArrayItem(define.data, lengthOf(define.data), "");
 	}
 	serializer.deserializeArrayEnd();
 }
@@ -331,10 +384,10 @@ void Material::deserializeDefines(JsonDeserializer& serializer)
 void Material::deserializeUniforms(JsonDeserializer& serializer)
 {
 	serializer.deserializeArrayBegin();
-	m_uniforms.clear();
+	m_decoded->uniforms.clear();
 	while (!serializer.isArrayEnd())
 	{
-		Uniform& uniform = m_uniforms.emplace();
+		Uniform& uniform = m_decoded->uniforms.emplace();
 		serializer.nextArrayItem();
 		serializer.deserializeObjectBegin();
 		char label[256];
@@ -470,7 +523,7 @@ void Material::setTexture(int i, Texture* texture)
 		}
 
 		createCommandBuffer();
-		m_shader_instance = &m_shader->getInstance(m_define_mask);
+		updateShaderInstance();
 	}
 }
 
@@ -482,10 +535,27 @@ void Material::setShader(const Path& path)
 }
 
 
-void Material::createCommandBuffer()
+void Material::destroyCommandBuffer()
 {
 	if (m_command_buffer != &DEFAULT_COMMAND_BUFFER) m_allocator.deallocate(m_command_buffer);
 	m_command_buffer = &DEFAULT_COMMAND_BUFFER;
+
+	if (m_baked_texture_count == 0) return;
+
+	// baked textures may be already destroyed, the manager does not dereference them
+	auto* texture_manager = static_cast<TextureManager*>(m_resource_manager.getOwner().get(Texture::TYPE));
+	for (int i = 0; i < m_baked_texture_count; ++i)
+	{
+		texture_manager->removeMaterial(*m_baked_textures[i], *this);
+	}
+	m_baked_texture_count = 0;
+}
+
+
+void Material::createCommandBuffer()
+{
+	++m_version;
+	destroyCommandBuffer();
 	if (!m_shader) return;
 
 	CommandBufferGenerator generator;
@@ -515,11 +585,15 @@ void Material::createCommandBuffer()
 		}
 	}
 
+	auto* texture_manager = static_cast<TextureManager*>(m_resource_manager.getOwner().get(Texture::TYPE));
 	for (int i = 0; i < m_shader->m_texture_slot_count; ++i)
 	{
 		if (i >= m_texture_count || !m_textures[i]) continue;
 
 		generator.setTexture(i, m_shader->m_texture_slots[i].uniform_handle, m_textures[i]->handle);
+		texture_manager->addMaterial(*m_textures[i], *this);
+		m_baked_textures[m_baked_texture_count] = m_textures[i];
+		++m_baked_texture_count;
 	}
 
 	auto& renderer = static_cast<MaterialManager&>(m_resource_manager).getRenderer();
@@ -593,7 +667,7 @@ void Material::onBeforeReady()
 	}
 
 	createCommandBuffer();
-	m_shader_instance = &m_shader->getInstance(m_define_mask);
+	updateShaderInstance();
 }
 
 
@@ -643,6 +717,16 @@ Texture* Material::getTextureByUniform(const char* uniform) const
 }
 
 
+void Material::requestTextureSize(int size_in_pixels)
+{
+	for (int i = 0; i < m_texture_count; ++i)
+	{
+		Texture* texture = m_textures[i];
+		if (texture && texture->is_streamed) texture->requestSize(size_in_pixels);
+	}
+}
+
+
 bool Material::isTextureDefine(u8 define_idx) const
 {
 	if (!m_shader) return false;
@@ -659,10 +743,18 @@ bool Material::isTextureDefine(u8 define_idx) const
 
 bool Material::deserializeTexture(JsonDeserializer& serializer, const char* material_dir)
 {
+	if (m_decoded->texture_count >= MAX_TEXTURE_COUNT)
+	{
+		g_log_error.log("Renderer") << "Too many textures in material " << getPath();
+		return false;
+	}
+
 	char path[MAX_PATH_LENGTH];
 	serializer.deserializeObjectBegin();
 	char label[256];
-	bool keep_data = false;
+	Decoded::DecodedTexture& texture = m_decoded->textures[m_decoded->texture_count];
+	texture.path = Path("");
+	texture.keep_data = false;
 	u32 flags = 0;
 
 	while (!serializer.isObjectEnd())
@@ -683,9 +775,7 @@ bool Material::deserializeTexture(JsonDeserializer& serializer, const char* mate
 				{
 					copyString(texture_path, path);
 				}
-				auto* mng = m_resource_manager.getOwner().get(Texture::TYPE);
-				m_textures[m_texture_count] = static_cast<Texture*>(mng->load(Path(texture_path)));
-				addDependency(*m_textures[m_texture_count]);
+				texture.path = Path(texture_path);
 			}
 		}
 		else if (equalStrings(label, "min_filter"))
@@ -740,7 +830,7 @@ bool Material::deserializeTexture(JsonDeserializer& serializer, const char* mate
 		}
 		else if (equalStrings(label, "keep_data"))
 		{
-			serializer.deserialize(keep_data, false);
+			serializer.deserialize(texture.keep_data, false);
 		}
 		else if (equalStrings(label, "srgb"))
 		{
@@ -754,17 +844,9 @@ bool Material::deserializeTexture(JsonDeserializer& serializer, const char* mate
 			return false;
 		}
 	}
-	if (m_textures[m_texture_count])
-	{
-		m_textures[m_texture_count]->setFlags(flags);
-
-		if (keep_data)
-		{
-			m_textures[m_texture_count]->addDataReference();
-		}
-	}
+	texture.flags = flags;
 	serializer.deserializeObjectEnd();
-	++m_texture_count;
+	++m_decoded->texture_count;
 	return true;
 }
 
@@ -797,13 +879,13 @@ bool Material::isBackfaceCulling() const
 }
 
 
-bool Material::load(FS::IFile& file)
+bool Material::decode(FS::IFile& file)
 {
 	PROFILE_FUNCTION();
 
-	m_render_states = BGFX_STATE_CULL_CW;
-	setAlphaRef(DEFAULT_ALPHA_REF_VALUE);
-	m_uniforms.clear();
+	MALMY_DELETE(m_allocator, m_decoded);
+	m_decoded = MALMY_NEW(m_allocator, Decoded)(m_allocator);
+	Decoded& decoded = *m_decoded;
 	JsonDeserializer serializer(file, getPath(), m_allocator);
 	serializer.deserializeObjectBegin();
 	char label[256];
@@ -822,15 +904,11 @@ bool Material::load(FS::IFile& file)
 		}
 		else if (equalStrings(label, "layers_count"))
 		{
-			serializer.deserialize(m_layers_count, 0);
+			serializer.deserialize(decoded.layers_count, 0);
 		}
 		else if (equalStrings(label, "render_layer"))
 		{
-			char tmp[32];
-			auto& renderer = static_cast<MaterialManager&>(m_resource_manager).getRenderer();
-			serializer.deserialize(tmp, lengthOf(tmp), "default");
-			m_render_layer = renderer.getLayer(tmp);
-			m_render_layer_mask = 1ULL << (u64)m_render_layer;
+			serializer.deserialize(decoded.render_layer.data, lengthOf(decoded.render_layer.data), "default");
 		}
 		else if (equalStrings(label, "uniforms"))
 		{
@@ -845,7 +923,7 @@ bool Material::load(FS::IFile& file)
 		}
 		else if (equalStrings(label, "alpha_ref"))
 		{
-			serializer.deserialize(m_alpha_ref, 0.3f);
+			serializer.deserialize(decoded.alpha_ref, 0.3f);
 		}
 		else if (equalStrings(label, "backface_culling"))
 		{
@@ -853,47 +931,44 @@ bool Material::load(FS::IFile& file)
 			serializer.deserialize(b, true);
 			if (b)
 			{
-				m_render_states |= BGFX_STATE_CULL_CW;
+				decoded.render_states |= BGFX_STATE_CULL_CW;
 			}
 			else
 			{
-				m_render_states &= ~BGFX_STATE_CULL_MASK;
+				decoded.render_states &= ~BGFX_STATE_CULL_MASK;
 			}
 		}
 		else if (equalStrings(label, "color"))
 		{
 			serializer.deserializeArrayBegin();
-			serializer.deserializeArrayItem(m_color.x, 1.0f);
-			serializer.deserializeArrayItem(m_color.y, 1.0f);
-			serializer.deserializeArrayItem(m_color.z, 1.0f);
+			serializer.deserializeArrayItem(decoded.color.x, 1.0f);
+			serializer.deserializeArrayItem(decoded.color.y, 1.0f);
+			serializer.deserializeArrayItem(decoded.color.z, 1.0f);
 			if (!serializer.isArrayEnd())
 			{
-				serializer.deserializeArrayItem(m_color.w, 1.0f);
+				serializer.deserializeArrayItem(decoded.color.w, 1.0f);
 			}
 			else
 			{
-				m_color.w = 1;
+				decoded.color.w = 1;
 			}
 			serializer.deserializeArrayEnd();
 		}
 		else if (equalStrings(label, "metallic"))
 		{
-			serializer.deserialize(m_metallic, 0.0f);
+			serializer.deserialize(decoded.metallic, 0.0f);
 		}
 		else if (equalStrings(label, "roughness"))
 		{
-			serializer.deserialize(m_roughness, 1.0f);
+			serializer.deserialize(decoded.roughness, 1.0f);
 		}
 		else if (equalStrings(label, "emission"))
 		{
-			serializer.deserialize(m_emission, 0.0f);
+			serializer.deserialize(decoded.emission, 0.0f);
 		}
 		else if (equalStrings(label, "shader"))
 		{
-			Path path;
-			serializer.deserialize(path, Path(""));
-			auto* manager = m_resource_manager.getOwner().get(Shader::TYPE);
-			setShader(static_cast<Shader*>(manager->load(Path(path))));
+			serializer.deserialize(decoded.shader, Path(""));
 		}
 		else
 		{
@@ -902,6 +977,65 @@ bool Material::load(FS::IFile& file)
 		}
 	}
 	serializer.deserializeObjectEnd();
+	return true;
+}
+
+
+bool Material::finalize(FS::IFile& file)
+{
+	PROFILE_FUNCTION();
+
+	ASSERT(m_decoded);
+	Decoded& decoded = *m_decoded;
+	auto& renderer = static_cast<MaterialManager&>(m_resource_manager).getRenderer();
+	m_render_states = decoded.render_states;
+	setAlphaRef(decoded.alpha_ref);
+	m_color = decoded.color;
+	m_metallic = decoded.metallic;
+	m_roughness = decoded.roughness;
+	m_emission = decoded.emission;
+	m_layers_count = decoded.layers_count;
+	m_uniforms.swap(decoded.uniforms);
+	if (decoded.render_layer.data[0] != '\0')
+	{
+		m_render_layer = renderer.getLayer(decoded.render_layer);
+		m_render_layer_mask = 1ULL << (u64)m_render_layer;
+	}
+	m_define_mask = 0;
+	for (const StaticString<32>& define : decoded.defines)
+	{
+		m_define_mask |= 1 << renderer.getShaderDefineIdx(define);
+	}
+	m_custom_flags = 0;
+	for (const StaticString<32>& flag : decoded.custom_flags)
+	{
+		setCustomFlag(getCustomFlag(flag));
+	}
+
+	auto* texture_manager = m_resource_manager.getOwner().get(Texture::TYPE);
+	for (int i = 0; i < decoded.texture_count; ++i)
+	{
+		const Decoded::DecodedTexture& decoded_texture = decoded.textures[i];
+		Texture* texture = nullptr;
+		if (decoded_texture.path.isValid())
+		{
+			texture = static_cast<Texture*>(texture_manager->load(decoded_texture.path));
+			addDependency(*texture);
+			texture->setFlags(decoded_texture.flags);
+			if (decoded_texture.keep_data) texture->addDataReference();
+		}
+		m_textures[i] = texture;
+	}
+	m_texture_count = decoded.texture_count;
+
+	if (decoded.shader.isValid())
+	{
+		auto* shader_manager = m_resource_manager.getOwner().get(Shader::TYPE);
+		setShader(static_cast<Shader*>(shader_manager->load(decoded.shader)));
+	}
+
+	MALMY_DELETE(m_allocator, m_decoded);
+	m_decoded = nullptr;
 
 	if (!m_shader)
 	{
@@ -914,4 +1048,10 @@ bool Material::load(FS::IFile& file)
 }
 
 
+bool Material::load(FS::IFile& file)
+{
+	return decode(file) && finalize(file);
+}
+
+
 } // namespace Malmy
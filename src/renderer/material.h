@@ -79,14 +79,21 @@ public:
 	bool isTextureDefine(u8 define_idx) const;
 	void setTexture(int i, Texture* texture);
 	void setTexturePath(int i, const Path& path);
+	// thread safe, size is the projected size of a mesh using this material
+	void requestTextureSize(int size_in_pixels);
 	bool save(JsonSerializer& serializer);
 	int getUniformCount() const { return m_uniforms.size(); }
 	Uniform& getUniform(int index) { return m_uniforms[index]; }
 	const Uniform& getUniform(int index) const { return m_uniforms[index]; }
 	ShaderInstance& getShaderInstance() { ASSERT(m_shader_instance); return *m_shader_instance; }
 	const ShaderInstance& getShaderInstance() const { ASSERT(m_shader_instance); return *m_shader_instance; }
+	// thread safe, does not change the material, defines in override_mask are taken from override_defines
+	// instead of the material; only defines in Renderer::getDrawDefinesMask have programs ready
+	ShaderInstance& getShaderInstance(u32 override_mask, u32 override_defines) const;
 	const u8* getCommandBuffer() const { return m_command_buffer; }
 	void createCommandBuffer();
+	// changes whenever uniforms, textures or the shader instance change
+	u32 getVersion() const { return m_version; }
 	int getRenderLayer() const { return m_render_layer; }
 	void setRenderLayer(int layer);
 	u64 getRenderLayerMask() const { return m_render_layer_mask; }
@@ -107,8 +114,12 @@ public:
 
 private:
 	void onBeforeReady() override;
+	void updateShaderInstance();
+	void destroyCommandBuffer();
 	void unload() override;
 	bool load(FS::IFile& file) override;
+	bool decode(FS::IFile& file) override;
+	bool finalize(FS::IFile& file) override;
 
 	bool deserializeTexture(JsonDeserializer& serializer, const char* material_dir);
 	void deserializeUniforms(JsonDeserializer& serializer);
@@ -118,6 +129,8 @@ private:
 private:
 	static const int MAX_TEXTURE_COUNT = 16;
 
+	struct Decoded;
+
 	Shader* m_shader;
 	ShaderInstance* m_shader_instance;
 	Texture* m_textures[MAX_TEXTURE_COUNT];
@@ -132,10 +145,16 @@ private:
 	float m_emission;
 	u32 m_define_mask;
 	u8* m_command_buffer;
+	// textures with handles in m_command_buffer, they are registered in TextureManager
+	Texture* m_baked_textures[MAX_TEXTURE_COUNT];
+	int m_baked_texture_count;
 	u32 m_custom_flags;
 	int m_render_layer;
 	u64 m_render_layer_mask;
 	int m_layers_count;
+	u32 m_version;
+	// between decode and finalize
+	Decoded* m_decoded;
 };
 
 } // namespace Malmy
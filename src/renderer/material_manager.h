@@ -14,7 +14,9 @@ namespace Malmy
 			: ResourceManagerBase(allocator)
 			, m_renderer(renderer)
 			, m_allocator(allocator)
-		{}
+		{
+			enableAsyncDecode(true);
+		}
 		~MaterialManager() {}
 
 		Renderer& getRenderer() { return m_renderer; }
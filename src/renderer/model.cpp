@@ -97,6 +97,9 @@ Model::Model(const Path& path, ResourceManagerBase& resource_manager, Renderer&
 	, m_bones(m_allocator)
 	, m_first_nonroot_bone_index(0)
 	, m_renderer(renderer)
+	, m_decoded_meshes(m_allocator)
+	, m_decode_error(nullptr)
+	, m_is_decoded(false)
 {
 	m_lods[0] = { 0, -1, FLT_MAX };
 	m_lods[1] = { 0, -1, FLT_MAX };
@@ -407,7 +410,7 @@ bool Model::parseBones(FS::IFile& file)
 	if (bone_count < 0) return false;
 	if (bone_count > Bone::MAX_COUNT)
 	{
-		g_log_warning.log("Renderer") << "Model " << getPath().c_str() << " has too many bones.";
+		m_decode_error = "Too many bones in model ";
 		return false;
 	}
 
@@ -452,7 +455,7 @@ bool Model::parseBones(FS::IFile& file)
 		{
 			if (m_first_nonroot_bone_index != -1)
 			{
-				g_log_error.log("Renderer") << "Invalid skeleton in " << getPath().c_str();
+				m_decode_error = "Invalid skeleton in ";
 				return false;
 			}
 			b.parent_idx = -1;
@@ -462,7 +465,7 @@ bool Model::parseBones(FS::IFile& file)
 			b.parent_idx = getBoneIdx(b.parent.c_str());
 			if (b.parent_idx > i || b.parent_idx < 0)
 			{
-				g_log_error.log("Renderer") << "Invalid skeleton in " << getPath().c_str();
+				m_decode_error = "Invalid skeleton in ";
 				return false;
 			}
 			if (m_first_nonroot_bone_index == -1)
@@ -505,18 +508,14 @@ int Model::getBoneIdx(const char* name)
 }
 
 
-bool Model::parseMeshes(const bgfx::VertexDecl& global_vertex_decl, FS::IFile& file, FileVersion version, u32 global_flags)
+bool Model::decodeMeshes(FS::IFile& file)
 {
-	if (version <= FileVersion::MULTIPLE_VERTEX_DECLS) return parseMeshesOld(global_vertex_decl, file, version, global_flags);
-	
 	int object_count = 0;
 	file.read(&object_count, sizeof(object_count));
 	if (object_count <= 0) return false;
 
-	char model_dir[MAX_PATH_LENGTH];
-	PathUtils::getDir(model_dir, MAX_PATH_LENGTH, getPath().c_str());
-
 	m_meshes.reserve(object_count);
+	m_decoded_meshes.reserve(object_count);
 	for (int i = 0; i < object_count; ++i)
 	{
 		bgfx::VertexDecl vertex_decl;
@@ -524,27 +523,21 @@ bool Model::parseMeshes(const bgfx::VertexDecl& global_vertex_decl, FS::IFile& f
 
 		i32 str_size;
 		file.read(&str_size, sizeof(str_size));
+		if (str_size < 0 || str_size >= MAX_PATH_LENGTH) return false;
 		char material_name[MAX_PATH_LENGTH];
 		file.read(material_name, str_size);
-		if (str_size >= MAX_PATH_LENGTH) return false;
-
 		material_name[str_size] = 0;
 
-		char material_path[MAX_PATH_LENGTH];
-		copyString(material_path, model_dir);
-		catString(material_path, material_name);
-		catString(material_path, ".mat");
-
-		auto* material_manager = m_resource_manager.getOwner().get(Material::TYPE);
-		Material* material = static_cast<Material*>(material_manager->load(Path(material_path)));
-		
 		file.read(&str_size, sizeof(str_size));
+		if (str_size < 0 || str_size >= MAX_PATH_LENGTH) return false;
 		char mesh_name[MAX_PATH_LENGTH];
 		mesh_name[str_size] = 0;
 		file.read(mesh_name, str_size);
 
-		m_meshes.emplace(material, vertex_decl, mesh_name, m_allocator);
-		addDependency(*material);
+		// materials are loaded in createMeshes, other resources can not be touched from decode
+		m_meshes.emplace(nullptr, vertex_decl, mesh_name, m_allocator);
+		DecodedMesh& decoded = m_decoded_meshes.emplace(m_allocator);
+		decoded.material_name = material_name;
 	}
 
 	for (int i = 0; i < object_count; ++i)
@@ -561,17 +554,17 @@ bool Model::parseMeshes(const bgfx::VertexDecl& global_vertex_decl, FS::IFile& f
 
 		if (index_size == 2) mesh.flags.set(Mesh::Flags::INDICES_16_BIT);
 		mesh.indices_count = indices_count;
-		const bgfx::Memory* indices_mem = bgfx::copy(&mesh.indices[0], mesh.indices.size());
-		mesh.index_buffer_handle = bgfx::createIndexBuffer(indices_mem);
 	}
 
 	for (int i = 0; i < object_count; ++i)
 	{
 		Mesh& mesh = m_meshes[i];
+		Array<u8>& vertices_data = m_decoded_meshes[i].vertices;
 		int data_size;
 		file.read(&data_size, sizeof(data_size));
-		const bgfx::Memory* vertices_mem = bgfx::alloc(data_size);
-		file.read(vertices_mem->data, vertices_mem->size);
+		if (data_size <= 0) return false;
+		vertices_data.resize(data_size);
+		file.read(&vertices_data[0], data_size);
 
 		const bgfx::VertexDecl& vertex_decl = mesh.vertex_decl;
 		int position_attribute_offset = vertex_decl.getOffset(bgfx::Attrib::Position);
@@ -581,11 +574,11 @@ bool Model::parseMeshes(const bgfx::VertexDecl& global_vertex_decl, FS::IFile& f
 		bool keep_skin = vertex_decl.has(bgfx::Attrib::Weight) && vertex_decl.has(bgfx::Attrib::Indices);
 
 		int vertex_size = mesh.vertex_decl.getStride();
-		int mesh_vertex_count = vertices_mem->size / mesh.vertex_decl.getStride();
+		int mesh_vertex_count = data_size / mesh.vertex_decl.getStride();
 		mesh.vertices.resize(mesh_vertex_count);
 		mesh.uvs.resize(mesh_vertex_count);
 		if (keep_skin) mesh.skin.resize(mesh_vertex_count);
-		const u8* vertices = vertices_mem->data;
+		const u8* vertices = &vertices_data[0];
 		for (int j = 0; j < mesh_vertex_count; ++j)
 		{
 			int offset = j * vertex_size;
@@ -599,7 +592,6 @@ bool Model::parseMeshes(const bgfx::VertexDecl& global_vertex_decl, FS::IFile& f
 			mesh.vertices[j] = *(const Vec3*)&vertices[offset + position_attribute_offset];
 			mesh.uvs[j] = *(const Vec2*)&vertices[offset + uv_attribute_offset];
 		}
-		mesh.vertex_buffer_handle = bgfx::createVertexBuffer(vertices_mem, mesh.vertex_decl);
 	}
 	file.read(&m_bounding_radius, sizeof(m_bounding_radius));
 	file.read(&m_aabb, sizeof(m_aabb));
@@ -608,6 +600,34 @@ bool Model::parseMeshes(const bgfx::VertexDecl& global_vertex_decl, FS::IFile& f
 }
 
 
+bool Model::createMeshes()
+{
+	char model_dir[MAX_PATH_LENGTH];
+	PathUtils::getDir(model_dir, MAX_PATH_LENGTH, getPath().c_str());
+
+	auto* material_manager = m_resource_manager.getOwner().get(Material::TYPE);
+	for (int i = 0; i < m_meshes.size(); ++i)
+	{
+		Mesh& mesh = m_meshes[i];
+		const DecodedMesh& decoded = m_decoded_meshes[i];
+
+		char material_path[MAX_PATH_LENGTH];
+		copyString(material_path, model_dir);
+		catString(material_path, decoded.material_name);
+		catString(material_path, ".mat");
+		mesh.material = static_cast<Material*>(material_manager->load(Path(material_path)));
+		addDependency(*mesh.material);
+
+		const bgfx::Memory* indices_mem = bgfx::copy(&mesh.indices[0], mesh.indices.size());
+		mesh.index_buffer_handle = bgfx::createIndexBuffer(indices_mem);
+		const bgfx::Memory* vertices_mem = bgfx::copy(&decoded.vertices[0], decoded.vertices.size());
+		mesh.vertex_buffer_handle = bgfx::createVertexBuffer(vertices_mem, mesh.vertex_decl);
+	}
+	m_decoded_meshes.clear();
+	return true;
+}
+
+
 bool Model::parseMeshesOld(bgfx::VertexDecl global_vertex_decl, FS::IFile& file, FileVersion version, u32 global_flags)
 {
 	int object_count = 0;
@@ -805,23 +825,74 @@ bool Model::parseLODs(FS::IFile& file)
 }
 
 
-bool Model::load(FS::IFile& file)
+bool Model::decode(FS::IFile& file)
 {
 	PROFILE_FUNCTION();
+	m_decode_error = nullptr;
+	m_is_decoded = false;
+
 	FileHeader header;
 	file.read(&header, sizeof(header));
-
 	if (header.magic != FILE_MAGIC)
 	{
-		g_log_warning.log("Renderer") << "Corrupted model " << getPath().c_str();
-		return false;
+		m_decode_error = "Corrupted model ";
+		return true;
 	}
 
-	if(header.version > (u32)FileVersion::LATEST)
+	if (header.version > (u32)FileVersion::LATEST)
 	{
-		g_log_warning.log("Renderer") << "Unsupported version of model " << getPath().c_str();
-		return false;
+		m_decode_error = "Unsupported version of model ";
+		return true;
+	}
+
+	// meshes in older versions share buffers, such models are parsed in finalize
+	if (header.version <= (u32)FileVersion::MULTIPLE_VERTEX_DECLS) return true;
+
+	u32 global_flags = 0;
+	file.read(&global_flags, sizeof(global_flags));
+
+	// errors are reported in finalize, logging is not thread-safe
+	m_is_decoded = decodeMeshes(file) && parseBones(file) && parseLODs(file);
+	if (!m_is_decoded && !m_decode_error) m_decode_error = "Error loading model ";
+	return true;
+}
+
+
+bool Model::finalize(FS::IFile& file)
+{
+	PROFILE_FUNCTION();
+	bool loaded = false;
+	if (m_is_decoded)
+	{
+		loaded = createMeshes();
 	}
+	else if (!m_decode_error)
+	{
+		file.seek(FS::SeekMode::BEGIN, 0);
+		loaded = parseLegacy(file);
+	}
+	if (m_decode_error) g_log_error.log("Renderer") << m_decode_error << getPath().c_str();
+	m_decode_error = nullptr;
+	m_is_decoded = false;
+	m_decoded_meshes.clear();
+
+	if (!loaded) return false;
+
+	m_size = file.size();
+	return true;
+}
+
+
+bool Model::load(FS::IFile& file)
+{
+	return decode(file) && finalize(file);
+}
+
+
+bool Model::parseLegacy(FS::IFile& file)
+{
+	FileHeader header;
+	file.read(&header, sizeof(header));
 
 	u32 global_flags = 0; // backward compatibility
 	if(header.version > (u32)FileVersion::WITH_FLAGS)
@@ -830,20 +901,19 @@ bool Model::load(FS::IFile& file)
 	}
 
 	bgfx::VertexDecl global_vertex_decl;
-	if (header.version > (u32)FileVersion::SINGLE_VERTEX_DECL && header.version <= (u32)FileVersion::MULTIPLE_VERTEX_DECLS)
+	if (header.version > (u32)FileVersion::SINGLE_VERTEX_DECL)
 	{
 		parseVertexDeclEx(file, &global_vertex_decl);
 	}
 
-	if (parseMeshes(global_vertex_decl, file, (FileVersion)header.version, global_flags)
+	if (parseMeshesOld(global_vertex_decl, file, (FileVersion)header.version, global_flags)
 		&& parseBones(file)
 		&& parseLODs(file))
 	{
-		m_size = file.size();
 		return true;
 	}
 
-	g_log_error.log("Renderer") << "Error loading model " << getPath().c_str();
+	if (!m_decode_error) m_decode_error = "Error loading model ";
 	return false;
 }
 
@@ -891,6 +961,8 @@ void Model::unload()
 	auto* material_manager = m_resource_manager.getOwner().get(Material::TYPE);
 	for (int i = 0; i < m_meshes.size(); ++i)
 	{
+		// meshes of models which failed to finalize do not have materials
+		if (!m_meshes[i].material) continue;
 		removeDependency(*m_meshes[i].material);
 		material_manager->unload(*m_meshes[i].material);
 	}
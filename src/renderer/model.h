@@ -221,13 +221,27 @@ private:
 	bool parseVertexDecl(FS::IFile& file, bgfx::VertexDecl* vertex_decl);
 	bool parseVertexDeclEx(FS::IFile& file, bgfx::VertexDecl* vertex_decl);
 	bool parseBones(FS::IFile& file);
-	bool parseMeshes(const bgfx::VertexDecl& global_vertex_decl, FS::IFile& file, FileVersion version, u32 global_flags);
+	bool decodeMeshes(FS::IFile& file);
+	bool createMeshes();
 	bool parseMeshesOld(bgfx::VertexDecl global_vertex_decl, FS::IFile& file, FileVersion version, u32 global_flags);
 	bool parseLODs(FS::IFile& file);
+	bool parseLegacy(FS::IFile& file);
 	int getBoneIdx(const char* name);
 
 	void unload() override;
 	bool load(FS::IFile& file) override;
+	bool decode(FS::IFile& file) override;
+	bool finalize(FS::IFile& file) override;
+
+private:
+	// data of meshes between decode and finalize
+	struct DecodedMesh
+	{
+		explicit DecodedMesh(IAllocator& allocator) : vertices(allocator) {}
+
+		StaticString<MAX_PATH_LENGTH> material_name;
+		Array<u8> vertices;
+	};
 
 private:
 	IAllocator& m_allocator;
@@ -240,6 +254,9 @@ private:
 	AABB m_aabb;
 	FlagSet<LoadingFlags, u32> m_loading_flags;
 	int m_first_nonroot_bone_index;
+	Array<DecodedMesh> m_decoded_meshes;
+	const char* m_decode_error;
+	bool m_is_decoded;
 };
 
 
@@ -15,7 +15,9 @@ namespace Malmy
 			: ResourceManagerBase(allocator)
 			, m_allocator(allocator)
 			, m_renderer(renderer)
-		{}
+		{
+			enableAsyncDecode(true);
+		}
 
 		~ModelManager() {}
 
@@ -1227,7 +1227,6 @@ void ParticleEmitter::SizeModule::update(float)
 		int next_idx = Math::minimum(idx + 1, size);
 		float w = float_idx - idx;
 		particle_size[i] = m_sampled[idx] * (1 - w) + m_sampled[next_idx] * w;
-		PROFILE_INT("Test", int(particle_size[i] * 1000));
 	}
 }
 
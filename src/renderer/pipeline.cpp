@@ -1,14 +1,18 @@
 #include "pipeline.h"
 
 #include "engine/crc32.h"
+#include "engine/debug/tracking_allocator.h"
 #include "engine/fs/disk_file_device.h"
 #include "engine/fs/file_system.h"
+#include "engine/frame_allocator.h"
 #include "engine/geometry.h"
 #include "engine/log.h"
 #include "engine/lua_wrapper.h"
+#include "engine/metrics.h"
 #include "engine/job_system.h"
 #include "engine/mt/atomic.h"
 #include "engine/profiler.h"
+#include "engine/sparse_set.h"
 #include "engine/engine.h"
 #include "imgui/imgui.h"
 #include "renderer/draw2d.h"
@@ -38,20 +42,82 @@ namespace Malmy
 	
 static const float SHADOW_CAM_NEAR = 50.0f;
 static const float SHADOW_CAM_FAR = 5000.0f;
+// static shadow casters in a cascade are re-rendered only if its shadow camera moves more than this
+static const float SHADOW_CACHE_TEXEL_THRESHOLD = 4.0f;
+// objects not moved for this many frames are considered static shadow casters
+static const u32 SHADOW_CACHE_STATIC_FRAMES = 30;
+// local light shadowmap slots are atlas_size / 2 ... atlas_size >> LOCAL_SHADOW_SLOT_LEVELS big
+static const int LOCAL_SHADOW_SLOT_LEVELS = 4;
+static const int LOCAL_SHADOW_MAX_LIGHTS = 16;
+static const int LOCAL_SHADOW_FACE_UPDATES_PER_FRAME = 8;
 
 
-struct InstanceData
+// bone matrices of instanced skinned meshes are stored in a texture, 4 texels per matrix
+static const int BONE_TEXTURE_WIDTH = 1024;
+static const int BONE_TEXTURE_HEIGHT = 64;
+static const int BONE_TEXTURE_STAGE = 7;
+
+
+struct SkinnedInstance
 {
-	static const int MAX_INSTANCE_COUNT = 1024;
+	Matrix matrix;
+	Vec4 bone_offset;
+};
+
+
+struct InstanceBatch
+{
+	explicit InstanceBatch(int stride, bool is_skinned) : stride(stride), is_skinned(is_skinned) {}
 
-	bgfx::InstanceDataBuffer buffer;
+	bgfx::InstanceDataBuffer buffer = {};
 	int offset = 0;
 	int instances_count = 0;
+	int stride;
+	bool is_skinned;
 	const Mesh* mesh = nullptr;
 };
 
 
-static thread_local InstanceData s_instance_data;
+// draws are submitted with preserved bgfx state, so a draw with the same material, view and program
+// as the previous one does not need to bind textures and set render state again; uniforms are set anyway
+struct DrawStateCache
+{
+	const u8* material_commands = nullptr;
+	const void* view = nullptr;
+	u16 program = bgfx::kInvalidHandle;
+	int commands_count = 0;
+};
+
+
+struct View;
+
+
+// state draws are recorded with, jobs recording a pass while the following passes are replayed
+// can not read it from the pipeline, the replayed ops change it
+struct DrawContext
+{
+	// all draws go to this view instead of the views their layers are mapped to
+	View* view = nullptr;
+	GameObject camera = INVALID_GAMEOBJECT;
+	bool is_shadowmap = false;
+};
+
+
+struct InstanceData
+{
+	static const int MAX_INSTANCE_COUNT = 1024;
+
+	InstanceData()
+		: rigid(sizeof(Matrix), false)
+		, skinned(sizeof(SkinnedInstance), true)
+	{}
+
+	InstanceBatch rigid;
+	InstanceBatch skinned;
+	DrawStateCache state_cache;
+	// pipeline's current state is used if not set
+	const DrawContext* context = nullptr;
+};
 
 
 struct View
@@ -62,6 +128,9 @@ struct View
 	u32 stencil;
 	int pass_idx;
 	CommandBufferGenerator command_buffer;
+	u32 define_mask;
+	u32 defines;
+	StaticString<32> name;
 };
 
 
@@ -247,6 +316,414 @@ void CommandBufferGenerator::end()
 }
 
 
+struct PipelineImpl;
+
+
+// Pipeline API calls issued by the Lua render function, recorded once and replayed each frame.
+// Only scripts which set RECORD_ONCE = true are recorded; such scripts must run anything which
+// changes from frame to frame through everyFrame. Lua values the recording read are compared before
+// each replay, fields of tables are not, so scripts call invalidateFrameGraph after changing those.
+// Arguments are decoded when an op is recorded, replay calls the pipeline directly without Lua.
+// Ops are grouped to passes by newView, passes depend on earlier passes they read from or whose inputs
+// they overwrite, so draws of an ASYNC op are recorded in a job while the independent passes are replayed.
+struct FrameGraph
+{
+	enum FunctionFlags : u32
+	{
+		NONE = 0,
+		// result is checked before each replay, different result means the graph is recorded again
+		QUERY = 1 << 0,
+		// result differs every frame, a graph containing this can not be replayed
+		VOLATILE = 1 << 1,
+		// starts a pass, 3rd argument is the framebuffer written by the pass
+		NEW_PASS = 1 << 2,
+		// 2nd argument is a framebuffer read by the current pass
+		READ_FRAMEBUFFER = 1 << 3,
+		// 3rd argument is a framebuffer written by the current pass
+		WRITE_FRAMEBUFFER = 1 << 4,
+		// 2nd argument is read, 4th argument is written by the current pass
+		COPY_FRAMEBUFFER = 1 << 5,
+		// runs code the graph does not know, the pass waits for all earlier passes and the later ones for it
+		BARRIER = 1 << 6,
+		// can record its draws in jobs which finish before a dependent pass or another op of the same pass
+		ASYNC = 1 << 7
+	};
+
+	// Lua value kept for ops which call back into Lua, see everyFrame
+	struct Arg
+	{
+		enum Type : u8
+		{
+			NIL,
+			BOOLEAN,
+			INTEGER,
+			NUMBER,
+			LIGHT_USERDATA,
+			REF
+		};
+
+		Type type;
+		union
+		{
+			bool b;
+			lua_Integer i;
+			lua_Number n;
+			void* ptr;
+			int ref;
+		};
+	};
+
+	struct Op;
+	// returns false if the op failed or, for queries, if the result differs from the recorded one
+	typedef bool (*ReplayFunction)(PipelineImpl& pipeline, const Op& op);
+	// decodes arguments on the Lua stack into the op and sets its replay function
+	typedef void (*RecordFunction)(PipelineImpl& pipeline, Op& op, lua_State* L);
+
+	struct Pass
+	{
+		int first_op;
+		int ops_count;
+		int first_access;
+		int accesses_count;
+		int first_dependency;
+		int dependencies_count;
+		bool is_barrier;
+	};
+
+	// framebuffer name hash, accessed by a pass
+	struct Access
+	{
+		u32 framebuffer;
+		bool is_write;
+	};
+
+	// Lua value read while recording, an upvalue of a called function or a field of the environment
+	struct Input
+	{
+		Arg function;
+		int upvalue;
+		Arg key;
+		Arg value;
+	};
+
+	struct Op
+	{
+		template <typename T> T& emplaceData()
+		{
+			static_assert(sizeof(T) <= sizeof(data), "Frame graph op data is too big");
+			return *new (NewPlaceholder(), (char*)data) T();
+		}
+
+		template <typename T> const T& getData() const { return *(const T*)data; }
+
+		ReplayFunction replay;
+		u32 flags;
+		u64 data[8];
+	};
+
+	explicit FrameGraph(IAllocator& allocator)
+		: ops(allocator)
+		, passes(allocator)
+		, accesses(allocator)
+		, dependencies(allocator)
+		, inputs(allocator)
+		, tracked_upvalues(allocator)
+		, args(allocator)
+		, strings(allocator)
+		, vec4s(allocator)
+		, framebuffers(allocator)
+		, is_enabled(false)
+		, is_valid(false)
+		, is_dirty(false)
+		, is_volatile(false)
+	{
+	}
+
+	static void capture(lua_State* L, int idx, Arg& arg)
+	{
+		switch (lua_type(L, idx))
+		{
+			case LUA_TNIL:
+			case LUA_TNONE: arg.type = Arg::NIL; break;
+			case LUA_TBOOLEAN:
+				arg.type = Arg::BOOLEAN;
+				arg.b = lua_toboolean(L, idx) != 0;
+				break;
+			case LUA_TLIGHTUSERDATA:
+				arg.type = Arg::LIGHT_USERDATA;
+				arg.ptr = lua_touserdata(L, idx);
+				break;
+			case LUA_TNUMBER:
+				if (lua_isinteger(L, idx))
+				{
+					arg.type = Arg::INTEGER;
+					arg.i = lua_tointeger(L, idx);
+				}
+				else
+				{
+					arg.type = Arg::NUMBER;
+					arg.n = lua_tonumber(L, idx);
+				}
+				break;
+			default:
+				// strings, tables and functions are kept alive and pushed as they are
+				arg.type = Arg::REF;
+				lua_pushvalue(L, idx);
+				arg.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+				break;
+		}
+	}
+
+	static void push(lua_State* L, const Arg& arg)
+	{
+		switch (arg.type)
+		{
+			case Arg::NIL: lua_pushnil(L); break;
+			case Arg::BOOLEAN: lua_pushboolean(L, arg.b); break;
+			case Arg::INTEGER: lua_pushinteger(L, arg.i); break;
+			case Arg::NUMBER: lua_pushnumber(L, arg.n); break;
+			case Arg::LIGHT_USERDATA: lua_pushlightuserdata(L, arg.ptr); break;
+			case Arg::REF: lua_rawgeti(L, LUA_REGISTRYINDEX, arg.ref); break;
+			default: ASSERT(false); break;
+		}
+	}
+
+	static void release(lua_State* L, const Arg& arg)
+	{
+		if (arg.type == Arg::REF) luaL_unref(L, LUA_REGISTRYINDEX, arg.ref);
+	}
+
+	static bool equals(lua_State* L, int idx, const Arg& arg)
+	{
+		switch (arg.type)
+		{
+			case Arg::NIL: return lua_isnil(L, idx);
+			case Arg::BOOLEAN: return lua_type(L, idx) == LUA_TBOOLEAN && (lua_toboolean(L, idx) != 0) == arg.b;
+			case Arg::INTEGER: return lua_isinteger(L, idx) && lua_tointeger(L, idx) == arg.i;
+			case Arg::NUMBER: return lua_type(L, idx) == LUA_TNUMBER && !lua_isinteger(L, idx) && lua_tonumber(L, idx) == arg.n;
+			case Arg::LIGHT_USERDATA: return lua_type(L, idx) == LUA_TLIGHTUSERDATA && lua_touserdata(L, idx) == arg.ptr;
+			case Arg::REF:
+			{
+				idx = lua_absindex(L, idx);
+				lua_rawgeti(L, LUA_REGISTRYINDEX, arg.ref);
+				bool res = lua_rawequal(L, idx, -1) != 0;
+				lua_pop(L, 1);
+				return res;
+			}
+			default: ASSERT(false); return false;
+		}
+	}
+
+	void clear(lua_State* L)
+	{
+		for (const Arg& arg : args)
+		{
+			release(L, arg);
+		}
+		for (const Input& input : inputs)
+		{
+			release(L, input.function);
+			release(L, input.key);
+			release(L, input.value);
+		}
+		for (int ref : strings)
+		{
+			luaL_unref(L, LUA_REGISTRYINDEX, ref);
+		}
+		ops.clear();
+		passes.clear();
+		accesses.clear();
+		dependencies.clear();
+		inputs.clear();
+		tracked_upvalues.clear();
+		args.clear();
+		strings.clear();
+		vec4s.clear();
+		framebuffers.clear();
+		is_valid = false;
+		is_volatile = false;
+	}
+
+	void addAccess(lua_State* L, int idx, bool is_write)
+	{
+		if (lua_type(L, idx) != LUA_TSTRING) return;
+		Access& access = accesses.emplace();
+		access.framebuffer = crc32(lua_tostring(L, idx));
+		access.is_write = is_write;
+		++passes.back().accesses_count;
+	}
+
+	void record(PipelineImpl& pipeline, lua_State* L, u32 flags, RecordFunction function)
+	{
+		if (flags & VOLATILE) is_volatile = true;
+
+		if ((flags & NEW_PASS) || passes.empty())
+		{
+			Pass& pass = passes.emplace();
+			pass.first_op = ops.size();
+			pass.ops_count = 0;
+			pass.first_access = accesses.size();
+			pass.accesses_count = 0;
+			pass.first_dependency = 0;
+			pass.dependencies_count = 0;
+			pass.is_barrier = false;
+		}
+		Pass& pass = passes.back();
+		++pass.ops_count;
+		if (flags & BARRIER) pass.is_barrier = true;
+		if (flags & (NEW_PASS | WRITE_FRAMEBUFFER)) addAccess(L, 3, true);
+		if (flags & (READ_FRAMEBUFFER | COPY_FRAMEBUFFER)) addAccess(L, 2, false);
+		if (flags & COPY_FRAMEBUFFER) addAccess(L, 4, true);
+
+		Op& op = ops.emplace();
+		op.replay = nullptr;
+		op.flags = flags;
+		function(pipeline, op, L);
+
+		// decoded const char* point into Lua strings, they must outlive the graph
+		for (int i = 1, c = lua_gettop(L); i <= c; ++i)
+		{
+			if (lua_type(L, i) != LUA_TSTRING) continue;
+			lua_pushvalue(L, i);
+			strings.push(luaL_ref(L, LUA_REGISTRYINDEX));
+		}
+	}
+
+	bool hasAccess(const Pass& pass, u32 framebuffer, bool is_write) const
+	{
+		for (int i = 0; i < pass.accesses_count; ++i)
+		{
+			const Access& access = accesses[pass.first_access + i];
+			if (access.framebuffer == framebuffer && access.is_write == is_write) return true;
+		}
+		return false;
+	}
+
+	// Only reads of what an earlier pass wrote and writes of what an earlier pass read make dependencies.
+	// bgfx executes views in their order, so passes writing the same framebuffer can be recorded in any order.
+	void computeDependencies()
+	{
+		dependencies.clear();
+		for (int i = 0; i < passes.size(); ++i)
+		{
+			Pass& pass = passes[i];
+			pass.first_dependency = dependencies.size();
+			pass.dependencies_count = 0;
+			for (int j = 0; j < i; ++j)
+			{
+				const Pass& prev = passes[j];
+				bool depends = pass.is_barrier || prev.is_barrier;
+				for (int k = 0; k < prev.accesses_count && !depends; ++k)
+				{
+					const Access& access = accesses[prev.first_access + k];
+					depends = hasAccess(pass, access.framebuffer, !access.is_write);
+				}
+				if (!depends) continue;
+				dependencies.push(j);
+				++pass.dependencies_count;
+			}
+		}
+	}
+
+	// upvalues of Lua functions called while recording
+	void trackUpvalues(lua_State* L, int function_idx)
+	{
+		function_idx = lua_absindex(L, function_idx);
+		for (int i = 1;; ++i)
+		{
+			const char* name = lua_getupvalue(L, function_idx, i);
+			if (!name) break;
+			void* id = lua_upvalueid(L, function_idx, i);
+			if (equalStrings(name, "_ENV") || tracked_upvalues.indexOf(id) >= 0)
+			{
+				lua_pop(L, 1);
+				continue;
+			}
+			tracked_upvalues.push(id);
+			Input& input = inputs.emplace();
+			capture(L, function_idx, input.function);
+			input.upvalue = i;
+			input.key.type = Arg::NIL;
+			capture(L, -1, input.value);
+			lua_pop(L, 1);
+		}
+	}
+
+	// fields of the environment table on the top of the stack
+	void trackEnvironment(lua_State* L)
+	{
+		lua_pushnil(L);
+		while (lua_next(L, -2))
+		{
+			Input& input = inputs.emplace();
+			input.function.type = Arg::NIL;
+			input.upvalue = 0;
+			capture(L, -2, input.key);
+			capture(L, -1, input.value);
+			lua_pop(L, 1);
+		}
+	}
+
+	// global missing in the environment, value is on the top of the stack, key just below
+	void trackGlobal(lua_State* L)
+	{
+		for (const Input& input : inputs)
+		{
+			if (input.upvalue == 0 && equals(L, -2, input.key)) return;
+		}
+		Input& input = inputs.emplace();
+		input.function.type = Arg::NIL;
+		input.upvalue = 0;
+		capture(L, -2, input.key);
+		capture(L, -1, input.value);
+	}
+
+	// environment table is on the top of the stack
+	bool inputsChanged(lua_State* L) const
+	{
+		for (const Input& input : inputs)
+		{
+			bool is_equal;
+			if (input.upvalue > 0)
+			{
+				push(L, input.function);
+				lua_getupvalue(L, -1, input.upvalue);
+				is_equal = equals(L, -1, input.value);
+				lua_pop(L, 2);
+			}
+			else
+			{
+				push(L, input.key);
+				lua_gettable(L, -2);
+				is_equal = equals(L, -1, input.value);
+				lua_pop(L, 1);
+			}
+			if (!is_equal) return true;
+		}
+		return false;
+	}
+
+	Array<Op> ops;
+	Array<Pass> passes;
+	Array<Access> accesses;
+	Array<int> dependencies;
+	Array<Input> inputs;
+	Array<void*> tracked_upvalues;
+	Array<Arg> args;
+	Array<int> strings;
+	Array<Vec4> vec4s;
+	Array<FrameBuffer::Declaration> framebuffers;
+	bool is_enabled;
+	bool is_valid;
+	bool is_dirty;
+	bool is_volatile;
+};
+
+
+// pipeline whose Lua render function is being recorded, see FrameGraph
+static PipelineImpl* s_recording_pipeline = nullptr;
+
+
 struct PipelineImpl MALMY_FINAL : public Pipeline
 {
 	struct TerrainInstance
@@ -260,10 +737,29 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	{
 		GameObject light;
 		FrameBuffer* framebuffer;
+		Vec4 atlas_slot;
 		Matrix matrices[4];
 	};
 
 
+	// draws of a FrameGraph::ASYNC op recorded while the following independent passes are replayed
+	struct PassJob
+	{
+		explicit PassJob(IAllocator& allocator)
+			: meshes(allocator)
+			, terrains(allocator)
+		{
+		}
+
+		PipelineImpl* pipeline;
+		DrawContext context;
+		u64 render_state;
+		bool restore_render_state;
+		Array<MeshInstance> meshes;
+		Array<TerrainInfo> terrains;
+	};
+
+
 	struct BaseVertex
 	{
 		float x, y, z;
@@ -291,6 +787,22 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		, m_terrains_buffer(allocator)
 		, m_grasses_buffer(allocator)
 		, m_is_rendering_in_shadowmap(false)
+		, m_shadow_cache_framebuffer(BGFX_INVALID_HANDLE)
+		, m_shadow_cache_width(0)
+		, m_shadow_cache_height(0)
+		, m_moved_gameobjects(allocator)
+		, m_static_again_gameobjects(allocator)
+		, m_static_casters(allocator)
+		, m_dynamic_casters(allocator)
+		, m_local_light_shadows(allocator)
+		, m_local_shadow_casters(allocator)
+		, m_pass_jobs(allocator)
+		, m_pass_jobs_signal(JobSystem::INVALID_HANDLE)
+		, m_first_job_pass(-1)
+		, m_last_job_pass(-1)
+		, m_replayed_pass(-1)
+		, m_is_op_async(false)
+		, m_frame_index(0)
 		, m_is_ready(false)
 		, m_debug_index_buffer(BGFX_INVALID_HANDLE)
 		, m_scene(nullptr)
@@ -299,7 +811,12 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		, m_define(define, allocator)
 		, m_draw2d(allocator)
 		, m_is_first_render(true)
+		, m_is_pass_block_open(false)
 		, m_occlusion_buffer(allocator)
+		, m_frame_graph(allocator)
+		, m_bone_matrices(allocator)
+		, m_bone_matrices_count(0)
+		, m_bone_texture(BGFX_INVALID_HANDLE)
 	{
 		for (auto& handle : m_debug_vertex_buffers)
 		{
@@ -319,6 +836,8 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		m_instanced_define_idx = m_renderer.getShaderDefineIdx("INSTANCED");
 
 		createUniforms();
+		createBoneTexture();
+		invalidateShadowCaches();
 
 		ShaderManager& shader_manager = renderer.getShaderManager();
 		m_debug_line_shader = (Shader*)shader_manager.load(Path("pipelines/common/debugline.shd"));
@@ -387,6 +906,55 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	}
 
 
+	static void parseFramebuffer(lua_State* L, FrameBuffer::Declaration& decl, PipelineImpl* pipeline)
+	{
+		const char* name = LuaWrapper::checkArg<const char*>(L, 2);
+		LuaWrapper::checkTableArg(L, 3);
+		copyString(decl.m_name, name);
+
+		LuaWrapper::getOptionalField(L, 3, "width", &decl.m_width);
+		decl.m_size_ratio = Vec2(-1, -1);
+		if(lua_getfield(L, 3, "size_ratio") == LUA_TTABLE)
+		{
+			decl.m_size_ratio = LuaWrapper::toType<Vec2>(L, -1);
+		}
+		lua_pop(L, 1);
+		if(lua_getfield(L, 3, "screen_size") == LUA_TBOOLEAN)
+		{
+			bool is_screen_size = lua_toboolean(L, -1) != 0;
+			decl.m_size_ratio = is_screen_size ? Vec2(1, 1) : Vec2(-1, -1);
+		}
+		lua_pop(L, 1);
+		LuaWrapper::getOptionalField(L, 3, "height", &decl.m_height);
+
+		if(lua_getfield(L, 3, "renderbuffers") == LUA_TTABLE)
+		{
+			parseRenderbuffers(L, decl, pipeline);
+		}
+		lua_pop(L, 1);
+	}
+
+
+	// reads a table of {x, y, z, w} tables, returns the number of vectors read
+	static int parseVec4Array(lua_State* L, int idx, Vec4* values, int max_count)
+	{
+		int len = Math::minimum((int)lua_rawlen(L, idx), max_count);
+		for (int i = 0; i < len; ++i)
+		{
+			if (lua_rawgeti(L, idx, 1 + i) == LUA_TTABLE)
+			{
+				if (lua_rawgeti(L, -1, 1) == LUA_TNUMBER) values[i].x = (float)lua_tonumber(L, -1);
+				if (lua_rawgeti(L, -2, 2) == LUA_TNUMBER) values[i].y = (float)lua_tonumber(L, -1);
+				if (lua_rawgeti(L, -3, 3) == LUA_TNUMBER) values[i].z = (float)lua_tonumber(L, -1);
+				if (lua_rawgeti(L, -4, 4) == LUA_TNUMBER) values[i].w = (float)lua_tonumber(L, -1);
+				lua_pop(L, 4);
+			}
+			lua_pop(L, 1);
+		}
+		return len;
+	}
+
+
 	Path& getPath() override
 	{
 		return m_path;
@@ -406,6 +974,8 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	{
 		if (m_lua_state)
 		{
+			m_frame_graph.clear(m_lua_state);
+			m_frame_graph.is_enabled = false;
 			luaL_unref(m_renderer.getEngine().getState(), LUA_REGISTRYINDEX, m_lua_thread_ref);
 			luaL_unref(m_lua_state, LUA_REGISTRYINDEX, m_lua_env);
 			m_lua_state = nullptr;
@@ -514,6 +1084,11 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 			return;
 		}
 
+		lua_rawgeti(m_lua_state, LUA_REGISTRYINDEX, m_lua_env);
+		lua_getfield(m_lua_state, -1, "RECORD_ONCE");
+		m_frame_graph.is_enabled = lua_toboolean(m_lua_state, -1) != 0;
+		lua_pop(m_lua_state, 2);
+
 		m_width = m_height = -1;
 		if(m_scene) callInitScene();
 
@@ -525,6 +1100,8 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	int m_lua_env;
 	Stats m_stats;
 	bool m_is_first_render;
+	bool m_is_pass_block_open;
+	FrameGraph m_frame_graph;
 
 	void createParticleBuffers()
 	{
@@ -544,6 +1121,22 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	}
 
 
+	void createBoneTexture()
+	{
+		const bgfx::Caps* caps = bgfx::getCaps();
+		if ((caps->supported & BGFX_CAPS_INSTANCING) == 0) return;
+		if ((caps->formats[bgfx::TextureFormat::RGBA32F] & BGFX_CAPS_FORMAT_TEXTURE_VERTEX) == 0) return;
+
+		m_bone_texture = bgfx::createTexture2D(BONE_TEXTURE_WIDTH,
+			BONE_TEXTURE_HEIGHT,
+			false,
+			1,
+			bgfx::TextureFormat::RGBA32F,
+			BGFX_TEXTURE_MIN_POINT | BGFX_TEXTURE_MAG_POINT | BGFX_TEXTURE_MIP_POINT);
+		m_bone_matrices.resize(BONE_TEXTURE_WIDTH * BONE_TEXTURE_HEIGHT / 4);
+	}
+
+
 	void createUniforms()
 	{
 		m_grass_max_dist_uniform = bgfx::createUniform("u_grassMaxDist", bgfx::UniformType::Vec4);
@@ -567,7 +1160,9 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 			bgfx::createUniform("u_lightRgbAndIndirectIntensity", bgfx::UniformType::Vec4);
 		m_light_dir_fov_uniform = bgfx::createUniform("u_lightDirFov", bgfx::UniformType::Vec4);
 		m_shadowmap_matrices_uniform = bgfx::createUniform("u_shadowmapMatrices", bgfx::UniformType::Mat4, 4);
+		m_shadow_atlas_slot_uniform = bgfx::createUniform("u_shadowAtlasSlot", bgfx::UniformType::Vec4);
 		m_bone_matrices_uniform = bgfx::createUniform("u_boneMatrices", bgfx::UniformType::Mat4, 196);
+		m_bone_texture_uniform = bgfx::createUniform("u_boneTexture", bgfx::UniformType::Int1);
 		m_layer_uniform = bgfx::createUniform("u_layer", bgfx::UniformType::Vec4);
 		m_terrain_matrix_uniform = bgfx::createUniform("u_terrainMatrix", bgfx::UniformType::Mat4);
 		m_decal_matrix_uniform = bgfx::createUniform("u_decalMatrix", bgfx::UniformType::Mat4);
@@ -581,6 +1176,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		bgfx::destroy(m_texture_uniform);
 		bgfx::destroy(m_terrain_matrix_uniform);
 		bgfx::destroy(m_bone_matrices_uniform);
+		bgfx::destroy(m_bone_texture_uniform);
 		bgfx::destroy(m_layer_uniform);
 		bgfx::destroy(m_terrain_scale_uniform);
 		bgfx::destroy(m_rel_camera_pos_uniform);
@@ -592,6 +1188,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		bgfx::destroy(m_light_color_indirect_intensity_uniform);
 		bgfx::destroy(m_light_dir_fov_uniform);
 		bgfx::destroy(m_shadowmap_matrices_uniform);
+		bgfx::destroy(m_shadow_atlas_slot_uniform);
 		bgfx::destroy(m_cam_inv_proj_uniform);
 		bgfx::destroy(m_cam_inv_viewproj_uniform);
 		bgfx::destroy(m_cam_view_uniform);
@@ -609,6 +1206,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	{
 		if(m_lua_state)
 		{
+			m_frame_graph.clear(m_lua_state);
 			luaL_unref(m_renderer.getEngine().getState(), LUA_REGISTRYINDEX, m_lua_thread_ref);
 			luaL_unref(m_lua_state, LUA_REGISTRYINDEX, m_lua_env);
 		}
@@ -619,6 +1217,13 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		m_default_cubemap->getResourceManager().unload(*m_default_cubemap);
 
 		destroyUniforms();
+		if (bgfx::isValid(m_bone_texture)) bgfx::destroy(m_bone_texture);
+		if (bgfx::isValid(m_shadow_cache_framebuffer)) bgfx::destroy(m_shadow_cache_framebuffer);
+		if (m_scene)
+		{
+			m_scene->destroyed().unbind<PipelineImpl, &PipelineImpl::onSceneDestroyed>(this);
+			m_scene->getProject().gameobjectTransformed().unbind<PipelineImpl, &PipelineImpl::onGameObjectMoved>(this);
+		}
 
 		for (int i = 0; i < m_uniforms.size(); ++i)
 		{
@@ -644,37 +1249,45 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	}
 
 
-	void renderParticlesFromEmitter(const ParticleEmitter& emitter)
+	struct ParticlesDraw
 	{
-		if (!m_current_view) return;
+		const ParticleEmitter* emitter;
+		const ScriptedParticleEmitter* scripted_emitter;
+		Material* material;
+		bgfx::ProgramHandle program;
+	};
+
+
+	void submitParticles(bgfx::Encoder* encoder,
+		const ParticlesDraw& draw,
+		const Matrix& mtx,
+		const bgfx::InstanceDataBuffer& instance_buffer,
+		int count)
+	{
+		Material* material = draw.material;
+		const View& view = *m_current_view;
+		executeCommandBuffer(encoder, material->getCommandBuffer());
+		executeCommandBuffer(encoder, view.command_buffer.buffer);
+
+		encoder->setInstanceDataBuffer(&instance_buffer, 0, count);
+		encoder->setVertexBuffer(0, m_particle_vertex_buffer);
+		encoder->setIndexBuffer(m_particle_index_buffer);
+		encoder->setStencil(view.stencil, BGFX_STENCIL_NONE);
+		encoder->setState(view.render_state | material->getRenderStates());
+		MT::atomicIncrement(&m_stats.draw_call_count);
+		MT::atomicAdd(&m_stats.instance_count, count);
+		MT::atomicAdd(&m_stats.triangle_count, count * 2);
+		encoder->setUniform(m_emitter_matrix_uniform, &mtx);
+		encoder->submit(view.bgfx_id, draw.program);
+	}
 
-		if (emitter.m_life.empty()) return;
-		if (!emitter.getMaterial()) return;
-		if (!emitter.getMaterial()->isReady()) return;
 
-		Material* material = emitter.getMaterial();
-		static const int local_space_define_idx = m_renderer.getShaderDefineIdx("LOCAL_SPACE");
-		material->setDefine(local_space_define_idx, emitter.m_local_space);
+	void renderParticlesFromEmitter(bgfx::Encoder* encoder, const ParticlesDraw& draw)
+	{
+		const ParticleEmitter& emitter = *draw.emitter;
 		bgfx::InstanceDataBuffer instance_buffer;
 
-		auto& view = *m_current_view;
 		Matrix mtx = m_scene->getProject().getMatrix(emitter.m_gameobject);
-		static const int subimage_define_idx = m_renderer.getShaderDefineIdx("SUBIMAGE");
-		auto draw = [this, material, &view, mtx](const bgfx::InstanceDataBuffer& instance_buffer, int count) {
-			executeCommandBuffer(material->getCommandBuffer(), material);
-			executeCommandBuffer(view.command_buffer.buffer, material);
-
-			bgfx::setInstanceDataBuffer(&instance_buffer, 0, count);
-			bgfx::setVertexBuffer(0, m_particle_vertex_buffer);
-			bgfx::setIndexBuffer(m_particle_index_buffer);
-			bgfx::setStencil(view.stencil, BGFX_STENCIL_NONE);
-			bgfx::setState(view.render_state | material->getRenderStates());
-			++m_stats.draw_call_count;
-			m_stats.instance_count += count;
-			m_stats.triangle_count += count * 2;
-			bgfx::setUniform(m_emitter_matrix_uniform, &mtx);
-			bgfx::submit(view.bgfx_id, material->getShaderInstance().getProgramHandle(view.pass_idx));
-		};
 		if (emitter.m_subimage_module)
 		{
 			struct Instance
@@ -688,7 +1301,6 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 			int rows = emitter.m_subimage_module->rows;
 			float w = 1.0f / cols;
 			float h = 1.0f / rows;
-			material->setDefine(subimage_define_idx, true);
 			int size = emitter.m_subimage_module->rows * emitter.m_subimage_module->cols;
 			bgfx::allocInstanceDataBuffer(&instance_buffer, emitter.m_life.size(), sizeof(Instance));
 			Instance* instance = (Instance*)instance_buffer.data;
@@ -707,7 +1319,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 				instance->uv_params1.set(col1, row1, t, 0);
 				++instance;
 			}
-			draw(instance_buffer, emitter.m_life.size());
+			submitParticles(encoder, draw, mtx, instance_buffer, emitter.m_life.size());
 		}
 		else
 		{
@@ -716,7 +1328,6 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 				Vec4 pos;
 				Vec4 alpha_and_rotation;
 			};
-			material->setDefine(subimage_define_idx, false);
 			bgfx::allocInstanceDataBuffer(&instance_buffer, emitter.m_life.size(), sizeof(Instance));
 			Instance* instance = (Instance*)instance_buffer.data;
 			for (int i = 0, c = emitter.m_life.size(); i < c; ++i)
@@ -725,66 +1336,77 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 				instance->alpha_and_rotation = Vec4(emitter.m_alpha[i], emitter.m_rotation[i], 0, 0);
 				++instance;
 			}
-			draw(instance_buffer, emitter.m_life.size());
+			submitParticles(encoder, draw, mtx, instance_buffer, emitter.m_life.size());
 		}
 	}
 
 
-	void renderParticlesFromEmitter(const ScriptedParticleEmitter& emitter)
+	void renderParticlesFromEmitter(bgfx::Encoder* encoder, const ParticlesDraw& draw, const ScriptedParticleEmitter& emitter)
 	{
-		if (!m_current_view) return;
-
-		if (!emitter.getMaterial()) return;
-		if (!emitter.getMaterial()->isReady()) return;
-
-		Material* material = emitter.getMaterial();
-		static const int local_space_define_idx = m_renderer.getShaderDefineIdx("LOCAL_SPACE");
-		material->setDefine(local_space_define_idx, true);
 		bgfx::InstanceDataBuffer instance_buffer = emitter.generateInstanceBuffer();
 		if (!instance_buffer.data) return;
-		static const int subimage_define_idx = m_renderer.getShaderDefineIdx("SUBIMAGE");
-		material->setDefine(subimage_define_idx, false);
-		auto& view = *m_current_view;
 		Matrix mtx = m_scene->getProject().getMatrix(emitter.m_gameobject);
-		auto draw = [this, material, &view, mtx](const bgfx::InstanceDataBuffer& instance_buffer, int count) {
-			executeCommandBuffer(material->getCommandBuffer(), material);
-			executeCommandBuffer(view.command_buffer.buffer, material);
-
-			bgfx::setInstanceDataBuffer(&instance_buffer, 0, count);
-			bgfx::setVertexBuffer(0, m_particle_vertex_buffer);
-			bgfx::setIndexBuffer(m_particle_index_buffer);
-			bgfx::setStencil(view.stencil, BGFX_STENCIL_NONE);
-			bgfx::setState(view.render_state | material->getRenderStates());
-			++m_stats.draw_call_count;
-			m_stats.instance_count += count;
-			m_stats.triangle_count += count * 2;
-			bgfx::setUniform(m_emitter_matrix_uniform, &mtx);
-			bgfx::submit(view.bgfx_id, material->getShaderInstance().getProgramHandle(view.pass_idx));
-		};
-
-		draw(instance_buffer, instance_buffer.num);
+		submitParticles(encoder, draw, mtx, instance_buffer, instance_buffer.num);
 	}
 
 
 	void renderParticles()
 	{
 		PROFILE_FUNCTION();
+		if (!m_current_view) return;
+
+		static const u32 local_space_mask = 1 << m_renderer.getShaderDefineIdx("LOCAL_SPACE");
+		static const u32 subimage_mask = 1 << m_renderer.getShaderDefineIdx("SUBIMAGE");
+		IAllocator& frame_allocator = m_renderer.getEngine().getFrameAllocator();
+		Array<ParticlesDraw> draws(frame_allocator);
+
 		const auto& emitters = m_scene->getParticleEmitters();
 		for (int i = 0, c = emitters.size(); i < c; ++i)
 		{
 			auto* emitter = emitters.at(i);
 			if (!emitter->m_is_valid) continue;
-
-			renderParticlesFromEmitter(*emitter);
+			if (emitter->m_life.empty()) continue;
+			Material* material = emitter->getMaterial();
+			if (!material || !material->isReady()) continue;
+
+			u32 defines = emitter->m_local_space ? local_space_mask : 0;
+			if (emitter->m_subimage_module) defines |= subimage_mask;
+			ParticlesDraw& draw = draws.emplace();
+			draw.emitter = emitter;
+			draw.scripted_emitter = nullptr;
+			draw.material = material;
+			draw.program = getProgram(*material, *m_current_view, local_space_mask | subimage_mask, defines);
 		}
 
 		const auto& scripted_emitters = m_scene->getScriptedParticleEmitters();
 		for (int i = 0, c = scripted_emitters.size(); i < c; ++i)
 		{
 			auto* scripted_emitter = scripted_emitters.at(i);
-
-			renderParticlesFromEmitter(*scripted_emitter);
+			Material* material = scripted_emitter->getMaterial();
+			if (!material || !material->isReady()) continue;
+
+			ParticlesDraw& draw = draws.emplace();
+			draw.emitter = nullptr;
+			draw.scripted_emitter = scripted_emitter;
+			draw.material = material;
+			draw.program = getProgram(*material, *m_current_view, local_space_mask | subimage_mask, local_space_mask);
 		}
+
+		auto record = [this, &draws](bgfx::Encoder* encoder, InstanceData&, int from, int to) {
+			for (int i = from; i < to; ++i)
+			{
+				const ParticlesDraw& draw = draws[i];
+				if (draw.emitter)
+				{
+					renderParticlesFromEmitter(encoder, draw);
+				}
+				else
+				{
+					renderParticlesFromEmitter(encoder, draw, *draw.scripted_emitter);
+				}
+			}
+		};
+		recordInJobs("particles", draws.size(), 8, record);
 	}
 
 
@@ -857,59 +1479,158 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	}
 
 
-	void finishInstances(bgfx::Encoder* encoder)
+	// draw-time defines are passed to the lookup instead of being set on the material, which is shared
+	// between jobs; override_* take precedence over the view's defines
+	bgfx::ProgramHandle getProgram(const Material& material, const View& view, u32 override_mask, u32 override_defines) const
 	{
-		InstanceData& data = s_instance_data;
-		if (!data.mesh) return;
-		if (!data.buffer.data) return;
-		if (data.instances_count == 0) return;
+		u32 defines = (view.defines & ~override_mask) | (override_defines & override_mask);
+		return material.getShaderInstance(view.define_mask | override_mask, defines).getProgramHandle(view.pass_idx);
+	}
 
-		const Mesh& mesh = *data.mesh;
-		Material* material = mesh.material;
 
-		material->setDefine(m_instanced_define_idx, true);
+	// view draws of the layer go to, nullptr if the layer is not rendered
+	View* getLayerView(const InstanceData& data, int layer)
+	{
+		if (data.context) return data.context->view;
+		int view_idx = m_layer_to_view_map[layer];
+		return view_idx >= 0 ? &m_views[view_idx] : nullptr;
+	}
 
-		int view_idx = m_layer_to_view_map[material->getRenderLayer()];
-		ASSERT(view_idx >= 0);
-		auto& view = m_views[view_idx >= 0 ? view_idx : 0];
 
-		executeCommandBuffer(encoder, material->getCommandBuffer(), material);
-		executeCommandBuffer(encoder, view.command_buffer.buffer, material);
+	View& getDrawView(const InstanceData& data, const Material& material)
+	{
+		View* view = getLayerView(data, material.getRenderLayer());
+		ASSERT(view);
+		return view ? *view : m_views[0];
+	}
 
-		encoder->setVertexBuffer(0, mesh.vertex_buffer_handle);
-		encoder->setIndexBuffer(mesh.index_buffer_handle);
-		encoder->setStencil(view.stencil, BGFX_STENCIL_NONE);
-		encoder->setState(view.render_state | material->getRenderStates());
-		data.buffer.offset += data.offset * sizeof(Matrix);
-		encoder->setInstanceDataBuffer(&data.buffer, 0, data.instances_count);
-		data.buffer.offset -= data.offset * sizeof(Matrix);
-		ShaderInstance& shader_instance = material->getShaderInstance();
-		MT::atomicIncrement(&m_stats.draw_call_count);
-		MT::atomicAdd(&m_stats.instance_count, data.instances_count);
-		MT::atomicAdd(&m_stats.triangle_count, data.instances_count * mesh.indices_count / 3);
-		encoder->submit(view.bgfx_id, shader_instance.getProgramHandle(view.pass_idx));
 
-		data.offset += data.instances_count;
-		if (data.offset == InstanceData::MAX_INSTANCE_COUNT)
-		{
-			data.buffer.data = nullptr;
-			data.offset = 0;
-		}
-		data.instances_count = 0;
-		data.mesh = nullptr;
+	GameObject getDrawCamera(const InstanceData& data) const
+	{
+		return data.context ? data.context->camera : m_applied_camera;
 	}
 
 
-	void applyCamera(const char* slot)
+	bool isDrawingShadowmap(const InstanceData& data) const
 	{
-		GameObject camera = m_scene->getCameraInSlot(slot);
-		if (!camera.isValid()) return;
-
-		m_scene->setCameraScreenSize(camera, m_width, m_height);
-		m_applied_camera = camera;
-		m_camera_frustum = m_scene->getCameraFrustum(camera);
+		return data.context ? data.context->is_shadowmap : m_is_rendering_in_shadowmap;
+	}
 
-		Matrix projection_matrix = m_scene->getCameraProjection(camera);
+
+	void finishInstances(bgfx::Encoder* encoder, InstanceData& data)
+	{
+		finishInstances(encoder, data, data.rigid);
+		finishInstances(encoder, data, data.skinned);
+		discardCachedState(encoder, data);
+	}
+
+
+	// must be called before anything else is submitted with the encoder
+	void discardCachedState(bgfx::Encoder* encoder, InstanceData& data) const
+	{
+		if (!data.state_cache.view) return;
+		encoder->discard();
+		data.state_cache = DrawStateCache();
+	}
+
+
+	void finishInstances(bgfx::Encoder* encoder, InstanceData& data, InstanceBatch& batch)
+	{
+		if (!batch.mesh) return;
+		if (!batch.buffer.data) return;
+		if (batch.instances_count == 0) return;
+
+		const Mesh& mesh = *batch.mesh;
+		Material* material = mesh.material;
+		if (mesh.type == Mesh::MULTILAYER_RIGID || mesh.type == Mesh::MULTILAYER_SKINNED)
+		{
+			// every layer draws all instances, then the base mesh is drawn in the default layer
+			View* layer_view = getLayerView(data, material->getRenderLayer());
+			if (layer_view && !isDrawingShadowmap(data))
+			{
+				int layers_count = material->getLayersCount();
+				for (int i = 0; i < layers_count; ++i)
+				{
+					Vec4 layer((i + 1) / (float)layers_count, 0, 0, 0);
+					encoder->setUniform(m_layer_uniform, &layer);
+					submitInstances(encoder, data, batch, *layer_view);
+				}
+			}
+			static const int default_layer = m_renderer.getLayer("default");
+			View* default_view = getLayerView(data, default_layer);
+			if (default_view) submitInstances(encoder, data, batch, *default_view);
+		}
+		else
+		{
+			submitInstances(encoder, data, batch, getDrawView(data, *material));
+		}
+
+		batch.offset += batch.instances_count;
+		if (batch.offset == InstanceData::MAX_INSTANCE_COUNT)
+		{
+			batch.buffer.data = nullptr;
+			batch.offset = 0;
+		}
+		batch.instances_count = 0;
+		batch.mesh = nullptr;
+	}
+
+
+	void submitInstances(bgfx::Encoder* encoder, InstanceData& data, const InstanceBatch& batch, View& view)
+	{
+		const Mesh& mesh = *batch.mesh;
+		Material* material = mesh.material;
+
+		u32 instanced_mask = 1 << m_instanced_define_idx;
+		bgfx::ProgramHandle program = getProgram(*material, view, instanced_mask, instanced_mask);
+		if (!bgfx::isValid(program)) return;
+
+		DrawStateCache& cache = data.state_cache;
+		if (cache.material_commands == material->getCommandBuffer() && cache.view == &view && cache.program == program.idx)
+		{
+			// uniforms are not per draw, other draws can be sorted in between, so they are always set
+			int count = executeCommandBuffer(encoder, material->getCommandBuffer(), true);
+			count += executeCommandBuffer(encoder, view.command_buffer.buffer, true);
+			MT::atomicAdd(&m_stats.elided_command_count, cache.commands_count - count);
+		}
+		else
+		{
+			discardCachedState(encoder, data);
+			cache.commands_count = executeCommandBuffer(encoder, material->getCommandBuffer());
+			cache.commands_count += executeCommandBuffer(encoder, view.command_buffer.buffer);
+			cache.material_commands = material->getCommandBuffer();
+			cache.view = &view;
+			cache.program = program.idx;
+		}
+
+		if (batch.is_skinned)
+		{
+			encoder->setTexture(BONE_TEXTURE_STAGE, m_bone_texture_uniform, m_bone_texture);
+		}
+		encoder->setVertexBuffer(0, mesh.vertex_buffer_handle);
+		encoder->setIndexBuffer(mesh.index_buffer_handle);
+		encoder->setStencil(view.stencil, BGFX_STENCIL_NONE);
+		encoder->setState(view.render_state | material->getRenderStates());
+		bgfx::InstanceDataBuffer buffer = batch.buffer;
+		buffer.offset += batch.offset * batch.stride;
+		encoder->setInstanceDataBuffer(&buffer, 0, batch.instances_count);
+		MT::atomicIncrement(&m_stats.draw_call_count);
+		MT::atomicAdd(&m_stats.instance_count, batch.instances_count);
+		MT::atomicAdd(&m_stats.triangle_count, batch.instances_count * mesh.indices_count / 3);
+		encoder->submit(view.bgfx_id, program, 0, true);
+	}
+
+
+	void applyCamera(const char* slot)
+	{
+		GameObject camera = m_scene->getCameraInSlot(slot);
+		if (!camera.isValid()) return;
+
+		m_scene->setCameraScreenSize(camera, m_width, m_height);
+		m_applied_camera = camera;
+		m_camera_frustum = m_scene->getCameraFrustum(camera);
+
+		Matrix projection_matrix = m_scene->getCameraProjection(camera);
 
 		Project& project = m_scene->getProject();
 		Matrix view = project.getMatrix(camera);
@@ -938,7 +1659,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		if (!m_text_mesh_shader->isReady()) return;
 		if (!m_applied_camera.isValid()) return;
 
-		IAllocator& allocator = m_renderer.getEngine().getLIFOAllocator();
+		IAllocator& allocator = m_renderer.getEngine().getFrameAllocator();
 		Array<TextMeshVertex> vertices(allocator);
 		vertices.reserve(1024);
 		m_scene->getTextMeshesVertices(vertices, m_applied_camera);
@@ -1003,6 +1724,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		copyMemory(index_buffer.data, &m_draw2d.IdxBuffer[0], num_indices * sizeof(u16));
 		
 		u32 elem_offset = 0;
+		int submitted_commands = 0;
 		const Draw2D::DrawCmd* pcmd_begin = m_draw2d.CmdBuffer.begin();
 		const Draw2D::DrawCmd* pcmd_end = m_draw2d.CmdBuffer.end();
 		ShaderInstance& shader_instance = m_draw2d_shader->getInstance(0);
@@ -1029,7 +1751,9 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 				shader_instance);
 				
 			elem_offset += pcmd->ElemCount;
+			++submitted_commands;
 		}
+		PROFILE_INT("draw2d commands", submitted_commands);
 		resetDraw2D();
 	}
 
@@ -1040,6 +1764,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		copyString(handler.name, name);
 		handler.hash = crc32(name);
 		exposeCustomCommandToLua(handler);
+		m_frame_graph.is_dirty = true;
 		return handler;
 	}
 
@@ -1120,7 +1845,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 				break;
 			}
 		}
-		finishInstances(m_renderer.getEncoder());
+		finishInstances(m_renderer.getEncoder(), m_instance_data);
 	}
 
 
@@ -1140,6 +1865,8 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		m_current_view->render_state = BGFX_STATE_WRITE_RGB | BGFX_STATE_WRITE_A | BGFX_STATE_WRITE_Z;
 		m_current_view->pass_idx = m_pass_idx;
 		m_current_view->command_buffer.clear();
+		m_current_view->define_mask = 0;
+		m_current_view->defines = 0;
 		m_global_textures_count = 0;
 		if (layer_mask != 0)
 		{
@@ -1158,10 +1885,30 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		}
 		bgfx::setViewClear(m_current_view->bgfx_id, 0, (u32)255, 0, 0);
 		bgfx::setViewName(m_current_view->bgfx_id, debug_name);
+		m_current_view->name = debug_name;
 		return m_view_idx;
 	}
 
 
+	// each view created by the script gets its own profiler block, view slots are reused by views
+	// with other names, so the profiler gets an interned copy of the name
+	void beginPassBlock()
+	{
+		endPassBlock();
+		if (!m_current_view) return;
+		Profiler::beginBlock(Profiler::internName(m_current_view->name.data));
+		m_is_pass_block_open = true;
+	}
+
+
+	void endPassBlock()
+	{
+		if (!m_is_pass_block_open) return;
+		Profiler::endBlock();
+		m_is_pass_block_open = false;
+	}
+
+
 	void saveRenderbuffer(const char* framebuffer, int render_buffer_index, const char* out_path)
 	{
 		FrameBuffer* fb = getFramebuffer(framebuffer);
@@ -1260,8 +2007,8 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 			state = ((state & ~BGFX_STATE_CULL_MASK) & ~BGFX_STATE_DEPTH_TEST_MASK) | BGFX_STATE_CULL_CCW;
 		}
 		bgfx::setState(state);
-		executeCommandBuffer(view.command_buffer.buffer, material);
-		material->setDefine(m_has_shadowmap_define_idx, shadowmap != nullptr);
+		executeCommandBuffer(view.command_buffer.buffer);
+		u32 has_shadowmap_mask = 1 << m_has_shadowmap_define_idx;
 		if (shadowmap)
 		{
 			u32 flags = BGFX_TEXTURE_MIN_ANISOTROPIC | BGFX_TEXTURE_MAG_ANISOTROPIC;
@@ -1269,13 +2016,14 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 			bgfx::setUniform(m_shadowmap_matrices_uniform,
 				&shadowmap->matrices[0],
 				m_scene->getLightFOV(shadowmap->light) > Math::PI ? 4 : 1);
+			bgfx::setUniform(m_shadow_atlas_slot_uniform, &shadowmap->atlas_slot);
 		}
 		bgfx::setVertexBuffer(0, m_cube_vb);
 		bgfx::setIndexBuffer(m_cube_ib);
 		++m_stats.draw_call_count;
 		m_stats.instance_count += instance_count;
 		m_stats.triangle_count += instance_count * 12;
-		bgfx::submit(m_current_view->bgfx_id, material->getShaderInstance().getProgramHandle(m_pass_idx));
+		bgfx::submit(m_current_view->bgfx_id, getProgram(*material, view, has_shadowmap_mask, shadowmap ? has_shadowmap_mask : 0));
 	}
 
 
@@ -1310,7 +2058,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		Material* material = static_cast<Material*>(res);
 		if (!material->isReady()) return;
 
-		IAllocator& frame_allocator = m_renderer.getEngine().getLIFOAllocator();
+		IAllocator& frame_allocator = m_renderer.getEngine().getFrameAllocator();
 		Array<GameObject> local_lights(frame_allocator);
 		m_scene->getPointLights(m_camera_frustum, local_lights);
 
@@ -1406,78 +2154,152 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		if (!m_applied_camera.isValid()) return;
 		if (!m_current_view) return;
 
-		IAllocator& frame_allocator = m_renderer.getEngine().getLIFOAllocator();
+		IAllocator& frame_allocator = m_renderer.getEngine().getFrameAllocator();
 		Array<DecalInfo> decals(frame_allocator);
 		m_scene->getDecals(m_camera_frustum, decals);
 
 		PROFILE_INT("decal count", decals.size());
 
-		const View& view = *m_current_view;
-		for (const DecalInfo& decal : decals)
-		{
-			auto state = view.render_state | decal.material->getRenderStates();
-			if (m_camera_frustum.intersectNearPlane(decal.position, decal.radius))
+		auto record = [this, &decals](bgfx::Encoder* encoder, InstanceData&, int from, int to) {
+			const View& view = *m_current_view;
+			for (int i = from; i < to; ++i)
 			{
-				state = ((state & ~BGFX_STATE_CULL_MASK) & ~BGFX_STATE_DEPTH_TEST_MASK) | BGFX_STATE_CULL_CCW;
+				const DecalInfo& decal = decals[i];
+				auto state = view.render_state | decal.material->getRenderStates();
+				if (m_camera_frustum.intersectNearPlane(decal.position, decal.radius))
+				{
+					state = ((state & ~BGFX_STATE_CULL_MASK) & ~BGFX_STATE_DEPTH_TEST_MASK) | BGFX_STATE_CULL_CCW;
+				}
+				encoder->setState(state);
+				executeCommandBuffer(encoder, decal.material->getCommandBuffer());
+				executeCommandBuffer(encoder, view.command_buffer.buffer);
+				encoder->setUniform(m_decal_matrix_uniform, &decal.inv_mtx.m11);
+				encoder->setTransform(&decal.mtx.m11);
+				encoder->setVertexBuffer(0, m_cube_vb);
+				encoder->setIndexBuffer(m_cube_ib);
+				encoder->setStencil(view.stencil, BGFX_STENCIL_NONE);
+
+				encoder->submit(view.bgfx_id, getProgram(*decal.material, view, 0, 0));
 			}
-			bgfx::setState(state);
-			executeCommandBuffer(decal.material->getCommandBuffer(), decal.material);
-			executeCommandBuffer(view.command_buffer.buffer, decal.material);
-			bgfx::setUniform(m_decal_matrix_uniform, &decal.inv_mtx.m11);
-			bgfx::setTransform(&decal.mtx.m11);
-			bgfx::setVertexBuffer(0, m_cube_vb);
-			bgfx::setIndexBuffer(m_cube_ib);
-			bgfx::setStencil(view.stencil, BGFX_STENCIL_NONE);
-			
-			bgfx::submit(m_current_view->bgfx_id, decal.material->getShaderInstance().getProgramHandle(m_pass_idx));
+		};
+		recordInJobs("decals", decals.size(), 64, record);
+	}
+
+
+	struct LocalLightShadow
+	{
+		GameObject light;
+		Matrix light_mtx;
+		float range;
+		float fov;
+		int slot_x;
+		int slot_y;
+		int slot_size;
+		u64 casters_hash;
+		u32 rendered_frame;
+		bool is_valid;
+		// kept until the shadowmap is rendered, causes of the change can be gone by then
+		bool is_dirty;
+		bool is_used;
+		Matrix matrices[4];
+	};
+
+
+	struct LocalLightShadowRequest
+	{
+		GameObject light;
+		int level;
+		// index to m_local_light_shadows, it can grow while requests are processed
+		int shadow_idx;
+		Matrix light_mtx;
+		float range;
+		float fov;
+	};
+
+
+	static void decodeMorton(u32 code, int* x, int* y)
+	{
+		auto compact = [](u32 v) {
+			v &= 0x55555555;
+			v = (v | (v >> 1)) & 0x33333333;
+			v = (v | (v >> 2)) & 0x0f0f0f0f;
+			v = (v | (v >> 4)) & 0x00ff00ff;
+			v = (v | (v >> 8)) & 0x0000ffff;
+			return v;
+		};
+		*x = (int)compact(code);
+		*y = (int)compact(code >> 1);
+	}
+
+
+	int getLocalLightShadowIndex(GameObject light)
+	{
+		for (int i = 0, c = m_local_light_shadows.size(); i < c; ++i)
+		{
+			if (m_local_light_shadows[i].light == light) return i;
 		}
+		LocalLightShadow& shadow = m_local_light_shadows.emplace();
+		shadow.light = light;
+		shadow.casters_hash = 0;
+		shadow.rendered_frame = 0;
+		shadow.is_valid = false;
+		shadow.is_dirty = true;
+		return m_local_light_shadows.size() - 1;
 	}
 
 
-	void renderSpotLightShadowmap(GameObject light)
+	Vec4 getShadowAtlasSlot(const LocalLightShadow& shadow, int atlas_size) const
 	{
-		newView("point_light", ~0ULL);
+		float size = shadow.slot_size / (float)atlas_size;
+		float x = shadow.slot_x / (float)atlas_size;
+		float y = bgfx::getCaps()->originBottomLeft
+			? 1 - (shadow.slot_y + shadow.slot_size) / (float)atlas_size
+			: shadow.slot_y / (float)atlas_size;
+		return Vec4(x, y, size, 0);
+	}
 
-		GameObject light_gameobject = m_scene->getPointLightGameObject(light);
-		Matrix mtx = m_scene->getProject().getMatrix(light_gameobject);
-		float fov = m_scene->getLightFOV(light);
-		float range = m_scene->getLightRange(light);
-		u16 shadowmap_height = (u16)m_current_framebuffer->getHeight();
-		u16 shadowmap_width = (u16)m_current_framebuffer->getWidth();
+
+	void renderSpotLightShadowmap(LocalLightShadow& shadow)
+	{
+		newView("spot_light", ~0ULL);
+
+		const Matrix& mtx = shadow.light_mtx;
 		Vec3 pos = mtx.getTranslation();
 
 		bgfx::setViewClear(m_current_view->bgfx_id, BGFX_CLEAR_DEPTH, 0, 0.0f, 0);
 		bgfx::touch(m_current_view->bgfx_id);
-		bgfx::setViewRect(m_current_view->bgfx_id, 0, 0, shadowmap_width, shadowmap_height);
+		bgfx::setViewRect(m_current_view->bgfx_id, (u16)shadow.slot_x, (u16)shadow.slot_y, (u16)shadow.slot_size, (u16)shadow.slot_size);
 
 		Matrix projection_matrix;
-		projection_matrix.setPerspective(fov, 1, 0.01f, range, bgfx::getCaps()->homogeneousDepth, true);
+		projection_matrix.setPerspective(shadow.fov, 1, 0.01f, shadow.range, bgfx::getCaps()->homogeneousDepth, true);
 		Matrix view_matrix;
 		view_matrix.lookAt(pos, pos + mtx.getZVector(), mtx.getYVector());
 		bgfx::setViewTransform(m_current_view->bgfx_id, &view_matrix.m11, &projection_matrix.m11);
 
-		PointLightShadowmap& s = m_point_light_shadowmaps.emplace();
-		s.framebuffer = m_current_framebuffer;
-		s.light = light;
 		float ymul = bgfx::getCaps()->originBottomLeft ? 0.5f : -0.5f;
 		static const Matrix biasMatrix(
 			0.5,  0.0, 0.0, 0.0,
 			0.0, ymul, 0.0, 0.0,
 			0.0,  0.0, 0.5, 0.0,
 			0.5,  0.5, 0.5, 1.0);
-		s.matrices[0] = biasMatrix * (projection_matrix * view_matrix);
+		shadow.matrices[0] = biasMatrix * (projection_matrix * view_matrix);
 
-		renderPointLightInfluencedGeometry(light);
+		Matrix camera_mtx = view_matrix;
+		camera_mtx.fastInverse();
+		Frustum frustum;
+		frustum.computePerspective(pos, -camera_mtx.getZVector(), camera_mtx.getYVector(), shadow.fov, 1, 0.01f, shadow.range);
+		Array<MeshInstance> tmp_meshes(m_renderer.getEngine().getFrameAllocator());
+		Vec3 lod_ref_point = m_scene->getProject().getPosition(m_applied_camera);
+		m_scene->getPointLightInfluencedGeometry(shadow.light, m_applied_camera, lod_ref_point, frustum, tmp_meshes);
+		recordDraws(*m_current_view, m_current_view->render_state, tmp_meshes, nullptr);
 	}
 
 
-	void renderOmniLightShadowmap(GameObject light)
+	void renderOmniLightShadowmap(LocalLightShadow& shadow)
 	{
-		GameObject light_gameobject = m_scene->getPointLightGameObject(light);
-		Vec3 light_pos = m_scene->getProject().getPosition(light_gameobject);
-		float range = m_scene->getLightRange(light);
-		u16 shadowmap_height = (u16)m_current_framebuffer->getHeight();
-		u16 shadowmap_width = (u16)m_current_framebuffer->getWidth();
+		Vec3 light_pos = shadow.light_mtx.getTranslation();
+		float range = shadow.range;
+		int face_size = shadow.slot_size >> 1;
 
 		float viewports[] = {0, 0, 0.5, 0, 0, 0.5, 0.5, 0.5};
 
@@ -1495,22 +2317,16 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 			{Math::degreesToRadians(90.0f), Math::degreesToRadians(-27.36780516f), Math::degreesToRadians(0.0f)},
 		};
 
-		PointLightShadowmap& shadowmap_info = m_point_light_shadowmaps.emplace();
-		shadowmap_info.framebuffer = m_current_framebuffer;
-		shadowmap_info.light = light;
-		//setPointLightUniforms(light);
-
-		IAllocator& frame_allocator = m_renderer.getEngine().getLIFOAllocator();
+		IAllocator& frame_allocator = m_renderer.getEngine().getFrameAllocator();
 		for (int i = 0; i < 4; ++i)
 		{
 			newView("omnilight", 0xff);
 
 			bgfx::setViewClear(m_current_view->bgfx_id, BGFX_CLEAR_DEPTH, 0, 0.0f, 0);
 			bgfx::touch(m_current_view->bgfx_id);
-			u16 view_x = u16(shadowmap_width * viewports[i * 2]);
-			u16 view_y = u16(shadowmap_height * viewports[i * 2 + 1]);
-			bgfx::setViewRect(
-				m_current_view->bgfx_id, view_x, view_y, shadowmap_width >> 1, shadowmap_height >> 1);
+			u16 view_x = u16(shadow.slot_x + shadow.slot_size * viewports[i * 2]);
+			u16 view_y = u16(shadow.slot_y + shadow.slot_size * viewports[i * 2 + 1]);
+			bgfx::setViewRect(m_current_view->bgfx_id, view_x, view_y, (u16)face_size, (u16)face_size);
 
 			float fovx = Math::degreesToRadians(143.98570868f + 3.51f);
 			float fovy = Math::degreesToRadians(125.26438968f + 9.85f);
@@ -1545,50 +2361,196 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 			float ymul = bgfx::getCaps()->originBottomLeft ? 0.5f : -0.5f;
 			static const Matrix biasMatrix(
 				0.5, 0.0, 0.0, 0.0, 0.0, ymul, 0.0, 0.0, 0.0, 0.0, 0.5, 0.0, 0.5, 0.5, 0.5, 1.0);
-			shadowmap_info.matrices[i] = biasMatrix * (projection_matrix * view_matrix);
+			shadow.matrices[i] = biasMatrix * (projection_matrix * view_matrix);
 
 			Array<MeshInstance> tmp_meshes(frame_allocator);
 			m_is_current_light_global = false;
 			Vec3 lod_ref_point = m_scene->getProject().getPosition(m_applied_camera);
-			m_scene->getPointLightInfluencedGeometry(light
+			m_scene->getPointLightInfluencedGeometry(shadow.light
 				, m_applied_camera
 				, lod_ref_point
 				, frustum
 				, tmp_meshes);
 
-			renderMeshes(tmp_meshes, false);
+			recordDraws(*m_current_view, m_current_view->render_state, tmp_meshes, nullptr);
 		}
 	}
 
 
-	void renderLocalLightShadowmaps(GameObject camera, FrameBuffer** fbs, int framebuffers_count)
+	// returns true if the shadow in its current slot can not be reused
+	bool isLocalLightShadowDirty(LocalLightShadow& shadow, const Matrix& light_mtx, float range, float fov)
 	{
-		if (!camera.isValid()) return;
+		bool is_dirty = shadow.is_dirty
+			|| !shadow.is_valid
+			|| shadow.range != range
+			|| shadow.fov != fov
+			|| compareMemory(&shadow.light_mtx, &light_mtx, sizeof(light_mtx)) != 0;
+
+		m_local_shadow_casters.clear();
+		Vec3 lod_ref_point = m_scene->getProject().getPosition(m_applied_camera);
+		m_scene->getPointLightInfluencedGeometry(shadow.light, m_applied_camera, lod_ref_point, m_local_shadow_casters);
+		u64 hash = 0;
+		for (const MeshInstance& mesh : m_local_shadow_casters)
+		{
+			hash += getShadowCasterHash(mesh);
+			if (is_dirty) continue;
+			if (mesh.mesh->type == Mesh::SKINNED || mesh.mesh->type == Mesh::MULTILAYER_SKINNED)
+			{
+				is_dirty = true;
+				continue;
+			}
+			auto iter = m_moved_gameobjects.find(mesh.owner);
+			if (iter.isValid() && iter.value() >= shadow.rendered_frame) is_dirty = true;
+		}
+		if (hash != shadow.casters_hash) is_dirty = true;
+		shadow.casters_hash = hash;
+		shadow.is_dirty = is_dirty;
+		return is_dirty;
+	}
+
+
+	// Shadowmaps of local lights are in slots of a single atlas. Slot size depends on how big the light is on screen.
+	// Slots are kept while lights' order does not change, so lights with nothing moving keep their shadowmaps
+	// and at most LOCAL_SHADOW_FACE_UPDATES_PER_FRAME faces are rendered per frame, missing and oldest first.
+	void renderLocalLightShadowmaps(GameObject camera, FrameBuffer* atlas)
+	{
+		PROFILE_FUNCTION();
+		if (!camera.isValid() || !atlas) return;
 
 		Project& project = m_scene->getProject();
 		Vec3 camera_pos = project.getPosition(camera);
 
-		GameObject lights[16];
+		GameObject lights[LOCAL_SHADOW_MAX_LIGHTS];
 		int light_count = m_scene->getClosestPointLights(camera_pos, lights, lengthOf(lights));
 
-		int fb_index = 0;
+		LocalLightShadowRequest requests[LOCAL_SHADOW_MAX_LIGHTS];
+		int requests_count = 0;
 		for (int i = 0; i < light_count; ++i)
 		{
 			if (!m_scene->getLightCastShadows(lights[i])) continue;
-			if (fb_index == framebuffers_count) break;
 
-			float fov = m_scene->getLightFOV(lights[i]);
+			Vec3 light_pos = project.getPosition(m_scene->getPointLightGameObject(lights[i]));
+			float range = m_scene->getLightRange(lights[i]);
+			float distance = Math::maximum((light_pos - camera_pos).length(), 0.001f);
+			float screen_ratio = range / distance;
+			int level = 0;
+			while (level < LOCAL_SHADOW_SLOT_LEVELS - 1 && screen_ratio < 0.5f)
+			{
+				screen_ratio *= 2;
+				++level;
+			}
+			// sorted by slot size and then by light, so slots do not change with lights' distance order
+			int j = requests_count;
+			for (; j > 0; --j)
+			{
+				const LocalLightShadowRequest& prev = requests[j - 1];
+				if (prev.level < level || (prev.level == level && prev.light.index < lights[i].index)) break;
+				requests[j] = prev;
+			}
+			requests[j].light = lights[i];
+			requests[j].level = level;
+			++requests_count;
+		}
+
+		for (LocalLightShadow& shadow : m_local_light_shadows) shadow.is_used = false;
+
+		// slots are allocated in Morton order from the biggest, so each one is aligned to its size
+		int atlas_size = Math::minimum(atlas->getWidth(), atlas->getHeight());
+		int cell_size = atlas_size >> LOCAL_SHADOW_SLOT_LEVELS;
+		u32 cells_count = 1 << (2 * LOCAL_SHADOW_SLOT_LEVELS);
+		u32 cursor = 0;
+		int slotted_count = 0;
+		for (int i = 0; i < requests_count; ++i)
+		{
+			LocalLightShadowRequest& request = requests[i];
+			u32 slot_cells = 1 << (2 * (LOCAL_SHADOW_SLOT_LEVELS - 1 - request.level));
+			if (cursor + slot_cells > cells_count) break;
+			++slotted_count;
+
+			int cell_x, cell_y;
+			decodeMorton(cursor, &cell_x, &cell_y);
+			cursor += slot_cells;
+
+			request.shadow_idx = getLocalLightShadowIndex(request.light);
+			LocalLightShadow& shadow = m_local_light_shadows[request.shadow_idx];
+			shadow.is_used = true;
+			int slot_x = cell_x * cell_size;
+			int slot_y = cell_y * cell_size;
+			int slot_size = atlas_size >> (request.level + 1);
+			if (shadow.slot_x != slot_x || shadow.slot_y != slot_y || shadow.slot_size != slot_size)
+			{
+				shadow.is_valid = false;
+				shadow.slot_x = slot_x;
+				shadow.slot_y = slot_y;
+				shadow.slot_size = slot_size;
+			}
+
+			request.light_mtx = project.getMatrix(m_scene->getPointLightGameObject(request.light));
+			request.range = m_scene->getLightRange(request.light);
+			request.fov = m_scene->getLightFOV(request.light);
+			isLocalLightShadowDirty(shadow, request.light_mtx, request.range, request.fov);
+		}
 
-			m_current_framebuffer = fbs[i];
-			if (fov < Math::PI)
+		// the ones rendered longest ago are updated first, so lights dirty every frame can not starve the others,
+		// stale shadowmaps are kept if the budget is exhausted, missing ones are not used at all
+		int face_updates = 0;
+		m_current_framebuffer = atlas;
+		for (;;)
+		{
+			LocalLightShadowRequest* oldest = nullptr;
+			for (int i = 0; i < slotted_count; ++i)
+			{
+				LocalLightShadowRequest& request = requests[i];
+				const LocalLightShadow& shadow = m_local_light_shadows[request.shadow_idx];
+				if (!shadow.is_dirty) continue;
+				const int faces = request.fov < Math::PI ? 1 : 4;
+				if (face_updates + faces > LOCAL_SHADOW_FACE_UPDATES_PER_FRAME) continue;
+				if (oldest)
+				{
+					const LocalLightShadow& oldest_shadow = m_local_light_shadows[oldest->shadow_idx];
+					if (shadow.is_valid && !oldest_shadow.is_valid) continue;
+					if (shadow.is_valid == oldest_shadow.is_valid && shadow.rendered_frame >= oldest_shadow.rendered_frame) continue;
+				}
+				oldest = &request;
+			}
+			if (!oldest) break;
+
+			LocalLightShadow& shadow = m_local_light_shadows[oldest->shadow_idx];
+			shadow.light_mtx = oldest->light_mtx;
+			shadow.range = oldest->range;
+			shadow.fov = oldest->fov;
+			shadow.rendered_frame = m_frame_index;
+			if (oldest->fov < Math::PI)
 			{
-				renderSpotLightShadowmap(lights[i]);
+				renderSpotLightShadowmap(shadow);
+				face_updates += 1;
 			}
 			else
 			{
-				renderOmniLightShadowmap(lights[i]);
+				renderOmniLightShadowmap(shadow);
+				face_updates += 4;
 			}
-			++fb_index;
+			shadow.is_valid = true;
+			shadow.is_dirty = false;
+		}
+
+		for (int i = 0; i < slotted_count; ++i)
+		{
+			const LocalLightShadowRequest& request = requests[i];
+			const LocalLightShadow& shadow = m_local_light_shadows[request.shadow_idx];
+			if (!shadow.is_valid) continue;
+
+			PointLightShadowmap& info = m_point_light_shadowmaps.emplace();
+			info.framebuffer = atlas;
+			info.light = request.light;
+			info.atlas_slot = getShadowAtlasSlot(shadow, atlas_size);
+			copyMemory(info.matrices, shadow.matrices, sizeof(info.matrices));
+		}
+		PROFILE_INT("shadow faces rendered", face_updates);
+
+		for (int i = m_local_light_shadows.size() - 1; i >= 0; --i)
+		{
+			if (!m_local_light_shadows[i].is_used) m_local_light_shadows.eraseFast(i);
 		}
 	}
 
@@ -1640,6 +2602,116 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	}
 
 
+	struct ShadowCascadeCache
+	{
+		Vec3 position;
+		Vec3 light_dir;
+		Vec3 light_up;
+		float radius;
+		u64 layer_mask;
+		u64 static_casters_hash;
+		int static_casters_count;
+		bool is_valid;
+	};
+
+
+	void onGameObjectMoved(GameObject gameobject)
+	{
+		auto iter = m_moved_gameobjects.find(gameobject);
+		if (iter.isValid())
+		{
+			iter.value() = m_frame_index;
+		}
+		else
+		{
+			m_moved_gameobjects.insert(gameobject, m_frame_index);
+		}
+	}
+
+
+	void forgetStaticGameObjects()
+	{
+		m_static_again_gameobjects.clear();
+		for (auto iter = m_moved_gameobjects.begin(), end = m_moved_gameobjects.end(); iter != end; ++iter)
+		{
+			if (m_frame_index - iter.value() > SHADOW_CACHE_STATIC_FRAMES) m_static_again_gameobjects.push(iter.key());
+		}
+		for (GameObject e : m_static_again_gameobjects)
+		{
+			m_moved_gameobjects.erase(e);
+		}
+	}
+
+
+	bool isStaticShadowCaster(const MeshInstance& mesh) const
+	{
+		if (mesh.mesh->type == Mesh::SKINNED || mesh.mesh->type == Mesh::MULTILAYER_SKINNED) return false;
+		if (m_moved_gameobjects.empty()) return true;
+
+		auto iter = m_moved_gameobjects.find(mesh.owner);
+		return !iter.isValid() || m_frame_index - iter.value() > SHADOW_CACHE_STATIC_FRAMES;
+	}
+
+
+	static u64 getShadowCasterHash(const MeshInstance& mesh)
+	{
+		// material and buffers are included so edits and reloads invalidate cached shadows
+		const Material* material = mesh.mesh->material;
+		u64 h = (u64)(uintptr)mesh.mesh ^ ((u64)mesh.owner.index * 0x9E3779B97F4A7C15ULL);
+		h ^= (u64)(uintptr)material * 0xC2B2AE3D27D4EB4FULL;
+		h ^= ((u64)material->getVersion() << 32) ^ material->getRenderStates();
+		h ^= ((u64)mesh.mesh->vertex_buffer_handle.idx << 48) ^ ((u64)mesh.mesh->index_buffer_handle.idx << 32)
+			^ (u64)mesh.mesh->indices_count;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+
+	bool prepareShadowCache(FrameBuffer& shadowmap)
+	{
+		if (!(bgfx::getCaps()->supported & BGFX_CAPS_TEXTURE_BLIT)) return false;
+		if (shadowmap.getRenderbuffersCounts() < 2) return false;
+		// cached static casters are blitted into the first renderbuffer
+		const FrameBuffer::RenderBuffer& rb = shadowmap.getRenderbuffer(0);
+		if (!((rb.m_shared ? rb.m_shared->m_flags : rb.m_flags) & BGFX_TEXTURE_BLIT_DST)) return false;
+
+		if (bgfx::isValid(m_shadow_cache_framebuffer)
+			&& m_shadow_cache_width == shadowmap.getWidth()
+			&& m_shadow_cache_height == shadowmap.getHeight())
+		{
+			return true;
+		}
+
+		if (bgfx::isValid(m_shadow_cache_framebuffer)) bgfx::destroy(m_shadow_cache_framebuffer);
+		m_shadow_cache_width = shadowmap.getWidth();
+		m_shadow_cache_height = shadowmap.getHeight();
+		bgfx::TextureHandle textures[2];
+		for (int i = 0; i < 2; ++i)
+		{
+			textures[i] = bgfx::createTexture2D((u16)m_shadow_cache_width,
+				(u16)m_shadow_cache_height,
+				false,
+				1,
+				shadowmap.getRenderbuffer(i).m_format,
+				FrameBuffer::RenderBuffer::DEFAULT_FLAGS);
+		}
+		m_shadow_cache_framebuffer = bgfx::createFrameBuffer(2, textures, true);
+		bgfx::setName(textures[0], "shadowmap_static_cache");
+		for (ShadowCascadeCache& cache : m_shadow_cascade_caches) cache.is_valid = false;
+		return bgfx::isValid(m_shadow_cache_framebuffer);
+	}
+
+
+	void invalidateShadowCaches()
+	{
+		for (ShadowCascadeCache& cache : m_shadow_cascade_caches) cache.is_valid = false;
+		m_local_light_shadows.clear();
+		m_moved_gameobjects.clear();
+	}
+
+
 	void renderShadowmap(int split_index)
 	{
 		if (!m_current_view) return;
@@ -1681,15 +2753,40 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 
 		Sphere frustum_bounding_sphere = camera_frustum.computeBoundingSphere();
 		Vec3 shadow_cam_pos = frustum_bounding_sphere.position;
+		float viewport_size = 0.5f * shadowmap_width - 2;
+		bool use_cache = prepareShadowCache(*m_current_framebuffer);
 		float bb_size = frustum_bounding_sphere.radius;
-		shadow_cam_pos = shadowmapTexelAlign(shadow_cam_pos, 0.5f * shadowmap_width - 2, bb_size, light_mtx);
+		// cascades are a few texels bigger with cache, so the cached content covers the camera's frustum after small moves
+		if (use_cache) bb_size *= viewport_size / (viewport_size - 2 * SHADOW_CACHE_TEXEL_THRESHOLD);
+		shadow_cam_pos = shadowmapTexelAlign(shadow_cam_pos, viewport_size, bb_size, light_mtx);
+
+		Vec3 light_forward = light_mtx.getZVector();
+		Vec3 light_up = light_mtx.getYVector();
+		ShadowCascadeCache& cache = m_shadow_cascade_caches[split_index];
+		bool is_cache_hit = false;
+		if (use_cache && cache.is_valid)
+		{
+			Vec3 offset = shadow_cam_pos - cache.position;
+			offset -= light_forward * dotProduct(offset, light_forward);
+			float max_offset = SHADOW_CACHE_TEXEL_THRESHOLD * 2 * bb_size / viewport_size;
+			is_cache_hit = cache.radius == bb_size
+				&& cache.layer_mask == m_current_view->layer_mask
+				&& dotProduct(cache.light_dir, light_forward) > 0.99999f
+				&& dotProduct(cache.light_up, light_up) > 0.99999f
+				&& offset.squaredLength() < max_offset * max_offset;
+		}
+		if (is_cache_hit)
+		{
+			shadow_cam_pos = cache.position;
+			light_forward = cache.light_dir;
+			light_up = cache.light_up;
+		}
 
 		Matrix projection_matrix;
 		projection_matrix.setOrtho(-bb_size, bb_size, -bb_size, bb_size, SHADOW_CAM_NEAR, SHADOW_CAM_FAR, bgfx::getCaps()->homogeneousDepth, true);
-		Vec3 light_forward = light_mtx.getZVector();
-		shadow_cam_pos -= light_forward * SHADOW_CAM_FAR * 0.5f;
+		Vec3 cam_pos = shadow_cam_pos - light_forward * SHADOW_CAM_FAR * 0.5f;
 		Matrix view_matrix;
-		view_matrix.lookAt(shadow_cam_pos, shadow_cam_pos + light_forward, light_mtx.getYVector());
+		view_matrix.lookAt(cam_pos, cam_pos + light_forward, light_up);
 		bgfx::setViewTransform(m_current_view->bgfx_id, &view_matrix.m11, &projection_matrix.m11);
 		float ymul = bgfx::getCaps()->originBottomLeft ? 0.5f : -0.5f;
 		static const Matrix biasMatrix(
@@ -1701,18 +2798,118 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 
 		Frustum shadow_camera_frustum;
 		shadow_camera_frustum.computeOrtho(
-			shadow_cam_pos, -light_forward, light_mtx.getYVector(), bb_size, bb_size, SHADOW_CAM_NEAR, SHADOW_CAM_FAR);
+			cam_pos, -light_forward, light_up, bb_size, bb_size, SHADOW_CAM_NEAR, SHADOW_CAM_FAR);
 
-		findExtraShadowcasterPlanes(light_forward, camera_frustum, camera_matrix.getTranslation(), &shadow_camera_frustum);
+		if (!use_cache)
+		{
+			findExtraShadowcasterPlanes(light_forward, camera_frustum, camera_matrix.getTranslation(), &shadow_camera_frustum);
+			renderAll(shadow_camera_frustum, false, m_applied_camera, m_current_view->layer_mask, false);
+			m_is_rendering_in_shadowmap = false;
+			return;
+		}
+
+		// static casters are culled without the camera dependent planes, so the cached content does not depend on camera rotation
+		u64 layer_mask = m_current_view->layer_mask;
+		Vec3 lod_ref_point = camera_matrix.getTranslation();
+		const Array<Array<MeshInstance>>& casters = m_scene->getModelInstanceInfos(shadow_camera_frustum, lod_ref_point, m_applied_camera, layer_mask);
+		m_static_casters.clear();
+		m_dynamic_casters.clear();
+		u64 static_hash = 0;
+		for (const Array<MeshInstance>& subcasters : casters)
+		{
+			for (const MeshInstance& mesh : subcasters)
+			{
+				if (isStaticShadowCaster(mesh))
+				{
+					m_static_casters.push(mesh);
+					static_hash += getShadowCasterHash(mesh);
+				}
+				else
+				{
+					m_dynamic_casters.push(mesh);
+				}
+			}
+		}
+		is_cache_hit = is_cache_hit && cache.static_casters_hash == static_hash && cache.static_casters_count == m_static_casters.size();
+		m_stats.shadow_cascade_cache_hit[split_index] = is_cache_hit;
+		PROFILE_INT("static casters", is_cache_hit ? 0 : m_static_casters.size());
+		PROFILE_INT("dynamic casters", m_dynamic_casters.size());
+
+		u16 view_x = (u16)(1 + shadowmap_width * viewport[0]);
+		u16 view_y = (u16)(1 + shadowmap_height * viewport[1]);
+		u16 view_w = (u16)viewport_size;
+		u16 view_h = (u16)(0.5f * shadowmap_height - 2);
+		if (!is_cache_hit)
+		{
+			// the view created by the script renders static casters to the cache,
+			// dynamic ones are rendered over a copy of it in a new view
+			bgfx::setViewFrameBuffer(m_current_view->bgfx_id, m_shadow_cache_framebuffer);
+			recordDraws(*m_current_view, m_current_view->render_state, m_static_casters, nullptr);
+
+			cache.position = shadow_cam_pos;
+			cache.light_dir = light_forward;
+			cache.light_up = light_up;
+			cache.radius = bb_size;
+			cache.layer_mask = layer_mask;
+			cache.static_casters_hash = static_hash;
+			cache.static_casters_count = m_static_casters.size();
+			cache.is_valid = true;
+
+			View& static_view = *m_current_view;
+			newView("shadow_dynamic", layer_mask);
+			m_current_view->pass_idx = static_view.pass_idx;
+			m_current_view->render_state = static_view.render_state;
+			m_current_view->define_mask = static_view.define_mask;
+			m_current_view->defines = static_view.defines;
+			bgfx::setViewTransform(m_current_view->bgfx_id, &view_matrix.m11, &projection_matrix.m11);
+			bgfx::setViewRect(m_current_view->bgfx_id, view_x, view_y, view_w, view_h);
+		}
 
-		renderAll(shadow_camera_frustum, false, m_applied_camera, m_current_view->layer_mask, false);
+		// depth of dynamic casters is tested only against each other, depth is reversed so the nearest one is picked
+		// by max blending
+		bgfx::setViewClear(m_current_view->bgfx_id, BGFX_CLEAR_DEPTH, 0, 0.0f, 0);
+		bgfx::touch(m_current_view->bgfx_id);
+		bgfx::blit(m_current_view->bgfx_id,
+			m_current_framebuffer->getRenderbufferHandle(0),
+			view_x,
+			view_y,
+			bgfx::getTexture(m_shadow_cache_framebuffer, 0),
+			view_x,
+			view_y,
+			view_w,
+			view_h);
 
+		findExtraShadowcasterPlanes(light_forward, camera_frustum, camera_matrix.getTranslation(), &shadow_camera_frustum);
+		m_terrains_buffer.clear();
+		m_scene->getTerrainInfos(shadow_camera_frustum, lod_ref_point, m_terrains_buffer);
+		recordDraws(*m_current_view, m_current_view->render_state | BGFX_STATE_BLEND_LIGHTEN, m_dynamic_casters, &m_terrains_buffer);
 		m_is_rendering_in_shadowmap = false;
 	}
 
 
+	struct DebugBatch
+	{
+		enum Type : u8
+		{
+			TRIANGLES,
+			LINES,
+			POINTS
+		};
+
+		Type type;
+		int first;
+		int count;
+		int buffer_idx;
+		const bgfx::Memory* mem;
+	};
+
+
 	void renderDebugShapes()
 	{
+		PROFILE_FUNCTION();
+		if (!m_current_view) return;
+		if (!m_debug_line_shader->isReady()) return;
+
 		if (!bgfx::isValid(m_debug_index_buffer))
 		{
 			auto* mem = bgfx::alloc(0xffFF * 2);
@@ -1721,168 +2918,142 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 			m_debug_index_buffer = bgfx::createDynamicIndexBuffer(mem);
 		}
 
-		m_debug_buffer_idx = 0;
-		renderDebugTriangles();
-		renderDebugLines();
-		renderDebugPoints();
-	}
-
-
-	void renderDebugPoints()
-	{
-		if (!m_current_view) return;
-
-		const Array<DebugPoint>& points = m_scene->getDebugPoints();
-		if (points.empty() || !m_debug_line_shader->isReady()) return;
-
-		static const int BATCH_SIZE = 0xffff;
-		View& view = *m_current_view;
-
-		ShaderInstance& shader_instance = m_debug_line_shader->getInstance(0);
-		for (int j = 0; j < points.size() && m_debug_buffer_idx < lengthOf(m_debug_vertex_buffers);
-			j += BATCH_SIZE, ++m_debug_buffer_idx)
-		{
-			if (!bgfx::isValid(m_debug_vertex_buffers[m_debug_buffer_idx]))
+		// buffers are created and updated on this thread, jobs only fill the vertices and submit
+		DebugBatch batches[lengthOf(m_debug_vertex_buffers)];
+		int batches_count = 0;
+		auto addBatches = [&](DebugBatch::Type type, int count, int batch_size, int vertices_per_shape) {
+			for (int j = 0; j < count && batches_count < lengthOf(m_debug_vertex_buffers); j += batch_size)
 			{
-				m_debug_vertex_buffers[m_debug_buffer_idx] = bgfx::createDynamicVertexBuffer(0xffFF, m_base_vertex_decl);
+				if (!bgfx::isValid(m_debug_vertex_buffers[batches_count]))
+				{
+					m_debug_vertex_buffers[batches_count] = bgfx::createDynamicVertexBuffer(0xffFF, m_base_vertex_decl);
+				}
+				DebugBatch& batch = batches[batches_count];
+				batch.type = type;
+				batch.first = j;
+				batch.count = Math::minimum(batch_size, count - j);
+				batch.buffer_idx = batches_count;
+				batch.mem = bgfx::alloc(sizeof(BaseVertex) * vertices_per_shape * batch.count);
+				++batches_count;
 			}
+		};
+		addBatches(DebugBatch::TRIANGLES, m_scene->getDebugTriangles().size(), 0xffFF / 3, 3);
+		addBatches(DebugBatch::LINES, m_scene->getDebugLines().size(), 0xffFF / 2, 2);
+		addBatches(DebugBatch::POINTS, m_scene->getDebugPoints().size(), 0xffFF, 1);
 
-			int point_count = Math::minimum(BATCH_SIZE, points.size() - j);
-			auto* mem = bgfx::alloc(sizeof(BaseVertex) * point_count);
-
-			BaseVertex* vertex = (BaseVertex*)mem->data;
-			for (int i = 0; i < points.size(); ++i)
+		auto record = [this, &batches](bgfx::Encoder* encoder, InstanceData&, int from, int to) {
+			for (int i = from; i < to; ++i)
 			{
-				const DebugPoint& point = points[i];
-				vertex[0].rgba = point.color;
-				vertex[0].x = point.pos.x;
-				vertex[0].y = point.pos.y;
-				vertex[0].z = point.pos.z;
-				vertex[0].u = vertex[0].v = 0;
-
-				++vertex;
+				renderDebugBatch(encoder, batches[i]);
 			}
+		};
+		recordInJobs("debug shapes", batches_count, 1, record);
 
-			bgfx::updateDynamicVertexBuffer(m_debug_vertex_buffers[m_debug_buffer_idx], 0, mem);
-
-			bgfx::setVertexBuffer(0, m_debug_vertex_buffers[m_debug_buffer_idx]);
-			bgfx::setIndexBuffer(m_debug_index_buffer, 0, point_count);
-			bgfx::setStencil(view.stencil, BGFX_STENCIL_NONE);
-			bgfx::setState(view.render_state | m_debug_line_shader->m_render_states | BGFX_STATE_PT_POINTS);
-			bgfx::submit(
-				m_current_view->bgfx_id, shader_instance.getProgramHandle(m_pass_idx));
+		for (int i = 0; i < batches_count; ++i)
+		{
+			bgfx::updateDynamicVertexBuffer(m_debug_vertex_buffers[batches[i].buffer_idx], 0, batches[i].mem);
 		}
 	}
 
 
-	void renderDebugLines()
+	void renderDebugBatch(bgfx::Encoder* encoder, const DebugBatch& batch)
 	{
-		if (!m_current_view) return;
+		BaseVertex* vertex = (BaseVertex*)batch.mem->data;
+		u64 primitive = 0;
+		int indices_count = 0;
+		switch (batch.type)
+		{
+			case DebugBatch::TRIANGLES:
+				fillDebugTriangles(vertex, batch.first, batch.count);
+				indices_count = batch.count * 3;
+				break;
+			case DebugBatch::LINES:
+				fillDebugLines(vertex, batch.first, batch.count);
+				primitive = BGFX_STATE_PT_LINES;
+				indices_count = batch.count * 2;
+				break;
+			case DebugBatch::POINTS:
+				fillDebugPoints(vertex, batch.first, batch.count);
+				primitive = BGFX_STATE_PT_POINTS;
+				indices_count = batch.count;
+				break;
+		}
 
-		const Array<DebugLine>& lines = m_scene->getDebugLines();
-		if (lines.empty() || !m_debug_line_shader->isReady()) return;
+		const View& view = *m_current_view;
+		ShaderInstance& shader_instance = m_debug_line_shader->getInstance(0);
+		encoder->setVertexBuffer(0, m_debug_vertex_buffers[batch.buffer_idx]);
+		encoder->setIndexBuffer(m_debug_index_buffer, 0, indices_count);
+		encoder->setStencil(view.stencil, BGFX_STENCIL_NONE);
+		encoder->setState(view.render_state | m_debug_line_shader->m_render_states | primitive);
+		encoder->submit(view.bgfx_id, shader_instance.getProgramHandle(m_pass_idx));
+	}
 
-		static const int BATCH_SIZE = 0xffff / 2;
-		View& view = *m_current_view;
 
-		ShaderInstance& shader_instance = m_debug_line_shader->getInstance(0);
-		for (int j = 0; j < lines.size() && m_debug_buffer_idx < lengthOf(m_debug_vertex_buffers);
-			 j += BATCH_SIZE, ++m_debug_buffer_idx)
-		{
-			if (!bgfx::isValid(m_debug_vertex_buffers[m_debug_buffer_idx]))
-			{
-				m_debug_vertex_buffers[m_debug_buffer_idx] = bgfx::createDynamicVertexBuffer(0xffFF, m_base_vertex_decl);
-			}
-
-			int line_count = Math::minimum(BATCH_SIZE, lines.size() - j);
-			auto* mem = bgfx::alloc(sizeof(BaseVertex) * 2 * line_count);
-			
-			BaseVertex* vertex = (BaseVertex*)mem->data;
-			for (int i = 0; i < line_count; ++i)
-			{
-				const DebugLine& line = lines[j + i];
-				vertex[0].rgba = line.color;
-				vertex[0].x = line.from.x;
-				vertex[0].y = line.from.y;
-				vertex[0].z = line.from.z;
-				vertex[0].u = vertex[0].v = 0;
-
-				vertex[1].rgba = line.color;
-				vertex[1].x = line.to.x;
-				vertex[1].y = line.to.y;
-				vertex[1].z = line.to.z;
-				vertex[1].u = vertex[0].v = 0;
-
-				vertex += 2;
-			}
+	void fillDebugPoints(BaseVertex* vertex, int first, int count)
+	{
+		const Array<DebugPoint>& points = m_scene->getDebugPoints();
+		for (int i = 0; i < count; ++i)
+		{
+			const DebugPoint& point = points[first + i];
+			vertex[0].rgba = point.color;
+			vertex[0].x = point.pos.x;
+			vertex[0].y = point.pos.y;
+			vertex[0].z = point.pos.z;
+			vertex[0].u = vertex[0].v = 0;
+
+			++vertex;
+		}
+	}
 
-			bgfx::updateDynamicVertexBuffer(m_debug_vertex_buffers[m_debug_buffer_idx], 0, mem);
 
-			bgfx::setVertexBuffer(0, m_debug_vertex_buffers[m_debug_buffer_idx]);
-			bgfx::setIndexBuffer(m_debug_index_buffer, 0, line_count * 2);
-			bgfx::setStencil(view.stencil, BGFX_STENCIL_NONE);
-			bgfx::setState(view.render_state | m_debug_line_shader->m_render_states | BGFX_STATE_PT_LINES);
-			bgfx::submit(
-				m_current_view->bgfx_id, shader_instance.getProgramHandle(m_pass_idx));
+	void fillDebugLines(BaseVertex* vertex, int first, int count)
+	{
+		const Array<DebugLine>& lines = m_scene->getDebugLines();
+		for (int i = 0; i < count; ++i)
+		{
+			const DebugLine& line = lines[first + i];
+			vertex[0].rgba = line.color;
+			vertex[0].x = line.from.x;
+			vertex[0].y = line.from.y;
+			vertex[0].z = line.from.z;
+			vertex[0].u = vertex[0].v = 0;
+
+			vertex[1].rgba = line.color;
+			vertex[1].x = line.to.x;
+			vertex[1].y = line.to.y;
+			vertex[1].z = line.to.z;
+			vertex[1].u = vertex[1].v = 0;
+
+			vertex += 2;
 		}
 	}
 
 
-	void renderDebugTriangles()
+	void fillDebugTriangles(BaseVertex* vertex, int first, int count)
 	{
-		if (!m_current_view) return;
-
 		const auto& tris = m_scene->getDebugTriangles();
-		if(tris.empty() || !m_debug_line_shader->isReady()) return;
-
-		static const int BATCH_SIZE = 0xffFF / 3;
-		View& view = *m_current_view;
-
-		ShaderInstance& shader_instance = m_debug_line_shader->getInstance(0);
-		for (int j = 0; j < tris.size() && m_debug_buffer_idx < lengthOf(m_debug_vertex_buffers);
-			 j += BATCH_SIZE, ++m_debug_buffer_idx)
+		for (int i = 0; i < count; ++i)
 		{
-			if (!bgfx::isValid(m_debug_vertex_buffers[m_debug_buffer_idx]))
-			{
-				m_debug_vertex_buffers[m_debug_buffer_idx] = bgfx::createDynamicVertexBuffer(0xffFF, m_base_vertex_decl);
-			}
-
-			int tri_count = Math::minimum(BATCH_SIZE, tris.size() - j);
-			auto* mem = bgfx::alloc(sizeof(BaseVertex) * 3 * tri_count);
-
-			BaseVertex* vertex = (BaseVertex*)mem->data;
-			for (int i = 0; i < tri_count; ++i)
-			{
-				const DebugTriangle& tri = tris[j + i];
-				vertex[0].rgba = tri.color;
-				vertex[0].x = tri.p0.x;
-				vertex[0].y = tri.p0.y;
-				vertex[0].z = tri.p0.z;
-				vertex[0].u = vertex[0].v = 0;
-
-				vertex[1].rgba = tri.color;
-				vertex[1].x = tri.p1.x;
-				vertex[1].y = tri.p1.y;
-				vertex[1].z = tri.p1.z;
-				vertex[1].u = vertex[0].v = 0;
-
-				vertex[2].rgba = tri.color;
-				vertex[2].x = tri.p2.x;
-				vertex[2].y = tri.p2.y;
-				vertex[2].z = tri.p2.z;
-				vertex[2].u = vertex[0].v = 0;
-
-				vertex += 3;
-			}
-
-			bgfx::updateDynamicVertexBuffer(m_debug_vertex_buffers[m_debug_buffer_idx], 0, mem);
-
-			bgfx::setVertexBuffer(0, m_debug_vertex_buffers[m_debug_buffer_idx]);
-			bgfx::setIndexBuffer(m_debug_index_buffer, 0, tri_count * 3);
-			bgfx::setStencil(view.stencil, BGFX_STENCIL_NONE);
-			bgfx::setState(view.render_state | m_debug_line_shader->m_render_states);
-			bgfx::submit(
-				m_current_view->bgfx_id, shader_instance.getProgramHandle(m_pass_idx));
+			const DebugTriangle& tri = tris[first + i];
+			vertex[0].rgba = tri.color;
+			vertex[0].x = tri.p0.x;
+			vertex[0].y = tri.p0.y;
+			vertex[0].z = tri.p0.z;
+			vertex[0].u = vertex[0].v = 0;
+
+			vertex[1].rgba = tri.color;
+			vertex[1].x = tri.p1.x;
+			vertex[1].y = tri.p1.y;
+			vertex[1].z = tri.p1.z;
+			vertex[1].u = vertex[1].v = 0;
+
+			vertex[2].rgba = tri.color;
+			vertex[2].x = tri.p2.x;
+			vertex[2].y = tri.p2.y;
+			vertex[2].z = tri.p2.z;
+			vertex[2].u = vertex[2].v = 0;
+
+			vertex += 3;
 		}
 	}
 
@@ -1941,17 +3112,22 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 					m_current_view->command_buffer.setUniform(m_shadowmap_matrices_uniform,
 						&info.matrices[0],
 						m_scene->getLightFOV(light) > Math::PI ? 4 : 1);
+					m_current_view->command_buffer.setUniform(m_shadow_atlas_slot_uniform, info.atlas_slot);
 					break;
 				}
 			}
 		}
+		u32 has_shadowmap_mask = 1 << m_has_shadowmap_define_idx;
+		m_current_view->define_mask |= has_shadowmap_mask;
 		if (shadowmap)
 		{
 			m_current_view->command_buffer.setLocalShadowmap(shadowmap->getRenderbufferHandle(0));
+			m_current_view->defines |= has_shadowmap_mask;
 		}
 		else
 		{
 			m_current_view->command_buffer.setLocalShadowmap(BGFX_INVALID_HANDLE);
+			m_current_view->defines &= ~has_shadowmap_mask;
 		}
 		m_current_view->command_buffer.end();
 	}
@@ -2058,7 +3234,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	{
 		PROFILE_FUNCTION();
 
-		Array<MeshInstance> tmp_meshes(m_renderer.getEngine().getLIFOAllocator());
+		Array<MeshInstance> tmp_meshes(m_renderer.getEngine().getFrameAllocator());
 		Vec3 lod_ref_point = m_scene->getProject().getPosition(m_applied_camera);
 		m_scene->getPointLightInfluencedGeometry(light, m_applied_camera, lod_ref_point, tmp_meshes);
 		renderMeshes(tmp_meshes, false);
@@ -2069,9 +3245,9 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	{
 		PROFILE_FUNCTION();
 
-		Array<GameObject> lights(m_allocator);
+		IAllocator& frame_allocator = m_renderer.getEngine().getFrameAllocator();
+		Array<GameObject> lights(frame_allocator);
 		m_scene->getPointLights(frustum, lights);
-		IAllocator& frame_allocator = m_renderer.getEngine().getLIFOAllocator();
 		m_is_current_light_global = false;
 		for (int i = 0; i < lights.size(); ++i)
 		{
@@ -2205,8 +3381,8 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 
 		View& view = *m_current_view;
 
-		executeCommandBuffer(material->getCommandBuffer(), material);
-		executeCommandBuffer(view.command_buffer.buffer, material);
+		executeCommandBuffer(material->getCommandBuffer());
+		executeCommandBuffer(view.command_buffer.buffer);
 
 		if (m_applied_camera.isValid())
 		{
@@ -2241,7 +3417,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		++m_stats.draw_call_count;
 		++m_stats.instance_count;
 		m_stats.triangle_count += 2;
-		bgfx::submit(m_current_view->bgfx_id, material->getShaderInstance().getProgramHandle(m_pass_idx));
+		bgfx::submit(m_current_view->bgfx_id, getProgram(*material, view, 0, 0));
 	}
 
 
@@ -2263,7 +3439,9 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		m_grasses_buffer.clear();
 		m_terrains_buffer.clear();
 
-		
+		// tile caches load and evict pages, the jobs below only read them
+		m_scene->updateTerrainTileCaches(lod_ref_point);
+
 		auto get_mesh_infos = [this, &frustum, &lod_ref_point, layer_mask, camera]() {
 			m_mesh_buffer = &m_scene->getModelInstanceInfos(frustum, lod_ref_point, camera, layer_mask);
 		};
@@ -2277,11 +3455,11 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		};
 
 		JobSystem::SignalHandle counter = JobSystem::INVALID_HANDLE;
-		JobSystem::run(&get_mesh_infos, [](void* user_ptr) { (*(decltype(get_mesh_infos)*)user_ptr)(); }, &counter, JobSystem::INVALID_HANDLE);
-		JobSystem::run(&get_terrain_infos, [](void* user_ptr) { (*(decltype(get_terrain_infos)*)user_ptr)(); }, &counter, JobSystem::INVALID_HANDLE);
+		JobSystem::run(&get_mesh_infos, [](void* user_ptr) { (*(decltype(get_mesh_infos)*)user_ptr)(); }, &counter, JobSystem::INVALID_HANDLE, "mesh infos");
+		JobSystem::run(&get_terrain_infos, [](void* user_ptr) { (*(decltype(get_terrain_infos)*)user_ptr)(); }, &counter, JobSystem::INVALID_HANDLE, "terrain infos");
 
 		if (render_grass) {
-			JobSystem::run(&get_grass_infos, [](void* user_ptr) { (*(decltype(get_grass_infos)*)user_ptr)(); }, &counter, JobSystem::INVALID_HANDLE);
+			JobSystem::run(&get_grass_infos, [](void* user_ptr) { (*(decltype(get_grass_infos)*)user_ptr)(); }, &counter, JobSystem::INVALID_HANDLE, "grass infos");
 		}
 
 		JobSystem::wait(counter);
@@ -2356,99 +3534,134 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 			switch (mesh.type)
 			{
 				case Mesh::RIGID_INSTANCED:
-					renderRigidMeshInstanced(encoder, s_instance_data, mtx, mesh);
+					renderRigidMeshInstanced(encoder, m_instance_data, mtx, mesh);
 					break;
 				case Mesh::RIGID:
 				{
 					float depth = (camera_pos - mtx.getTranslation()).squaredLength();
-					renderRigidMesh(encoder, mtx, mesh, depth);
+					discardCachedState(encoder, m_instance_data);
+					renderRigidMesh(encoder, m_instance_data, mtx, mesh, depth);
 					break;
 				}
 				case Mesh::MULTILAYER_RIGID:
-					renderMultilayerRigidMesh(encoder, model, mtx, mesh);
-					break;
 				case Mesh::MULTILAYER_SKINNED:
-					renderMultilayerSkinnedMesh(encoder, *pose, model, mtx, mesh);
+					renderMultilayerMesh(encoder, m_instance_data, pose, model, mtx, mesh);
 					break;
 				case Mesh::SKINNED:
-					if(pose) renderSkinnedMesh(encoder, *pose, model, mtx, mesh);
+					if (canInstanceSkinnedMesh(pose, mesh))
+					{
+						renderSkinnedMeshInstanced(encoder, m_instance_data, *pose, model, mtx, mesh);
+					}
+					else if (pose)
+					{
+						discardCachedState(encoder, m_instance_data);
+						renderSkinnedMesh(encoder, m_instance_data, *pose, model, mtx, mesh);
+					}
 					break;
 			}
 		}
+		// the caller can submit anything after this
+		discardCachedState(encoder, m_instance_data);
 	}
 
 
-	void renderSkinnedMesh(bgfx::Encoder* encoder, const Pose& pose, const Model& model, const Matrix& matrix, const Mesh& mesh)
+	static void computeBoneMatrices(const Pose& pose, const Model& model, Matrix* out)
 	{
-		Material* material = mesh.material;
-		auto& shader_instance = mesh.material->getShaderInstance();
-
-		material->setDefine(m_instanced_define_idx, false);
-
-		Matrix bone_mtx[196];
-
 		Vec3* poss = pose.positions;
 		Quat* rots = pose.rotations;
 
-		ASSERT(pose.count <= lengthOf(bone_mtx));
 		for (int bone_index = 0, bone_count = pose.count; bone_index < bone_count; ++bone_index)
 		{
 			auto& bone = model.getBone(bone_index);
 			RigidTransform tmp = {poss[bone_index], rots[bone_index]};
-			bone_mtx[bone_index] = (tmp * bone.inv_bind_transform).toMatrix();
+			out[bone_index] = (tmp * bone.inv_bind_transform).toMatrix();
 		}
+	}
 
-		int view_idx = m_layer_to_view_map[material->getRenderLayer()];
-		ASSERT(view_idx >= 0);
-		auto& view = m_views[view_idx >= 0 ? view_idx : 0];
 
-		if (!bgfx::isValid(shader_instance.getProgramHandle(view.pass_idx))) return;
+	void renderSkinnedMesh(bgfx::Encoder* encoder, const InstanceData& data, const Pose& pose, const Model& model, const Matrix& matrix, const Mesh& mesh)
+	{
+		Material* material = mesh.material;
+
+		Matrix bone_mtx[196];
+		ASSERT(pose.count <= lengthOf(bone_mtx));
+		computeBoneMatrices(pose, model, bone_mtx);
+
+		View& view = getDrawView(data, *material);
+
+		bgfx::ProgramHandle program = getProgram(*material, view, 1 << m_instanced_define_idx, 0);
+		if (!bgfx::isValid(program)) return;
 
 		encoder->setUniform(m_bone_matrices_uniform, bone_mtx, pose.count);
-		executeCommandBuffer(encoder, material->getCommandBuffer(), material);
-		executeCommandBuffer(encoder, view.command_buffer.buffer, material);
+		executeCommandBuffer(encoder, material->getCommandBuffer());
+		executeCommandBuffer(encoder, view.command_buffer.buffer);
 
 		encoder->setTransform(&matrix);
 		encoder->setVertexBuffer(0, mesh.vertex_buffer_handle);
 		encoder->setIndexBuffer(mesh.index_buffer_handle);
 		encoder->setStencil(view.stencil, BGFX_STENCIL_NONE);
 		encoder->setState(view.render_state | material->getRenderStates());
-		++m_stats.draw_call_count;
-		++m_stats.instance_count;
-		m_stats.triangle_count += mesh.indices_count / 3;
-		encoder->submit(view.bgfx_id, shader_instance.getProgramHandle(view.pass_idx));
+		MT::atomicIncrement(&m_stats.draw_call_count);
+		MT::atomicIncrement(&m_stats.instance_count);
+		MT::atomicAdd(&m_stats.triangle_count, mesh.indices_count / 3);
+		encoder->submit(view.bgfx_id, program);
 	}
 
 
-	void renderMultilayerRigidMesh(bgfx::Encoder* encoder, const Model& model, const Matrix& matrix, const Mesh& mesh)
+	// fur, instances of the same mesh share a draw call per layer, see finishInstances; shaders without
+	// the INSTANCED define and skinned meshes which can not use the bone texture are drawn one by one
+	void renderMultilayerMesh(bgfx::Encoder* encoder, InstanceData& data, const Pose* pose, const Model& model, const Matrix& matrix, const Mesh& mesh)
 	{
-		Material* material = mesh.material;
+		if (mesh.type == Mesh::MULTILAYER_SKINNED)
+		{
+			if (canInstanceSkinnedMesh(pose, mesh))
+			{
+				renderSkinnedMeshInstanced(encoder, data, *pose, model, matrix, mesh);
+				return;
+			}
+			if (!pose) return;
+			discardCachedState(encoder, data);
+			renderMultilayerSkinnedMesh(encoder, data, *pose, model, matrix, mesh);
+			return;
+		}
+
+		if (mesh.material->hasDefine(m_instanced_define_idx))
+		{
+			renderRigidMeshInstanced(encoder, data, matrix, mesh);
+			return;
+		}
+		discardCachedState(encoder, data);
+		renderMultilayerRigidMesh(encoder, data, model, matrix, mesh);
+	}
+
 
-		material->setDefine(m_instanced_define_idx, true);
+	void renderMultilayerRigidMesh(bgfx::Encoder* encoder, const InstanceData& data, const Model& model, const Matrix& matrix, const Mesh& mesh)
+	{
+		Material* material = mesh.material;
+		u32 instanced_mask = 1 << m_instanced_define_idx;
 
 		int layers_count = material->getLayersCount();
-		auto& shader_instance = mesh.material->getShaderInstance();
 
 		auto renderLayer = [&](View& view) {
-			executeCommandBuffer(encoder, material->getCommandBuffer(), material);
-			executeCommandBuffer(encoder, view.command_buffer.buffer, material);
+			executeCommandBuffer(encoder, material->getCommandBuffer());
+			executeCommandBuffer(encoder, view.command_buffer.buffer);
 
 			encoder->setTransform(&matrix);
 			encoder->setVertexBuffer(0, mesh.vertex_buffer_handle);
 			encoder->setIndexBuffer(mesh.index_buffer_handle);
 			encoder->setStencil(view.stencil, BGFX_STENCIL_NONE);
 			encoder->setState(view.render_state | material->getRenderStates());
-			++m_stats.draw_call_count;
-			++m_stats.instance_count;
-			m_stats.triangle_count += mesh.indices_count / 3;
-			encoder->submit(view.bgfx_id, shader_instance.getProgramHandle(view.pass_idx));
+			MT::atomicIncrement(&m_stats.draw_call_count);
+			MT::atomicIncrement(&m_stats.instance_count);
+			MT::atomicAdd(&m_stats.triangle_count, mesh.indices_count / 3);
+			encoder->submit(view.bgfx_id, getProgram(*material, view, instanced_mask, 0));
 		};
 
-		int view_idx = m_layer_to_view_map[material->getRenderLayer()];
-		if (view_idx >= 0 && !m_is_rendering_in_shadowmap)
+		View* layer_view = getLayerView(data, material->getRenderLayer());
+		if (layer_view && !isDrawingShadowmap(data))
 		{
-			auto& view = m_views[view_idx];
-			if (bgfx::isValid(shader_instance.getProgramHandle(view.pass_idx)))
+			View& view = *layer_view;
+			if (bgfx::isValid(getProgram(*material, view, instanced_mask, 0)))
 			{
 				for (int i = 0; i < layers_count; ++i)
 				{
@@ -2460,44 +3673,37 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		}
 
 		static const int default_layer = m_renderer.getLayer("default");
-		int default_view_idx = m_layer_to_view_map[default_layer];
-		if (default_view_idx < 0) return;
-		View& default_view = m_views[default_view_idx];
-		renderLayer(default_view);
+		View* default_view = getLayerView(data, default_layer);
+		if (!default_view) return;
+		renderLayer(*default_view);
 	}
 
 
-	MALMY_FORCE_INLINE void renderRigidMesh(bgfx::Encoder* encoder, const Matrix& matrix, Mesh& mesh, float depth)
+	MALMY_FORCE_INLINE void renderRigidMesh(bgfx::Encoder* encoder, const InstanceData& data, const Matrix& matrix, Mesh& mesh, float depth)
 	{
 		Material* material = mesh.material;
 
-		material->setDefine(m_instanced_define_idx, false);
-
-		int view_idx = m_layer_to_view_map[material->getRenderLayer()];
-		ASSERT(view_idx >= 0);
-		auto& view = m_views[view_idx >= 0 ? view_idx : 0];
+		View& view = getDrawView(data, *material);
 
-		executeCommandBuffer(encoder, material->getCommandBuffer(), material);
-		executeCommandBuffer(encoder, view.command_buffer.buffer, material);
+		executeCommandBuffer(encoder, material->getCommandBuffer());
+		executeCommandBuffer(encoder, view.command_buffer.buffer);
 
 		encoder->setTransform(&matrix);
 		encoder->setVertexBuffer(0, mesh.vertex_buffer_handle);
 		encoder->setIndexBuffer(mesh.index_buffer_handle);
 		encoder->setStencil(view.stencil, BGFX_STENCIL_NONE);
 		encoder->setState(view.render_state | material->getRenderStates());
-		ShaderInstance& shader_instance = material->getShaderInstance();
-		++m_stats.draw_call_count;
-		++m_stats.instance_count;
-		m_stats.triangle_count += mesh.indices_count / 3;
-		encoder->submit(view.bgfx_id, shader_instance.getProgramHandle(view.pass_idx), Math::floatFlip(*(u32*)&depth));
+		MT::atomicIncrement(&m_stats.draw_call_count);
+		MT::atomicIncrement(&m_stats.instance_count);
+		MT::atomicAdd(&m_stats.triangle_count, mesh.indices_count / 3);
+		encoder->submit(view.bgfx_id, getProgram(*material, view, 1 << m_instanced_define_idx, 0), Math::floatFlip(*(u32*)&depth));
 	}
 
 
-	void renderMultilayerSkinnedMesh(bgfx::Encoder* encoder, const Pose& pose, const Model& model, const Matrix& matrix, const Mesh& mesh)
+	void renderMultilayerSkinnedMesh(bgfx::Encoder* encoder, const InstanceData& data, const Pose& pose, const Model& model, const Matrix& matrix, const Mesh& mesh)
 	{
 		Material* material = mesh.material;
-
-		material->setDefine(m_instanced_define_idx, false);
+		u32 instanced_mask = 1 << m_instanced_define_idx;
 
 		Matrix bone_mtx[196];
 		Vec3* poss = pose.positions;
@@ -2512,29 +3718,28 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		}
 
 		int layers_count = material->getLayersCount();
-		auto& shader_instance = mesh.material->getShaderInstance();
 
 		auto renderLayer = [&](View& view) {
 			encoder->setUniform(m_bone_matrices_uniform, bone_mtx, pose.count);
-			executeCommandBuffer(encoder, material->getCommandBuffer(), material);
-			executeCommandBuffer(encoder, view.command_buffer.buffer, material);
+			executeCommandBuffer(encoder, material->getCommandBuffer());
+			executeCommandBuffer(encoder, view.command_buffer.buffer);
 
 			encoder->setTransform(&matrix);
 			encoder->setVertexBuffer(0, mesh.vertex_buffer_handle);
 			encoder->setIndexBuffer(mesh.index_buffer_handle);
 			encoder->setStencil(view.stencil, BGFX_STENCIL_NONE);
 			encoder->setState(view.render_state | material->getRenderStates());
-			++m_stats.draw_call_count;
-			++m_stats.instance_count;
-			m_stats.triangle_count += mesh.indices_count / 3;
-			encoder->submit(view.bgfx_id, shader_instance.getProgramHandle(view.pass_idx));
+			MT::atomicIncrement(&m_stats.draw_call_count);
+			MT::atomicIncrement(&m_stats.instance_count);
+			MT::atomicAdd(&m_stats.triangle_count, mesh.indices_count / 3);
+			encoder->submit(view.bgfx_id, getProgram(*material, view, instanced_mask, 0));
 		};
 
-		int view_idx = m_layer_to_view_map[material->getRenderLayer()];
-		if (view_idx >= 0 && !m_is_rendering_in_shadowmap)
+		View* layer_view = getLayerView(data, material->getRenderLayer());
+		if (layer_view && !isDrawingShadowmap(data))
 		{
-			auto& view = m_views[view_idx];
-			if (bgfx::isValid(shader_instance.getProgramHandle(view.pass_idx)))
+			View& view = *layer_view;
+			if (bgfx::isValid(getProgram(*material, view, instanced_mask, 0)))
 			{
 				for (int i = 0; i < layers_count; ++i)
 				{
@@ -2546,10 +3751,9 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		}
 
 		static const int default_layer = m_renderer.getLayer("default");
-		int default_view_idx = m_layer_to_view_map[default_layer];
-		if (default_view_idx < 0) return;
-		View& default_view = m_views[default_view_idx];
-		renderLayer(default_view);
+		View* default_view = getLayerView(data, default_layer);
+		if (!default_view) return;
+		renderLayer(*default_view);
 	}
 
 
@@ -2667,36 +3871,91 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 
 
 	
-	MALMY_FORCE_INLINE void renderRigidMeshInstanced(bgfx::Encoder* encoder, InstanceData& data, const Matrix& matrix, const Mesh& mesh)
+	// consecutive instances of the same mesh are batched to a single draw call,
+	// returns memory for the instance data or nullptr
+	MALMY_FORCE_INLINE u8* beginInstance(bgfx::Encoder* encoder, InstanceData& data, InstanceBatch& batch, const Mesh& mesh)
 	{
-		if (data.mesh != &mesh)
+		if (batch.mesh != &mesh)
 		{
-			if (data.mesh)
+			if (batch.mesh)
 			{
-				finishInstances(encoder);
+				finishInstances(encoder, data, batch);
 			}
-			if (!data.buffer.data)
+			if (!batch.buffer.data)
 			{
-				if (bgfx::getAvailInstanceDataBuffer(InstanceData::MAX_INSTANCE_COUNT, sizeof(Matrix)) < InstanceData::MAX_INSTANCE_COUNT)
+				if (bgfx::getAvailInstanceDataBuffer(InstanceData::MAX_INSTANCE_COUNT, batch.stride) < InstanceData::MAX_INSTANCE_COUNT)
 				{
 					g_log_warning.log("Renderer") << "Could not allocate instance data buffer";
-					return;
+					return nullptr;
 				}
-				bgfx::allocInstanceDataBuffer(&data.buffer, InstanceData::MAX_INSTANCE_COUNT, sizeof(Matrix));
-				ASSERT(data.buffer.data);
-				data.instances_count = 0;
-				data.offset = 0;
+				bgfx::allocInstanceDataBuffer(&batch.buffer, InstanceData::MAX_INSTANCE_COUNT, batch.stride);
+				ASSERT(batch.buffer.data);
+				batch.instances_count = 0;
+				batch.offset = 0;
 			}
-			data.mesh = &mesh;
+			batch.mesh = &mesh;
+		}
+		return batch.buffer.data + (batch.offset + batch.instances_count) * batch.stride;
+	}
+
+
+	MALMY_FORCE_INLINE void endInstance(bgfx::Encoder* encoder, InstanceData& data, InstanceBatch& batch)
+	{
+		++batch.instances_count;
+		if (batch.instances_count + batch.offset == InstanceData::MAX_INSTANCE_COUNT)
+		{
+			finishInstances(encoder, data, batch);
 		}
-		Matrix* mtcs = (Matrix*)data.buffer.data;
-		copyMemory(&mtcs[data.offset + data.instances_count], &matrix, sizeof(matrix));
-		++data.instances_count;
+	}
+
+
+	MALMY_FORCE_INLINE void renderRigidMeshInstanced(bgfx::Encoder* encoder, InstanceData& data, const Matrix& matrix, const Mesh& mesh)
+	{
+		u8* instance = beginInstance(encoder, data, data.rigid, mesh);
+		if (!instance) return;
+		copyMemory(instance, &matrix, sizeof(matrix));
+		endInstance(encoder, data, data.rigid);
+	}
+
+
+	bool canInstanceSkinnedMesh(const Pose* pose, const Mesh& mesh) const
+	{
+		return pose && bgfx::isValid(m_bone_texture) && mesh.material->hasDefine(m_instanced_define_idx);
+	}
+
 
-		if (data.instances_count + data.offset == InstanceData::MAX_INSTANCE_COUNT)
+	// bone matrices go to the bone texture, so instances with different poses can share a draw call
+	void renderSkinnedMeshInstanced(bgfx::Encoder* encoder, InstanceData& data, const Pose& pose, const Model& model, const Matrix& matrix, const Mesh& mesh)
+	{
+		int bone_offset = MT::atomicAdd(&m_bone_matrices_count, pose.count);
+		if (bone_offset + pose.count > m_bone_matrices.size())
 		{
-			finishInstances(encoder);
+			discardCachedState(encoder, data);
+			if (mesh.type == Mesh::MULTILAYER_SKINNED) renderMultilayerSkinnedMesh(encoder, data, pose, model, matrix, mesh);
+			else renderSkinnedMesh(encoder, data, pose, model, matrix, mesh);
+			return;
 		}
+
+		u8* mem = beginInstance(encoder, data, data.skinned, mesh);
+		if (!mem) return;
+
+		computeBoneMatrices(pose, model, &m_bone_matrices[bone_offset]);
+		SkinnedInstance* instance = (SkinnedInstance*)mem;
+		instance->matrix = matrix;
+		instance->bone_offset.set(float(bone_offset), 0, 0, 0);
+		endInstance(encoder, data, data.skinned);
+	}
+
+
+	void uploadBoneMatrices()
+	{
+		int count = Math::minimum((int)m_bone_matrices_count, m_bone_matrices.size());
+		if (count == 0) return;
+
+		const int matrices_per_row = BONE_TEXTURE_WIDTH / 4;
+		int rows = (count + matrices_per_row - 1) / matrices_per_row;
+		const bgfx::Memory* mem = bgfx::copy(&m_bone_matrices[0], rows * matrices_per_row * sizeof(Matrix));
+		bgfx::updateTexture2D(m_bone_texture, 0, 0, 0, 0, BONE_TEXTURE_WIDTH, rows, mem);
 	}
 
 
@@ -2709,8 +3968,8 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		if (!m_current_view) return;
 		View& view = *m_current_view;
 
-		executeCommandBuffer(material.getCommandBuffer(), &material);
-		executeCommandBuffer(view.command_buffer.buffer, &material);
+		executeCommandBuffer(material.getCommandBuffer());
+		executeCommandBuffer(view.command_buffer.buffer);
 
 		bgfx::setInstanceDataBuffer(&instance_buffer, 0, count);
 		bgfx::setVertexBuffer(0, vertex_buffer);
@@ -2721,28 +3980,32 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		m_stats.instance_count += count;
 		m_stats.triangle_count += count * 2;
 
-		bgfx::submit(view.bgfx_id, material.getShaderInstance().getProgramHandle(view.pass_idx));
+		bgfx::submit(view.bgfx_id, getProgram(material, view, 0, 0));
 	}
 
-	void executeCommandBuffer(const u8* data, Material* material) const
+	void executeCommandBuffer(const u8* data) const
 	{
 		bgfx::Encoder* encoder = m_renderer.getEncoder();
-		executeCommandBuffer(encoder, data, material);
+		executeCommandBuffer(encoder, data);
 	}
 
-	void executeCommandBuffer(bgfx::Encoder* encoder, const u8* data, Material* material) const
+	// returns number of executed commands, skip_textures leaves textures bound by the previous draw
+	int executeCommandBuffer(bgfx::Encoder* encoder, const u8* data, bool skip_textures = false) const
 	{
 		const u8* ip = data;
+		int count = 0;
 		for (;;)
 		{
+			++count;
 			switch ((BufferCommands)*ip)
 			{
 				case BufferCommands::END:
-					return;
+					return count - 1;
 				case BufferCommands::SET_TEXTURE:
 				{
 					auto cmd = (SetTextureCommand*)ip;
-					encoder->setTexture(cmd->stage, cmd->uniform, cmd->texture, cmd->flags);
+					if (skip_textures) --count;
+					else encoder->setTexture(cmd->stage, cmd->uniform, cmd->texture, cmd->flags);
 					ip += sizeof(*cmd);
 					break;
 				}
@@ -2771,6 +4034,12 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 				}
 				case BufferCommands::SET_GLOBAL_SHADOWMAP:
 				{
+					if (skip_textures)
+					{
+						--count;
+						ip += 1;
+						break;
+					}
 					auto handle = m_global_light_shadowmap->getRenderbufferHandle(0);
 					encoder->setTexture(15 - m_global_textures_count,
 						m_tex_shadowmap_uniform,
@@ -2781,10 +4050,8 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 				case BufferCommands::SET_LOCAL_SHADOWMAP:
 				{
 					auto cmd = (SetLocalShadowmapCommand*)ip;
-					material->setDefine(m_has_shadowmap_define_idx, bgfx::isValid(cmd->texture));
-					encoder->setTexture(15 - m_global_textures_count,
-						m_tex_shadowmap_uniform,
-						cmd->texture);
+					if (skip_textures) --count;
+					else encoder->setTexture(15 - m_global_textures_count, m_tex_shadowmap_uniform, cmd->texture);
 					ip += sizeof(*cmd);
 					break;
 				}
@@ -2796,24 +4063,26 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	}
 
 
-	void renderTerrain(const TerrainInfo& info)
+	void renderTerrain(bgfx::Encoder* encoder, const InstanceData& data, TerrainInstance* instances, const TerrainInfo& info)
 	{
-		auto& inst = m_terrain_instances[info.m_index];
+		auto& inst = instances[info.m_index];
 		if ((inst.m_count > 0 && inst.m_infos[0]->m_terrain != info.m_terrain) ||
 			inst.m_count == lengthOf(inst.m_infos))
 		{
-			finishTerrainInstances(info.m_index);
+			finishTerrainInstances(encoder, data, inst);
 		}
 		inst.m_infos[inst.m_count] = &info;
 		++inst.m_count;
 	}
 
 
-	void finishTerrainInstances(int index)
+	void finishTerrainInstances(bgfx::Encoder* encoder, const InstanceData& data, TerrainInstance& inst)
 	{
-		if (m_terrain_instances[index].m_count == 0) return;
+		int count = inst.m_count;
+		inst.m_count = 0;
+		if (count == 0) return;
 
-		const TerrainInfo& info = *m_terrain_instances[index].m_infos[0];
+		const TerrainInfo& info = *inst.m_infos[0];
 		Material* material = info.m_terrain->getMaterial();
 		if (!material->isReady()) return;
 
@@ -2827,7 +4096,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 			Vec4 m_quad_min_and_size;
 			Vec4 m_morph_const;
 		};
-		if (bgfx::getAvailInstanceDataBuffer(m_terrain_instances[index].m_count, sizeof(TerrainInstanceData)) < (u32)m_terrain_instances[index].m_count)
+		if (bgfx::getAvailInstanceDataBuffer(count, sizeof(TerrainInstanceData)) < (u32)count)
 		{
 			g_log_error.log("Renderer") << "Not enough memory to render the terrain";
 			return;
@@ -2835,8 +4104,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 
 		Matrix inv_world_matrix = info.m_world_matrix;
 		inv_world_matrix.fastInverse();
-		Vec3 camera_pos =
-			m_scene->getProject().getPosition(m_applied_camera);
+		Vec3 camera_pos = m_scene->getProject().getPosition(getDrawCamera(data));
 
 		Vec4 rel_cam_pos(
 			inv_world_matrix.transformPoint(camera_pos) / info.m_terrain->getXZScale(), 1);
@@ -2845,50 +4113,45 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 
 		Vec4 terrain_params(
 			info.m_terrain->getRootSize(), (float)detail_texture->width, (float)splat_texture->width, 0);
-		bgfx::setUniform(m_terrain_params_uniform, &terrain_params);
-		bgfx::setUniform(m_rel_camera_pos_uniform, &rel_cam_pos);
-		bgfx::setUniform(m_terrain_scale_uniform, &terrain_scale);
-		bgfx::setUniform(m_terrain_matrix_uniform, &info.m_world_matrix.m11);
+		encoder->setUniform(m_terrain_params_uniform, &terrain_params);
+		encoder->setUniform(m_rel_camera_pos_uniform, &rel_cam_pos);
+		encoder->setUniform(m_terrain_scale_uniform, &terrain_scale);
+		encoder->setUniform(m_terrain_matrix_uniform, &info.m_world_matrix.m11);
 
-		int view_idx = m_layer_to_view_map[material->getRenderLayer()];
-		ASSERT(view_idx >= 0);
-		auto& view = m_views[view_idx >= 0 ? view_idx : 0];
+		View& view = getDrawView(data, *material);
 
-		executeCommandBuffer(material->getCommandBuffer(), material);
-		executeCommandBuffer(view.command_buffer.buffer, material);
+		executeCommandBuffer(encoder, material->getCommandBuffer());
+		executeCommandBuffer(encoder, view.command_buffer.buffer);
 
 		bgfx::InstanceDataBuffer instance_buffer;
-		bgfx::allocInstanceDataBuffer(&instance_buffer, m_terrain_instances[index].m_count, sizeof(TerrainInstanceData));
+		bgfx::allocInstanceDataBuffer(&instance_buffer, count, sizeof(TerrainInstanceData));
 		TerrainInstanceData* instance_data = (TerrainInstanceData*)instance_buffer.data;
 
-		for (int i = 0; i < m_terrain_instances[index].m_count; ++i)
+		for (int i = 0; i < count; ++i)
 		{
-			const TerrainInfo& info = *m_terrain_instances[index].m_infos[i];
+			const TerrainInfo& info = *inst.m_infos[i];
 			instance_data[i].m_quad_min_and_size.set(
 				info.m_min.x, info.m_min.y, info.m_min.z, info.m_size);
 			instance_data[i].m_morph_const.set(
 				info.m_morph_const.x, info.m_morph_const.y, info.m_morph_const.z, 0);
 		}
 
-		bgfx::setVertexBuffer(0, mesh.vertex_buffer_handle);
+		encoder->setVertexBuffer(0, mesh.vertex_buffer_handle);
 		int mesh_part_indices_count = mesh.indices_count / 4;
-		bgfx::setIndexBuffer(mesh.index_buffer_handle,
+		encoder->setIndexBuffer(mesh.index_buffer_handle,
 			info.m_index * mesh_part_indices_count,
 			mesh_part_indices_count);
-		bgfx::setStencil(view.stencil, BGFX_STENCIL_NONE);
-		bgfx::setState(view.render_state | mesh.material->getRenderStates());
-		bgfx::setInstanceDataBuffer(&instance_buffer, 0, m_terrain_instances[index].m_count);
-		auto shader_instance = material->getShaderInstance().getProgramHandle(view.pass_idx);
-		++m_stats.draw_call_count;
-		m_stats.instance_count += m_terrain_instances[index].m_count;
-		m_stats.triangle_count += m_terrain_instances[index].m_count * mesh_part_indices_count;
-		bgfx::submit(view.bgfx_id, shader_instance);
-
-		m_terrain_instances[index].m_count = 0;
+		encoder->setStencil(view.stencil, BGFX_STENCIL_NONE);
+		encoder->setState(view.render_state | mesh.material->getRenderStates());
+		encoder->setInstanceDataBuffer(&instance_buffer, 0, count);
+		MT::atomicIncrement(&m_stats.draw_call_count);
+		MT::atomicAdd(&m_stats.instance_count, count);
+		MT::atomicAdd(&m_stats.triangle_count, count * mesh_part_indices_count);
+		encoder->submit(view.bgfx_id, getProgram(*material, view, 0, 0));
 	}
 
 
-	void renderGrass(const GrassInfo& grass)
+	void renderGrass(bgfx::Encoder* encoder, const GrassInfo& grass)
 	{
 		if (bgfx::getAvailInstanceDataBuffer(grass.instance_count, sizeof(GrassInfo::InstanceData)) < (u32)grass.instance_count) return;
 
@@ -2902,135 +4165,226 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		ASSERT(view_idx >= 0);
 		auto& view = m_views[view_idx >= 0 ? view_idx : 0];
 
-		executeCommandBuffer(material->getCommandBuffer(), material);
-		executeCommandBuffer(view.command_buffer.buffer, material);
+		executeCommandBuffer(encoder, material->getCommandBuffer());
+		executeCommandBuffer(encoder, view.command_buffer.buffer);
 		auto max_grass_distance = Vec4(grass.type_distance, 0, 0, 0);
-		bgfx::setUniform(m_grass_max_dist_uniform, &max_grass_distance);
+		encoder->setUniform(m_grass_max_dist_uniform, &max_grass_distance);
 
-		bgfx::setVertexBuffer(0, mesh.vertex_buffer_handle);
-		bgfx::setIndexBuffer(mesh.index_buffer_handle);
-		bgfx::setStencil(view.stencil, BGFX_STENCIL_NONE);
-		bgfx::setState(view.render_state | material->getRenderStates());
-		bgfx::setInstanceDataBuffer(&idb, 0, grass.instance_count);
-		++m_stats.draw_call_count;
-		m_stats.instance_count += grass.instance_count;
-		m_stats.triangle_count += grass.instance_count * mesh.indices_count;
-		bgfx::submit(view.bgfx_id, material->getShaderInstance().getProgramHandle(view.pass_idx));
+		encoder->setVertexBuffer(0, mesh.vertex_buffer_handle);
+		encoder->setIndexBuffer(mesh.index_buffer_handle);
+		encoder->setStencil(view.stencil, BGFX_STENCIL_NONE);
+		encoder->setState(view.render_state | material->getRenderStates());
+		encoder->setInstanceDataBuffer(&idb, 0, grass.instance_count);
+		MT::atomicIncrement(&m_stats.draw_call_count);
+		MT::atomicAdd(&m_stats.instance_count, grass.instance_count);
+		MT::atomicAdd(&m_stats.triangle_count, grass.instance_count * mesh.indices_count);
+		encoder->submit(view.bgfx_id, getProgram(*material, view, 0, 0));
 	}
 
 
-	void renderGrasses(const Array<GrassInfo>& grasses)
+	// splits [0, count) between jobs, each job records to the encoder of its thread
+	// and batches instances in its own InstanceData, callback(encoder, instance_data, from, to)
+	template <typename T>
+	void recordInJobs(const char* name, int count, int batch_size, T& callback, const DrawContext* context = nullptr)
 	{
-		PROFILE_FUNCTION();
-		for (const auto& grass : grasses)
+		if (count <= 0) return;
+
+		struct Job
+		{
+			PipelineImpl* pipeline;
+			T* callback;
+			const DrawContext* context;
+			const char* name;
+			int from;
+			int to;
+		} jobs[64];
+
+		int jobs_count = Math::minimum((count + batch_size - 1) / batch_size, (int)lengthOf(jobs));
+		int step = (count + jobs_count - 1) / jobs_count;
+		JobSystem::SignalHandle counter = JobSystem::INVALID_HANDLE;
+		for (int i = 0; i < jobs_count; ++i)
 		{
-			renderGrass(grass);
+			Job& job = jobs[i];
+			job.pipeline = this;
+			job.callback = &callback;
+			job.context = context;
+			job.name = name;
+			job.from = Math::minimum(i * step, count);
+			job.to = Math::minimum(job.from + step, count);
+			JobSystem::run(&job, [](void* data) {
+				Job* job = (Job*)data;
+				PROFILE_BLOCK(job->name);
+				bgfx::Encoder* encoder = job->pipeline->m_renderer.getEncoder();
+				InstanceData instance_data;
+				instance_data.context = job->context;
+				(*job->callback)(encoder, instance_data, job->from, job->to);
+				job->pipeline->finishInstances(encoder, instance_data);
+			}, &counter, JobSystem::INVALID_HANDLE, name);
 		}
+		JobSystem::wait(counter);
+	}
+
+
+	void renderGrasses(const Array<GrassInfo>& grasses)
+	{
+		PROFILE_FUNCTION();
+		auto record = [this, &grasses](bgfx::Encoder* encoder, InstanceData&, int from, int to) {
+			for (int i = from; i < to; ++i)
+			{
+				renderGrass(encoder, grasses[i]);
+			}
+		};
+		recordInJobs("grass", grasses.size(), 16, record);
 	}
 
 
-	void renderTerrains(const Array<TerrainInfo>& terrains)
+	void renderTerrains(const Array<TerrainInfo>& terrains, const DrawContext* context = nullptr)
 	{
 		PROFILE_FUNCTION();
 		PROFILE_INT("terrain patches", terrains.size());
-		for (const auto& info : terrains)
+		// each job batches its own patches, batch size keeps instancing mostly intact
+		auto record = [this, &terrains](bgfx::Encoder* encoder, InstanceData& data, int from, int to) {
+			TerrainInstance instances[4];
+			for (TerrainInstance& inst : instances) inst.m_count = 0;
+			for (int i = from; i < to; ++i)
+			{
+				renderTerrain(encoder, data, instances, terrains[i]);
+			}
+			for (TerrainInstance& inst : instances)
+			{
+				finishTerrainInstances(encoder, data, inst);
+			}
+		};
+		recordInJobs("terrains", terrains.size(), 256, record, context);
+	}
+
+
+	// Records meshes and terrains to the view with the render state. While a FrameGraph::ASYNC op is replayed,
+	// it is done by a job and the replay continues, the job owns the view until waitPassJobs.
+	void recordDraws(View& view, u64 render_state, const Array<MeshInstance>& meshes, const Array<TerrainInfo>* terrains)
+	{
+		if (!m_is_op_async)
 		{
-			renderTerrain(info);
+			u64 view_render_state = view.render_state;
+			view.render_state = render_state;
+			if (terrains) renderTerrains(*terrains);
+			renderMeshes(meshes, false);
+			view.render_state = view_render_state;
+			return;
 		}
-		for (int i = 0; i < lengthOf(m_terrain_instances); ++i)
+
+		PassJob* job = MALMY_NEW(m_allocator, PassJob)(m_renderer.getEngine().getFrameAllocator());
+		job->pipeline = this;
+		job->context.view = &view;
+		job->context.camera = m_applied_camera;
+		job->context.is_shadowmap = m_is_rendering_in_shadowmap;
+		job->render_state = view.render_state;
+		job->restore_render_state = view.render_state != render_state;
+		view.render_state = render_state;
+		job->meshes.reserve(meshes.size());
+		for (const MeshInstance& mesh : meshes) job->meshes.push(mesh);
+		if (terrains)
 		{
-			finishTerrainInstances(i);
+			job->terrains.reserve(terrains->size());
+			for (const TerrainInfo& terrain : *terrains) job->terrains.push(terrain);
 		}
+
+		if (m_pass_jobs.empty()) m_first_job_pass = m_replayed_pass;
+		m_last_job_pass = m_replayed_pass;
+		m_pass_jobs.push(job);
+		JobSystem::run(job, [](void* data) {
+			PassJob* job = (PassJob*)data;
+			PROFILE_BLOCK("pass draws");
+			job->pipeline->renderTerrains(job->terrains, &job->context);
+			job->pipeline->renderMeshes(job->meshes, false, &job->context);
+			if (job->restore_render_state) job->context.view->render_state = job->render_state;
+		}, &m_pass_jobs_signal, JobSystem::INVALID_HANDLE, "pass draws");
 	}
 
 
-	void renderMeshes(const Array<MeshInstance>& meshes, bool use_occlusion_culling)
+	void waitPassJobs()
 	{
-		bgfx::Encoder* encoder = m_renderer.getEncoder();
+		if (m_pass_jobs.empty()) return;
+
 		PROFILE_FUNCTION();
-		int mesh_count = 0;
+		JobSystem::wait(m_pass_jobs_signal);
+		m_pass_jobs_signal = JobSystem::INVALID_HANDLE;
+		for (PassJob* job : m_pass_jobs) MALMY_DELETE(m_allocator, job);
+		m_pass_jobs.clear();
+		m_first_job_pass = -1;
+		m_last_job_pass = -1;
+	}
+
+
+	bool dependsOnPassJobs(const FrameGraph::Pass& pass) const
+	{
+		if (m_pass_jobs.empty()) return false;
+		for (int i = 0; i < pass.dependencies_count; ++i)
+		{
+			if (m_frame_graph.dependencies[pass.first_dependency + i] >= m_first_job_pass) return true;
+		}
+		return false;
+	}
+
+
+	void renderMeshes(bgfx::Encoder* encoder, InstanceData& instance_data, const MeshInstance* meshes, int count, bool use_occlusion_culling)
+	{
 		ModelInstance* model_instances = m_scene->getModelInstances();
-		if (use_occlusion_culling)
+		for (int i = 0; i < count; ++i)
 		{
-			mesh_count += meshes.size();
-			for (auto& mesh : meshes)
+			const MeshInstance& mesh = meshes[i];
+			ModelInstance& model_instance = model_instances[mesh.owner.index];
+			switch (mesh.mesh->type)
 			{
-				ModelInstance& model_instance = model_instances[mesh.owner.index];
-				switch (mesh.mesh->type)
+			case Mesh::RIGID_INSTANCED:
+				if (use_occlusion_culling && m_occlusion_buffer.isOccluded(model_instance.matrix, model_instance.model->getAABB())) break;
+				renderRigidMeshInstanced(encoder, instance_data, model_instance.matrix, *mesh.mesh);
+				break;
+			case Mesh::RIGID:
+				discardCachedState(encoder, instance_data);
+				renderRigidMesh(encoder, instance_data, model_instance.matrix, *mesh.mesh, mesh.depth);
+				break;
+			case Mesh::SKINNED:
+				if (canInstanceSkinnedMesh(model_instance.pose, *mesh.mesh))
 				{
-				case Mesh::RIGID_INSTANCED:
-					if (m_occlusion_buffer.isOccluded(model_instance.matrix, model_instance.model->getAABB())) break;
-					renderRigidMeshInstanced(encoder, s_instance_data, model_instance.matrix, *mesh.mesh);
-					break;
-				case Mesh::RIGID:
-					renderRigidMesh(encoder, model_instance.matrix, *mesh.mesh, mesh.depth);
-					break;
-				case Mesh::SKINNED:
-					renderSkinnedMesh(encoder, *model_instance.pose, *model_instance.model, model_instance.matrix, *mesh.mesh);
-					break;
-				case Mesh::MULTILAYER_SKINNED:
-					renderMultilayerSkinnedMesh(encoder, *model_instance.pose, *model_instance.model, model_instance.matrix, *mesh.mesh);
-					break;
-				case Mesh::MULTILAYER_RIGID:
-					renderMultilayerRigidMesh(encoder, *model_instance.model, model_instance.matrix, *mesh.mesh);
-					break;
+					renderSkinnedMeshInstanced(encoder, instance_data, *model_instance.pose, *model_instance.model, model_instance.matrix, *mesh.mesh);
 				}
-			}
-		}
-		else
-		{
-			mesh_count += meshes.size();
-			for (auto& mesh : meshes)
-			{
-				ModelInstance& model_instance = model_instances[mesh.owner.index];
-				switch (mesh.mesh->type)
+				else
 				{
-				case Mesh::RIGID_INSTANCED:
-					renderRigidMeshInstanced(encoder, s_instance_data, model_instance.matrix, *mesh.mesh);
-					break;
-				case Mesh::RIGID:
-					renderRigidMesh(encoder, model_instance.matrix, *mesh.mesh, mesh.depth);
-					break;
-				case Mesh::SKINNED:
-					renderSkinnedMesh(encoder, *model_instance.pose, *model_instance.model, model_instance.matrix, *mesh.mesh);
-					break;
-				case Mesh::MULTILAYER_SKINNED:
-					renderMultilayerSkinnedMesh(encoder, *model_instance.pose, *model_instance.model, model_instance.matrix, *mesh.mesh);
-					break;
-				case Mesh::MULTILAYER_RIGID:
-					renderMultilayerRigidMesh(encoder, *model_instance.model, model_instance.matrix, *mesh.mesh);
-					break;
+					discardCachedState(encoder, instance_data);
+					renderSkinnedMesh(encoder, instance_data, *model_instance.pose, *model_instance.model, model_instance.matrix, *mesh.mesh);
 				}
+				break;
+			case Mesh::MULTILAYER_SKINNED:
+			case Mesh::MULTILAYER_RIGID:
+				renderMultilayerMesh(encoder, instance_data, model_instance.pose, *model_instance.model, model_instance.matrix, *mesh.mesh);
+				break;
 			}
 		}
-		finishInstances(encoder);
-		s_instance_data.buffer.data = nullptr;
-		s_instance_data.instances_count = 0;
-		s_instance_data.offset = 0;
-		PROFILE_INT("mesh count", mesh_count);
+	}
+
+
+	void renderMeshes(const Array<MeshInstance>& meshes, bool use_occlusion_culling, const DrawContext* context = nullptr)
+	{
+		PROFILE_FUNCTION();
+		PROFILE_INT("mesh count", meshes.size());
+		auto record = [this, &meshes, use_occlusion_culling](bgfx::Encoder* encoder, InstanceData& instance_data, int from, int to) {
+			renderMeshes(encoder, instance_data, meshes.begin() + from, to - from, use_occlusion_culling);
+		};
+		recordInJobs("meshes", meshes.size(), 256, record, context);
 	}
 
 
 	void renderMeshes(const Array<Array<MeshInstance>>& meshes, bool use_occlusion_culling)
 	{
 		PROFILE_FUNCTION();
-		struct Data
-		{
-			PipelineImpl* that;
-			const Array<MeshInstance>* meshes;
-			bool use_occlusion_culling;
-		} data[64];
-		JobSystem::SignalHandle counter = JobSystem::INVALID_HANDLE;
-		for (int i = 0; i < meshes.size(); ++i) {
-			data[i].that = this;
-			data[i].use_occlusion_culling = use_occlusion_culling;
-			data[i].meshes = &meshes[i];
-			JobSystem::run(&data[i], [](void* data) {
-				Data* job_data = (Data*)data;
-				job_data->that->renderMeshes(*job_data->meshes, job_data->use_occlusion_culling);
-			}, &counter, JobSystem::INVALID_HANDLE);
-		}
-		JobSystem::wait(counter);
+		auto record = [this, &meshes, use_occlusion_culling](bgfx::Encoder* encoder, InstanceData& instance_data, int from, int to) {
+			for (int i = from; i < to; ++i)
+			{
+				renderMeshes(encoder, instance_data, meshes[i].begin(), meshes[i].size(), use_occlusion_culling);
+			}
+		};
+		recordInJobs("meshes", meshes.size(), 1, record);
 	}
 
 
@@ -3052,6 +4406,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		}
 		m_width = w;
 		m_height = h;
+		m_frame_graph.is_dirty = true;
 	}
 
 
@@ -3067,6 +4422,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	bool render() override
 	{
 		PROFILE_FUNCTION();
+		MEMORY_TAG("pipeline");
 
 		if (!isReady() || !m_scene)
 		{
@@ -3082,7 +4438,10 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 			m_draw2d.Clear();
 		}
 
+		const u64 start_time = Profiler::now();
 		m_stats = {};
+		++m_frame_index;
+		if (m_frame_index % SHADOW_CACHE_STATIC_FRAMES == 0) forgetStaticGameObjects();
 		m_applied_camera = INVALID_GAMEOBJECT;
 		m_global_light_shadowmap = nullptr;
 		m_current_view = nullptr;
@@ -3090,17 +4449,39 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		m_layer_mask = 0;
 		m_pass_idx = -1;
 		m_current_framebuffer = m_default_framebuffer;
-		s_instance_data.mesh = nullptr;
-		s_instance_data.buffer.data = nullptr;
-		s_instance_data.instances_count = 0;
-		s_instance_data.offset = 0;
+		m_instance_data = InstanceData();
+		m_bone_matrices_count = 0;
 		m_point_light_shadowmaps.clear();
 		clearLayerToViewMap();
-		for (int i = 0; i < lengthOf(m_terrain_instances); ++i)
+
+		bool success;
+		if (m_frame_graph.is_enabled && m_frame_graph.is_valid && !m_frame_graph.is_dirty && checkFrameGraph())
+		{
+			success = replayFrameGraph();
+		}
+		else if (m_frame_graph.is_enabled)
 		{
-			m_terrain_instances[i].m_count = 0;
+			success = recordFrameGraph();
 		}
+		else
+		{
+			success = callRender();
+		}
+		ASSERT(!m_instance_data.rigid.mesh && !m_instance_data.skinned.mesh);
+		if (bgfx::isValid(m_bone_texture)) uploadBoneMatrices();
+
+		// m_stats is reset every render, metrics keep the history
+		METRICS_ADD("draw calls", m_stats.draw_call_count);
+		METRICS_ADD("instances", m_stats.instance_count);
+		METRICS_ADD("triangles", m_stats.triangle_count);
+		METRICS_ADD("elided commands", m_stats.elided_command_count);
+		METRICS_SAMPLE("pipeline render ms", 64, (Profiler::now() - start_time) * 1000.0f / Profiler::frequency());
+		return success;
+	}
+
 
+	bool callRender()
+	{
 		lua_rawgeti(m_lua_state, LUA_REGISTRYINDEX, m_lua_env);
 		bool success = true;
 		if (lua_getfield(m_lua_state, -1, "render") == LUA_TFUNCTION)
@@ -3117,11 +4498,124 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 		{
 			lua_pop(m_lua_state, 1);
 		}
-		ASSERT(!s_instance_data.mesh);
+		lua_pop(m_lua_state, 1);
+		endPassBlock();
+		return success;
+	}
+
+
+	bool recordFrameGraph()
+	{
+		PROFILE_FUNCTION();
+		m_frame_graph.clear(m_lua_state);
+		m_frame_graph.is_dirty = false;
+		setGlobalsIndex(&trackGlobalRead);
+		lua_sethook(m_lua_state, &trackCall, LUA_MASKCALL, 0);
+		s_recording_pipeline = this;
+		bool success = callRender();
+		s_recording_pipeline = nullptr;
+		lua_sethook(m_lua_state, nullptr, 0, 0);
+		setGlobalsIndex(nullptr);
+		lua_rawgeti(m_lua_state, LUA_REGISTRYINDEX, m_lua_env);
+		m_frame_graph.trackEnvironment(m_lua_state);
+		lua_pop(m_lua_state, 1);
+		m_frame_graph.computeDependencies();
+		if (success && m_frame_graph.is_volatile)
+		{
+			g_log_warning.log("Renderer") << m_path << " can not be recorded once, it queries values changing every frame";
+			m_frame_graph.clear(m_lua_state);
+			m_frame_graph.is_enabled = false;
+			return success;
+		}
+		m_frame_graph.is_valid = success && !m_frame_graph.is_dirty;
 		return success;
 	}
 
 
+	// upvalues of functions called while recording are inputs of the graph, see FrameGraph::Input
+	static void trackCall(lua_State* L, lua_Debug* ar)
+	{
+		if (!s_recording_pipeline) return;
+		lua_getinfo(L, "f", ar);
+		if (!lua_iscfunction(L, -1)) s_recording_pipeline->m_frame_graph.trackUpvalues(L, -1);
+		lua_pop(L, 1);
+	}
+
+
+	// __index of the environment while recording, so globals read from the global table are inputs too
+	static int trackGlobalRead(lua_State* L)
+	{
+		lua_pushvalue(L, 2);
+		lua_gettable(L, lua_upvalueindex(1));
+		if (s_recording_pipeline) s_recording_pipeline->m_frame_graph.trackGlobal(L);
+		return 1;
+	}
+
+
+	// environment falls back to the global table, through the function if there is one
+	void setGlobalsIndex(lua_CFunction function)
+	{
+		lua_rawgeti(m_lua_state, LUA_REGISTRYINDEX, m_lua_env);
+		lua_pushglobaltable(m_lua_state);
+		if (function) lua_pushcclosure(m_lua_state, function, 1);
+		lua_setfield(m_lua_state, -2, "__index");
+		lua_pop(m_lua_state, 1);
+	}
+
+
+	// queries are side-effect free, so they are all evaluated before anything is replayed
+	bool checkFrameGraph()
+	{
+		PROFILE_FUNCTION();
+		lua_rawgeti(m_lua_state, LUA_REGISTRYINDEX, m_lua_env);
+		bool inputs_changed = m_frame_graph.inputsChanged(m_lua_state);
+		lua_pop(m_lua_state, 1);
+		if (inputs_changed) return false;
+
+		for (const FrameGraph::Op& op : m_frame_graph.ops)
+		{
+			if ((op.flags & FrameGraph::QUERY) == 0) continue;
+			if (!op.replay(*this, op)) return false;
+		}
+		return true;
+	}
+
+
+	bool replayFrameGraph()
+	{
+		PROFILE_FUNCTION();
+		bool success = true;
+		for (int pass_idx = 0; pass_idx < m_frame_graph.passes.size() && success; ++pass_idx)
+		{
+			const FrameGraph::Pass& pass = m_frame_graph.passes[pass_idx];
+			if (dependsOnPassJobs(pass)) waitPassJobs();
+			m_replayed_pass = pass_idx;
+			for (int i = pass.first_op, end = pass.first_op + pass.ops_count; i < end; ++i)
+			{
+				const FrameGraph::Op& op = m_frame_graph.ops[i];
+				if (op.flags & FrameGraph::QUERY) continue;
+				// other ops of the pass can change the views its jobs record to
+				bool is_async = (op.flags & FrameGraph::ASYNC) != 0;
+				if (!is_async && m_last_job_pass == pass_idx) waitPassJobs();
+				m_is_op_async = is_async;
+				success = op.replay(*this, op);
+				m_is_op_async = false;
+				if (!success) break;
+			}
+		}
+		waitPassJobs();
+		m_replayed_pass = -1;
+		endPassBlock();
+		if (!success)
+		{
+			m_frame_graph.is_valid = false;
+			return false;
+		}
+		m_stats.frame_graph_ops_count = m_frame_graph.ops.size();
+		return true;
+	}
+
+
 	void exposeCustomCommandToLua(const CustomCommandHandler& handler)
 	{
 		if (!m_lua_state) return;
@@ -3185,6 +4679,108 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	}
 
 
+	void invalidateFrameGraph()
+	{
+		m_frame_graph.is_dirty = true;
+	}
+
+
+	int beginView(const char* debug_name, const char* framebuffer_name, u64 layer_mask)
+	{
+		m_layer_mask |= layer_mask;
+		int view_idx = newView(debug_name, layer_mask);
+		setFramebuffer(framebuffer_name);
+		beginPassBlock();
+		return view_idx;
+	}
+
+
+	void setViewMode(int mode)
+	{
+		if (!m_current_view) return;
+		bgfx::setViewMode(m_current_view->bgfx_id, (bgfx::ViewMode::Enum)mode);
+	}
+
+
+	void bindFramebufferTexture(const char* framebuffer_name, int renderbuffer_idx, int uniform_idx, u32 flags)
+	{
+		if (!m_current_view) return;
+		FrameBuffer* fb = getFramebuffer(framebuffer_name);
+		if (!fb)
+		{
+			g_log_warning.log("Renderer") << "Framebuffer " << framebuffer_name << " does not exist";
+			return;
+		}
+
+		Vec4 size;
+		size.x = (float)fb->getWidth();
+		size.y = (float)fb->getHeight();
+		size.z = 1.0f / (float)fb->getWidth();
+		size.w = 1.0f / (float)fb->getHeight();
+		m_current_view->command_buffer.beginAppend();
+		if (m_global_textures_count == 0)
+		{
+			m_current_view->command_buffer.setUniform(m_texture_size_uniform, size);
+		}
+		m_current_view->command_buffer.setTexture(15 - m_global_textures_count,
+			m_uniforms[uniform_idx],
+			fb->getRenderbufferHandle(renderbuffer_idx),
+			flags);
+		++m_global_textures_count;
+		m_current_view->command_buffer.end();
+	}
+
+
+	void setUniform(int uniform_idx, const Vec4* values, int count)
+	{
+		if (!m_current_view) return;
+		m_current_view->command_buffer.beginAppend();
+		m_current_view->command_buffer.setUniform(m_uniforms[uniform_idx], values, count);
+		m_current_view->command_buffer.end();
+	}
+
+
+	void renderModels(bool use_occlusion_culling)
+	{
+		renderAll(m_camera_frustum, true, m_applied_camera, m_layer_mask, use_occlusion_culling);
+		m_layer_mask = 0;
+	}
+
+
+	void renderLocalLightsShadowmaps(const char* camera_slot, const char* atlas_name)
+	{
+		FrameBuffer* atlas = getFramebuffer(atlas_name);
+		GameObject camera = m_scene->getCameraInSlot(camera_slot);
+		renderLocalLightShadowmaps(camera, atlas);
+	}
+
+
+	bgfx::TextureHandle* getRenderbufferPtr(const char* framebuffer_name, int renderbuffer_idx)
+	{
+		return &getRenderbuffer(framebuffer_name, renderbuffer_idx);
+	}
+
+
+	void addFramebuffer(const FrameBuffer::Declaration& decl)
+	{
+		if (getFramebuffer(decl.m_name))
+		{
+			g_log_warning.log("Renderer") << "Trying to create already existing framebuffer " << decl.m_name;
+			return;
+		}
+
+		FrameBuffer::Declaration sized_decl = decl;
+		if ((decl.m_size_ratio.x > 0 || decl.m_size_ratio.y > 0) && m_height > 0)
+		{
+			sized_decl.m_width = int(m_width * decl.m_size_ratio.x);
+			sized_decl.m_height = int(m_height * decl.m_size_ratio.y);
+		}
+		auto* fb = MALMY_NEW(m_allocator, FrameBuffer)(sized_decl);
+		m_framebuffers.push(fb);
+		if (equalStrings(decl.m_name, "default")) m_default_framebuffer = fb;
+	}
+
+
 	void clear(u32 flags, u32 color)
 	{
 		if (!m_current_view) return;
@@ -3210,11 +4806,34 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 
 	void setScene(RenderScene* scene) override
 	{
+		if (m_scene)
+		{
+			m_scene->destroyed().unbind<PipelineImpl, &PipelineImpl::onSceneDestroyed>(this);
+			m_scene->getProject().gameobjectTransformed().unbind<PipelineImpl, &PipelineImpl::onGameObjectMoved>(this);
+		}
 		m_scene = scene;
+		invalidateShadowCaches();
+		if (m_scene)
+		{
+			m_scene->destroyed().bind<PipelineImpl, &PipelineImpl::onSceneDestroyed>(this);
+			m_scene->getProject().gameobjectTransformed().bind<PipelineImpl, &PipelineImpl::onGameObjectMoved>(this);
+		}
+		m_frame_graph.is_dirty = true;
 		if (m_lua_state && m_scene) callInitScene();
 	}
 
 
+	// pipelines can outlive their scene, e.g. when the project is destroyed first,
+	// the scene is not unbound here because it is invoking this
+	void onSceneDestroyed()
+	{
+		m_scene->getProject().gameobjectTransformed().unbind<PipelineImpl, &PipelineImpl::onGameObjectMoved>(this);
+		m_scene = nullptr;
+		invalidateShadowCaches();
+		m_frame_graph.is_dirty = true;
+	}
+
+
 	void callInitScene()
 	{
 		lua_rawgeti(m_lua_state, LUA_REGISTRYINDEX, m_lua_env);
@@ -3240,7 +4859,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	IAllocator& m_allocator;
 	bgfx::VertexDecl m_deferred_point_light_vertex_decl;
 	bgfx::VertexDecl m_base_vertex_decl;
-	TerrainInstance m_terrain_instances[4];
+	InstanceData m_instance_data;
 	u32 m_debug_flags;
 	int m_view_idx;
 	u64 m_layer_mask;
@@ -3270,6 +4889,23 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	Array<GrassInfo> m_grasses_buffer;
 
 	Matrix m_shadow_viewprojection[4];
+	ShadowCascadeCache m_shadow_cascade_caches[4];
+	bgfx::FrameBufferHandle m_shadow_cache_framebuffer;
+	int m_shadow_cache_width;
+	int m_shadow_cache_height;
+	HashMap<GameObject, u32> m_moved_gameobjects;
+	Array<GameObject> m_static_again_gameobjects;
+	Array<MeshInstance> m_static_casters;
+	Array<MeshInstance> m_dynamic_casters;
+	Array<LocalLightShadow> m_local_light_shadows;
+	Array<MeshInstance> m_local_shadow_casters;
+	Array<PassJob*> m_pass_jobs;
+	JobSystem::SignalHandle m_pass_jobs_signal;
+	int m_first_job_pass;
+	int m_last_job_pass;
+	int m_replayed_pass;
+	bool m_is_op_async;
+	u32 m_frame_index;
 	int m_width;
 	int m_height;
 	string m_define;
@@ -3278,6 +4914,10 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	Array<CustomCommandHandler> m_custom_commands_handlers;
 
 	bgfx::UniformHandle m_bone_matrices_uniform;
+	bgfx::UniformHandle m_bone_texture_uniform;
+	bgfx::TextureHandle m_bone_texture;
+	Array<Matrix> m_bone_matrices;
+	volatile i32 m_bone_matrices_count;
 	bgfx::UniformHandle m_layer_uniform;
 	bgfx::UniformHandle m_terrain_scale_uniform;
 	bgfx::UniformHandle m_rel_camera_pos_uniform;
@@ -3289,6 +4929,7 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	bgfx::UniformHandle m_light_color_indirect_intensity_uniform;
 	bgfx::UniformHandle m_light_dir_fov_uniform;
 	bgfx::UniformHandle m_shadowmap_matrices_uniform;
+	bgfx::UniformHandle m_shadow_atlas_slot_uniform;
 	bgfx::UniformHandle m_terrain_matrix_uniform;
 	bgfx::UniformHandle m_decal_matrix_uniform;
 	bgfx::UniformHandle m_emitter_matrix_uniform;
@@ -3312,7 +4953,6 @@ struct PipelineImpl MALMY_FINAL : public Pipeline
 	bgfx::DynamicVertexBufferHandle m_debug_vertex_buffers[32];
 	bgfx::DynamicIndexBufferHandle m_debug_index_buffer;
 	OcclusionBuffer m_occlusion_buffer;
-	int m_debug_buffer_idx;
 	int m_has_shadowmap_define_idx;
 	int m_instanced_define_idx;
 };
@@ -3334,12 +4974,258 @@ namespace LuaAPI
 {
 
 
-int setViewMode(lua_State* L)
+// all pipeline functions are called through this, so calls made while a frame graph is recorded are captured
+static int recordCall(lua_State* L)
 {
-	PipelineImpl* that = LuaWrapper::checkArg<PipelineImpl*>(L, 1);
-	auto mode = (bgfx::ViewMode::Enum)LuaWrapper::checkArg<int>(L, 2);
-	if (!that->m_current_view) return 0;
-	bgfx::setViewMode(that->m_current_view->bgfx_id, mode);
+	lua_CFunction function = lua_tocfunction(L, lua_upvalueindex(1));
+	if (!s_recording_pipeline) return function(L);
+
+	u32 flags = (u32)lua_tointeger(L, lua_upvalueindex(2));
+	auto record = (FrameGraph::RecordFunction)lua_touserdata(L, lua_upvalueindex(3));
+	s_recording_pipeline->m_frame_graph.record(*s_recording_pipeline, L, flags, record);
+	return function(L);
+}
+
+
+template <typename... Args>
+struct RecordedArgs
+{
+	using Values = Tuple<RemoveCVR<Args>...>;
+	using ValueIndices = typename BuildIndices<-1, sizeof...(Args)>::result;
+
+	template <int... indices>
+	static Values decode(lua_State* L, int first_lua_index, Indices<indices...>)
+	{
+		return Values(LuaWrapper::checkArg<RemoveCVR<Args>>(L, first_lua_index + indices)...);
+	}
+};
+
+
+// Arguments are decoded once when recorded, replay calls the method directly.
+// Queries are evaluated when recorded too, so their replay compares the results.
+template <typename T, T t> struct RecordedMethod;
+
+
+template <typename R, typename... Args, R (PipelineImpl::*method)(Args...)>
+struct RecordedMethod<R (PipelineImpl::*)(Args...), method> : RecordedArgs<Args...>
+{
+	using Base = RecordedArgs<Args...>;
+
+	struct Data
+	{
+		typename Base::Values args;
+		RemoveCVR<R> result;
+	};
+
+	template <int... indices>
+	static R call(PipelineImpl& pipeline, const typename Base::Values& args, Indices<indices...>)
+	{
+		return (pipeline.*method)(get<indices>(args)...);
+	}
+
+	static void record(PipelineImpl& pipeline, FrameGraph::Op& op, lua_State* L)
+	{
+		Data& data = op.emplaceData<Data>();
+		data.args = Base::decode(L, 2, typename Base::ValueIndices());
+		if (op.flags & FrameGraph::QUERY)
+		{
+			data.result = call(pipeline, data.args, typename Base::ValueIndices());
+			op.replay = &check;
+		}
+		else
+		{
+			op.replay = &replay;
+		}
+	}
+
+	static bool check(PipelineImpl& pipeline, const FrameGraph::Op& op)
+	{
+		const Data& data = op.getData<Data>();
+		return call(pipeline, data.args, typename Base::ValueIndices()) == data.result;
+	}
+
+	static bool replay(PipelineImpl& pipeline, const FrameGraph::Op& op)
+	{
+		call(pipeline, op.getData<Data>().args, typename Base::ValueIndices());
+		return true;
+	}
+};
+
+
+template <typename... Args, void (PipelineImpl::*method)(Args...)>
+struct RecordedMethod<void (PipelineImpl::*)(Args...), method> : RecordedArgs<Args...>
+{
+	using Base = RecordedArgs<Args...>;
+
+	template <int... indices>
+	static void call(PipelineImpl& pipeline, const typename Base::Values& args, Indices<indices...>)
+	{
+		(pipeline.*method)(get<indices>(args)...);
+	}
+
+	static void record(PipelineImpl& pipeline, FrameGraph::Op& op, lua_State* L)
+	{
+		ASSERT((op.flags & FrameGraph::QUERY) == 0);
+		op.emplaceData<typename Base::Values>() = Base::decode(L, 2, typename Base::ValueIndices());
+		op.replay = &replay;
+	}
+
+	static bool replay(PipelineImpl& pipeline, const FrameGraph::Op& op)
+	{
+		call(pipeline, op.getData<typename Base::Values>(), typename Base::ValueIndices());
+		return true;
+	}
+};
+
+
+template <typename T, T t> struct RecordedFunction;
+
+
+template <typename... Args, void (*function)(Args...)>
+struct RecordedFunction<void (*)(Args...), function> : RecordedArgs<Args...>
+{
+	using Base = RecordedArgs<Args...>;
+
+	template <int... indices>
+	static void call(const typename Base::Values& args, Indices<indices...>)
+	{
+		function(get<indices>(args)...);
+	}
+
+	static void record(PipelineImpl& pipeline, FrameGraph::Op& op, lua_State* L)
+	{
+		op.emplaceData<typename Base::Values>() = Base::decode(L, 1, typename Base::ValueIndices());
+		op.replay = &replay;
+	}
+
+	static bool replay(PipelineImpl& pipeline, const FrameGraph::Op& op)
+	{
+		call(op.getData<typename Base::Values>(), typename Base::ValueIndices());
+		return true;
+	}
+};
+
+
+// optional arguments are filled in, so these are decoded like the other methods
+static void recordNewView(PipelineImpl& pipeline, FrameGraph::Op& op, lua_State* L)
+{
+	if (lua_gettop(L) == 3) lua_pushinteger(L, 0);
+	RecordedMethod<decltype(&PipelineImpl::beginView), &PipelineImpl::beginView>::record(pipeline, op, L);
+}
+
+
+static void recordBindFramebufferTexture(PipelineImpl& pipeline, FrameGraph::Op& op, lua_State* L)
+{
+	if (lua_gettop(L) == 4) lua_pushinteger(L, 0xffffFFFF);
+	using Recorded = RecordedMethod<decltype(&PipelineImpl::bindFramebufferTexture), &PipelineImpl::bindFramebufferTexture>;
+	Recorded::record(pipeline, op, L);
+}
+
+
+static void recordRenderModels(PipelineImpl& pipeline, FrameGraph::Op& op, lua_State* L)
+{
+	if (lua_gettop(L) == 1) lua_pushboolean(L, false);
+	RecordedMethod<decltype(&PipelineImpl::renderModels), &PipelineImpl::renderModels>::record(pipeline, op, L);
+}
+
+
+// uniform values are copied when recorded
+struct RecordedSetUniform
+{
+	struct Data
+	{
+		int uniform_idx;
+		int first_value;
+		int values_count;
+	};
+
+	static void record(PipelineImpl& pipeline, FrameGraph::Op& op, lua_State* L)
+	{
+		FrameGraph& graph = pipeline.m_frame_graph;
+		Data& data = op.emplaceData<Data>();
+		data.uniform_idx = LuaWrapper::checkArg<int>(L, 2);
+		LuaWrapper::checkTableArg(L, 3);
+		Vec4 values[64];
+		data.values_count = PipelineImpl::parseVec4Array(L, 3, values, lengthOf(values));
+		data.first_value = graph.vec4s.size();
+		for (int i = 0; i < data.values_count; ++i) graph.vec4s.push(values[i]);
+		op.replay = &replay;
+	}
+
+	static bool replay(PipelineImpl& pipeline, const FrameGraph::Op& op)
+	{
+		const Data& data = op.getData<Data>();
+		const Vec4* values = data.values_count > 0 ? &pipeline.m_frame_graph.vec4s[data.first_value] : nullptr;
+		pipeline.setUniform(data.uniform_idx, values, data.values_count);
+		return true;
+	}
+};
+
+
+struct RecordedAddFramebuffer
+{
+	static void record(PipelineImpl& pipeline, FrameGraph::Op& op, lua_State* L)
+	{
+		FrameGraph& graph = pipeline.m_frame_graph;
+		op.emplaceData<int>() = graph.framebuffers.size();
+		PipelineImpl::parseFramebuffer(L, graph.framebuffers.emplace(), &pipeline);
+		op.replay = &replay;
+	}
+
+	static bool replay(PipelineImpl& pipeline, const FrameGraph::Op& op)
+	{
+		pipeline.addFramebuffer(pipeline.m_frame_graph.framebuffers[op.getData<int>()]);
+		return true;
+	}
+};
+
+
+// the only op which still calls Lua when replayed
+struct RecordedEveryFrame
+{
+	struct Data
+	{
+		int first_arg;
+		int args_count;
+	};
+
+	static void record(PipelineImpl& pipeline, FrameGraph::Op& op, lua_State* L)
+	{
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+		FrameGraph& graph = pipeline.m_frame_graph;
+		Data& data = op.emplaceData<Data>();
+		data.first_arg = graph.args.size();
+		data.args_count = lua_gettop(L) - 1;
+		for (int i = 2; i <= lua_gettop(L); ++i) FrameGraph::capture(L, i, graph.args.emplace());
+		op.replay = &replay;
+	}
+
+	static bool replay(PipelineImpl& pipeline, const FrameGraph::Op& op)
+	{
+		lua_State* L = pipeline.m_lua_state;
+		const FrameGraph& graph = pipeline.m_frame_graph;
+		const Data& data = op.getData<Data>();
+		for (int i = 0; i < data.args_count; ++i) FrameGraph::push(L, graph.args[data.first_arg + i]);
+		if (lua_pcall(L, data.args_count - 1, 0, 0) != LUA_OK)
+		{
+			g_log_warning.log("Renderer") << lua_tostring(L, -1);
+			lua_pop(L, 1);
+			return false;
+		}
+		return true;
+	}
+};
+
+
+int everyFrame(lua_State* L)
+{
+	LuaWrapper::checkArg<PipelineImpl*>(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+
+	PipelineImpl* recording = s_recording_pipeline;
+	s_recording_pipeline = nullptr;
+	lua_call(L, lua_gettop(L) - 2, 0);
+	s_recording_pipeline = recording;
 	return 0;
 }
 
@@ -3353,30 +5239,14 @@ int bindFramebufferTexture(lua_State* L)
 	int uniform_idx = LuaWrapper::checkArg<int>(L, 4);
 	u32 flags = lua_gettop(L) > 4 ? LuaWrapper::checkArg<u32>(L, 5) : 0xffffFFFF;
 
-	FrameBuffer* fb = that->getFramebuffer(framebuffer_name);
-	if (!fb)
+	if (!that->getFramebuffer(framebuffer_name))
 	{
 		StaticString<128> tmp("Framebuffer ", framebuffer_name, " does not exist");
 		luaL_argerror(L, 2, tmp);
 		return 0;
 	}
 
-	Vec4 size;
-	size.x = (float)fb->getWidth();
-	size.y = (float)fb->getHeight();
-	size.z = 1.0f / (float)fb->getWidth();
-	size.w = 1.0f / (float)fb->getHeight();
-	that->m_current_view->command_buffer.beginAppend();
-	if (that->m_global_textures_count == 0)
-	{
-		that->m_current_view->command_buffer.setUniform(that->m_texture_size_uniform, size);
-	}
-	that->m_current_view->command_buffer.setTexture(15 - that->m_global_textures_count,
-		that->m_uniforms[uniform_idx],
-		fb->getRenderbufferHandle(renderbuffer_idx),
-		flags);
-	++that->m_global_textures_count;
-	that->m_current_view->command_buffer.end();
+	that->bindFramebufferTexture(framebuffer_name, renderbuffer_idx, uniform_idx, flags);
 	return 0;
 }
 
@@ -3390,10 +5260,7 @@ int newView(lua_State* L)
 	u64 layer_mask = 0;
 	if (lua_gettop(L) > 3) layer_mask = LuaWrapper::checkArg<u64>(L, 4);
 
-	pipeline->m_layer_mask |= layer_mask;
-
-	LuaWrapper::push(L, pipeline->newView(debug_name, layer_mask));
-	pipeline->setFramebuffer(framebuffer_name);
+	LuaWrapper::push(L, pipeline->beginView(debug_name, framebuffer_name, layer_mask));
 	return 1;
 }
 
@@ -3401,47 +5268,9 @@ int newView(lua_State* L)
 int addFramebuffer(lua_State* L)
 {
 	auto* pipeline = LuaWrapper::checkArg<PipelineImpl*>(L, 1);
-	const char* name = LuaWrapper::checkArg<const char*>(L, 2);
-	FrameBuffer* framebuffer = pipeline->getFramebuffer(name);
-	if (framebuffer)
-	{
-		g_log_warning.log("Renderer") << "Trying to create already existing framebuffer " << name;
-		return 0;
-	}
-
-	LuaWrapper::checkTableArg(L, 3);
 	FrameBuffer::Declaration decl;
-	copyString(decl.m_name, name);
-
-	LuaWrapper::getOptionalField(L, 3, "width", &decl.m_width);
-	decl.m_size_ratio = Vec2(-1, -1);
-	if(lua_getfield(L, 3, "size_ratio") == LUA_TTABLE)
-	{
-		decl.m_size_ratio = LuaWrapper::toType<Vec2>(L, -1);
-	}
-	lua_pop(L, 1);
-	if(lua_getfield(L, 3, "screen_size") == LUA_TBOOLEAN)
-	{
-		bool is_screen_size = lua_toboolean(L, -1) != 0;
-		decl.m_size_ratio = is_screen_size ? Vec2(1, 1) : Vec2(-1, -1);
-	}
-	lua_pop(L, 1);
-	LuaWrapper::getOptionalField(L, 3, "height", &decl.m_height);
-
-	if(lua_getfield(L, 3, "renderbuffers") == LUA_TTABLE)
-	{
-		PipelineImpl::parseRenderbuffers(L, decl, pipeline);
-	}
-	lua_pop(L, 1);
-	if ((decl.m_size_ratio.x > 0 || decl.m_size_ratio.y > 0) && pipeline->m_height > 0)
-	{
-		decl.m_width = int(pipeline->m_width * decl.m_size_ratio.x);
-		decl.m_height = int(pipeline->m_height * decl.m_size_ratio.y);
-	}
-	auto* fb = MALMY_NEW(pipeline->m_allocator, FrameBuffer)(decl);
-	pipeline->m_framebuffers.push(fb);
-	if(equalStrings(decl.m_name, "default")) pipeline->m_default_framebuffer = fb;
-
+	PipelineImpl::parseFramebuffer(L, decl, pipeline);
+	pipeline->addFramebuffer(decl);
 	return 0;
 }
 
@@ -3450,11 +5279,7 @@ int renderModels(lua_State* L)
 {
 	auto* pipeline = LuaWrapper::checkArg<PipelineImpl*>(L, 1);
 	bool use_occlusion_culling = lua_gettop(L) > 1 ? LuaWrapper::checkArg<bool>(L, 2) : false;
-
-	GameObject cam = pipeline->m_applied_camera;
-
-	pipeline->renderAll(pipeline->m_camera_frustum, true, cam, pipeline->m_layer_mask, use_occlusion_culling);
-	pipeline->m_layer_mask = 0;
+	pipeline->renderModels(use_occlusion_culling);
 	return 0;
 }
 
@@ -3474,62 +5299,11 @@ int setUniform(lua_State* L)
 	LuaWrapper::checkTableArg(L, 3);
 
 	Vec4 tmp[64];
-	int len = Math::minimum((int)lua_rawlen(L, 3), lengthOf(tmp));
-	for (int i = 0; i < len; ++i)
-	{
-		if (lua_rawgeti(L, 3, 1 + i) == LUA_TTABLE)
-		{
-			if (lua_rawgeti(L, -1, 1) == LUA_TNUMBER) tmp[i].x = (float)lua_tonumber(L, -1);
-			if (lua_rawgeti(L, -2, 2) == LUA_TNUMBER) tmp[i].y = (float)lua_tonumber(L, -1);
-			if (lua_rawgeti(L, -3, 3) == LUA_TNUMBER) tmp[i].z = (float)lua_tonumber(L, -1);
-			if (lua_rawgeti(L, -4, 4) == LUA_TNUMBER) tmp[i].w = (float)lua_tonumber(L, -1);
-			lua_pop(L, 4);
-		}
-		lua_pop(L, 1);
-	}
+	int len = PipelineImpl::parseVec4Array(L, 3, tmp, lengthOf(tmp));
 
 	if (uniform_idx >= pipeline->m_uniforms.size()) luaL_argerror(L, 2, "unknown uniform");
 
-	pipeline->m_current_view->command_buffer.beginAppend();
-	pipeline->m_current_view->command_buffer.setUniform(pipeline->m_uniforms[uniform_idx], tmp, len);
-	pipeline->m_current_view->command_buffer.end();
-	return 0;
-}
-
-
-int getRenderbuffer(lua_State* L)
-{
-	auto* pipeline = LuaWrapper::checkArg<PipelineImpl*>(L, 1);
-	const char* fb_name = LuaWrapper::checkArg<const char*>(L, 2);
-	int rb_idx = LuaWrapper::checkArg<int>(L, 3);
-
-	void* rb = &pipeline->getRenderbuffer(fb_name, rb_idx);
-	LuaWrapper::push(L, rb);
-	return 1;
-}
-
-
-int renderLocalLightsShadowmaps(lua_State* L)
-{
-	auto* pipeline = LuaWrapper::checkArg<PipelineImpl*>(L, 1);
-	const char* camera_slot = LuaWrapper::checkArg<const char*>(L, 2);
-
-	FrameBuffer* fbs[16];
-	int len = Math::minimum((int)lua_rawlen(L, 3), lengthOf(fbs));
-	for (int i = 0; i < len; ++i)
-	{
-		if (lua_rawgeti(L, 3, 1 + i) == LUA_TSTRING)
-		{
-			const char* fb_name = lua_tostring(L, -1);
-			fbs[i] = pipeline->getFramebuffer(fb_name);
-		}
-		lua_pop(L, 1);
-	}
-
-	RenderScene* scene = pipeline->m_scene;
-	GameObject camera = scene->getCameraInSlot(camera_slot);
-	pipeline->renderLocalLightShadowmaps(camera, fbs, len);
-
+	pipeline->setUniform(uniform_idx, tmp, len);
 	return 0;
 }
 
@@ -3545,9 +5319,15 @@ void print(int x, int y, const char* text)
 
 void Pipeline::registerLuaAPI(lua_State* L)
 {
-	auto registerCFunction = [L](const char* name, lua_CFunction function)
+	auto registerCFunction = [L](const char* name,
+		lua_CFunction function,
+		u32 frame_graph_flags,
+		FrameGraph::RecordFunction record)
 	{
 		lua_pushcfunction(L, function);
+		lua_pushinteger(L, frame_graph_flags);
+		lua_pushlightuserdata(L, (void*)record);
+		lua_pushcclosure(L, &LuaAPI::recordCall, 3);
 		lua_setglobal(L, name);
 	};
 
@@ -3557,30 +5337,39 @@ void Pipeline::registerLuaAPI(lua_State* L)
 		lua_setglobal(L, name);
 	};
 
-	registerCFunction("newView", &LuaAPI::newView);
-	registerCFunction("bindFramebufferTexture", &LuaAPI::bindFramebufferTexture);
-	registerCFunction("setViewMode", &LuaAPI::setViewMode);
-	
-	#define REGISTER_FUNCTION(name) \
+	registerCFunction("newView", &LuaAPI::newView, FrameGraph::NEW_PASS, &LuaAPI::recordNewView);
+	registerCFunction("bindFramebufferTexture",
+		&LuaAPI::bindFramebufferTexture,
+		FrameGraph::READ_FRAMEBUFFER,
+		&LuaAPI::recordBindFramebufferTexture);
+	registerCFunction("everyFrame", &LuaAPI::everyFrame, FrameGraph::BARRIER, &LuaAPI::RecordedEveryFrame::record);
+	registerCFunction("addFramebuffer", &LuaAPI::addFramebuffer, FrameGraph::BARRIER, &LuaAPI::RecordedAddFramebuffer::record);
+	registerCFunction("renderModels", &LuaAPI::renderModels, FrameGraph::NONE, &LuaAPI::recordRenderModels);
+	registerCFunction("setUniform", &LuaAPI::setUniform, FrameGraph::NONE, &LuaAPI::RecordedSetUniform::record);
+
+	#define REGISTER_FUNCTION_EX(name, lua_name, flags) \
 		do {\
-			auto f = &LuaWrapper::wrapMethod<PipelineImpl, decltype(&PipelineImpl::name), &PipelineImpl::name>; \
-			registerCFunction(#name, f); \
+			using T = decltype(&PipelineImpl::name); \
+			auto f = &LuaWrapper::wrapMethod<PipelineImpl, T, &PipelineImpl::name>; \
+			registerCFunction(lua_name, f, flags, &LuaAPI::RecordedMethod<T, &PipelineImpl::name>::record); \
 		} while(false) \
 
+	#define REGISTER_FUNCTION(name) REGISTER_FUNCTION_EX(name, #name, FrameGraph::NONE)
+
 	REGISTER_FUNCTION(renderTextMeshes);
 	REGISTER_FUNCTION(render2D);
 	REGISTER_FUNCTION(rasterizeOccluders);
 	REGISTER_FUNCTION(debugOcclusionBuffer);
 	REGISTER_FUNCTION(drawQuad);
-	REGISTER_FUNCTION(getLayerMask);
+	REGISTER_FUNCTION_EX(getLayerMask, "getLayerMask", FrameGraph::QUERY);
 	REGISTER_FUNCTION(drawQuadEx);
 	REGISTER_FUNCTION(setPass);
-	REGISTER_FUNCTION(bindRenderbuffer);
+	REGISTER_FUNCTION_EX(bindRenderbuffer, "bindRenderbuffer", FrameGraph::BARRIER);
 	REGISTER_FUNCTION(bindTexture);
 	REGISTER_FUNCTION(bindEnvironmentMaps);
 	REGISTER_FUNCTION(applyCamera);
-	REGISTER_FUNCTION(getWidth);
-	REGISTER_FUNCTION(getHeight);
+	REGISTER_FUNCTION_EX(getWidth, "getWidth", FrameGraph::QUERY);
+	REGISTER_FUNCTION_EX(getHeight, "getHeight", FrameGraph::QUERY);
 
 	REGISTER_FUNCTION(disableBlending);
 	REGISTER_FUNCTION(enableAlphaWrite);
@@ -3591,39 +5380,42 @@ void Pipeline::registerLuaAPI(lua_State* L)
 	REGISTER_FUNCTION(disableDepthWrite);
 	REGISTER_FUNCTION(renderDebugShapes);
 	REGISTER_FUNCTION(renderParticles);
-	REGISTER_FUNCTION(executeCustomCommand);
-	REGISTER_FUNCTION(getFPS);
+	REGISTER_FUNCTION_EX(executeCustomCommand, "executeCustomCommand", FrameGraph::BARRIER);
+	REGISTER_FUNCTION_EX(getFPS, "getFPS", FrameGraph::VOLATILE);
 	REGISTER_FUNCTION(createUniform);
 	REGISTER_FUNCTION(createVec4ArrayUniform);
-	REGISTER_FUNCTION(hasScene);
-	REGISTER_FUNCTION(cameraExists);
+	REGISTER_FUNCTION_EX(hasScene, "hasScene", FrameGraph::QUERY);
+	REGISTER_FUNCTION_EX(cameraExists, "cameraExists", FrameGraph::QUERY);
 	REGISTER_FUNCTION(enableBlending);
 	REGISTER_FUNCTION(clear);
 	REGISTER_FUNCTION(renderPointLightLitGeometry);
-	REGISTER_FUNCTION(renderShadowmap);
-	REGISTER_FUNCTION(copyRenderbuffer);
+	REGISTER_FUNCTION_EX(renderShadowmap, "renderShadowmap", FrameGraph::ASYNC);
+	REGISTER_FUNCTION_EX(copyRenderbuffer, "copyRenderbuffer", FrameGraph::COPY_FRAMEBUFFER);
 	REGISTER_FUNCTION(setActiveGlobalLightUniforms);
 	REGISTER_FUNCTION(setStencil);
 	REGISTER_FUNCTION(setStencilRMask);
 	REGISTER_FUNCTION(setStencilRef);
 	REGISTER_FUNCTION(renderLightVolumes);
 	REGISTER_FUNCTION(renderDecalsVolumes);
-	REGISTER_FUNCTION(removeFramebuffer);
+	REGISTER_FUNCTION_EX(removeFramebuffer, "removeFramebuffer", FrameGraph::BARRIER);
 	REGISTER_FUNCTION(setMaterialDefine);
-	REGISTER_FUNCTION(saveRenderbuffer);
+	REGISTER_FUNCTION_EX(saveRenderbuffer, "saveRenderbuffer", FrameGraph::READ_FRAMEBUFFER);
+	REGISTER_FUNCTION(invalidateFrameGraph);
+	REGISTER_FUNCTION(setViewMode);
+	REGISTER_FUNCTION_EX(renderLocalLightsShadowmaps, "renderLocalLightsShadowmaps", FrameGraph::ASYNC | FrameGraph::WRITE_FRAMEBUFFER);
+	REGISTER_FUNCTION_EX(getRenderbufferPtr, "getRenderbuffer", FrameGraph::QUERY | FrameGraph::READ_FRAMEBUFFER);
 
 	#undef REGISTER_FUNCTION
+	#undef REGISTER_FUNCTION_EX
 
 	#define REGISTER_FUNCTION(name) \
-		registerCFunction(#name, LuaWrapper::wrap<decltype(&LuaAPI::name), LuaAPI::name>)
+		do {\
+			using T = decltype(&LuaAPI::name); \
+			registerCFunction(#name, LuaWrapper::wrap<T, LuaAPI::name>, FrameGraph::NONE, &LuaAPI::RecordedFunction<T, LuaAPI::name>::record); \
+		} while(false) \
 
 	REGISTER_FUNCTION(print);
 	REGISTER_FUNCTION(logError);
-	REGISTER_FUNCTION(getRenderbuffer);
-	REGISTER_FUNCTION(renderLocalLightsShadowmaps);
-	REGISTER_FUNCTION(setUniform);
-	REGISTER_FUNCTION(addFramebuffer);
-	REGISTER_FUNCTION(renderModels);
 
 	#undef REGISTER_FUNCTION
 
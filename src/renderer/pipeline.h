@@ -73,6 +73,9 @@ class MALMY_RENDERER_API Pipeline
 			int draw_call_count;
 			int instance_count;
 			int triangle_count;
+			int frame_graph_ops_count;
+			int elided_command_count;
+			bool shadow_cascade_cache_hit[4];
 		};
 
 		struct CustomCommandHandler
@@ -4,6 +4,7 @@
 #include "engine/blob.h"
 #include "engine/crc32.h"
 #include "engine/engine.h"
+#include "engine/flat_hash_map.h"
 #include "engine/fs/file_system.h"
 #include "engine/geometry.h"
 #include "engine/job_system.h"
@@ -16,6 +17,8 @@
 #include "engine/resource_manager.h"
 #include "engine/resource_manager_base.h"
 #include "engine/serializer.h"
+#include "engine/sparse_set.h"
+#include "engine/simd.h"
 #include "engine/project/project.h"
 #include "lua_script/lua_script_system.h"
 #include "renderer/culling_system.h"
@@ -30,6 +33,7 @@
 #include "renderer/renderer.h"
 #include "renderer/terrain.h"
 #include "renderer/texture.h"
+#include "renderer/texture_manager.h"
 #include <cfloat>
 #include <cmath>
 #include <algorithm>
@@ -187,6 +191,16 @@ struct BoneAttachment
 };
 
 
+// glyph quad in text mesh space, corners are x0y0, x1y0, x1y1, x0y1
+struct TextMeshGlyph
+{
+	float x[4];
+	float y[4];
+	Vec2 uv0;
+	Vec2 uv1;
+};
+
+
 struct TextMesh
 {
 	enum Flags : u32
@@ -194,9 +208,51 @@ struct TextMesh
 		CAMERA_ORIENTED = 1 << 0
 	};
 	
-	TextMesh(IAllocator& allocator) : text("", allocator) {}
+	TextMesh(IAllocator& allocator) : text("", allocator), glyphs(allocator) {}
 	~TextMesh() { setFontResource(nullptr); }
 
+	void setText(const char* value)
+	{
+		text = value;
+		is_layout_dirty = true;
+	}
+
+	// glyphs are cached until text, font or font atlas changes
+	void updateLayout(Font* font, u32 atlas_version)
+	{
+		if (!is_layout_dirty && layout_font == font && layout_atlas_version == atlas_version) return;
+
+		is_layout_dirty = false;
+		layout_font = font;
+		layout_atlas_version = atlas_version;
+		glyphs.clear();
+		radius = 0;
+
+		const char* str = text.c_str();
+		Vec2 text_size = font->CalcTextSizeA((float)m_font_size, FLT_MAX, 0, str);
+		float x = text_size.x * -0.5f;
+		float y = text_size.y * -0.5f;
+		for (int i = 0, n = text.length(); i < n; ++i)
+		{
+			const Font::Glyph* glyph = font->FindGlyph(str[i]);
+			if (!glyph) continue;
+
+			TextMeshGlyph& g = glyphs.emplace();
+			g.x[0] = g.x[3] = x + glyph->X0;
+			g.x[1] = g.x[2] = x + glyph->X1;
+			g.y[0] = g.y[1] = y + glyph->Y0;
+			g.y[2] = g.y[3] = y + glyph->Y1;
+			g.uv0 = { glyph->U0, glyph->V0 };
+			g.uv1 = { glyph->U1, glyph->V1 };
+			for (int j = 0; j < 4; ++j)
+			{
+				radius = Math::maximum(radius, sqrtf(g.x[j] * g.x[j] + g.y[j] * g.y[j]));
+			}
+
+			x += glyph->XAdvance;
+		}
+	}
+
 	void setFontResource(FontResource* res)
 	{
 		if (m_font_resource)
@@ -228,6 +284,7 @@ struct TextMesh
 	void setFontSize(int value)
 	{
 		m_font_size = value;
+		is_layout_dirty = true;
 		if (m_font_resource && m_font_resource->isReady())
 		{
 			if(m_font) m_font_resource->removeRef(*m_font);
@@ -242,6 +299,11 @@ struct TextMesh
 	string text;
 	u32 color = 0xff000000;
 	FlagSet<Flags, u32> m_flags;
+	Array<TextMeshGlyph> glyphs;
+	float radius = 0;
+	bool is_layout_dirty = true;
+	Font* layout_font = nullptr;
+	u32 layout_atlas_version = 0;
 
 private:
 	int m_font_size = 13;
@@ -282,8 +344,10 @@ public:
 
 	~RenderSceneImpl()
 	{
+		m_destroyed.invoke();
 		m_project.gameobjectTransformed().unbind<RenderSceneImpl, &RenderSceneImpl::onGameObjectMoved>(this);
 		m_project.gameobjectDestroyed().unbind<RenderSceneImpl, &RenderSceneImpl::onGameObjectDestroyed>(this);
+		m_renderer.getFontManager().onAtlasTextureChanged().unbind<RenderSceneImpl, &RenderSceneImpl::onFontAtlasChanged>(this);
 		CullingSystem::destroy(*m_culling_system);
 	}
 
@@ -913,7 +977,7 @@ public:
 
 	void setTextMeshText(GameObject gameobject, const char* text) override
 	{
-		m_text_meshes.get(gameobject)->text = text;
+		m_text_meshes.get(gameobject)->setText(text);
 	}
 
 
@@ -991,57 +1055,146 @@ public:
 	}
 
 
+	struct VisibleTextMesh
+	{
+		const TextMesh* text;
+		Vec3 origin;
+		Vec3 right;
+		Vec3 up;
+		int first_vertex;
+	};
+
+
+	static void fillTextMeshVertices(const VisibleTextMesh& visible, TextMeshVertex* out)
+	{
+		const float4 ox = f4Splat(visible.origin.x);
+		const float4 oy = f4Splat(visible.origin.y);
+		const float4 oz = f4Splat(visible.origin.z);
+		const float4 rx = f4Splat(visible.right.x);
+		const float4 ry = f4Splat(visible.right.y);
+		const float4 rz = f4Splat(visible.right.z);
+		const float4 ux = f4Splat(visible.up.x);
+		const float4 uy = f4Splat(visible.up.y);
+		const float4 uz = f4Splat(visible.up.z);
+		const u32 color = visible.text->color;
+
+		for (const TextMeshGlyph& glyph : visible.text->glyphs)
+		{
+			float4 gx = f4LoadUnaligned(glyph.x);
+			float4 gy = f4LoadUnaligned(glyph.y);
+			float4 corners[3];
+			corners[0] = f4Add(ox, f4Add(f4Mul(rx, gx), f4Mul(ux, gy)));
+			corners[1] = f4Add(oy, f4Add(f4Mul(ry, gx), f4Mul(uy, gy)));
+			corners[2] = f4Add(oz, f4Add(f4Mul(rz, gx), f4Mul(uz, gy)));
+			const float* c = (const float*)corners;
+
+			Vec3 x0y0(c[0], c[4], c[8]);
+			Vec3 x1y0(c[1], c[5], c[9]);
+			Vec3 x1y1(c[2], c[6], c[10]);
+			Vec3 x0y1(c[3], c[7], c[11]);
+
+			out[0] = { x0y0, color, { glyph.uv0.x, glyph.uv0.y } };
+			out[1] = { x1y0, color, { glyph.uv1.x, glyph.uv0.y } };
+			out[2] = { x1y1, color, { glyph.uv1.x, glyph.uv1.y } };
+
+			out[3] = { x0y0, color, { glyph.uv0.x, glyph.uv0.y } };
+			out[4] = { x1y1, color, { glyph.uv1.x, glyph.uv1.y } };
+			out[5] = { x0y1, color, { glyph.uv0.x, glyph.uv1.y } };
+			out += 6;
+		}
+	}
+
+
 	void getTextMeshesVertices(Array<TextMeshVertex>& vertices, GameObject camera) override
 	{
+		PROFILE_FUNCTION();
 		Matrix camera_mtx = m_project.getMatrix(camera);
 		Vec3 cam_right = camera_mtx.getXVector();
 		Vec3 cam_up = -camera_mtx.getYVector();
+		Frustum frustum = getCameraFrustum(camera);
+		Font* default_font = m_renderer.getFontManager().getDefaultFont();
+
+		Array<VisibleTextMesh>& visible = m_visible_text_meshes;
+		visible.clear();
+		int vertices_count = vertices.size();
 		for (int j = 0, nj = m_text_meshes.size(); j < nj; ++j)
 		{
 			TextMesh& text = *m_text_meshes.at(j);
 			Font* font = text.getFont();
-			if (!font) font = m_renderer.getFontManager().getDefaultFont();
+			if (!font) font = default_font;
+			text.updateLayout(font, m_font_atlas_version);
+			if (text.glyphs.empty()) continue;
+
 			GameObject gameobject = m_text_meshes.getKey(j);
-			const char* str = text.text.c_str();
-			Vec3 base = m_project.getPosition(gameobject);
-			Quat rot = m_project.getRotation(gameobject);
+			Vec3 origin = m_project.getPosition(gameobject);
 			float scale = m_project.getScale(gameobject);
-			Vec3 right = rot.rotate({ 1, 0, 0 }) * scale;
-			Vec3 up = rot.rotate({ 0, -1, 0 }) * scale;
+			if (!frustum.isSphereInside(origin, text.radius * scale)) continue;
+
+			VisibleTextMesh& v = visible.emplace();
+			v.text = &text;
+			v.origin = origin;
 			if (text.m_flags.isSet(TextMesh::CAMERA_ORIENTED))
 			{
-				right = cam_right * scale;
-				up = cam_up * scale;
+				v.right = cam_right * scale;
+				v.up = cam_up * scale;
 			}
-			u32 color = text.color;
-			Vec2 text_size = font->CalcTextSizeA((float)text.getFontSize(), FLT_MAX, 0, str);
-			base += right * text_size.x * -0.5f;
-			base += up * text_size.y * -0.5f;
-			for (int i = 0, n = text.text.length(); i < n; ++i)
+			else
 			{
-				const Font::Glyph* glyph = font->FindGlyph(str[i]);
-				if (!glyph) continue;
-
-				Vec3 x0y0 = base + right * glyph->X0 + up * glyph->Y0;
-				Vec3 x1y0 = base + right * glyph->X1 + up * glyph->Y0;
-				Vec3 x1y1 = base + right * glyph->X1 + up * glyph->Y1;
-				Vec3 x0y1 = base + right * glyph->X0 + up * glyph->Y1;
-
-				vertices.push({ x0y0, color, { glyph->U0, glyph->V0 } });
-				vertices.push({ x1y0, color, { glyph->U1, glyph->V0 } });
-				vertices.push({ x1y1, color, { glyph->U1, glyph->V1 } });
-
-				vertices.push({ x0y0, color, { glyph->U0, glyph->V0 } });
-				vertices.push({ x1y1, color, { glyph->U1, glyph->V1 } });
-				vertices.push({ x0y1, color, { glyph->U0, glyph->V1 } });
-				
-				base += right * glyph->XAdvance;
+				Quat rot = m_project.getRotation(gameobject);
+				v.right = rot.rotate({ 1, 0, 0 }) * scale;
+				v.up = rot.rotate({ 0, -1, 0 }) * scale;
 			}
+			v.first_vertex = vertices_count;
+			vertices_count += text.glyphs.size() * 6;
+		}
+		PROFILE_INT("visible text meshes", visible.size());
+		if (visible.empty()) return;
+
+		vertices.resize(vertices_count);
+		TextMeshVertex* out = &vertices[0];
+
+		static const int TEXT_MESHES_PER_JOB = 64;
+		if (visible.size() <= TEXT_MESHES_PER_JOB)
+		{
+			for (const VisibleTextMesh& v : visible)
+			{
+				fillTextMeshVertices(v, out + v.first_vertex);
+			}
+			return;
+		}
 
+		struct Job
+		{
+			const VisibleTextMesh* from;
+			const VisibleTextMesh* to;
+			TextMeshVertex* out;
+		} jobs[64];
+		int jobs_count = Math::minimum((visible.size() + TEXT_MESHES_PER_JOB - 1) / TEXT_MESHES_PER_JOB, (int)lengthOf(jobs));
+		int step = (visible.size() + jobs_count - 1) / jobs_count;
+		JobSystem::SignalHandle counter = JobSystem::INVALID_HANDLE;
+		for (int i = 0; i < jobs_count; ++i)
+		{
+			Job& job = jobs[i];
+			int from = Math::minimum(i * step, visible.size());
+			job.from = visible.begin() + from;
+			job.to = visible.begin() + Math::minimum(from + step, visible.size());
+			job.out = out;
+			JobSystem::run(&job, [](void* data) {
+				PROFILE_BLOCK("text mesh vertices");
+				Job* job = (Job*)data;
+				for (const VisibleTextMesh* v = job->from; v != job->to; ++v)
+				{
+					fillTextMeshVertices(*v, job->out + v->first_vertex);
+				}
+			}, &counter, JobSystem::INVALID_HANDLE, "text mesh vertices");
 		}
+		JobSystem::wait(counter);
 	}
 
 
+	void onFontAtlasChanged() { ++m_font_atlas_version; }
+
+
 	void setTextMeshFontPath(GameObject gameobject, const Path& path) override
 	{
 		TextMesh& text = *m_text_meshes.get(gameobject);
@@ -2814,6 +2967,9 @@ public:
 	Engine& getEngine() const override { return m_engine; }
 
 
+	DelegateList<void()>& destroyed() override { return m_destroyed; }
+
+
 	GameObject getTerrainGameObject(GameObject gameobject) override
 	{
 		return gameobject;
@@ -3062,6 +3218,16 @@ public:
 	void forceGrassUpdate(GameObject gameobject) override { m_terrains[gameobject]->forceGrassUpdate(); }
 
 
+	void updateTerrainTileCaches(const Vec3& lod_ref_point) override
+	{
+		PROFILE_FUNCTION();
+		for (auto* terrain : m_terrains)
+		{
+			terrain->updateTileCaches(lod_ref_point);
+		}
+	}
+
+
 	void getTerrainInfos(const Frustum& frustum, const Vec3& lod_ref_point, Array<TerrainInfo>& infos) override
 	{
 		PROFILE_FUNCTION();
@@ -3575,6 +3741,16 @@ public:
 	}
 
 
+	// projected size in pixels of a unit sphere at unit distance, 0 if textures are not streamed
+	float getCameraTextureSizeFactor(GameObject camera)
+	{
+		if (!camera.isValid() || !m_renderer.getTextureManager().isStreamingEnabled()) return 0;
+		const Camera& cam = m_cameras[camera];
+		if (cam.is_ortho) return 0;
+		return cam.screen_height / tanf(cam.fov * 0.5f);
+	}
+
+
 	Array<Array<MeshInstance>>& getModelInstanceInfos(const Frustum& frustum,
 		const Vec3& lod_ref_point,
 		GameObject camera,
@@ -3606,6 +3782,7 @@ public:
 				if (results[subresult_index].empty()) return;
 
 				float lod_multiplier = getCameraLODMultiplier(camera);
+				float texture_size_factor = getCameraTextureSizeFactor(camera);
 				Vec3 ref_point = lod_ref_point;
 				float final_lod_multiplier = m_lod_multiplier * lod_multiplier;
 				const GameObject* MALMY_RESTRICT raw_subresults = &results[subresult_index][0];
@@ -3614,14 +3791,22 @@ public:
 				{
 					const ModelInstance* MALMY_RESTRICT model_instance = &model_instances[raw_subresults[i].index];
 					float squared_distance = (model_instance->matrix.getTranslation() - ref_point).squaredLength();
+					const Model* MALMY_RESTRICT model = model_instance->model;
+					int texture_size = 0;
+					if (texture_size_factor > 0)
+					{
+						float radius = model->getBoundingRadius() * m_project.getScale(raw_subresults[i]);
+						float distance = Math::maximum(sqrtf(squared_distance), radius, 0.01f);
+						texture_size = int(texture_size_factor * radius / distance);
+					}
 					squared_distance *= final_lod_multiplier;
 
-					const Model* MALMY_RESTRICT model = model_instance->model;
 					LODMeshIndices lod = model->getLODMeshIndices(squared_distance);
 					for (int j = lod.from, c = lod.to; j <= c; ++j)
 					{
 						Mesh& mesh = model_instance->meshes[j];
 						if ((mesh.layer_mask & layer_mask) == 0) continue;
+						if (texture_size > 0) mesh.material->requestTextureSize(texture_size);
 						
 						MeshInstance& info = subinfos.emplace();
 						info.owner = raw_subresults[i];
@@ -3635,14 +3820,16 @@ public:
 					MeshInstance* begin = &subinfos[0];
 					MeshInstance* end = begin + subinfos.size();
 
+					// material first, so consecutive draws can reuse material state, see Pipeline
 					auto cmp = [](const MeshInstance& a, const MeshInstance& b) -> bool {
+						if (a.mesh->material != b.mesh->material) return a.mesh->material < b.mesh->material;
 						if (a.mesh != b.mesh) return a.mesh < b.mesh;
 						return (a.depth < b.depth);
 					};
 					std::sort(begin, end, cmp);
 				}
 			};
-			JobSystem::run(&jobs[subresult_index], [](void* user_ptr) { ((LambdaStorage<64>*)user_ptr)->invoke(); }, &counter, JobSystem::INVALID_HANDLE);
+			JobSystem::run(&jobs[subresult_index], [](void* user_ptr) { ((LambdaStorage<64>*)user_ptr)->invoke(); }, &counter, JobSystem::INVALID_HANDLE, "mesh infos");
 		}
 		JobSystem::wait(counter);
 
@@ -5211,12 +5398,12 @@ public:
 	}
 
 
-	const AssociativeArray<GameObject, ParticleEmitter*>& getParticleEmitters() const override
+	const SparseSet<GameObject, ParticleEmitter*>& getParticleEmitters() const override
 	{
 		return m_particle_emitters;
 	}
 
-	const AssociativeArray<GameObject, ScriptedParticleEmitter*>& getScriptedParticleEmitters() const override
+	const SparseSet<GameObject, ScriptedParticleEmitter*>& getScriptedParticleEmitters() const override
 	{
 		return m_scripted_particle_emitters;
 	}
@@ -5224,25 +5411,26 @@ public:
 private:
 	IAllocator& m_allocator;
 	Project& m_project;
+	DelegateList<void()> m_destroyed;
 	Renderer& m_renderer;
 	Engine& m_engine;
 	CullingSystem* m_culling_system;
 
 	Array<Array<GameObject>> m_light_influenced_geometry;
 	GameObject m_active_global_light_gameobject;
-	HashMap<GameObject, int> m_point_lights_map;
+	FlatHashMap<GameObject, int> m_point_lights_map;
 
-	AssociativeArray<GameObject, Decal> m_decals;
+	SparseSet<GameObject, Decal> m_decals;
 	Array<ModelInstance> m_model_instances;
-	HashMap<GameObject, GlobalLight> m_global_lights;
+	FlatHashMap<GameObject, GlobalLight> m_global_lights;
 	Array<PointLight> m_point_lights;
-	HashMap<GameObject, Camera> m_cameras;
-	AssociativeArray<GameObject, TextMesh*> m_text_meshes;
-	AssociativeArray<GameObject, BoneAttachment> m_bone_attachments;
-	AssociativeArray<GameObject, EnvironmentProbe> m_environment_probes;
-	HashMap<GameObject, Terrain*> m_terrains;
-	AssociativeArray<GameObject, ParticleEmitter*> m_particle_emitters;
-	AssociativeArray<GameObject, ScriptedParticleEmitter*> m_scripted_particle_emitters;
+	FlatHashMap<GameObject, Camera> m_cameras;
+	SparseSet<GameObject, TextMesh*> m_text_meshes;
+	SparseSet<GameObject, BoneAttachment> m_bone_attachments;
+	SparseSet<GameObject, EnvironmentProbe> m_environment_probes;
+	FlatHashMap<GameObject, Terrain*> m_terrains;
+	SparseSet<GameObject, ParticleEmitter*> m_particle_emitters;
+	SparseSet<GameObject, ScriptedParticleEmitter*> m_scripted_particle_emitters;
 
 	Array<DebugTriangle> m_debug_triangles;
 	Array<DebugLine> m_debug_lines;
@@ -5253,6 +5441,8 @@ private:
 	float m_time;
 	float m_lod_multiplier;
 	bool m_is_updating_attachments;
+	u32 m_font_atlas_version;
+	Array<VisibleTextMesh> m_visible_text_meshes;
 	bool m_is_grass_enabled;
 	bool m_is_game_running;
 
@@ -5334,9 +5524,13 @@ RenderSceneImpl::RenderSceneImpl(Renderer& renderer,
 	, m_lod_multiplier(1.0f)
 	, m_time(0)
 	, m_is_updating_attachments(false)
+	, m_font_atlas_version(0)
+	, m_visible_text_meshes(m_allocator)
+	, m_destroyed(m_allocator)
 {
 	m_project.gameobjectTransformed().bind<RenderSceneImpl, &RenderSceneImpl::onGameObjectMoved>(this);
 	m_project.gameobjectDestroyed().bind<RenderSceneImpl, &RenderSceneImpl::onGameObjectDestroyed>(this);
+	m_renderer.getFontManager().onAtlasTextureChanged().bind<RenderSceneImpl, &RenderSceneImpl::onFontAtlasChanged>(this);
 	m_culling_system = CullingSystem::create(m_allocator);
 	m_model_instances.reserve(5000);
 
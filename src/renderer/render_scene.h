@@ -30,7 +30,7 @@ class Terrain;
 class Texture;
 class Project;
 template <typename T> class Array;
-template <typename T, typename T2> class AssociativeArray;
+template <typename T, typename T2> class SparseSet;
 template <typename T> class DelegateList;
 
 
@@ -155,6 +155,8 @@ public:
 	virtual Frustum getCameraFrustum(GameObject gameobject, const Vec2& a, const Vec2& b) const = 0;
 	virtual float getTime() const = 0;
 	virtual Engine& getEngine() const = 0;
+	// invoked before the scene is destroyed, its project is still alive then
+	virtual DelegateList<void()>& destroyed() = 0;
 	virtual IAllocator& getAllocator() = 0;
 
 	virtual Pose* lockPose(GameObject gameobject) = 0;
@@ -249,12 +251,12 @@ public:
 
 	virtual void setScriptedParticleEmitterMaterialPath(GameObject gameobject, const Path& path) = 0;
 	virtual Path getScriptedParticleEmitterMaterialPath(GameObject gameobject) = 0;
-	virtual const AssociativeArray<GameObject, class ScriptedParticleEmitter*>& getScriptedParticleEmitters() const = 0;
+	virtual const SparseSet<GameObject, class ScriptedParticleEmitter*>& getScriptedParticleEmitters() const = 0;
 
 	virtual class ParticleEmitter* getParticleEmitter(GameObject gameobject) = 0;
 	virtual void resetParticleEmitter(GameObject gameobject) = 0;
 	virtual void updateEmitter(GameObject gameobject, float time_delta) = 0;
-	virtual const AssociativeArray<GameObject, class ParticleEmitter*>& getParticleEmitters() const = 0;
+	virtual const SparseSet<GameObject, class ParticleEmitter*>& getParticleEmitters() const = 0;
 	virtual const Vec2* getParticleEmitterAlpha(GameObject gameobject) = 0;
 	virtual int getParticleEmitterAlphaCount(GameObject gameobject) = 0;
 	virtual const Vec2* getParticleEmitterSize(GameObject gameobject) = 0;
@@ -335,6 +337,7 @@ public:
 		GameObject gameobject,
 		Array<GrassInfo>& infos) = 0;
 	virtual void forceGrassUpdate(GameObject gameobject) = 0;
+	virtual void updateTerrainTileCaches(const Vec3& lod_ref_point) = 0;
 	virtual void getTerrainInfos(const Frustum& frustum, const Vec3& lod_ref_point, Array<TerrainInfo>& infos) = 0;
 	virtual float getTerrainHeightAt(GameObject gameobject, float x, float z) = 0;
 	virtual Vec3 getTerrainNormalAt(GameObject gameobject, float x, float z) = 0;
@@ -443,7 +443,8 @@ struct RendererImpl MALMY_FINAL : public Renderer
 		) override
 		{
 			setThreadName();
-			Profiler::beginBlock("bgfx_dynamic");
+			// _name is in a buffer bgfx reuses
+			Profiler::beginBlock(Profiler::internName(_name));
 		}
 
 		void profilerBeginLiteral(
@@ -503,17 +504,32 @@ struct RendererImpl MALMY_FINAL : public Renderer
 		getCommandLine(cmd_line, lengthOf(cmd_line));
 		CommandLineParser cmd_line_parser(cmd_line);
 		m_vsync = true;
+		bool texture_streaming = false;
+		u32 texture_budget_mb = 0;
 		while (cmd_line_parser.next())
 		{
 			if (cmd_line_parser.currentEquals("-opengl"))
 			{
 				renderer_type = bgfx::RendererType::OpenGL;
-				break;
+			}
+			else if (cmd_line_parser.currentEquals("-noop_renderer"))
+			{
+				renderer_type = bgfx::RendererType::Noop;
 			}
 			else if (cmd_line_parser.currentEquals("-no_vsync"))
 			{
 				m_vsync = false;
-				break;
+			}
+			else if (cmd_line_parser.currentEquals("-texture_streaming"))
+			{
+				texture_streaming = true;
+			}
+			else if (cmd_line_parser.currentEquals("-texture_budget"))
+			{
+				if (!cmd_line_parser.next()) break;
+				char tmp[32];
+				cmd_line_parser.getCurrent(tmp, lengthOf(tmp));
+				fromCString(tmp, lengthOf(tmp), &texture_budget_mb);
 			}
 		}
 
@@ -529,6 +545,8 @@ struct RendererImpl MALMY_FINAL : public Renderer
 
 		ResourceManager& manager = engine.getResourceManager();
 		m_texture_manager.create(Texture::TYPE, manager);
+		m_texture_manager.setStreamingEnabled(texture_streaming);
+		if (texture_budget_mb > 0) m_texture_manager.setStreamingBudget(u64(texture_budget_mb) * 1024 * 1024);
 		m_model_manager.create(Model::TYPE, manager);
 		m_material_manager.create(Material::TYPE, manager);
 		m_shader_manager.create(Shader::TYPE, manager);
@@ -553,6 +571,10 @@ struct RendererImpl MALMY_FINAL : public Renderer
 			.add(bgfx::Attrib::Color0, 4, bgfx::AttribType::Uint8, true)
 			.end();
 
+		m_draw_defines_mask = (1 << getShaderDefineIdx("INSTANCED"))
+			| (1 << getShaderDefineIdx("HAS_SHADOWMAP"))
+			| (1 << getShaderDefineIdx("LOCAL_SPACE"))
+			| (1 << getShaderDefineIdx("SUBIMAGE"));
 		m_default_shader = static_cast<Shader*>(m_shader_manager.load(Path("pipelines/common/default.shd")));
 		RenderScene::registerLuaAPI(m_engine.getState());
 		m_layers.emplace("default");
@@ -642,6 +664,7 @@ struct RendererImpl MALMY_FINAL : public Renderer
 	const char* getName() const override { return "renderer"; }
 	Engine& getEngine() override { return m_engine; }
 	int getShaderDefinesCount() const override { return m_shader_defines.size(); }
+	u32 getDrawDefinesMask() const override { return m_draw_defines_mask; }
 	const char* getShaderDefine(int define_idx) override { return m_shader_defines[define_idx]; }
 	const char* getPassName(int idx) override { return m_passes[idx]; }
 	const bgfx::UniformHandle& getMaterialColorUniform() const override { return m_mat_color_uniform; }
@@ -705,6 +728,7 @@ struct RendererImpl MALMY_FINAL : public Renderer
 			}
 			m_encoders.clear();
 		}
+		if (m_texture_manager.isStreamingEnabled()) m_texture_manager.updateStreaming();
 		bgfx::frame(capture);
 		m_view_counter = 0;
 	}
@@ -727,6 +751,7 @@ struct RendererImpl MALMY_FINAL : public Renderer
 	ShaderBinaryManager m_shader_binary_manager;
 	ModelManager m_model_manager;
 	u32 m_current_pass_hash;
+	u32 m_draw_defines_mask;
 	int m_view_counter;
 	bool m_vsync;
 	Shader* m_default_shader;
@@ -46,6 +46,8 @@ class MALMY_RENDERER_API Renderer : public IPlugin
 		virtual u8 getShaderDefineIdx(const char* define) = 0;
 		virtual const char* getShaderDefine(int define_idx) = 0;
 		virtual int getShaderDefinesCount() const = 0;
+		// defines pipelines select per draw call, see Material::getShaderInstance
+		virtual u32 getDrawDefinesMask() const = 0;
 		virtual const bgfx::VertexDecl& getBasicVertexDecl() const = 0;
 		virtual const bgfx::VertexDecl& getBasic2DVertexDecl() const = 0;
 		virtual FontManager& getFontManager() = 0;
@@ -48,17 +48,23 @@ bool Shader::hasDefine(u8 define_idx) const
 
 ShaderInstance& Shader::getInstance(u32 mask)
 {
-	mask = mask & m_all_defines_mask;
-	for (int i = 0; i < m_instances.size(); ++i)
+	// instances are generated in dense mask order, see generateInstances
+	u32 dense = 0;
+	for (int i = 0; i < m_combinations.define_count; ++i)
 	{
-		if (m_instances[i].define_mask == mask)
-		{
-			return m_instances[i];
-		}
+		if (mask & (1 << m_combinations.defines[i])) dense |= 1 << i;
 	}
+	return m_instances[dense];
+}
 
-	g_log_error.log("Renderer") << "Unknown shader combination requested: " << mask;
-	return m_instances[0];
+
+void Shader::createPrograms(u32 mask, u32 variable_mask)
+{
+	u32 fixed_defines = mask & ~variable_mask & m_all_defines_mask;
+	for (ShaderInstance& instance : m_instances)
+	{
+		if ((instance.define_mask & ~variable_mask) == fixed_defines) instance.createPrograms();
+	}
 }
 
 
@@ -463,28 +469,20 @@ void Shader::unload()
 }
 
 
-bgfx::ProgramHandle ShaderInstance::getProgramHandle(int pass_idx)
+void ShaderInstance::createPrograms()
 {
-	if (!bgfx::isValid(program_handles[pass_idx]))
+	Renderer& renderer = shader.getRenderer();
+	for (int i = 0; i < shader.m_combinations.pass_count; ++i)
 	{
-		for (int i = 0; i < lengthOf(shader.m_combinations.passes); ++i)
-		{
-			auto& pass = shader.m_combinations.passes[i];
-			int global_idx = shader.getRenderer().getPassIdx(pass);
-			if (global_idx == pass_idx)
-			{
-				int binary_index = i * 2;
-				if (!binaries[binary_index] || !binaries[binary_index + 1]) break;
-				auto vs_handle = binaries[binary_index]->getHandle();
-				auto fs_handle = binaries[binary_index + 1]->getHandle();
-				auto program = bgfx::createProgram(vs_handle, fs_handle);
-				program_handles[global_idx] = program;
-				break;
-			}
-		}
-	}
+		int global_idx = renderer.getPassIdx(shader.m_combinations.passes[i]);
+		if (bgfx::isValid(program_handles[global_idx])) continue;
 
-	return program_handles[pass_idx];
+		int binary_index = i * 2;
+		if (!binaries[binary_index] || !binaries[binary_index + 1]) continue;
+		auto vs_handle = binaries[binary_index]->getHandle();
+		auto fs_handle = binaries[binary_index + 1]->getHandle();
+		program_handles[global_idx] = bgfx::createProgram(vs_handle, fs_handle);
+	}
 }
 
 
@@ -508,6 +506,13 @@ ShaderInstance::~ShaderInstance()
 }
 
 
+void Shader::onBeforeReady()
+{
+	// programs used without a material, e.g. debug lines or 2D
+	createPrograms(0, 0);
+}
+
+
 void Shader::onBeforeEmpty()
 {
 	for (ShaderInstance& inst : m_instances)
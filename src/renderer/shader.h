@@ -35,7 +35,9 @@ struct ShaderInstance
 		}
 	}
 	~ShaderInstance();
-	bgfx::ProgramHandle getProgramHandle(int pass_idx);
+	// thread safe, programs are created by createPrograms
+	bgfx::ProgramHandle getProgramHandle(int pass_idx) const { return program_handles[pass_idx]; }
+	void createPrograms();
 
 	bgfx::ProgramHandle program_handles[32];
 	ShaderBinary* binaries[64];
@@ -136,7 +138,10 @@ public:
 	ResourceType getType() const override { return TYPE; }
 
 	bool hasDefine(u8 define_idx) const;
+	// thread safe
 	ShaderInstance& getInstance(u32 mask);
+	// creates programs of instances whose defines match mask outside of variable_mask, main thread only
+	void createPrograms(u32 mask, u32 variable_mask);
 	Renderer& getRenderer();
 
 	static bool getShaderCombinations(const char* shd_path,
@@ -144,6 +149,7 @@ public:
 		const char* shader_content,
 		ShaderCombinations* output);
 
+	void onBeforeReady() override;
 	void onBeforeEmpty() override;
 
 	IAllocator& m_allocator;
@@ -14,6 +14,7 @@
 #include "renderer/model.h"
 #include "renderer/render_scene.h"
 #include "renderer/shader.h"
+#include "renderer/terrain_tiles.h"
 #include "renderer/texture.h"
 #include "engine/project/project.h"
 #include <cfloat>
@@ -179,6 +180,8 @@ Terrain::Terrain(Renderer& renderer, GameObject gameobject, RenderScene& scene,
 	, m_detail_texture(nullptr)
 	, m_heightmap(nullptr)
 	, m_splatmap(nullptr)
+	, m_heightmap_tiles(nullptr)
+	, m_splatmap_tiles(nullptr)
 	, m_width(0)
 	, m_height(0)
 	, m_layer_mask(1)
@@ -207,6 +210,7 @@ Terrain::GrassType::~GrassType()
 Terrain::~Terrain()
 {
 	setMaterial(nullptr);
+	destroyTileCaches();
 	MALMY_DELETE(m_allocator, m_mesh);
 	MALMY_DELETE(m_allocator, m_root);
 	for (int j = 0; j < m_grass_quads.size(); ++j)
@@ -307,6 +311,12 @@ AABB Terrain::getAABB() const
 {
 	Vec3 min(0, 0, 0);
 	Vec3 max(m_width * m_scale.x, 0, m_height * m_scale.z);
+	if (m_heightmap_tiles)
+	{
+		// stored in the tiles file, pages do not have to be resident
+		max.y = m_scale.y * m_heightmap_tiles->getMaxTexel() / 65535.0f;
+		return AABB(min, max);
+	}
 	for (int j = 0; j < m_height; ++j)
 	{
 		for (int i = 0; i < m_width; ++i)
@@ -381,6 +391,7 @@ void Terrain::generateGrassTypeQuad(GrassPatch& patch, const RigidTransform& ter
 	ASSERT(quad_pos.y >= 0);
 	ASSERT(!m_splatmap->data.empty());
 	ASSERT(m_splatmap->bytes_per_pixel == 4);
+	ASSERT(m_splatmap_tiles || m_splatmap->tile_size == 0);
 
 	PROFILE_FUNCTION();
 	
@@ -395,7 +406,6 @@ void Terrain::generateGrassTypeQuad(GrassPatch& patch, const RigidTransform& ter
 	struct { float x, y; void* type; } hashed_patch = { quad_pos.x, quad_pos.y, patch.m_type };
 	const u32 hash = crc32(&hashed_patch, sizeof(hashed_patch));
 	Math::seedRandom(hash);
-	const int max_idx = splat_map->width * splat_map->height;
 
 	const Vec2 step = quad_size * (1 / (float)patch.m_type->m_density);
 	for (float dy = 0; dy < quad_size.y; dy += step.y)
@@ -407,10 +417,11 @@ void Terrain::generateGrassTypeQuad(GrassPatch& patch, const RigidTransform& ter
 				(dy + quad_pos.y) / m_height * splat_map->height
 			);
 
-			int tx = int(sm_pos.x) + int(sm_pos.y) * splat_map->width;
-			tx = Math::clamp(tx, 0, max_idx - 1);
-
-			const u32 pixel_value = ((u32*)&splat_map->data[0])[tx];
+			const int sx = Math::clamp(int(sm_pos.x), 0, splat_map->width - 1);
+			const int sy = Math::clamp(int(sm_pos.y), 0, splat_map->height - 1);
+			const u32 pixel_value = m_splatmap_tiles
+				? m_splatmap_tiles->getTexel(sx, sy)
+				: ((u32*)&splat_map->data[0])[sx + sy * splat_map->width];
 
 			const int ground_mask = (pixel_value >> 16) & 0xffff;
 			if ((ground_mask & (1 << patch.m_type->m_idx)) == 0) continue;
@@ -595,6 +606,7 @@ void Terrain::setMaterial(Material* material)
 		m_material = material;
 		m_splatmap = nullptr;
 		m_heightmap = nullptr;
+		destroyTileCaches();
 		if (m_mesh && m_material)
 		{
 			m_mesh->material = m_material;
@@ -659,6 +671,30 @@ void Terrain::serialize(OutputBlob& serializer)
 }
 
 
+Vec3 Terrain::getLocalLodRefPoint(const Matrix& inv_matrix, const Vec3& lod_ref_point) const
+{
+	Vec3 local_lod_ref_point = inv_matrix.transformPoint(lod_ref_point);
+	local_lod_ref_point.x /= m_scale.x;
+	local_lod_ref_point.z /= m_scale.z;
+	return local_lod_ref_point;
+}
+
+
+void Terrain::updateTileCaches(const Vec3& lod_ref_point)
+{
+	if (!m_heightmap_tiles && !m_splatmap_tiles) return;
+
+	Matrix inv_matrix = m_scene.getProject().getMatrix(m_gameobject);
+	inv_matrix.fastInverse();
+	const Vec3 local_lod_ref_point = getLocalLodRefPoint(inv_matrix, lod_ref_point);
+
+	int loaded_pages = 0;
+	if (m_heightmap_tiles) loaded_pages += m_heightmap_tiles->update(local_lod_ref_point);
+	if (m_splatmap_tiles) loaded_pages += m_splatmap_tiles->update(local_lod_ref_point);
+	if (loaded_pages > 0) forceGrassUpdate();
+}
+
+
 void Terrain::getInfos(Array<TerrainInfo>& infos, const Frustum& frustum, const Vec3& lod_ref_point)
 {
 	if (!m_root) return;
@@ -667,10 +703,7 @@ void Terrain::getInfos(Array<TerrainInfo>& infos, const Frustum& frustum, const
 	Matrix matrix = m_scene.getProject().getMatrix(m_gameobject);
 	Matrix inv_matrix = matrix;
 	inv_matrix.fastInverse();
-	
-	Vec3 local_lod_ref_point = inv_matrix.transformPoint(lod_ref_point);
-	local_lod_ref_point.x /= m_scale.x;
-	local_lod_ref_point.z /= m_scale.z;
+	const Vec3 local_lod_ref_point = getLocalLodRefPoint(inv_matrix, lod_ref_point);
 
 	Frustum rel_frustum = frustum;
 	rel_frustum.transform(inv_matrix);
@@ -736,6 +769,7 @@ float Terrain::getHeight(int x, int z) const
 
 	Texture* t = m_heightmap;
 	ASSERT(t->bytes_per_pixel == 2);
+	if (m_heightmap_tiles) return m_scale.y * DIV64K * m_heightmap_tiles->getTexel(x, z);
 	int idx = Math::clamp(x, 0, m_width) + Math::clamp(z, 0, m_height) * m_width;
 	return m_scale.y * DIV64K * ((u16*)t->getData())[idx];
 }
@@ -756,6 +790,11 @@ void Terrain::setHeight(int x, int z, float h)
 
 	Texture* t = m_heightmap;
 	ASSERT(t->bytes_per_pixel == 2);
+	if (m_heightmap_tiles)
+	{
+		m_heightmap_tiles->setTexel(x, z, (u16)(h * (65535.0f / m_scale.y)));
+		return;
+	}
 	int idx = Math::clamp(x, 0, m_width) + Math::clamp(z, 0, m_height) * m_width;
 	((u16*)t->getData())[idx] = (u16)(h * (65535.0f / m_scale.y));
 }
@@ -943,9 +982,19 @@ TerrainQuad* Terrain::generateQuadTree(float size)
 	return root;
 }
 
+void Terrain::destroyTileCaches()
+{
+	MALMY_DELETE(m_allocator, m_heightmap_tiles);
+	MALMY_DELETE(m_allocator, m_splatmap_tiles);
+	m_heightmap_tiles = nullptr;
+	m_splatmap_tiles = nullptr;
+}
+
+
 void Terrain::onMaterialLoaded(Resource::State, Resource::State new_state, Resource&)
 {
 	PROFILE_FUNCTION();
+	destroyTileCaches();
 	if (new_state == Resource::State::READY)
 	{
 		m_detail_texture = m_material->getTextureByUniform(TEX_COLOR_UNIFORM);
@@ -976,6 +1025,15 @@ void Terrain::onMaterialLoaded(Resource::State, Resource::State new_state, Resou
 			MALMY_DELETE(m_allocator, m_root);
 			if (m_heightmap && m_splatmap)
 			{
+				FS::FileSystem& fs = m_scene.getEngine().getFileSystem();
+				if (m_heightmap->tile_size > 0)
+				{
+					m_heightmap_tiles = MALMY_NEW(m_allocator, TerrainTileCache)(*m_heightmap, fs, m_allocator);
+				}
+				if (m_splatmap->tile_size > 0)
+				{
+					m_splatmap_tiles = MALMY_NEW(m_allocator, TerrainTileCache)(*m_splatmap, fs, m_allocator);
+				}
 				m_width = m_heightmap->width;
 				m_height = m_heightmap->height;
 				m_root = generateQuadTree((float)m_width);
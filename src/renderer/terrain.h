@@ -26,6 +26,7 @@ class Renderer;
 class RenderScene;
 struct TerrainQuad;
 struct TerrainInfo;
+class TerrainTileCache;
 class Texture;
 class Project;
 
@@ -117,6 +118,8 @@ class Terrain
 		void setGrassTypeRotationMode(int index, GrassType::RotationMode mode);
 		void setMaterial(Material* material);
 
+		// main thread only, must not run concurrently with getInfos or getGrassInfos
+		void updateTileCaches(const Vec3& lod_ref_point);
 		void getInfos(Array<TerrainInfo>& infos, const Frustum& frustum, const Vec3& lod_ref_point);
 		void getGrassInfos(const Frustum& frustum, Array<GrassInfo>& infos, GameObject camera);
 
@@ -134,6 +137,8 @@ class Terrain
 		void updateGrass(GameObject camera);
 		void generateGrassTypeQuad(GrassPatch& patch, const RigidTransform& terrain_tr, const Vec2& quad_pos_hm_space);
 		void generateGeometry();
+		void destroyTileCaches();
+		Vec3 getLocalLodRefPoint(const Matrix& inv_matrix, const Vec3& lod_ref_point) const;
 		void onMaterialLoaded(Resource::State, Resource::State new_state, Resource&);
 		void grassLoaded(Resource::State, Resource::State, Resource&);
 
@@ -150,6 +155,8 @@ class Terrain
 		Texture* m_heightmap;
 		Texture* m_splatmap;
 		Texture* m_detail_texture;
+		TerrainTileCache* m_heightmap_tiles;
+		TerrainTileCache* m_splatmap_tiles;
 		RenderScene& m_scene;
 		Array<GrassType> m_grass_types;
 		AssociativeArray<GameObject, Array<GrassQuad*> > m_grass_quads;
@@ -0,0 +1,528 @@
+#include "terrain_tiles.h"
+#include "engine/fs/file_system.h"
+#include "engine/log.h"
+#include "engine/math_utils.h"
+#include "engine/path.h"
+#include "engine/path_utils.h"
+#include "engine/profiler.h"
+#include "engine/string.h"
+#include "renderer/texture.h"
+#include <bgfx/bgfx.h>
+
+
+namespace Malmy
+{
+
+
+static const int PAGE_WINDOW = 1;
+static const int MAX_UPLOADED_TILES_PER_UPDATE = 16;
+static const i8 NOT_UPLOADED = 0x7f;
+static const u32 FIRST_RETRY_DELAY_FRAMES = 60;
+static const u32 MAX_RETRY_DELAY_FRAMES = 60 * 60;
+
+
+TerrainTileCache::TerrainTileCache(Texture& texture, FS::FileSystem& fs, IAllocator& allocator)
+	: m_allocator(allocator)
+	, m_file_system(fs)
+	, m_texture(texture)
+	, m_pages(allocator)
+	, m_uploads(allocator)
+	, m_uploaded_mip(allocator)
+	, m_requested_keys(allocator)
+	, m_requested_keys_mutex(false)
+	, m_max_resident_pages(DEFAULT_MAX_RESIDENT_PAGES)
+	, m_pending_count(0)
+	, m_loaded_finest_count(0)
+	, m_background_fill(0)
+	, m_max_texel(texture.tile_max_texel)
+	, m_frame(0)
+{
+	ASSERT(texture.tile_size > 0);
+	m_tiles_x = (texture.width + texture.tile_size - 1) / texture.tile_size;
+	m_tiles_y = (texture.height + texture.tile_size - 1) / texture.tile_size;
+	m_uploaded_mip.resize(m_tiles_x * m_tiles_y);
+	for (i8& mip : m_uploaded_mip) mip = NOT_UPLOADED;
+}
+
+
+TerrainTileCache::~TerrainTileCache()
+{
+	for (Page* page : m_pages)
+	{
+		if (page->async != FS::FileSystem::INVALID_ASYNC) m_file_system.cancelAsync(page->async);
+		MALMY_DELETE(m_allocator, page);
+	}
+}
+
+
+void TerrainTileCache::getLevelSize(const Texture& texture, int mip, int* w, int* h)
+{
+	*w = Math::maximum(1, texture.width >> mip);
+	*h = Math::maximum(1, texture.height >> mip);
+}
+
+
+void TerrainTileCache::getPagePath(char* out, int max_size, const char* tiles_path, int mip, int x, int y)
+{
+	PathUtils::FileInfo info(tiles_path);
+	StaticString<MAX_PATH_LENGTH> tmp(info.m_dir, info.m_basename, "_tiles/", mip, "_", x, "_", y, ".tile");
+	copyString(out, max_size, tmp);
+}
+
+
+u32 TerrainTileCache::readTexel(const u8* data, int stride, int x, int y) const
+{
+	if (m_texture.bytes_per_pixel == 2) return ((const u16*)data)[x + y * stride];
+	return ((const u32*)data)[x + y * stride];
+}
+
+
+TerrainTileCache::Page* TerrainTileCache::getResidentPage(int mip, int x, int y)
+{
+	auto iter = m_pages.find(getPageKey(mip, x, y));
+	if (!iter.isValid() || !iter.value()->is_loaded) return nullptr;
+	return iter.value();
+}
+
+
+void TerrainTileCache::requestPage(int mip, int x, int y)
+{
+	const u32 key = getPageKey(mip, x, y);
+	auto iter = m_pages.find(key);
+	if (iter.isValid())
+	{
+		Page* page = iter.value();
+		page->last_used = m_frame;
+		const bool is_failed = !page->is_loaded && page->async == FS::FileSystem::INVALID_ASYNC;
+		if (is_failed && m_frame >= page->retry_frame) loadPage(*page);
+		return;
+	}
+
+	Page* page = MALMY_NEW(m_allocator, Page)(*this, m_allocator);
+	page->key = key;
+	page->last_used = m_frame;
+	page->retry_frame = 0;
+	page->failures = 0;
+	page->is_loaded = false;
+	page->is_dirty = false;
+	if (!loadPage(*page))
+	{
+		MALMY_DELETE(m_allocator, page);
+		return;
+	}
+	m_pages.insert(key, page);
+}
+
+
+bool TerrainTileCache::loadPage(Page& page)
+{
+	const int mip = int(page.key >> 28);
+	const int x = int(page.key & 0x3fff);
+	const int y = int((page.key >> 14) & 0x3fff);
+	char path[MAX_PATH_LENGTH];
+	getPagePath(path, lengthOf(path), m_texture.getPath().c_str(), mip, x, y);
+	FS::ReadCallback cb;
+	cb.bind<Page, &Page::onLoaded>(&page);
+	page.async = m_file_system.openAsync(m_file_system.getDefaultDevice(), Path(path), FS::Mode::OPEN_AND_READ, cb);
+	if (page.async == FS::FileSystem::INVALID_ASYNC) return false;
+	++m_pending_count;
+	return true;
+}
+
+
+void TerrainTileCache::Page::onLoaded(FS::IFile& file, bool success)
+{
+	async = FS::FileSystem::INVALID_ASYNC;
+	--cache.m_pending_count;
+	const Texture& texture = cache.m_texture;
+	const size_t expected_size = size_t(texture.tile_size * texture.tile_size * texture.bytes_per_pixel);
+	bool is_valid = success && file.size() == expected_size;
+	if (is_valid)
+	{
+		data.resize((int)expected_size);
+		is_valid = file.read(&data[0], expected_size);
+	}
+	if (!is_valid)
+	{
+		g_log_error.log("Renderer") << "Could not load terrain page " << key << " of " << texture.getPath();
+		const u32 delay = Math::minimum(FIRST_RETRY_DELAY_FRAMES << Math::minimum(failures, 16U), MAX_RETRY_DELAY_FRAMES);
+		retry_frame = cache.m_frame + delay;
+		++failures;
+		data.clear();
+		return;
+	}
+	failures = 0;
+	is_loaded = true;
+	cache.onPageLoaded(*this);
+}
+
+
+void TerrainTileCache::onPageLoaded(Page& page)
+{
+	const int mip = int(page.key >> 28);
+	const int x = int(page.key & 0x3fff);
+	const int y = int((page.key >> 14) & 0x3fff);
+	if (mip == 0) ++m_loaded_finest_count;
+	queueUpload(mip, x, y);
+}
+
+
+void TerrainTileCache::queueUpload(int mip, int page_x, int page_y)
+{
+	const int from_x = page_x << mip;
+	const int from_y = page_y << mip;
+	const int to_x = Math::minimum(m_tiles_x, (page_x + 1) << mip);
+	const int to_y = Math::minimum(m_tiles_y, (page_y + 1) << mip);
+	for (int ty = from_y; ty < to_y; ++ty)
+	{
+		for (int tx = from_x; tx < to_x; ++tx)
+		{
+			if (mip > 0 && m_uploaded_mip[tx + ty * m_tiles_x] <= mip) continue;
+			m_uploads.push({tx, ty, mip});
+		}
+	}
+}
+
+
+void TerrainTileCache::uploadTile(const Upload& upload)
+{
+	const int tile_size = m_texture.tile_size;
+	const int bpp = m_texture.bytes_per_pixel;
+	const int coarse_mip = m_texture.mips - 1;
+	i8& uploaded_mip = m_uploaded_mip[upload.tile_x + upload.tile_y * m_tiles_x];
+	if (upload.mip > 0 && uploaded_mip <= upload.mip) return;
+
+	const u8* src;
+	int src_w, src_h, src_x, src_y;
+	if (upload.mip == coarse_mip)
+	{
+		src = m_texture.getData();
+		getLevelSize(m_texture, coarse_mip, &src_w, &src_h);
+		src_x = src_y = 0;
+	}
+	else
+	{
+		const int page_x = upload.tile_x >> upload.mip;
+		const int page_y = upload.tile_y >> upload.mip;
+		Page* page = getResidentPage(upload.mip, page_x, page_y);
+		if (!page) return; // evicted before we got to it, a coarser level stays on GPU
+		src = &page->data[0];
+		src_w = src_h = tile_size;
+		src_x = page_x * tile_size;
+		src_y = page_y * tile_size;
+		page->is_dirty = false;
+	}
+
+	const int w = Math::minimum(tile_size, m_texture.width - upload.tile_x * tile_size);
+	const int h = Math::minimum(tile_size, m_texture.height - upload.tile_y * tile_size);
+	const bgfx::Memory* mem = bgfx::alloc(w * h * bpp);
+	const float inv_scale = 1.0f / float(1 << upload.mip);
+	for (int j = 0; j < h; ++j)
+	{
+		const int y = upload.tile_y * tile_size + j;
+		for (int i = 0; i < w; ++i)
+		{
+			const int x = upload.tile_x * tile_size + i;
+			if (bpp == 2)
+			{
+				const float fx = Math::clamp((x + 0.5f) * inv_scale - 0.5f - src_x, 0.0f, float(src_w - 1));
+				const float fy = Math::clamp((y + 0.5f) * inv_scale - 0.5f - src_y, 0.0f, float(src_h - 1));
+				const int x0 = int(fx);
+				const int y0 = int(fy);
+				const int x1 = Math::minimum(x0 + 1, src_w - 1);
+				const int y1 = Math::minimum(y0 + 1, src_h - 1);
+				const float dx = fx - x0;
+				const float dy = fy - y0;
+				const float top = readTexel(src, src_w, x0, y0) * (1 - dx) + readTexel(src, src_w, x1, y0) * dx;
+				const float bottom = readTexel(src, src_w, x0, y1) * (1 - dx) + readTexel(src, src_w, x1, y1) * dx;
+				((u16*)mem->data)[i + j * w] = u16(top * (1 - dy) + bottom * dy + 0.5f);
+			}
+			else
+			{
+				// splatmap texels are bit masks, they can not be interpolated
+				const int sx = Math::minimum((x >> upload.mip) - src_x, src_w - 1);
+				const int sy = Math::minimum((y >> upload.mip) - src_y, src_h - 1);
+				((u32*)mem->data)[i + j * w] = readTexel(src, src_w, sx, sy);
+			}
+		}
+	}
+	bgfx::updateTexture2D(m_texture.handle,
+		0,
+		0,
+		uint16_t(upload.tile_x * tile_size),
+		uint16_t(upload.tile_y * tile_size),
+		uint16_t(w),
+		uint16_t(h),
+		mem);
+	uploaded_mip = (i8)upload.mip;
+}
+
+
+void TerrainTileCache::evictPages()
+{
+	while (m_pages.size() > (u32)m_max_resident_pages)
+	{
+		Page* victim = nullptr;
+		for (Page* page : m_pages)
+		{
+			if (page->last_used == m_frame) continue;
+			if (!victim || page->last_used < victim->last_used) victim = page;
+		}
+		if (!victim) return;
+
+		if (victim->async != FS::FileSystem::INVALID_ASYNC)
+		{
+			m_file_system.cancelAsync(victim->async);
+			--m_pending_count;
+		}
+		m_pages.erase(victim->key);
+		MALMY_DELETE(m_allocator, victim);
+	}
+}
+
+
+int TerrainTileCache::update(const Vec3& lod_ref_point)
+{
+	PROFILE_FUNCTION();
+	++m_frame;
+	{
+		MT::SpinLock lock(m_requested_keys_mutex);
+		for (u32 key : m_requested_keys)
+		{
+			requestPage(int(key >> 28), int(key & 0x3fff), int((key >> 14) & 0x3fff));
+		}
+		m_requested_keys.clear();
+	}
+
+	const int tile_size = m_texture.tile_size;
+	for (int mip = 0; mip < m_texture.mips - 1; ++mip)
+	{
+		int level_w, level_h;
+		getLevelSize(m_texture, mip, &level_w, &level_h);
+		const int pages_x = (level_w + tile_size - 1) / tile_size;
+		const int pages_y = (level_h + tile_size - 1) / tile_size;
+		const int center_x = int(lod_ref_point.x) / (tile_size << mip);
+		const int center_y = int(lod_ref_point.z) / (tile_size << mip);
+		for (int y = Math::maximum(0, center_y - PAGE_WINDOW); y <= Math::minimum(pages_y - 1, center_y + PAGE_WINDOW); ++y)
+		{
+			for (int x = Math::maximum(0, center_x - PAGE_WINDOW); x <= Math::minimum(pages_x - 1, center_x + PAGE_WINDOW); ++x)
+			{
+				requestPage(mip, x, y);
+			}
+		}
+	}
+	evictPages();
+
+	int budget = MAX_UPLOADED_TILES_PER_UPDATE;
+	int processed = 0;
+	for (; processed < m_uploads.size() && budget > 0; ++processed, --budget)
+	{
+		uploadTile(m_uploads[processed]);
+	}
+	for (int i = processed, c = m_uploads.size(); i < c; ++i)
+	{
+		m_uploads[i - processed] = m_uploads[i];
+	}
+	m_uploads.resize(m_uploads.size() - processed);
+
+	const int coarse_mip = m_texture.mips - 1;
+	while (budget > 0 && m_background_fill < m_uploaded_mip.size())
+	{
+		if (m_uploaded_mip[m_background_fill] == NOT_UPLOADED)
+		{
+			uploadTile({m_background_fill % m_tiles_x, m_background_fill / m_tiles_x, coarse_mip});
+			--budget;
+		}
+		++m_background_fill;
+	}
+
+	int loaded = m_loaded_finest_count;
+	m_loaded_finest_count = 0;
+	return loaded;
+}
+
+
+u32 TerrainTileCache::getTexel(int x, int y)
+{
+	const int tile_size = m_texture.tile_size;
+	x = Math::clamp(x, 0, m_texture.width - 1);
+	y = Math::clamp(y, 0, m_texture.height - 1);
+
+	const int coarse_mip = m_texture.mips - 1;
+	for (int mip = 0; mip < coarse_mip; ++mip)
+	{
+		const int level_x = x >> mip;
+		const int level_y = y >> mip;
+		Page* page = getResidentPage(mip, level_x / tile_size, level_y / tile_size);
+		if (page)
+		{
+			// keeps pages read only on CPU, e.g. by physics or grass, from being evicted
+			// all readers store the same value and evictPages does not run concurrently
+			page->last_used = m_frame;
+		}
+		else
+		{
+			if (mip == 0)
+			{
+				// pages are not touched here, they are requested on the main thread in the next update
+				const u32 key = getPageKey(0, level_x / tile_size, level_y / tile_size);
+				MT::SpinLock lock(m_requested_keys_mutex);
+				if (m_requested_keys.indexOf(key) < 0) m_requested_keys.push(key);
+			}
+			continue;
+		}
+		return readTexel(&page->data[0], tile_size, level_x % tile_size, level_y % tile_size);
+	}
+
+	int coarse_w, coarse_h;
+	getLevelSize(m_texture, coarse_mip, &coarse_w, &coarse_h);
+	const int coarse_x = Math::minimum(x >> coarse_mip, coarse_w - 1);
+	const int coarse_y = Math::minimum(y >> coarse_mip, coarse_h - 1);
+	return readTexel(m_texture.getData(), coarse_w, coarse_x, coarse_y);
+}
+
+
+void TerrainTileCache::setTexel(int x, int y, u32 value)
+{
+	const int tile_size = m_texture.tile_size;
+	if (x < 0 || y < 0 || x >= m_texture.width || y >= m_texture.height) return;
+
+	Page* page = getResidentPage(0, x / tile_size, y / tile_size);
+	if (!page) return;
+
+	const int idx = x % tile_size + (y % tile_size) * tile_size;
+	if (m_texture.bytes_per_pixel == 2) ((u16*)&page->data[0])[idx] = (u16)value;
+	else ((u32*)&page->data[0])[idx] = value;
+	page->last_used = m_frame;
+	m_max_texel = Math::maximum(m_max_texel, value);
+
+	if (!page->is_dirty)
+	{
+		page->is_dirty = true;
+		m_uploads.push({x / tile_size, y / tile_size, 0});
+	}
+}
+
+
+static void downsample(const u8* src, int src_w, int src_h, int bpp, Array<u8>& dst, int dst_w, int dst_h)
+{
+	dst.resize(dst_w * dst_h * bpp);
+	for (int j = 0; j < dst_h; ++j)
+	{
+		const int y0 = Math::minimum(j * 2, src_h - 1);
+		const int y1 = Math::minimum(j * 2 + 1, src_h - 1);
+		for (int i = 0; i < dst_w; ++i)
+		{
+			const int x0 = Math::minimum(i * 2, src_w - 1);
+			const int x1 = Math::minimum(i * 2 + 1, src_w - 1);
+			if (bpp == 2)
+			{
+				const u16* s = (const u16*)src;
+				const u32 sum = s[x0 + y0 * src_w] + s[x1 + y0 * src_w] + s[x0 + y1 * src_w] + s[x1 + y1 * src_w];
+				((u16*)&dst[0])[i + j * dst_w] = u16((sum + 2) / 4);
+			}
+			else
+			{
+				((u32*)&dst[0])[i + j * dst_w] = ((const u32*)src)[x0 + y0 * src_w];
+			}
+		}
+	}
+}
+
+
+bool TerrainTileCache::convert(FS::FileSystem& fs,
+	const Texture& texture,
+	const char* out_path,
+	int tile_size,
+	IAllocator& allocator)
+{
+	PROFILE_FUNCTION();
+	if (!texture.getData() || texture.tile_size > 0)
+	{
+		g_log_error.log("Renderer") << "Could not convert " << texture.getPath() << " to tiles, no data loaded";
+		return false;
+	}
+	if (texture.bytes_per_pixel != 2 && texture.bytes_per_pixel != 4)
+	{
+		g_log_error.log("Renderer") << "Could not convert " << texture.getPath() << " to tiles, unsupported format";
+		return false;
+	}
+
+	TerrainTilesHeader header;
+	header.magic = TerrainTilesHeader::MAGIC;
+	header.version = TerrainTilesHeader::VERSION;
+	header.width = texture.width;
+	header.height = texture.height;
+	header.bytes_per_pixel = texture.bytes_per_pixel;
+	header.tile_size = tile_size;
+	header.mip_count = 1;
+	while ((Math::maximum(texture.width, texture.height) >> (header.mip_count - 1)) > tile_size) ++header.mip_count;
+
+	const int bpp = texture.bytes_per_pixel;
+	header.max_texel = 0;
+	for (int i = 0, c = texture.width * texture.height; i < c; ++i)
+	{
+		u32 texel = bpp == 2 ? ((const u16*)texture.getData())[i] : ((const u32*)texture.getData())[i];
+		header.max_texel = Math::maximum(header.max_texel, texel);
+	}
+	Array<u8> level_data(allocator);
+	Array<u8> next_level_data(allocator);
+	Array<u8> page_data(allocator);
+	page_data.resize(tile_size * tile_size * bpp);
+	const u8* level = texture.getData();
+	int level_w = texture.width;
+	int level_h = texture.height;
+	for (int mip = 0; mip < header.mip_count - 1; ++mip)
+	{
+		const int pages_x = (level_w + tile_size - 1) / tile_size;
+		const int pages_y = (level_h + tile_size - 1) / tile_size;
+		for (int py = 0; py < pages_y; ++py)
+		{
+			for (int px = 0; px < pages_x; ++px)
+			{
+				for (int j = 0; j < tile_size; ++j)
+				{
+					const int y = Math::minimum(py * tile_size + j, level_h - 1);
+					for (int i = 0; i < tile_size; ++i)
+					{
+						const int x = Math::minimum(px * tile_size + i, level_w - 1);
+						copyMemory(&page_data[(i + j * tile_size) * bpp], &level[(x + y * level_w) * bpp], bpp);
+					}
+				}
+
+				char page_path[MAX_PATH_LENGTH];
+				getPagePath(page_path, lengthOf(page_path), out_path, mip, px, py);
+				FS::IFile* file = fs.open(fs.getDiskDevice(), Path(page_path), FS::Mode::CREATE_AND_WRITE);
+				if (!file)
+				{
+					g_log_error.log("Renderer") << "Could not create " << page_path;
+					return false;
+				}
+				file->write(&page_data[0], page_data.size());
+				fs.close(*file);
+			}
+		}
+
+		const int next_w = Math::maximum(1, level_w >> 1);
+		const int next_h = Math::maximum(1, level_h >> 1);
+		downsample(level, level_w, level_h, bpp, next_level_data, next_w, next_h);
+		level_data.swap(next_level_data);
+		level = &level_data[0];
+		level_w = next_w;
+		level_h = next_h;
+	}
+
+	FS::IFile* file = fs.open(fs.getDiskDevice(), Path(out_path), FS::Mode::CREATE_AND_WRITE);
+	if (!file)
+	{
+		g_log_error.log("Renderer") << "Could not create " << out_path;
+		return false;
+	}
+	file->write(&header, sizeof(header));
+	file->write(level, level_w * level_h * bpp);
+	fs.close(*file);
+	return true;
+}
+
+
+} // namespace Malmy
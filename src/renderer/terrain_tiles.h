@@ -0,0 +1,132 @@
+#pragma once
+
+
+#include "engine/array.h"
+#include "engine/hash_map.h"
+#include "engine/mt/sync.h"
+#include "engine/vec.h"
+
+
+namespace Malmy
+{
+
+
+namespace FS
+{
+	class FileSystem;
+	struct IFile;
+}
+struct IAllocator;
+class Texture;
+
+
+#pragma pack(1)
+struct TerrainTilesHeader
+{
+	static const u32 MAGIC = 0x4C54544D; // 'MTTL'
+	static const u32 VERSION = 1;
+	// files of version 0 end the header before max_texel
+	static const u32 FIRST_VERSION_WITH_MAX_TEXEL = 1;
+
+	u32 magic;
+	u32 version;
+	i32 width;
+	i32 height;
+	i32 bytes_per_pixel;
+	i32 tile_size;
+	i32 mip_count;
+	// maximum of the finest level, coarser levels are averaged so they can be lower
+	u32 max_texel;
+};
+#pragma pack()
+
+
+// Pages of a tiled terrain heightmap or splatmap (*.tiles).
+// The *.tiles file contains TerrainTilesHeader followed by the coarsest mip level, which is
+// always resident (Texture::data). Finer levels are split into tile_size x tile_size pages,
+// each in its own file, loaded on demand through FS::FileSystem::openAsync and evicted LRU.
+// The GPU texture is updated only in the regions whose content changed.
+// update and setTexel must be called from the main thread, getTexel can be called from jobs while update
+// is not running, pages it misses are requested in the next update.
+class MALMY_RENDERER_API TerrainTileCache
+{
+public:
+	static const int DEFAULT_TILE_SIZE = 256;
+	static const int DEFAULT_MAX_RESIDENT_PAGES = 128;
+
+public:
+	TerrainTileCache(Texture& texture, FS::FileSystem& fs, IAllocator& allocator);
+	~TerrainTileCache();
+
+	// lod_ref_point is in texel space, returns number of finest level pages which became resident
+	int update(const Vec3& lod_ref_point);
+	u32 getTexel(int x, int y);
+	void setTexel(int x, int y, u32 value);
+	// maximum of all texels, including the ones changed by setTexel
+	u32 getMaxTexel() const { return m_max_texel; }
+
+	int getResidentPagesCount() const { return m_pages.size(); }
+	int getPendingPagesCount() const { return m_pending_count; }
+	int getMaxResidentPages() const { return m_max_resident_pages; }
+	void setMaxResidentPages(int count) { m_max_resident_pages = count; }
+
+	static void getPagePath(char* out, int max_size, const char* tiles_path, int mip, int x, int y);
+	static void getLevelSize(const Texture& texture, int mip, int* w, int* h);
+	static bool convert(FS::FileSystem& fs, const Texture& texture, const char* out_path, int tile_size, IAllocator& allocator);
+
+private:
+	struct Page
+	{
+		Page(TerrainTileCache& cache, IAllocator& allocator) : cache(cache), data(allocator) {}
+		void onLoaded(FS::IFile& file, bool success);
+
+		TerrainTileCache& cache;
+		Array<u8> data;
+		u32 key;
+		u32 async;
+		u32 last_used;
+		// failed pages are loaded again after a delay which doubles with each failure
+		u32 retry_frame;
+		u32 failures;
+		bool is_loaded;
+		bool is_dirty;
+	};
+
+	struct Upload
+	{
+		int tile_x;
+		int tile_y;
+		int mip;
+	};
+
+	static u32 getPageKey(int mip, int x, int y) { return (u32(mip) << 28) | (u32(y) << 14) | u32(x); }
+	Page* getResidentPage(int mip, int x, int y);
+	void requestPage(int mip, int x, int y);
+	bool loadPage(Page& page);
+	void onPageLoaded(Page& page);
+	void evictPages();
+	void queueUpload(int mip, int page_x, int page_y);
+	void uploadTile(const Upload& upload);
+	u32 readTexel(const u8* data, int stride, int x, int y) const;
+
+private:
+	IAllocator& m_allocator;
+	FS::FileSystem& m_file_system;
+	Texture& m_texture;
+	HashMap<u32, Page*> m_pages;
+	Array<Upload> m_uploads;
+	Array<i8> m_uploaded_mip;
+	Array<u32> m_requested_keys;
+	MT::SpinMutex m_requested_keys_mutex;
+	int m_tiles_x;
+	int m_tiles_y;
+	int m_max_resident_pages;
+	int m_pending_count;
+	int m_loaded_finest_count;
+	int m_background_fill;
+	u32 m_max_texel;
+	u32 m_frame;
+};
+
+
+} // namespace Malmy
@@ -1,10 +1,12 @@
 #include "engine/fs/file_system.h"
 #include "engine/log.h"
 #include "engine/math_utils.h"
+#include "engine/mt/atomic.h"
 #include "engine/path_utils.h"
 #include "engine/profiler.h"
 #include "engine/resource_manager.h"
 #include "engine/resource_manager_base.h"
+#include "renderer/terrain_tiles.h"
 #include "renderer/texture.h"
 #include "renderer/texture_manager.h"
 #include <bgfx/bgfx.h>
@@ -25,6 +27,14 @@ Texture::Texture(const Path& path, ResourceManagerBase& resource_manager, IAlloc
 	, bytes_per_pixel(-1)
 	, depth(-1)
 	, layers(1)
+	, tile_size(0)
+	, tile_max_texel(0)
+	, is_streamed(false)
+	, streaming_base_data(_allocator)
+	, required_size(0)
+	, streaming_async(FS::FileSystem::INVALID_ASYNC)
+	, m_decode_error(nullptr)
+	, m_is_decoded(false)
 {
 	bgfx_flags = 0;
 	is_cubemap = false;
@@ -464,7 +474,7 @@ bool Texture::loadTGA(FS::IFile& file, TGAHeader& header, Array<u8>& data, const
 }
 
 
-bool Texture::loadTGA(FS::IFile& file)
+bool Texture::decodeTGA(FS::IFile& file)
 {
 	PROFILE_FUNCTION();
 	TGAHeader header;
@@ -474,13 +484,13 @@ bool Texture::loadTGA(FS::IFile& file)
 	int image_size = header.width * header.height * 4;
 	if (header.dataType != 2 && header.dataType != 10)
 	{
-		g_log_error.log("Renderer") << "Unsupported texture format " << getPath().c_str();
+		m_decode_error = "Unsupported texture format ";
 		return false;
 	}
 
 	if (bytes_per_pixel < 3)
 	{
-		g_log_error.log("Renderer") << "Unsupported color mode " << getPath().c_str();
+		m_decode_error = "Unsupported color mode ";
 		return false;
 	}
 
@@ -488,12 +498,9 @@ bool Texture::loadTGA(FS::IFile& file)
 	height = header.height;
 	int pixel_count = width * height;
 	is_cubemap = false;
-	TextureManager& manager = static_cast<TextureManager&>(getResourceManager());
-	if (data_reference)
-	{
-		data.resize(image_size);
-	}
-	u8* image_dest = data_reference ? &data[0] : (u8*)manager.getBuffer(image_size);
+	// decoded into data even if it is not referenced, the shared buffer of TextureManager is not thread-safe
+	data.resize(image_size);
+	u8* image_dest = &data[0];
 
 	bool is_rle = header.dataType == 10;
 	if (is_rle)
@@ -580,9 +587,18 @@ bool Texture::loadTGA(FS::IFile& file)
 
 	bytes_per_pixel = 4;
 	mips = 1;
+	depth = 1;
+	layers = 1;
+	return true;
+}
+
+
+bool Texture::createFromTGA()
+{
+	PROFILE_FUNCTION();
 	handle = bgfx::createTexture2D(
-		header.width,
-		header.height,
+		(uint16_t)width,
+		(uint16_t)height,
 		false,
 		0,
 		bgfx::TextureFormat::RGBA8,
@@ -595,11 +611,10 @@ bool Texture::loadTGA(FS::IFile& file)
 		0,
 		0,
 		0,
-		header.width,
-		header.height,
-		bgfx::copy(image_dest, header.width * header.height * 4));
-	depth = 1;
-	layers = 1;
+		(uint16_t)width,
+		(uint16_t)height,
+		bgfx::copy(&data[0], width * height * 4));
+	if (data_reference == 0) data.clear();
 	return bgfx::isValid(handle);
 }
 
@@ -607,7 +622,7 @@ bool Texture::loadTGA(FS::IFile& file)
 void Texture::addDataReference()
 {
 	++data_reference;
-	if (data_reference == 1 && isReady())
+	if (data_reference == 1 && isReady() && tile_size == 0)
 	{
 		m_resource_manager.reload(*this);
 	}
@@ -617,7 +632,7 @@ void Texture::addDataReference()
 void Texture::removeDataReference()
 {
 	--data_reference;
-	if (data_reference == 0)
+	if (data_reference == 0 && tile_size == 0)
 	{
 		data.clear();
 	}
@@ -640,25 +655,520 @@ static bool loadDDSorKTX(Texture& texture, FS::IFile& file)
 }
 
 
-bool Texture::load(FS::IFile& file)
+// DDS / KTX layout of a plain 2D texture with a complete mip chain, only such textures can be streamed
+struct MipChainInfo
+{
+	bgfx::TextureFormat::Enum format;
+	bool is_srgb;
+	bool is_ktx;
+	int width;
+	int height;
+	int mips;
+	u32 data_offset;
+};
+
+
+static u32 readU32(const u8* data)
+{
+	u32 value;
+	copyMemory(&value, data, sizeof(value));
+	return value;
+}
+
+
+static u32 getMipSize(bgfx::TextureFormat::Enum format, int width, int height, int mip)
+{
+	int block_size = 4;
+	u32 block_bytes = 16;
+	switch (format)
+	{
+		case bgfx::TextureFormat::BC1:
+		case bgfx::TextureFormat::BC4: block_bytes = 8; break;
+		case bgfx::TextureFormat::BC2:
+		case bgfx::TextureFormat::BC3:
+		case bgfx::TextureFormat::BC5:
+		case bgfx::TextureFormat::BC7: break;
+		default: block_size = 1; block_bytes = 4; break;
+	}
+	int w = Math::maximum(1, width >> mip);
+	int h = Math::maximum(1, height >> mip);
+	return u32((w + block_size - 1) / block_size) * u32((h + block_size - 1) / block_size) * block_bytes;
+}
+
+
+static u32 getMipChainSize(bgfx::TextureFormat::Enum format, int width, int height, int from_mip, int mips)
+{
+	u32 size = 0;
+	for (int mip = from_mip; mip < mips; ++mip) size += getMipSize(format, width, height, mip);
+	return size;
+}
+
+
+static bool parseDDS(const u8* data, size_t size, MipChainInfo& info)
+{
+	static const u32 DDS_MAGIC = 0x20534444; // 'DDS '
+	static const u32 DDSD_MIPMAPCOUNT = 0x20000;
+	static const u32 DDSD_DEPTH = 0x800000;
+	static const u32 DDPF_FOURCC = 0x4;
+	static const u32 DDPF_RGB = 0x40;
+	static const u32 DDSCAPS2_CUBEMAP = 0x200;
+	static const u32 DDS_HEADER_SIZE = 128;
+	static const u32 DX10_HEADER_SIZE = 20;
+
+	if (size < DDS_HEADER_SIZE || readU32(data) != DDS_MAGIC) return false;
+
+	const u8* header = data + 4;
+	u32 flags = readU32(header + 4);
+	u32 depth = readU32(header + 20);
+	u32 pf_flags = readU32(header + 76);
+	u32 four_cc = readU32(header + 80);
+	u32 caps2 = readU32(header + 108);
+	if ((caps2 & DDSCAPS2_CUBEMAP) || ((flags & DDSD_DEPTH) && depth > 1)) return false;
+
+	info.height = (int)readU32(header + 8);
+	info.width = (int)readU32(header + 12);
+	info.mips = (flags & DDSD_MIPMAPCOUNT) ? Math::maximum(1, (int)readU32(header + 24)) : 1;
+	info.data_offset = DDS_HEADER_SIZE;
+	info.is_srgb = false;
+	info.is_ktx = false;
+
+	if (pf_flags & DDPF_FOURCC)
+	{
+		switch (four_cc)
+		{
+			case 0x31545844: info.format = bgfx::TextureFormat::BC1; return true; // DXT1
+			case 0x33545844: info.format = bgfx::TextureFormat::BC2; return true; // DXT3
+			case 0x35545844: info.format = bgfx::TextureFormat::BC3; return true; // DXT5
+			case 0x31495441: // ATI1
+			case 0x55344342: info.format = bgfx::TextureFormat::BC4; return true; // BC4U
+			case 0x32495441: // ATI2
+			case 0x55354342: info.format = bgfx::TextureFormat::BC5; return true; // BC5U
+			case 0x30315844: break; // DX10
+			default: return false;
+		}
+
+		if (size < DDS_HEADER_SIZE + DX10_HEADER_SIZE) return false;
+		const u8* dx10 = data + DDS_HEADER_SIZE;
+		static const u32 D3D10_RESOURCE_DIMENSION_TEXTURE2D = 3;
+		static const u32 D3D10_RESOURCE_MISC_TEXTURECUBE = 0x4;
+		u32 dimension = readU32(dx10 + 4);
+		u32 misc_flags = readU32(dx10 + 8);
+		u32 array_size = readU32(dx10 + 12);
+		if (dimension != D3D10_RESOURCE_DIMENSION_TEXTURE2D || (misc_flags & D3D10_RESOURCE_MISC_TEXTURECUBE) ||
+			array_size > 1)
+		{
+			return false;
+		}
+		info.data_offset += DX10_HEADER_SIZE;
+
+		u32 dxgi_format = readU32(dx10);
+		switch (dxgi_format)
+		{
+			case 29: info.is_srgb = true; // fallthrough
+			case 28: info.format = bgfx::TextureFormat::RGBA8; return true;
+			case 72: info.is_srgb = true; // fallthrough
+			case 71: info.format = bgfx::TextureFormat::BC1; return true;
+			case 75: info.is_srgb = true; // fallthrough
+			case 74: info.format = bgfx::TextureFormat::BC2; return true;
+			case 78: info.is_srgb = true; // fallthrough
+			case 77: info.format = bgfx::TextureFormat::BC3; return true;
+			case 80: info.format = bgfx::TextureFormat::BC4; return true;
+			case 83: info.format = bgfx::TextureFormat::BC5; return true;
+			case 91: info.is_srgb = true; // fallthrough
+			case 87: info.format = bgfx::TextureFormat::BGRA8; return true;
+			case 99: info.is_srgb = true; // fallthrough
+			case 98: info.format = bgfx::TextureFormat::BC7; return true;
+			default: return false;
+		}
+	}
+
+	if ((pf_flags & DDPF_RGB) && readU32(header + 84) == 32)
+	{
+		u32 red_mask = readU32(header + 88);
+		if (red_mask == 0x00ff0000)
+		{
+			info.format = bgfx::TextureFormat::BGRA8;
+			return true;
+		}
+		if (red_mask == 0x000000ff)
+		{
+			info.format = bgfx::TextureFormat::RGBA8;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static bool parseKTX(const u8* data, size_t size, MipChainInfo& info)
+{
+	static const u8 KTX_IDENTIFIER[] = {0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'};
+	static const u32 KTX_ENDIANNESS = 0x04030201;
+	static const u32 KTX_HEADER_SIZE = 64;
+
+	if (size < KTX_HEADER_SIZE || compareMemory(data, KTX_IDENTIFIER, sizeof(KTX_IDENTIFIER)) != 0) return false;
+	if (readU32(data + 12) != KTX_ENDIANNESS) return false;
+
+	u32 depth = readU32(data + 44);
+	u32 array_elements = readU32(data + 48);
+	u32 faces = readU32(data + 52);
+	if (depth > 1 || array_elements > 0 || faces != 1) return false;
+
+	info.width = (int)readU32(data + 36);
+	info.height = (int)readU32(data + 40);
+	info.mips = Math::maximum(1, (int)readU32(data + 56));
+	info.data_offset = KTX_HEADER_SIZE + readU32(data + 60);
+	info.is_srgb = false;
+	info.is_ktx = true;
+
+	u32 internal_format = readU32(data + 28);
+	switch (internal_format)
+	{
+		case 0x8C43: info.is_srgb = true; // fallthrough, GL_SRGB8_ALPHA8
+		case 0x8058: info.format = bgfx::TextureFormat::RGBA8; return true;
+		case 0x8C4C: // GL_COMPRESSED_SRGB_S3TC_DXT1_EXT
+		case 0x8C4D: info.is_srgb = true; // fallthrough
+		case 0x83F0: // GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+		case 0x83F1: info.format = bgfx::TextureFormat::BC1; return true;
+		case 0x8C4E: info.is_srgb = true; // fallthrough
+		case 0x83F2: info.format = bgfx::TextureFormat::BC2; return true;
+		case 0x8C4F: info.is_srgb = true; // fallthrough
+		case 0x83F3: info.format = bgfx::TextureFormat::BC3; return true;
+		case 0x8DBB: info.format = bgfx::TextureFormat::BC4; return true;
+		case 0x8DBD: info.format = bgfx::TextureFormat::BC5; return true;
+		case 0x8E8D: info.is_srgb = true; // fallthrough
+		case 0x8E8C: info.format = bgfx::TextureFormat::BC7; return true;
+		default: return false;
+	}
+}
+
+
+static bool parseMipChain(const u8* data, size_t size, MipChainInfo& info)
+{
+	if (!data) return false;
+	if (!parseDDS(data, size, info) && !parseKTX(data, size, info)) return false;
+	if (info.width <= 0 || info.height <= 0 || info.width > 0xffff || info.height > 0xffff) return false;
+
+	// bgfx creates either a single mip or the complete chain
+	int full_mips = 1;
+	while ((Math::maximum(info.width, info.height) >> full_mips) > 0) ++full_mips;
+	return info.mips == full_mips;
+}
+
+
+// copies mips from_mip..info.mips - 1 to out, in the layout expected by bgfx::createTexture2D
+static bool gatherMips(const MipChainInfo& info, const u8* data, size_t size, int from_mip, u8* out)
+{
+	size_t src = info.data_offset;
+	for (int mip = 0; mip < info.mips; ++mip)
+	{
+		u32 mip_size = getMipSize(info.format, info.width, info.height, mip);
+		if (info.is_ktx)
+		{
+			if (src + sizeof(u32) > size || readU32(data + src) != mip_size) return false;
+			src += sizeof(u32);
+		}
+		if (src + mip_size > size) return false;
+		if (mip >= from_mip)
+		{
+			copyMemory(out, data + src, mip_size);
+			out += mip_size;
+		}
+		src += mip_size;
+		if (info.is_ktx) src = (src + 3) & ~size_t(3);
+	}
+	return true;
+}
+
+
+static bool createStreamedHandle(Texture& texture, const u8* mip_data, int mip)
+{
+	u32 size = getMipChainSize(texture.streaming_format, texture.width, texture.height, mip, texture.mips);
+	bgfx::TextureHandle handle = bgfx::createTexture2D((uint16_t)Math::maximum(1, texture.width >> mip),
+		(uint16_t)Math::maximum(1, texture.height >> mip),
+		true,
+		1,
+		texture.streaming_format,
+		texture.bgfx_flags | texture.streaming_flags,
+		bgfx::copy(mip_data, size));
+	if (!bgfx::isValid(handle)) return false;
+
+	bgfx::setName(handle, texture.getPath().c_str());
+	if (bgfx::isValid(texture.handle)) bgfx::destroy(texture.handle);
+	texture.handle = handle;
+	texture.resident_mip = mip;
+	return true;
+}
+
+
+// runs in the decode job, mips from base_mip are gathered to streaming_base_data,
+// textures which are not streamed have base_mip 0 and the data are freed once the handle is created
+static bool decodeMipChain(Texture& texture, const MipChainInfo& info, FS::IFile& file, bool streamed)
+{
+	PROFILE_FUNCTION();
+	int base_mip = 0;
+	if (streamed)
+	{
+		while ((Math::maximum(info.width, info.height) >> base_mip) > TextureManager::STREAMING_BASE_SIZE) ++base_mip;
+	}
+
+	texture.width = info.width;
+	texture.height = info.height;
+	texture.mips = info.mips;
+	texture.depth = 1;
+	texture.layers = 1;
+	texture.is_cubemap = false;
+	texture.streaming_format = info.format;
+	texture.streaming_flags = info.is_srgb ? BGFX_TEXTURE_SRGB : 0;
+	texture.base_mip = base_mip;
+	texture.requested_mip = base_mip;
+	texture.required_size = 0;
+	texture.last_needed_frame = 0;
+	texture.streaming_retry_frame = 0;
+	texture.streaming_failures = 0;
+
+	texture.streaming_base_data.resize(getMipChainSize(info.format, info.width, info.height, base_mip, info.mips));
+	return gatherMips(info, (const u8*)file.getBuffer(), file.size(), base_mip, &texture.streaming_base_data[0]);
+}
+
+
+void Texture::requestSize(int size_in_pixels)
+{
+	i32 current = required_size;
+	while (current < size_in_pixels)
+	{
+		if (MT::compareAndExchange(&required_size, size_in_pixels, current)) return;
+		current = required_size;
+	}
+}
+
+
+u32 Texture::getMemory(int from_mip) const
+{
+	if (!is_streamed) return 0;
+	return getMipChainSize(streaming_format, width, height, from_mip, mips);
+}
+
+
+// includes mips which are being loaded
+u32 Texture::getResidentMemory() const
+{
+	return getMemory(streaming_async != FS::FileSystem::INVALID_ASYNC ? streaming_mip : resident_mip);
+}
+
+
+bool Texture::streamIn(int mip)
+{
+	if (!is_streamed || streaming_async != FS::FileSystem::INVALID_ASYNC || mip >= resident_mip) return false;
+
+	FS::FileSystem& fs = m_resource_manager.getOwner().getFileSystem();
+	FS::ReadCallback cb;
+	cb.bind<Texture, &Texture::onStreamedMipsLoaded>(this);
+	streaming_mip = mip;
+	streaming_async = fs.openAsync(fs.getDefaultDevice(), getPath(), FS::Mode::OPEN_AND_READ, cb, FS::AsyncPriority::LOW);
+	return streaming_async != FS::FileSystem::INVALID_ASYNC;
+}
+
+
+void Texture::onStreamedMipsLoaded(FS::IFile& file, bool success)
+{
+	PROFILE_FUNCTION();
+	streaming_async = FS::FileSystem::INVALID_ASYNC;
+	if (!is_streamed) return;
+
+	TextureManager& manager = static_cast<TextureManager&>(m_resource_manager);
+	if (!success)
+	{
+		g_log_error.log("Renderer") << "Could not stream " << getPath();
+		manager.onStreamingFailed(*this, false);
+		return;
+	}
+
+	MipChainInfo info;
+	const u8* file_data = (const u8*)file.getBuffer();
+	if (!parseMipChain(file_data, file.size(), info) || info.width != width || info.height != height ||
+		info.format != streaming_format)
+	{
+		g_log_warning.log("Renderer") << getPath() << " changed, it can not be streamed until reloaded";
+		manager.onStreamingFailed(*this, true);
+		return;
+	}
+
+	u8* mip_data = manager.getBuffer((i32)getMipChainSize(streaming_format, width, height, streaming_mip, mips));
+	if (!gatherMips(info, file_data, file.size(), streaming_mip, mip_data))
+	{
+		g_log_error.log("Renderer") << "Corrupted mip chain in " << getPath();
+		manager.onStreamingFailed(*this, true);
+		return;
+	}
+	streaming_failures = 0;
+	if (createStreamedHandle(*this, mip_data, streaming_mip)) manager.onHandleChanged(*this);
+}
+
+
+void Texture::evictMips()
+{
+	if (!is_streamed) return;
+
+	if (streaming_async != FS::FileSystem::INVALID_ASYNC)
+	{
+		m_resource_manager.getOwner().getFileSystem().cancelAsync(streaming_async);
+		streaming_async = FS::FileSystem::INVALID_ASYNC;
+	}
+	if (resident_mip >= base_mip) return;
+
+	if (createStreamedHandle(*this, &streaming_base_data[0], base_mip))
+	{
+		static_cast<TextureManager&>(m_resource_manager).onHandleChanged(*this);
+	}
+}
+
+
+static bool loadTiles(Texture& texture, FS::IFile& file)
+{
+	PROFILE_FUNCTION();
+	TerrainTilesHeader header;
+	const size_t first_version_size = sizeof(header) - sizeof(header.max_texel);
+	if (!file.read(&header, first_version_size) || header.magic != TerrainTilesHeader::MAGIC)
+	{
+		g_log_error.log("Renderer") << "Invalid tiles file " << texture.getPath();
+		return false;
+	}
+	if (header.version > TerrainTilesHeader::VERSION)
+	{
+		g_log_error.log("Renderer") << "Unsupported version of tiles file " << texture.getPath();
+		return false;
+	}
+	if (header.version >= TerrainTilesHeader::FIRST_VERSION_WITH_MAX_TEXEL)
+	{
+		if (!file.read(&header.max_texel, sizeof(header.max_texel)))
+		{
+			g_log_error.log("Renderer") << "Could not read " << texture.getPath();
+			return false;
+		}
+	}
+	else
+	{
+		// the real maximum is unknown without reading all pages, anything below the full range could clip bounds
+		header.max_texel = header.bytes_per_pixel == 2 ? 0xffff : 0xffffFFFF;
+	}
+	if (header.bytes_per_pixel != 2 && header.bytes_per_pixel != 4)
+	{
+		g_log_error.log("Renderer") << "Unsupported format of tiles file " << texture.getPath();
+		return false;
+	}
+
+	texture.width = header.width;
+	texture.height = header.height;
+	texture.bytes_per_pixel = header.bytes_per_pixel;
+	texture.tile_size = header.tile_size;
+	texture.tile_max_texel = header.max_texel;
+	texture.mips = header.mip_count;
+	texture.depth = 1;
+	texture.layers = 1;
+	texture.is_cubemap = false;
+
+	int coarse_w, coarse_h;
+	TerrainTileCache::getLevelSize(texture, header.mip_count - 1, &coarse_w, &coarse_h);
+	texture.data.resize(coarse_w * coarse_h * header.bytes_per_pixel);
+	if (!file.read(&texture.data[0], texture.data.size()))
+	{
+		g_log_error.log("Renderer") << "Could not read " << texture.getPath();
+		return false;
+	}
+
+	// only the finest level lives on GPU, TerrainTileCache fills it page by page
+	texture.handle = bgfx::createTexture2D((uint16_t)texture.width,
+		(uint16_t)texture.height,
+		false,
+		1,
+		header.bytes_per_pixel == 2 ? bgfx::TextureFormat::R16 : bgfx::TextureFormat::RGBA8,
+		texture.bgfx_flags,
+		nullptr);
+	bgfx::setName(texture.handle, texture.getPath().c_str());
+	return bgfx::isValid(texture.handle);
+}
+
+
+bool Texture::decode(FS::IFile& file)
+{
+	PROFILE_FUNCTION();
+	m_decode_error = nullptr;
+	m_is_decoded = false;
+
+	const char* path = getPath().c_str();
+	if (PathUtils::hasExtension(path, "dds") || PathUtils::hasExtension(path, "ktx"))
+	{
+		// cubemaps, volumes, arrays, partial mip chains and other formats are parsed by bgfx in finalize
+		MipChainInfo info;
+		if (!parseMipChain((const u8*)file.getBuffer(), file.size(), info)) return true;
+
+		TextureManager& manager = static_cast<TextureManager&>(m_resource_manager);
+		bool streamed = manager.isStreamingEnabled() &&
+						Math::maximum(info.width, info.height) > TextureManager::STREAMING_BASE_SIZE;
+		m_is_decoded = decodeMipChain(*this, info, file, streamed);
+		if (!m_is_decoded) m_decode_error = "Corrupted mip chain in ";
+		return true;
+	}
+
+	// raw and tiles are created in finalize
+	if (PathUtils::hasExtension(path, "raw") || PathUtils::hasExtension(path, "tiles")) return true;
+
+	// errors are reported in finalize, logging is not thread-safe
+	m_is_decoded = decodeTGA(file);
+	return true;
+}
+
+
+bool Texture::finalize(FS::IFile& file)
 {
 	PROFILE_FUNCTION();
 
 	const char* path = getPath().c_str();
-	size_t len = getPath().length();
 	bool loaded = false;
-	if (len > 3 && (equalStrings(path + len - 4, ".dds") || equalStrings(path + len - 4, ".ktx")))
+	if (PathUtils::hasExtension(path, "dds") || PathUtils::hasExtension(path, "ktx"))
 	{
-		loaded = loadDDSorKTX(*this, file);
+		if (m_is_decoded)
+		{
+			loaded = createStreamedHandle(*this, &streaming_base_data[0], base_mip);
+			if (loaded && base_mip > 0)
+			{
+				is_streamed = true;
+				static_cast<TextureManager&>(m_resource_manager).addStreamed(*this);
+			}
+			else
+			{
+				streaming_base_data.clear();
+			}
+		}
+		else if (m_decode_error)
+		{
+			g_log_error.log("Renderer") << m_decode_error << path;
+		}
+		else
+		{
+			loaded = loadDDSorKTX(*this, file);
+		}
 	}
-	else if (len > 3 && equalStrings(path + len - 4, ".raw"))
+	else if (PathUtils::hasExtension(path, "raw"))
 	{
 		loaded = loadRaw(*this, file);
 	}
-	else
+	else if (PathUtils::hasExtension(path, "tiles"))
+	{
+		loaded = loadTiles(*this, file);
+	}
+	else if (m_is_decoded)
+	{
+		loaded = createFromTGA();
+	}
+	else if (m_decode_error)
 	{
-		loaded = loadTGA(file);
+		g_log_error.log("Renderer") << m_decode_error << path;
 	}
+	m_is_decoded = false;
+	m_decode_error = nullptr;
+
 	if (!loaded)
 	{
 		g_log_warning.log("Renderer") << "Error loading texture " << path;
@@ -670,14 +1180,33 @@ bool Texture::load(FS::IFile& file)
 }
 
 
+bool Texture::load(FS::IFile& file)
+{
+	return decode(file) && finalize(file);
+}
+
+
 void Texture::unload()
 {
+	if (is_streamed)
+	{
+		if (streaming_async != FS::FileSystem::INVALID_ASYNC)
+		{
+			m_resource_manager.getOwner().getFileSystem().cancelAsync(streaming_async);
+			streaming_async = FS::FileSystem::INVALID_ASYNC;
+		}
+		static_cast<TextureManager&>(m_resource_manager).removeStreamed(*this);
+		streaming_base_data.clear();
+		is_streamed = false;
+	}
 	if (bgfx::isValid(handle))
 	{
 		bgfx::destroy(handle);
 		handle = BGFX_INVALID_HANDLE;
 	}
 	data.clear();
+	tile_size = 0;
+	tile_max_texel = 0;
 }
 
 
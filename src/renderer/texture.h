@@ -53,6 +53,11 @@ class MALMY_RENDERER_API Texture MALMY_FINAL : public Resource
 		void setFlag(u32 flag, bool value);
 		u32 getPixelNearest(int x, int y) const;
 		u32 getPixel(float x, float y) const;
+		void requestSize(int size_in_pixels);
+		u32 getMemory(int from_mip) const;
+		u32 getResidentMemory() const;
+		bool streamIn(int mip);
+		void evictMips();
 
 		static unsigned int compareTGA(FS::IFile* file1, FS::IFile* file2, int difference, IAllocator& allocator);
 		static bool saveTGA(FS::IFile* file,
@@ -73,17 +78,43 @@ class MALMY_RENDERER_API Texture MALMY_FINAL : public Resource
 		int depth;
 		int layers;
 		int mips;
+		int tile_size; // non-zero for tiled terrain textures, data then holds only the coarsest mip
+		u32 tile_max_texel; // maximum texel of the finest mip of tiled textures
 		bool is_cubemap;
 		u32 bgfx_flags;
 		bgfx::TextureHandle handle;
 		IAllocator& allocator;
 		int data_reference;
 		Array<u8> data;
+		// streamed textures (see TextureManager::updateStreaming) have only mips from resident_mip on GPU,
+		// mips from base_mip are always resident and their data are kept in streaming_base_data
+		bool is_streamed;
+		int resident_mip;
+		int base_mip;
+		int requested_mip;
+		bgfx::TextureFormat::Enum streaming_format;
+		u32 streaming_flags;
+		volatile i32 required_size;
+		u32 last_needed_frame;
+		u32 streaming_async;
+		int streaming_mip;
+		// failed loads are not retried before this frame of TextureManager
+		u32 streaming_retry_frame;
+		int streaming_failures;
+		Array<u8> streaming_base_data;
+
+	private:
+		const char* m_decode_error;
+		bool m_is_decoded;
 
 	private:
 		void unload() override;
 		bool load(FS::IFile& file) override;
-		bool loadTGA(FS::IFile& file);
+		bool decode(FS::IFile& file) override;
+		bool finalize(FS::IFile& file) override;
+		bool decodeTGA(FS::IFile& file);
+		bool createFromTGA();
+		void onStreamedMipsLoaded(FS::IFile& file, bool success);
 };
 
 
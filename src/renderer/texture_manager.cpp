@@ -1,7 +1,13 @@
 #include "engine/malmy.h"
 #include "renderer/texture_manager.h"
 
+#include "engine/fs/file_system.h"
+#include "engine/math_utils.h"
+#include "engine/profiler.h"
 #include "engine/resource.h"
+#include "engine/resource_manager.h"
+#include "engine/string.h"
+#include "renderer/material.h"
 #include "renderer/texture.h"
 
 namespace Malmy
@@ -9,9 +15,16 @@ namespace Malmy
 	TextureManager::TextureManager(IAllocator& allocator)
 		: ResourceManagerBase(allocator)
 		, m_allocator(allocator)
+		, m_streaming_enabled(false)
+		, m_streamed(allocator)
+		, m_materials(allocator)
+		, m_frame(0)
 	{
 		m_buffer = nullptr;
 		m_buffer_size = -1;
+		setMemory(&m_stats, 0, sizeof(m_stats));
+		m_stats.budget = DEFAULT_STREAMING_BUDGET;
+		enableAsyncDecode(true);
 	}
 
 
@@ -46,4 +59,150 @@ namespace Malmy
 		}
 		return m_buffer;
 	}
-}
\ No newline at end of file
+
+
+	void TextureManager::addStreamed(Texture& texture)
+	{
+		m_streamed.push(&texture);
+	}
+
+
+	void TextureManager::removeStreamed(Texture& texture)
+	{
+		m_streamed.eraseItemFast(&texture);
+	}
+
+
+	void TextureManager::addMaterial(Texture& texture, Material& material)
+	{
+		auto iter = m_materials.find(&texture);
+		if (!iter.isValid())
+		{
+			m_materials.insert(&texture, Array<Material*>(m_allocator));
+			iter = m_materials.find(&texture);
+		}
+		Array<Material*>& materials = iter.value();
+		if (materials.indexOf(&material) < 0) materials.push(&material);
+	}
+
+
+	void TextureManager::removeMaterial(Texture& texture, Material& material)
+	{
+		auto iter = m_materials.find(&texture);
+		if (!iter.isValid()) return;
+
+		Array<Material*>& materials = iter.value();
+		materials.eraseItemFast(&material);
+		if (materials.empty()) m_materials.erase(iter);
+	}
+
+
+	void TextureManager::onHandleChanged(Texture& texture)
+	{
+		auto iter = m_materials.find(&texture);
+		if (!iter.isValid()) return;
+
+		// createCommandBuffer re-registers the material
+		Array<Material*> materials(m_allocator);
+		for (Material* material : iter.value()) materials.push(material);
+		for (Material* material : materials)
+		{
+			if (material->isReady()) material->createCommandBuffer();
+		}
+	}
+
+
+	void TextureManager::onStreamingFailed(Texture& texture, bool is_permanent)
+	{
+		if (is_permanent)
+		{
+			texture.streaming_retry_frame = 0xffffFFFF;
+			return;
+		}
+
+		u32 delay = STREAMING_RETRY_DELAY_FRAMES << Math::minimum(texture.streaming_failures, 6);
+		texture.streaming_retry_frame = m_frame + Math::minimum(delay, MAX_STREAMING_RETRY_DELAY_FRAMES);
+		++texture.streaming_failures;
+	}
+
+
+	bool TextureManager::evictLeastRecentlyNeeded(u64 bytes)
+	{
+		u64 freed = 0;
+		while (freed < bytes)
+		{
+			Texture* victim = nullptr;
+			for (Texture* texture : m_streamed)
+			{
+				if (texture->last_needed_frame == m_frame) continue;
+				if (texture->getResidentMemory() == texture->getMemory(texture->base_mip)) continue;
+				if (!victim || texture->last_needed_frame < victim->last_needed_frame) victim = texture;
+			}
+			if (!victim) return false;
+
+			freed += victim->getResidentMemory() - victim->getMemory(victim->base_mip);
+			victim->evictMips();
+			victim->requested_mip = victim->base_mip;
+			++m_stats.evictions_count;
+		}
+		m_stats.resident_memory -= freed;
+		return true;
+	}
+
+
+	void TextureManager::updateStreaming()
+	{
+		PROFILE_FUNCTION();
+		++m_frame;
+
+		m_stats.streamed_count = m_streamed.size();
+		m_stats.resident_memory = 0;
+		for (Texture* texture : m_streamed)
+		{
+			i32 required_size = texture->required_size;
+			texture->required_size = 0;
+			if (required_size > 0)
+			{
+				int size = Math::maximum(texture->width, texture->height);
+				int mip = 0;
+				while (mip < texture->base_mip && (size >> (mip + 1)) >= required_size) ++mip;
+				texture->requested_mip = mip;
+				texture->last_needed_frame = m_frame;
+			}
+			m_stats.resident_memory += texture->getResidentMemory();
+		}
+
+		if (m_stats.resident_memory > m_stats.budget)
+		{
+			evictLeastRecentlyNeeded(m_stats.resident_memory - m_stats.budget);
+		}
+
+		m_stats.pending_count = 0;
+		m_stats.fully_resident_count = 0;
+		for (Texture* texture : m_streamed)
+		{
+			if (texture->resident_mip == 0) ++m_stats.fully_resident_count;
+			if (texture->streaming_async != FS::FileSystem::INVALID_ASYNC) ++m_stats.pending_count;
+		}
+
+		for (Texture* texture : m_streamed)
+		{
+			if (m_stats.pending_count >= MAX_PENDING_STREAMING_LOADS) break;
+			if (texture->requested_mip >= texture->resident_mip) continue;
+			if (texture->streaming_async != FS::FileSystem::INVALID_ASYNC) continue;
+			if (m_frame < texture->streaming_retry_frame) continue;
+
+			u64 current = texture->getResidentMemory();
+			u64 needed = texture->getMemory(texture->requested_mip);
+			u64 new_resident = m_stats.resident_memory - current + needed;
+			if (new_resident > m_stats.budget && !evictLeastRecentlyNeeded(new_resident - m_stats.budget)) continue;
+
+			if (texture->streamIn(texture->requested_mip))
+			{
+				m_stats.resident_memory = m_stats.resident_memory - current + needed;
+				++m_stats.pending_count;
+				++m_stats.loads_count;
+			}
+		}
+	}
+}
@@ -1,24 +1,71 @@
 #pragma once
 
+#include "engine/array.h"
+#include "engine/hash_map.h"
 #include "engine/resource_manager_base.h"
 
 namespace Malmy
 {
+	class Material;
+	class Texture;
+
 	class MALMY_RENDERER_API TextureManager MALMY_FINAL : public ResourceManagerBase
 	{
+	public:
+		// streamed textures keep mips up to this size always resident
+		static const int STREAMING_BASE_SIZE = 64;
+		static const int MAX_PENDING_STREAMING_LOADS = 4;
+		static const u64 DEFAULT_STREAMING_BUDGET = 256 * 1024 * 1024;
+		// a failed load is retried after this many frames, the delay doubles with each failure
+		static const u32 STREAMING_RETRY_DELAY_FRAMES = 60;
+		static const u32 MAX_STREAMING_RETRY_DELAY_FRAMES = 3600;
+
+		struct StreamingStats
+		{
+			int streamed_count;
+			int fully_resident_count;
+			int pending_count;
+			int loads_count;
+			int evictions_count;
+			u64 resident_memory;
+			u64 budget;
+		};
+
 	public:
 		explicit TextureManager(IAllocator& allocator);
 		~TextureManager();
 
 		u8* getBuffer(i32 size);
 
+		void setStreamingEnabled(bool enabled) { m_streaming_enabled = enabled; }
+		bool isStreamingEnabled() const { return m_streaming_enabled; }
+		void setStreamingBudget(u64 bytes) { m_stats.budget = bytes; }
+		void updateStreaming();
+		const StreamingStats& getStreamingStats() const { return m_stats; }
+		void addStreamed(Texture& texture);
+		void removeStreamed(Texture& texture);
+		// materials bake texture handles in their command buffers, they are recreated in onHandleChanged
+		void addMaterial(Texture& texture, Material& material);
+		void removeMaterial(Texture& texture, Material& material);
+		void onHandleChanged(Texture& texture);
+		// permanent failures, e.g. the file changed, stop streaming of the texture until it's reloaded
+		void onStreamingFailed(Texture& texture, bool is_permanent);
+
 	protected:
 		Resource* createResource(const Path& path) override;
 		void destroyResource(Resource& resource) override;
 
+	private:
+		bool evictLeastRecentlyNeeded(u64 bytes);
+
 	private:
 		IAllocator& m_allocator;
 		u8* m_buffer;
 		i32 m_buffer_size;
+		bool m_streaming_enabled;
+		Array<Texture*> m_streamed;
+		HashMap<Texture*, Array<Material*>> m_materials;
+		StreamingStats m_stats;
+		u32 m_frame;
 	};
-}
\ No newline at end of file
+}